@@ -1,9 +1,16 @@
 #include <stddef.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <cstring>
+#include <string>
 #include <tuple>
 #include <utility>
 #include <vector>
 
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
 #include "common.h"
 
 namespace nc {
@@ -111,4 +118,233 @@ class BloomFilter {
   std::vector<bool> bits_;
 };
 
+// A Bloom filter in which all bits for a value are set in a single 256-bit
+// block, so that each Add or PossiblyContains touches only one cache line. The
+// block is picked by one hash, and another hash sets one bit in each of the 8
+// 32-bit words of the block (a split block Bloom filter, as used by Impala and
+// Parquet). The number of blocks is a power of two, so no modulo is needed,
+// and when AVX2 is available a block is updated or checked with a handful of
+// vector instructions. The filter can be serialized and later used directly
+// from the serialized bytes (e.g. from a memory-mapped file) without copying.
+template <typename T, typename V = ValueExtractor<T>>
+class BlockedBloomFilter {
+ public:
+  BlockedBloomFilter(size_t expected_num_elements,
+                     double false_positive_probability = 0.0001)
+      : num_blocks_(0), blocks_(nullptr) {
+    CHECK(expected_num_elements > 0);
+    CHECK(false_positive_probability > 0 && false_positive_probability < 1);
+
+    // The fraction of bits that should be set in each word such that the
+    // probability that all 8 probed bits are set is the target probability.
+    double words = kWordsPerBlock;
+    double bits_per_element =
+        -words / std::log(1 - std::pow(false_positive_probability, 1 / words));
+    double num_blocks =
+        std::ceil(bits_per_element * expected_num_elements / kBitsPerBlock);
+    num_blocks_ = 1;
+    while (num_blocks_ < num_blocks) {
+      num_blocks_ *= 2;
+    }
+
+    void* storage;
+    CHECK(posix_memalign(&storage, kBlockAlignment,
+                         num_blocks_ * kBytesPerBlock) == 0);
+    std::memset(storage, 0, num_blocks_ * kBytesPerBlock);
+    owned_blocks_.reset(static_cast<uint32_t*>(storage));
+    blocks_ = owned_blocks_.get();
+  }
+
+  // Returns a filter that uses a previously serialized filter in place. The
+  // memory pointed to by 'data' must outlive the returned filter, which cannot
+  // be added to. Returns null if 'data' is not a serialized filter.
+  static std::unique_ptr<BlockedBloomFilter> FromSerialized(const char* data,
+                                                            size_t size) {
+    if (size < sizeof(Header)) {
+      return std::unique_ptr<BlockedBloomFilter>();
+    }
+
+    Header header;
+    std::memcpy(&header, data, sizeof(Header));
+    // Divides instead of multiplying num_blocks, which comes from the input
+    // and could wrap around.
+    size_t blocks_size = size - sizeof(Header);
+    if (header.magic != kMagic || header.num_blocks == 0 ||
+        (header.num_blocks & (header.num_blocks - 1)) != 0 ||
+        blocks_size % kBytesPerBlock != 0 ||
+        header.num_blocks != blocks_size / kBytesPerBlock) {
+      return std::unique_ptr<BlockedBloomFilter>();
+    }
+
+    const uint32_t* blocks =
+        reinterpret_cast<const uint32_t*>(data + sizeof(Header));
+    return std::unique_ptr<BlockedBloomFilter>(
+        new BlockedBloomFilter(header.num_blocks, blocks));
+  }
+
+  void Add(const T& value) {
+    CHECK(owned_blocks_) << "Filter is read-only";
+    uint32_t hash_one;
+    uint32_t hash_two;
+    HashValue(value, &hash_one, &hash_two);
+
+    uint32_t* block = owned_blocks_.get() + BlockOffset(hash_one);
+#ifdef __AVX2__
+    __m256i* block_ptr = reinterpret_cast<__m256i*>(block);
+    _mm256_store_si256(block_ptr, _mm256_or_si256(_mm256_load_si256(block_ptr),
+                                                  BlockMask(hash_two)));
+#else
+    for (size_t i = 0; i < kWordsPerBlock; ++i) {
+      block[i] |= WordMask(hash_two, i);
+    }
+#endif
+  }
+
+  bool PossiblyContains(const T& value) const {
+    uint32_t hash_one;
+    uint32_t hash_two;
+    HashValue(value, &hash_one, &hash_two);
+    return BlockContains(blocks_ + BlockOffset(hash_one), hash_two);
+  }
+
+  // Checks 'count' values and stores the results in 'out'. Values are hashed
+  // and have their blocks prefetched in batches, so that the cache misses for
+  // different values overlap.
+  void PossiblyContainsMany(const T* values, size_t count, bool* out) const {
+    static constexpr size_t kBatchSize = 16;
+    size_t offsets[kBatchSize];
+    uint32_t hashes[kBatchSize];
+
+    for (size_t batch_start = 0; batch_start < count;
+         batch_start += kBatchSize) {
+      size_t batch_size = std::min(kBatchSize, count - batch_start);
+      for (size_t i = 0; i < batch_size; ++i) {
+        uint32_t hash_one;
+        HashValue(values[batch_start + i], &hash_one, &hashes[i]);
+        offsets[i] = BlockOffset(hash_one);
+        __builtin_prefetch(blocks_ + offsets[i]);
+      }
+
+      for (size_t i = 0; i < batch_size; ++i) {
+        out[batch_start + i] = BlockContains(blocks_ + offsets[i], hashes[i]);
+      }
+    }
+  }
+
+  // Fraction of bits that are set.
+  double SaturationFactor() const {
+    size_t total = 0;
+    for (size_t i = 0; i < num_blocks_ * kWordsPerBlock; ++i) {
+      total += __builtin_popcount(blocks_[i]);
+    }
+
+    return total / static_cast<double>(num_blocks_ * kBitsPerBlock);
+  }
+
+  // Size of the filter's bits.
+  size_t SizeBytes() const { return num_blocks_ * kBytesPerBlock; }
+
+  // Serializes the filter. The result can be passed to FromSerialized. The
+  // serialized form is not portable across machines with different
+  // endianness.
+  std::string Serialize() const {
+    Header header;
+    std::memset(&header, 0, sizeof(Header));
+    header.magic = kMagic;
+    header.num_blocks = num_blocks_;
+
+    std::string out(sizeof(Header) + SizeBytes(), '\0');
+    std::memcpy(&out[0], &header, sizeof(Header));
+    std::memcpy(&out[sizeof(Header)], blocks_, SizeBytes());
+    return out;
+  }
+
+ private:
+  static constexpr size_t kWordsPerBlock = 8;
+  static constexpr size_t kBitsPerBlock = kWordsPerBlock * 32;
+  static constexpr size_t kBytesPerBlock = kBitsPerBlock / 8;
+  static constexpr size_t kBlockAlignment = 64;
+  static constexpr uint32_t kHashSeed = 42;
+  static constexpr uint64_t kMagic = 0x4e43424c4f4f4d31;  // "NCBLOOM1"
+
+  // Serialized filters start with this header. Padded so that the blocks that
+  // follow are aligned if the header is.
+  struct Header {
+    uint64_t magic;
+    uint64_t num_blocks;
+    uint64_t reserved[2];
+  };
+
+  struct FreeDeleter {
+    void operator()(uint32_t* ptr) const { free(ptr); }
+  };
+
+  BlockedBloomFilter(size_t num_blocks, const uint32_t* blocks)
+      : num_blocks_(num_blocks), blocks_(blocks) {}
+
+  // Odd constants used to derive a bit for each word from a single hash.
+  static const uint32_t* Salts() {
+    static const uint32_t kSalts[kWordsPerBlock] = {
+        0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+        0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U};
+    return kSalts;
+  }
+
+  size_t BlockOffset(uint32_t hash_one) const {
+    return (hash_one & (num_blocks_ - 1)) * kWordsPerBlock;
+  }
+
+  static uint32_t WordMask(uint32_t hash_two, size_t word) {
+    return 1U << ((hash_two * Salts()[word]) >> 27);
+  }
+
+#ifdef __AVX2__
+  static __m256i BlockMask(uint32_t hash_two) {
+    __m256i salts =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(Salts()));
+    __m256i bits = _mm256_srli_epi32(
+        _mm256_mullo_epi32(_mm256_set1_epi32(hash_two), salts), 27);
+    return _mm256_sllv_epi32(_mm256_set1_epi32(1), bits);
+  }
+#endif
+
+  static bool BlockContains(const uint32_t* block, uint32_t hash_two) {
+#ifdef __AVX2__
+    __m256i block_bits =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block));
+    return _mm256_testc_si256(block_bits, BlockMask(hash_two));
+#else
+    for (size_t i = 0; i < kWordsPerBlock; ++i) {
+      uint32_t mask = WordMask(hash_two, i);
+      if ((block[i] & mask) != mask) {
+        return false;
+      }
+    }
+
+    return true;
+#endif
+  }
+
+  inline void HashValue(const T& value, uint32_t* hash_one,
+                        uint32_t* hash_two) const {
+    const void* value_ptr;
+    size_t len;
+    extractor_(value, &value_ptr, &len);
+
+    MurmurHash3_x64_128(value_ptr, len, kHashSeed, hash_one, hash_two);
+  }
+
+  V extractor_;
+
+  // Number of blocks, a power of 2.
+  size_t num_blocks_;
+
+  // The filter's bits. Either points to owned_blocks_, or to memory owned by
+  // someone else if the filter was created from serialized data.
+  const uint32_t* blocks_;
+  std::unique_ptr<uint32_t, FreeDeleter> owned_blocks_;
+
+  DISALLOW_COPY_AND_ASSIGN(BlockedBloomFilter);
+};
+
 }  // namespace nc
@@ -74,6 +74,110 @@ TEST(Bloom, Vectors) {
   ASSERT_TRUE(filter.PossiblyContains(v2));
 }
 
+TEST(BlockedBloom, BadSize) {
+  ASSERT_DEATH(BlockedBloomFilter<SomeCustomDatatype> filter(0), ".*");
+}
+
+TEST(BlockedBloom, Simple) {
+  BlockedBloomFilter<SomeCustomDatatype> filter(kMillion);
+  ASSERT_FALSE(filter.PossiblyContains({1, 2, 3.0}));
+  ASSERT_EQ(0.0, filter.SaturationFactor());
+
+  filter.Add({1, 2, 3.0});
+  ASSERT_TRUE(filter.PossiblyContains({1, 2, 3.0}));
+  ASSERT_FALSE(filter.PossiblyContains({1, 2, 4.0}));
+}
+
+TEST(BlockedBloom, Saturated) {
+  BlockedBloomFilter<SomeCustomDatatype> filter(1);
+  for (int i = 0; i < 1000; ++i) {
+    filter.Add({i, i, 3.0});
+  }
+  ASSERT_EQ(1.0, filter.SaturationFactor());
+  ASSERT_TRUE(filter.PossiblyContains({1, 2, 4.0}));
+}
+
+TEST(BlockedBloom, FalsePositiveRate) {
+  BlockedBloomFilter<uint64_t> filter(kMillion, 0.001);
+  for (uint64_t i = 0; i < kMillion; ++i) {
+    filter.Add(i);
+  }
+
+  for (uint64_t i = 0; i < kMillion; ++i) {
+    ASSERT_TRUE(filter.PossiblyContains(i));
+  }
+
+  size_t false_positives = 0;
+  for (uint64_t i = kMillion; i < 2 * kMillion; ++i) {
+    if (filter.PossiblyContains(i)) {
+      ++false_positives;
+    }
+  }
+
+  // Sizing is rounded up to a power of two, so the rate should be at most the
+  // target one, allowing for some noise.
+  ASSERT_GT(0.0015, false_positives / static_cast<double>(kMillion));
+}
+
+TEST(BlockedBloom, ContainsMany) {
+  BlockedBloomFilter<uint64_t> filter(10000);
+  std::vector<uint64_t> values;
+  for (uint64_t i = 0; i < 10000; ++i) {
+    filter.Add(i * 2);
+    values.emplace_back(i);
+  }
+
+  std::unique_ptr<bool[]> out(new bool[values.size()]);
+  filter.PossiblyContainsMany(values.data(), values.size(), out.get());
+  for (size_t i = 0; i < values.size(); ++i) {
+    ASSERT_EQ(filter.PossiblyContains(values[i]), out[i]);
+    if (i % 2 == 0) {
+      ASSERT_TRUE(out[i]);
+    }
+  }
+}
+
+TEST(BlockedBloom, Serialize) {
+  BlockedBloomFilter<std::string> filter(1000);
+  for (size_t i = 0; i < 1000; ++i) {
+    filter.Add(std::to_string(i));
+  }
+
+  std::string serialized = filter.Serialize();
+  auto restored =
+      BlockedBloomFilter<std::string>::FromSerialized(serialized.data(),
+                                                      serialized.size());
+  ASSERT_TRUE(restored);
+  ASSERT_EQ(filter.SizeBytes(), restored->SizeBytes());
+  ASSERT_EQ(filter.SaturationFactor(), restored->SaturationFactor());
+  for (size_t i = 0; i < 2000; ++i) {
+    std::string value = std::to_string(i);
+    ASSERT_EQ(filter.PossiblyContains(value),
+              restored->PossiblyContains(value));
+  }
+
+  ASSERT_DEATH(restored->Add("1"), "read-only");
+  ASSERT_FALSE(BlockedBloomFilter<std::string>::FromSerialized(
+      serialized.data(), serialized.size() - 1));
+  ASSERT_FALSE(BlockedBloomFilter<std::string>::FromSerialized("abc", 3));
+}
+
+TEST(BlockedBloom, SerializedOversizedBlockCount) {
+  BlockedBloomFilter<std::string> filter(1000);
+  std::string serialized = filter.Serialize();
+
+  // A block count whose size in bytes wraps around to zero, with no blocks.
+  uint64_t num_blocks = 1ULL << 59;
+  std::string forged = serialized.substr(0, 32);
+  memcpy(&forged[8], &num_blocks, sizeof(num_blocks));
+  ASSERT_FALSE(BlockedBloomFilter<std::string>::FromSerialized(forged.data(),
+                                                               forged.size()));
+
+  // Same, but with the blocks of the original filter.
+  memcpy(&serialized[8], &num_blocks, sizeof(num_blocks));
+  ASSERT_FALSE(BlockedBloomFilter<std::string>::FromSerialized(
+      serialized.data(), serialized.size()));
+}
 
 }  // namespace
 }  // namespace nc
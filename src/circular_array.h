@@ -2,11 +2,14 @@
 #define NCODE_CIRCULAR_ARRAY_H_
 
 #include <array>
+#include <atomic>
 #include <cstdbool>
+#include <type_traits>
 #include <vector>
 
 #include "common.h"
 #include "logging.h"
+#include "stats.h"
 
 namespace nc {
 
@@ -84,6 +87,262 @@ class CircularArray {
   DISALLOW_COPY_AND_ASSIGN(CircularArray);
 };
 
+// A circular array of numbers that keeps aggregates (sum, mean, variance, min
+// and max) of the values currently in it. Both updates and queries are O(1)
+// amortized. Sums are updated incrementally, and recomputed from scratch once
+// every NumValues evictions to keep floating point error from accumulating.
+// The min and max are tracked with monotonic queues of indices -- each value
+// is added to and removed from each queue at most once.
+template <typename T, size_t NumValues>
+class AggregatingCircularArray {
+ public:
+  static constexpr size_t kMaxValues = NumValues;
+
+  AggregatingCircularArray() { Clear(); }
+
+  // Adds a new value, evicting the oldest one if the array is full.
+  void AddValue(T value) {
+    static_assert(std::is_arithmetic<T>::value, "Values should be numbers");
+    static_assert(IsPowerOfTwo(NumValues),
+                  "Number of values should be power of 2");
+
+    if (num_values_ == NumValues) {
+      Evict();
+    } else {
+      ++num_values_;
+    }
+
+    size_t index = index_++;
+    values_[index & kMask] = value;
+    double value_double = value;
+    sum_ += value_double;
+    sum_squared_ += value_double * value_double;
+
+    while (min_queue_.size() > 0 &&
+           values_[min_queue_.back() & kMask] > value) {
+      min_queue_.pop_back();
+    }
+    min_queue_.push_back(index);
+
+    while (max_queue_.size() > 0 &&
+           values_[max_queue_.back() & kMask] < value) {
+      max_queue_.pop_back();
+    }
+    max_queue_.push_back(index);
+  }
+
+  // Number of elements in the array.
+  size_t size() const { return num_values_; }
+
+  // Returns true if the array has no values.
+  bool empty() const { return num_values_ == 0; }
+
+  double sum() const { return sum_; }
+
+  double sum_squared() const { return sum_squared_; }
+
+  double mean() const {
+    CHECK(num_values_ > 0) << "Circular array empty";
+    return sum_ / num_values_;
+  }
+
+  // Population variance of the values in the window.
+  double var() const {
+    double m = mean();
+    return std::max(0.0, sum_squared_ / num_values_ - m * m);
+  }
+
+  T min() const {
+    CHECK(num_values_ > 0) << "Circular array empty";
+    return values_[min_queue_.front() & kMask];
+  }
+
+  T max() const {
+    CHECK(num_values_ > 0) << "Circular array empty";
+    return values_[max_queue_.front() & kMask];
+  }
+
+  // Returns the aggregates of the window as SummaryStats.
+  SummaryStats Stats() const {
+    SummaryStats stats;
+    if (num_values_ > 0) {
+      stats.Reset(num_values_, sum_, sum_squared_, min(), max());
+    }
+    return stats;
+  }
+
+  const T& MostRecentValueOrDie() const {
+    CHECK(num_values_ > 0) << "Circular array empty";
+    return values_[(index_ - 1) & kMask];
+  }
+
+  const T& OldestValueOrDie() const {
+    CHECK(num_values_ > 0) << "Circular array empty";
+    return values_[(index_ - num_values_) & kMask];
+  }
+
+  // Removes all values.
+  void Clear() {
+    num_values_ = 0;
+    index_ = 0;
+    evictions_ = 0;
+    sum_ = 0;
+    sum_squared_ = 0;
+    min_queue_.clear();
+    max_queue_.clear();
+  }
+
+ private:
+  static constexpr size_t kMask = NumValues - 1;
+
+  // A fixed-capacity double-ended queue of value indices.
+  class IndexQueue {
+   public:
+    IndexQueue() : head_(0), tail_(0) {}
+
+    size_t size() const { return tail_ - head_; }
+    size_t front() const { return indices_[head_ & kMask]; }
+    size_t back() const { return indices_[(tail_ - 1) & kMask]; }
+    void push_back(size_t index) { indices_[tail_++ & kMask] = index; }
+    void pop_back() { --tail_; }
+    void pop_front() { ++head_; }
+    void clear() { head_ = tail_ = 0; }
+
+   private:
+    size_t head_;
+    size_t tail_;
+    std::array<size_t, NumValues> indices_;
+  };
+
+  // Removes the oldest value from the aggregates.
+  void Evict() {
+    size_t oldest_index = index_ - num_values_;
+    double oldest = values_[oldest_index & kMask];
+    sum_ -= oldest;
+    sum_squared_ -= oldest * oldest;
+
+    if (min_queue_.front() == oldest_index) {
+      min_queue_.pop_front();
+    }
+    if (max_queue_.front() == oldest_index) {
+      max_queue_.pop_front();
+    }
+
+    if (std::is_floating_point<T>::value && ++evictions_ == NumValues) {
+      evictions_ = 0;
+      Resum(oldest_index + 1);
+    }
+  }
+
+  // Recomputes the sums of the values starting at a given index.
+  void Resum(size_t start) {
+    sum_ = 0;
+    sum_squared_ = 0;
+    for (size_t i = start; i < index_; ++i) {
+      double value = values_[i & kMask];
+      sum_ += value;
+      sum_squared_ += value * value;
+    }
+  }
+
+  size_t num_values_;
+
+  // Index of the next value to be added. Values are stored at index & kMask.
+  size_t index_;
+
+  // Evictions since the sums were last recomputed.
+  size_t evictions_;
+
+  double sum_;
+  double sum_squared_;
+
+  // Indices of values in increasing (for the min queue) and decreasing (for
+  // the max queue) order of value. The front of each queue is the min / max.
+  IndexQueue min_queue_;
+  IndexQueue max_queue_;
+
+  std::array<T, NumValues> values_;
+
+  DISALLOW_COPY_AND_ASSIGN(AggregatingCircularArray);
+};
+
+// An AggregatingCircularArray whose aggregates can be read by other threads
+// while a single thread adds values. After each value is added the aggregates
+// are published under a sequence lock, so the writer never waits and readers
+// never block the writer (they retry in the rare case that they race with an
+// update).
+template <typename T, size_t NumValues>
+class ConcurrentAggregatingCircularArray {
+ public:
+  ConcurrentAggregatingCircularArray()
+      : sequence_(0), count_(0), sum_(0), sum_squared_(0), min_(0), max_(0) {}
+
+  // Adds a new value. Should only be called from a single thread.
+  void AddValue(T value) {
+    array_.AddValue(value);
+
+    uint64_t sequence = sequence_.load(std::memory_order_relaxed);
+    sequence_.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    count_.store(array_.size(), std::memory_order_relaxed);
+    sum_.store(array_.sum(), std::memory_order_relaxed);
+    sum_squared_.store(array_.sum_squared(), std::memory_order_relaxed);
+    min_.store(array_.min(), std::memory_order_relaxed);
+    max_.store(array_.max(), std::memory_order_relaxed);
+
+    sequence_.store(sequence + 2, std::memory_order_release);
+  }
+
+  // Returns a consistent snapshot of the aggregates of the window. Can be
+  // called from any thread.
+  SummaryStats Stats() const {
+    SummaryStats stats;
+    while (true) {
+      uint64_t sequence_before = sequence_.load(std::memory_order_acquire);
+      if (sequence_before % 2 == 1) {
+        // Update in progress.
+        continue;
+      }
+
+      uint64_t count = count_.load(std::memory_order_relaxed);
+      double sum = sum_.load(std::memory_order_relaxed);
+      double sum_squared = sum_squared_.load(std::memory_order_relaxed);
+      double min = min_.load(std::memory_order_relaxed);
+      double max = max_.load(std::memory_order_relaxed);
+
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (sequence_.load(std::memory_order_relaxed) == sequence_before) {
+        if (count > 0) {
+          stats.Reset(count, sum, sum_squared, min, max);
+        }
+        return stats;
+      }
+    }
+  }
+
+  // The underlying array. Should only be accessed by the thread that adds
+  // values.
+  const AggregatingCircularArray<T, NumValues>& array() const {
+    return array_;
+  }
+
+ private:
+  AggregatingCircularArray<T, NumValues> array_;
+
+  // Odd while the published aggregates are being updated.
+  std::atomic<uint64_t> sequence_;
+
+  // The published aggregates.
+  std::atomic<uint64_t> count_;
+  std::atomic<double> sum_;
+  std::atomic<double> sum_squared_;
+  std::atomic<double> min_;
+  std::atomic<double> max_;
+
+  DISALLOW_COPY_AND_ASSIGN(ConcurrentAggregatingCircularArray);
+};
+
 }  // namespace nc
 
 #endif
@@ -1,5 +1,9 @@
 #include "circular_array.h"
 
+#include <algorithm>
+#include <random>
+#include <thread>
+
 #include "common.h"
 #include "map_util.h"
 #include "gtest/gtest.h"
@@ -108,5 +112,125 @@ TEST(CircularArray, Movable) {
   ASSERT_EQ(10, *values.front());
 }
 
+// Compares the aggregates of an AggregatingCircularArray to the ones computed
+// from scratch over the same window.
+template <typename T, size_t NumValues>
+static void CheckAggregates(const AggregatingCircularArray<T, NumValues>& array,
+                            const std::vector<T>& window) {
+  ASSERT_EQ(window.size(), array.size());
+  SummaryStats model;
+  for (T value : window) {
+    model.Add(value);
+  }
+
+  ASSERT_NEAR(model.sum(), array.sum(), 1e-6);
+  ASSERT_NEAR(model.mean(), array.mean(), 1e-6);
+  ASSERT_NEAR(model.var(), array.var(), 1e-6);
+  ASSERT_EQ(*std::min_element(window.begin(), window.end()), array.min());
+  ASSERT_EQ(*std::max_element(window.begin(), window.end()), array.max());
+  ASSERT_EQ(window.front(), array.OldestValueOrDie());
+  ASSERT_EQ(window.back(), array.MostRecentValueOrDie());
+}
+
+TEST(AggregatingCircularArray, Empty) {
+  AggregatingCircularArray<double, 16> array;
+  ASSERT_TRUE(array.empty());
+  ASSERT_EQ(0, array.sum());
+  ASSERT_EQ(0ul, array.Stats().count());
+  ASSERT_DEATH(array.min(), "empty");
+  ASSERT_DEATH(array.mean(), "empty");
+}
+
+TEST(AggregatingCircularArray, Random) {
+  std::mt19937 rnd(1);
+  std::uniform_real_distribution<double> dist(-100, 100);
+
+  AggregatingCircularArray<double, 64> array;
+  std::vector<double> window;
+  for (size_t i = 0; i < 10000; ++i) {
+    double value = dist(rnd);
+    array.AddValue(value);
+    window.emplace_back(value);
+    if (window.size() > 64) {
+      window.erase(window.begin());
+    }
+
+    CheckAggregates(array, window);
+  }
+
+  SummaryStats stats = array.Stats();
+  ASSERT_EQ(64ul, stats.count());
+  ASSERT_EQ(array.min(), stats.min());
+  ASSERT_EQ(array.max(), stats.max());
+  ASSERT_NEAR(array.mean(), stats.mean(), 1e-9);
+
+  array.Clear();
+  ASSERT_TRUE(array.empty());
+  array.AddValue(1.0);
+  CheckAggregates(array, {1.0});
+}
+
+TEST(AggregatingCircularArray, Monotonic) {
+  // Increasing and decreasing sequences are the worst cases for the min / max
+  // queues.
+  AggregatingCircularArray<int, 8> array;
+  std::vector<int> window;
+  for (int i = 0; i < 100; ++i) {
+    int value = i < 50 ? i : 100 - i;
+    array.AddValue(value);
+    window.emplace_back(value);
+    if (window.size() > 8) {
+      window.erase(window.begin());
+    }
+
+    CheckAggregates(array, window);
+  }
+}
+
+TEST(AggregatingCircularArray, Drift) {
+  // Large and small values mixed, the sums should not drift away.
+  AggregatingCircularArray<double, 4> array;
+  for (size_t i = 0; i < 100000; ++i) {
+    array.AddValue(i % 2 ? 1e12 : 0.1);
+  }
+  for (size_t i = 0; i < 4; ++i) {
+    array.AddValue(0.1);
+  }
+  ASSERT_NEAR(0.4, array.sum(), 1e-9);
+  ASSERT_NEAR(0.0, array.var(), 1e-9);
+}
+
+TEST(ConcurrentAggregatingCircularArray, Snapshot) {
+  // The writer adds consecutive integers, any consistent snapshot should have
+  // max - min + 1 == count and a sum that is the sum of [min, max].
+  ConcurrentAggregatingCircularArray<uint64_t, 128> array;
+  std::atomic<bool> done(false);
+  std::thread writer([&array, &done] {
+    for (uint64_t i = 1; i <= 1000000; ++i) {
+      array.AddValue(i);
+    }
+    done = true;
+  });
+
+  size_t snapshots = 0;
+  while (!done) {
+    SummaryStats stats = array.Stats();
+    ++snapshots;
+    if (stats.count() == 0) {
+      continue;
+    }
+
+    ASSERT_EQ(stats.count(), stats.max() - stats.min() + 1);
+    ASSERT_EQ((stats.min() + stats.max()) * stats.count() / 2, stats.sum());
+  }
+  writer.join();
+
+  SummaryStats stats = array.Stats();
+  ASSERT_EQ(128ul, stats.count());
+  ASSERT_EQ(1000000, stats.max());
+  ASSERT_EQ(array.array().sum(), stats.sum());
+  ASSERT_LT(0ul, snapshots);
+}
+
 }  // namespace
 }  // namespace nc
@@ -46,10 +46,11 @@
 #endif
 #include <errno.h>
 #include <string.h>
-#include <fstream>
 
 #include "file.h"
+#include "line_reader.h"
 #include "logging.h"
+#include "mapped_file.h"
 #include "strutil.h"
 
 namespace nc {
@@ -68,6 +69,17 @@ bool File::Exists(const std::string& name) {
 }
 
 bool File::ReadFileToString(const std::string& name, std::string* output) {
+  // Regular files are mapped and copied in one go. Some files (e.g. in /proc)
+  // report a size of 0 and have to be read.
+  MappedFileOptions options;
+  options.access = MappedFileOptions::SEQUENTIAL;
+  StatusOr<MappedFile> mapped_file = MappedFile::Open(name, options);
+  if (mapped_file.ok() && mapped_file.ValueOrDie().size() > 0) {
+    StringPiece data = mapped_file.ValueOrDie().data();
+    output->append(data.data(), data.size());
+    return true;
+  }
+
   char buffer[1024];
   FILE* file = fopen(name.c_str(), "rb");
   if (file == NULL) return false;
@@ -278,17 +290,12 @@ std::string File::PickFileName(const std::string& dir, size_t len) {
 
 bool File::ReadLines(const std::string& name,
                      std::function<void(const std::string& line)> callback) {
-  std::ifstream infile(name);
-  if (infile.fail()) {
-    return false;
-  }
-
-  std::string line;
-  while (std::getline(infile, line)) {
-    callback(line);
-  }
-
-  return true;
+  // The same string is reused for all lines.
+  std::string line_string;
+  return ForEachLineInFile(name, [&line_string, &callback](StringPiece line) {
+    line_string.assign(line.data(), line.size());
+    callback(line_string);
+  });
 }
 
 void WalkRecursively(
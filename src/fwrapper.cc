@@ -1,10 +1,18 @@
 #include "fwrapper.h"
 
+#include <fcntl.h>
 #include <sys/errno.h>
+#include <unistd.h>
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <iterator>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <utility>
 
 #include "port.h"
@@ -12,6 +20,294 @@
 #include "strutil.h"
 
 namespace nc {
+namespace fwrapper_internal {
+
+// Alignment of buffers, sizes and offsets required by O_DIRECT.
+static constexpr size_t kDirectIOAlignment = 4096;
+
+class BufferedWriter {
+ public:
+  BufferedWriter(int fd, const BufferedWriteOptions& options);
+
+  // Waits for all queued buffers to be written.
+  ~BufferedWriter();
+
+  // Returns a buffer of buffer_bytes() bytes to fill, blocks until one is
+  // free.
+  uint8_t* NextBuffer();
+
+  // Queues the first 'size' bytes of a buffer returned by NextBuffer to be
+  // written. Returns the first error that the background thread encountered
+  // so far. After an error all data is discarded.
+  Status Submit(uint8_t* buffer, size_t size);
+
+  // Blocks until all queued buffers are written, returns the first error.
+  Status Wait();
+
+  // Waits for written data to reach the disk, if sync_on_flush is set.
+  Status Sync();
+
+  // Moves the statistics accumulated since the last call to 'stats'.
+  void CollectStats(FWRapperStats* stats);
+
+  size_t buffer_bytes() const { return buffer_bytes_; }
+
+ private:
+  struct FreeDeleter {
+    void operator()(uint8_t* ptr) const { free(ptr); }
+  };
+
+  // Body of the background thread.
+  void Run();
+
+  // Writes a buffer to the file, using O_DIRECT if possible.
+  Status WriteBuffer(const uint8_t* data, size_t size);
+
+  // Sets or clears O_DIRECT on the file descriptor. Returns false if that is
+  // not possible.
+  bool SetDirect(bool direct);
+
+  int fd_;
+  size_t buffer_bytes_;
+  bool sync_on_flush_;
+
+  // Only accessed by the background thread (and the destructor, after the
+  // thread is done).
+  bool direct_io_;
+  bool direct_;
+
+  std::vector<std::unique_ptr<uint8_t, FreeDeleter>> buffers_;
+
+  // Protects all members below.
+  std::mutex mu_;
+  std::condition_variable cv_;
+
+  // Buffers to write and their sizes, free buffers.
+  std::deque<std::pair<uint8_t*, size_t>> queue_;
+  std::vector<uint8_t*> free_;
+
+  // True while the background thread writes a buffer.
+  bool writing_;
+  bool stop_;
+  Status status_;
+
+  DiscreteDistribution<uint64_t> writes_;
+  uint64_t bytes_written_;
+  std::chrono::nanoseconds write_time_;
+  std::chrono::nanoseconds stall_time_;
+
+  std::thread thread_;
+
+  DISALLOW_COPY_AND_ASSIGN(BufferedWriter);
+};
+
+BufferedWriter::BufferedWriter(int fd, const BufferedWriteOptions& options)
+    : fd_(fd),
+      sync_on_flush_(options.sync_on_flush),
+      direct_io_(options.direct_io),
+      direct_(false),
+      writing_(false),
+      stop_(false),
+      bytes_written_(0),
+      write_time_(0),
+      stall_time_(0) {
+  CHECK(options.buffer_count >= 2) << "Need at least 2 buffers";
+  CHECK(options.buffer_bytes > 0);
+  buffer_bytes_ = (options.buffer_bytes + kDirectIOAlignment - 1) /
+                  kDirectIOAlignment * kDirectIOAlignment;
+  for (size_t i = 0; i < options.buffer_count; ++i) {
+    void* buffer;
+    CHECK(posix_memalign(&buffer, kDirectIOAlignment, buffer_bytes_) == 0);
+    buffers_.emplace_back(static_cast<uint8_t*>(buffer));
+    free_.emplace_back(buffers_.back().get());
+  }
+
+  thread_ = std::thread([this] { Run(); });
+}
+
+BufferedWriter::~BufferedWriter() {
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    stop_ = true;
+    cv_.notify_all();
+  }
+
+  thread_.join();
+  SetDirect(false);
+}
+
+uint8_t* BufferedWriter::NextBuffer() {
+  std::unique_lock<std::mutex> lock(mu_);
+  if (free_.empty()) {
+    Timer timer(&stall_time_);
+    cv_.wait(lock, [this] { return !free_.empty(); });
+  }
+
+  uint8_t* buffer = free_.back();
+  free_.pop_back();
+  return buffer;
+}
+
+Status BufferedWriter::Submit(uint8_t* buffer, size_t size) {
+  std::lock_guard<std::mutex> lock(mu_);
+  if (size == 0) {
+    free_.emplace_back(buffer);
+  } else {
+    queue_.emplace_back(buffer, size);
+  }
+
+  cv_.notify_all();
+  return status_;
+}
+
+Status BufferedWriter::Wait() {
+  std::unique_lock<std::mutex> lock(mu_);
+  if (!queue_.empty() || writing_) {
+    Timer timer(&stall_time_);
+    cv_.wait(lock, [this] { return queue_.empty() && !writing_; });
+  }
+
+  return status_;
+}
+
+Status BufferedWriter::Sync() {
+  if (!sync_on_flush_) {
+    return Status::OK;
+  }
+
+  Timer timer(&stall_time_);
+#ifdef __linux__
+  int result = fdatasync(fd_);
+#else
+  int result = fsync(fd_);
+#endif
+  if (result != 0) {
+    return Status(error::INTERNAL, StrCat("Unable to sync, ", strerror(errno)));
+  }
+
+  return Status::OK;
+}
+
+void BufferedWriter::CollectStats(FWRapperStats* stats) {
+  std::lock_guard<std::mutex> lock(mu_);
+  stats->writes.Add(writes_);
+  stats->buffered_bytes_written += bytes_written_;
+  stats->buffered_write_time += write_time_;
+  stats->total_write_time += write_time_;
+  stats->write_stall_time += stall_time_;
+
+  writes_ = DiscreteDistribution<uint64_t>();
+  bytes_written_ = 0;
+  write_time_ = std::chrono::nanoseconds::zero();
+  stall_time_ = std::chrono::nanoseconds::zero();
+}
+
+void BufferedWriter::Run() {
+  std::unique_lock<std::mutex> lock(mu_);
+  while (true) {
+    cv_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+    if (queue_.empty()) {
+      return;
+    }
+
+    std::pair<uint8_t*, size_t> buffer_and_size = queue_.front();
+    queue_.pop_front();
+    writing_ = true;
+
+    // Data after an error is dropped, it would end up at the wrong offset.
+    bool failed = !status_.ok();
+    lock.unlock();
+
+    Status status;
+    std::chrono::nanoseconds write_time(0);
+    if (!failed) {
+      Timer timer(&write_time);
+      status = WriteBuffer(buffer_and_size.first, buffer_and_size.second);
+    }
+
+    lock.lock();
+    writing_ = false;
+    write_time_ += write_time;
+    if (!failed) {
+      if (status.ok()) {
+        writes_.Add(buffer_and_size.second);
+        bytes_written_ += buffer_and_size.second;
+      } else {
+        status_ = status;
+      }
+    }
+
+    free_.emplace_back(buffer_and_size.first);
+    cv_.notify_all();
+  }
+}
+
+bool BufferedWriter::SetDirect(bool direct) {
+  if (direct == direct_) {
+    return true;
+  }
+
+#ifdef O_DIRECT
+  int flags = fcntl(fd_, F_GETFL);
+  if (flags == -1) {
+    return false;
+  }
+
+  flags = direct ? (flags | O_DIRECT) : (flags & ~O_DIRECT);
+  if (fcntl(fd_, F_SETFL, flags) == -1) {
+    return false;
+  }
+
+  direct_ = direct;
+  return true;
+#else
+  return false;
+#endif
+}
+
+Status BufferedWriter::WriteBuffer(const uint8_t* data, size_t size) {
+  // O_DIRECT needs the size and the file offset to be aligned. A partial
+  // buffer (written on Flush) usually leaves the offset unaligned, after
+  // which writes go through the page cache.
+  bool direct = false;
+  if (direct_io_ && size % kDirectIOAlignment == 0) {
+    off_t offset = lseek(fd_, 0, SEEK_CUR);
+    direct = offset >= 0 && offset % kDirectIOAlignment == 0;
+  }
+
+  if (!SetDirect(direct)) {
+    LOG(ERROR) << "Unable to use direct I/O";
+    direct_io_ = false;
+    SetDirect(false);
+  }
+
+  while (size > 0) {
+    ssize_t result = write(fd_, data, size);
+    if (result < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      if (errno == EINVAL && direct_) {
+        // The file system does not support direct I/O.
+        LOG(ERROR) << "Unable to use direct I/O";
+        direct_io_ = false;
+        SetDirect(false);
+        continue;
+      }
+
+      return Status(error::INTERNAL,
+                    StrCat("Unable to write, ", strerror(errno)));
+    }
+
+    data += result;
+    size -= result;
+  }
+
+  return Status::OK;
+}
+
+}  // namespace fwrapper_internal
 
 StatusOr<FWrapper> FWrapper::Open(const std::string& file,
                                   const std::string& fopen_mode) {
@@ -23,16 +319,53 @@ StatusOr<FWrapper> FWrapper::Open(const std::string& file,
   return FWrapper(new_stream);
 }
 
+FWrapper::FWrapper()
+    : file_(nullptr),
+      write_pos_(nullptr),
+      write_end_(nullptr),
+      write_begin_(nullptr),
+      stream_in_sync_(false) {}
+
+FWrapper::FWrapper(FILE* file)
+    : file_(file),
+      write_pos_(nullptr),
+      write_end_(nullptr),
+      write_begin_(nullptr),
+      stream_in_sync_(false) {
+  CHECK(file != nullptr);
+}
+
+FWrapper::FWrapper(FWrapper&& other)
+    : file_(other.file_),
+      writer_(std::move(other.writer_)),
+      write_pos_(other.write_pos_),
+      write_end_(other.write_end_),
+      write_begin_(other.write_begin_),
+      stream_in_sync_(other.stream_in_sync_) {
+  other.file_ = nullptr;
+  other.write_pos_ = nullptr;
+  other.write_end_ = nullptr;
+  other.write_begin_ = nullptr;
+}
+
 FWrapper::~FWrapper() {
+  Status status = DisableBufferedWrites();
+  if (!status.ok()) {
+    LOG(ERROR) << "Unable to complete buffered writes: " << status;
+  }
+
   if (file_ != nullptr && fclose(file_) != 0) {
     LOG(ERROR) << "Unable to fclose: " << strerror(errno);
   }
 }
 
 Status FWrapper::WriteUint32(uint32_t value) {
-  Timer t(&stats_.total_write_time);
-
   uint32_t to_write = BigEndian::FromHost32(value);
+  if (writer_) {
+    return BufferedWrite(&to_write, 4);
+  }
+
+  Timer t(&stats_.total_write_time);
   if (fwrite(&to_write, 4, 1, file_) != 1) {
     return Status(error::INTERNAL,
                   StrCat("Unable to fwrite, ", strerror(errno)));
@@ -43,9 +376,12 @@ Status FWrapper::WriteUint32(uint32_t value) {
 }
 
 Status FWrapper::WriteUint64(uint64_t value) {
-  Timer t(&stats_.total_write_time);
-
   uint64_t to_write = BigEndian::FromHost64(value);
+  if (writer_) {
+    return BufferedWrite(&to_write, 8);
+  }
+
+  Timer t(&stats_.total_write_time);
   if (fwrite(&to_write, 8, 1, file_) != 1) {
     return Status(error::INTERNAL,
                   StrCat("Unable to fwrite, ", strerror(errno)));
@@ -56,6 +392,7 @@ Status FWrapper::WriteUint64(uint64_t value) {
 }
 
 StatusOr<uint32_t> FWrapper::ReadUint32() {
+  RETURN_IF_ERROR(WaitForBufferedWrites());
   Timer t(&stats_.total_read_time);
 
   uint32_t to_read;
@@ -69,6 +406,7 @@ StatusOr<uint32_t> FWrapper::ReadUint32() {
 }
 
 StatusOr<uint64_t> FWrapper::ReadUint64() {
+  RETURN_IF_ERROR(WaitForBufferedWrites());
   Timer t(&stats_.total_read_time);
 
   uint64_t to_read;
@@ -90,16 +428,19 @@ static Status FseekHelper(FILE* stream, long int offset, int whence) {
 }
 
 Status FWrapper::Seek(uint64_t offset) {
+  RETURN_IF_ERROR(WaitForBufferedWrites());
   Timer t(&stats_.total_seek_time);
   return FseekHelper(file_, offset, SEEK_SET);
 }
 
 Status FWrapper::Skip(uint64_t num_bytes) {
+  RETURN_IF_ERROR(WaitForBufferedWrites());
   Timer t(&stats_.total_seek_time);
   return FseekHelper(file_, num_bytes, SEEK_CUR);
 }
 
 StatusOr<uint64_t> FWrapper::Tell() {
+  RETURN_IF_ERROR(WaitForBufferedWrites());
   Timer t(&stats_.total_seek_time);
 
   long int tell = ftell(file_);
@@ -111,6 +452,10 @@ StatusOr<uint64_t> FWrapper::Tell() {
 }
 
 Status FWrapper::Write(const void* bytes, uint64_t count_bytes) {
+  if (writer_) {
+    return BufferedWrite(bytes, count_bytes);
+  }
+
   Timer t(&stats_.total_write_time);
 
   if (fwrite(bytes, count_bytes, 1, file_) != 1) {
@@ -123,6 +468,7 @@ Status FWrapper::Write(const void* bytes, uint64_t count_bytes) {
 }
 
 Status FWrapper::Read(uint64_t count_bytes, void* destination) {
+  RETURN_IF_ERROR(WaitForBufferedWrites());
   Timer t(&stats_.total_read_time);
 
   if (fread(destination, count_bytes, 1, file_) != 1) {
@@ -135,6 +481,19 @@ Status FWrapper::Read(uint64_t count_bytes, void* destination) {
 }
 
 Status FWrapper::Flush() {
+  RETURN_IF_ERROR(FlushToSystem());
+  if (writer_) {
+    return writer_->Sync();
+  }
+
+  return Status::OK;
+}
+
+Status FWrapper::FlushToSystem() {
+  if (writer_) {
+    return WaitForBufferedWrites();
+  }
+
   if (file_ != nullptr) {
     if (fflush(file_) != 0) {
       return Status(error::INTERNAL, "Unable to fflush");
@@ -144,6 +503,112 @@ Status FWrapper::Flush() {
   return Status::OK;
 }
 
+Status FWrapper::EnableBufferedWrites(const BufferedWriteOptions& options) {
+  CHECK(file_ != nullptr);
+  if (writer_) {
+    return Status(error::FAILED_PRECONDITION, "Already buffering writes");
+  }
+
+  RETURN_IF_ERROR(Flush());
+  writer_ = make_unique<fwrapper_internal::BufferedWriter>(fileno(file_),
+                                                           options);
+  write_begin_ = writer_->NextBuffer();
+  write_pos_ = write_begin_;
+  write_end_ = write_begin_ + writer_->buffer_bytes();
+
+  // Flush left the stream with no buffered data, at the descriptor's offset.
+  stream_in_sync_ = true;
+  return Status::OK;
+}
+
+Status FWrapper::DisableBufferedWrites() {
+  if (!writer_) {
+    return Status::OK;
+  }
+
+  Status status = WaitForBufferedWrites();
+  writer_->CollectStats(&stats_);
+  writer_.reset();
+  write_begin_ = nullptr;
+  write_pos_ = nullptr;
+  write_end_ = nullptr;
+  stream_in_sync_ = false;
+  return status;
+}
+
+Status FWrapper::BufferedWrite(const void* bytes, uint64_t count) {
+  if (stream_in_sync_) {
+    // Reads may have left data buffered in the stream, with the descriptor
+    // ahead of the stream's position. fflush drops that data and moves the
+    // descriptor back, so the writer starts where the stream is.
+    if (fflush(file_) != 0) {
+      return Status(error::INTERNAL, "Unable to fflush");
+    }
+
+    stream_in_sync_ = false;
+  }
+
+  const uint8_t* data = static_cast<const uint8_t*>(bytes);
+  while (count > 0) {
+    size_t space = write_end_ - write_pos_;
+    if (space == 0) {
+      Status status = writer_->Submit(write_begin_, write_pos_ - write_begin_);
+      write_begin_ = writer_->NextBuffer();
+      write_pos_ = write_begin_;
+      write_end_ = write_begin_ + writer_->buffer_bytes();
+      RETURN_IF_ERROR(status);
+      continue;
+    }
+
+    size_t to_copy = std::min(static_cast<uint64_t>(space), count);
+    memcpy(write_pos_, data, to_copy);
+    write_pos_ += to_copy;
+    data += to_copy;
+    count -= to_copy;
+  }
+
+  return Status::OK;
+}
+
+Status FWrapper::WaitForBufferedWrites() {
+  if (!writer_ || stream_in_sync_) {
+    return Status::OK;
+  }
+
+  Status status = writer_->Submit(write_begin_, write_pos_ - write_begin_);
+  Status wait_status = writer_->Wait();
+  write_begin_ = writer_->NextBuffer();
+  write_pos_ = write_begin_;
+  write_end_ = write_begin_ + writer_->buffer_bytes();
+
+  RETURN_IF_ERROR(status);
+  RETURN_IF_ERROR(wait_status);
+
+  // The writer moved the descriptor's offset without the stream knowing, the
+  // stream has to seek there before it can be used again.
+  off_t offset = lseek(fileno(file_), 0, SEEK_CUR);
+  if (offset == -1 || fseeko(file_, offset, SEEK_SET) != 0) {
+    return Status(error::INTERNAL,
+                  StrCat("Unable to sync stream offset, ", strerror(errno)));
+  }
+
+  stream_in_sync_ = true;
+  return Status::OK;
+}
+
+StatusOr<MappedFile> FWrapper::Map(MappedFileOptions options) {
+  RETURN_IF_ERROR(FlushToSystem());
+  return MappedFile::FromDescriptor(fileno(file_), options);
+}
+
+const FWRapperStats& FWrapper::stats() const {
+  if (writer_) {
+    writer_->CollectStats(&stats_);
+  }
+
+  return stats_;
+}
+
 StatusOr<uint64_t> FWrapper::FileSize() {
   uint64_t current = 0;
   ASSIGN_OR_RETURN(current, Tell());
@@ -158,11 +623,9 @@ StatusOr<uint64_t> FWrapper::FileSize() {
 
 using RegionAndIndex = std::pair<const FWrapper::FileRegion*, size_t>;
 
-Status FWrapper::ReadBulk(
-    const std::vector<FileRegion>& regions,
-    std::function<void(std::vector<uint8_t>::const_iterator from,
-                       std::vector<uint8_t>::const_iterator to, size_t)>
-        processor) {
+// Returns the regions, along with their indices, sorted by offset.
+static std::vector<RegionAndIndex> SortRegions(
+    const std::vector<FWrapper::FileRegion>& regions) {
   std::vector<RegionAndIndex> regions_and_indices(regions.size());
   for (size_t i = 0; i < regions.size(); ++i) {
     CHECK(regions[i].numer_of_bytes > 0);
@@ -174,7 +637,15 @@ Status FWrapper::ReadBulk(
               return lhs.first->offset_from_start <
                      rhs.first->offset_from_start;
             });
+  return regions_and_indices;
+}
 
+Status FWrapper::ReadBulk(
+    const std::vector<FileRegion>& regions,
+    std::function<void(std::vector<uint8_t>::const_iterator from,
+                       std::vector<uint8_t>::const_iterator to, size_t)>
+        processor) {
+  std::vector<RegionAndIndex> regions_and_indices = SortRegions(regions);
   std::vector<uint8_t> tmp_storage;
   for (size_t i = 0; i < regions_and_indices.size(); ++i) {
     const FileRegion& ri = *(regions_and_indices[i].first);
@@ -222,4 +693,153 @@ Status FWrapper::ReadBulk(
   return Status::OK;
 }
 
+// A single read performed by ParallelReadBulk, covers one or more regions.
+struct ParallelRead {
+  uint64_t offset;
+  uint64_t num_bytes;
+
+  // Range of the regions (in order of offset) that the read covers.
+  size_t regions_begin;
+  size_t regions_end;
+};
+
+// Pool for reads when the caller does not provide one. Never deleted, like
+// ThreadPool::Default.
+static ThreadPool* IOThreadPool() {
+  static ThreadPool* pool = new ThreadPool(kIOPoolThreads);
+  return pool;
+}
+
+// Reads exactly 'count' bytes at a given offset, retrying short reads.
+static Status PreadFully(int fd, uint64_t offset, uint64_t count,
+                         uint8_t* destination) {
+  while (count > 0) {
+    ssize_t result = pread(fd, destination, count, offset);
+    if (result < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      return Status(error::INTERNAL,
+                    StrCat("Unable to pread, ", strerror(errno)));
+    }
+
+    if (result == 0) {
+      return Status(error::INTERNAL, "Unexpected end of file");
+    }
+
+    destination += result;
+    offset += result;
+    count -= result;
+  }
+
+  return Status::OK;
+}
+
+Status FWrapper::ParallelReadBulk(const std::vector<FileRegion>& regions,
+                                  Processor processor,
+                                  const ParallelReadOptions& options) {
+  CHECK(options.max_reads_in_flight > 0);
+  std::vector<RegionAndIndex> regions_and_indices = SortRegions(regions);
+
+  std::vector<ParallelRead> reads;
+  for (size_t i = 0; i < regions_and_indices.size(); ++i) {
+    const FileRegion& region = *(regions_and_indices[i].first);
+    uint64_t region_end = region.offset_from_start + region.numer_of_bytes;
+    if (!reads.empty()) {
+      ParallelRead& last = reads.back();
+      uint64_t last_end = last.offset + last.num_bytes;
+      if (region.offset_from_start < last_end) {
+        LOG(FATAL) << "Regions overlap, next offset "
+                   << region.offset_from_start << " read end " << last_end;
+      }
+
+      if (region.offset_from_start - last_end <= options.max_gap_bytes &&
+          region_end - last.offset <= options.max_read_bytes) {
+        last.num_bytes = region_end - last.offset;
+        last.regions_end = i + 1;
+        continue;
+      }
+    }
+
+    reads.push_back({region.offset_from_start, region.numer_of_bytes, i,
+                     i + 1});
+  }
+
+  if (reads.empty()) {
+    return Status::OK;
+  }
+
+  // Reads bypass the stream's buffer, so pending writes should reach the
+  // file first.
+  RETURN_IF_ERROR(FlushToSystem());
+  int fd = fileno(file_);
+
+  ThreadPool* pool = options.pool != nullptr ? options.pool : IOThreadPool();
+
+  Timer wall_timer(&stats_.parallel_read_wall_time);
+
+  // Protects stats_, the buffers and the status.
+  std::mutex mu;
+  std::vector<std::vector<uint8_t>> free_buffers;
+  Status status = Status::OK;
+  std::atomic<bool> failed(false);
+  std::atomic<size_t> in_flight(0);
+
+  pool->RunIndices(reads.size(), options.max_reads_in_flight, [&](size_t i) {
+    if (failed.load()) {
+      return;
+    }
+
+    std::vector<uint8_t> buffer;
+    {
+      std::lock_guard<std::mutex> lock(mu);
+      if (!free_buffers.empty()) {
+        buffer = std::move(free_buffers.back());
+        free_buffers.pop_back();
+      }
+    }
+
+    const ParallelRead& read = reads[i];
+    buffer.resize(read.num_bytes);
+
+    std::chrono::nanoseconds read_time(0);
+    size_t queue_depth = in_flight.fetch_add(1) + 1;
+    Status read_status;
+    {
+      Timer read_timer(&read_time);
+      read_status = PreadFully(fd, read.offset, read.num_bytes, &buffer[0]);
+    }
+    in_flight.fetch_sub(1);
+
+    {
+      std::lock_guard<std::mutex> lock(mu);
+      stats_.total_read_time += read_time;
+      stats_.read_queue_depth.Add(queue_depth);
+      if (!read_status.ok()) {
+        if (status.ok()) {
+          status = read_status;
+        }
+        failed.store(true);
+        return;
+      }
+
+      stats_.reads.Add(read.num_bytes);
+      stats_.parallel_bytes_read += read.num_bytes;
+    }
+
+    for (size_t j = read.regions_begin; j < read.regions_end; ++j) {
+      const RegionAndIndex& region_and_index = regions_and_indices[j];
+      const FileRegion& region = *(region_and_index.first);
+      auto from = buffer.cbegin() + (region.offset_from_start - read.offset);
+      processor(from, from + region.numer_of_bytes, region_and_index.second);
+    }
+
+    std::lock_guard<std::mutex> lock(mu);
+    free_buffers.emplace_back(std::move(buffer));
+  });
+
+  return status;
+}
+
 }  // namespace nc
@@ -1,32 +1,145 @@
 #include <chrono>
 #include <cstdint>
 #include <cstdio>
+#include <cstring>
 #include <functional>
 #include <iostream>
+#include <memory>
+#include <type_traits>
 #include <vector>
 
 #include "common.h"
 #include "logging.h"
+#include "mapped_file.h"
 #include "stats.h"
 #include "statusor.h"
+#include "thread_runner.h"
 
 namespace nc {
 
 // Statistics about a FWrapper instance.
 struct FWRapperStats {
   FWRapperStats()
-      : total_read_time(0), total_write_time(0), total_seek_time(0) {}
+      : total_read_time(0),
+        total_write_time(0),
+        total_seek_time(0),
+        parallel_bytes_read(0),
+        parallel_read_wall_time(0),
+        buffered_bytes_written(0),
+        buffered_write_time(0),
+        write_stall_time(0) {}
 
-  // Total time spent reading, writing and seeking
+  // Total time spent reading, writing and seeking. For parallel reads this is
+  // the sum of the time spent in each read, so it can exceed the wall time.
   std::chrono::nanoseconds total_read_time;
   std::chrono::nanoseconds total_write_time;
   std::chrono::nanoseconds total_seek_time;
 
-  // Statistics about the reads and the writes performed.
+  // Statistics about the reads and the writes performed. In buffered write
+  // mode the writes are the ones the background thread performs, one per
+  // buffer.
   DiscreteDistribution<uint64_t> reads;
   DiscreteDistribution<uint64_t> writes;
+
+  // Number of reads in flight (including the new one) every time
+  // ParallelReadBulk issues a read.
+  DiscreteDistribution<uint64_t> read_queue_depth;
+
+  // Bytes read and wall time spent in ParallelReadBulk.
+  uint64_t parallel_bytes_read;
+  std::chrono::nanoseconds parallel_read_wall_time;
+
+  // Bandwidth achieved by ParallelReadBulk, in bytes per second.
+  double ParallelReadBandwidth() const {
+    if (parallel_read_wall_time.count() == 0) {
+      return 0;
+    }
+
+    return parallel_bytes_read / (parallel_read_wall_time.count() / 1e9);
+  }
+
+  // Bytes written by the background thread in buffered write mode and the
+  // time it spent writing them. The time is also part of total_write_time.
+  uint64_t buffered_bytes_written;
+  std::chrono::nanoseconds buffered_write_time;
+
+  // Time the writing thread spent blocked in buffered write mode, waiting for
+  // a free buffer or for Flush to complete.
+  std::chrono::nanoseconds write_stall_time;
+
+  // Bandwidth of the background thread's writes, in bytes per second.
+  double BufferedWriteBandwidth() const {
+    if (buffered_write_time.count() == 0) {
+      return 0;
+    }
+
+    return buffered_bytes_written / (buffered_write_time.count() / 1e9);
+  }
+};
+
+// Threads in the pool ParallelReadBulk uses when it is not given one. Enough
+// for the default max_reads_in_flight.
+static constexpr size_t kIOPoolThreads = 15;
+
+// Controls how ParallelReadBulk reads regions.
+struct ParallelReadOptions {
+  ParallelReadOptions()
+      : max_gap_bytes(4096),
+        max_read_bytes(1 << 22),
+        max_reads_in_flight(16),
+        pool(nullptr) {}
+
+  // Regions separated by at most this many bytes are read with a single read.
+  // The bytes in the gap are read and discarded.
+  uint64_t max_gap_bytes;
+
+  // Regions are not merged into reads larger than this. A single region
+  // larger than this is still read in one go.
+  uint64_t max_read_bytes;
+
+  // Maximum number of reads that are issued concurrently. This is also the
+  // maximum number of read buffers held at any time.
+  size_t max_reads_in_flight;
+
+  // Pool to run the reads on. If null a process-wide pool with
+  // kIOPoolThreads threads, created on first use, is shared by all calls.
+  // The calling thread also reads. Since reads block, the pool should have
+  // at least max_reads_in_flight - 1 threads.
+  ThreadPool* pool;
+};
+
+// Controls buffered write mode, see FWrapper::EnableBufferedWrites.
+struct BufferedWriteOptions {
+  BufferedWriteOptions()
+      : buffer_bytes(1 << 20),
+        buffer_count(2),
+        direct_io(false),
+        sync_on_flush(true) {}
+
+  // Size of each buffer. Rounded up to a multiple of 4096.
+  size_t buffer_bytes;
+
+  // Number of buffers. While the background thread writes one buffer the
+  // others can be filled. Should be at least 2.
+  size_t buffer_count;
+
+  // Bypasses the page cache (O_DIRECT) for writes that are aligned. Falls
+  // back to regular writes if the file system does not support it.
+  bool direct_io;
+
+  // If true Flush waits for the data to reach the disk (fdatasync). If false
+  // it only waits for the data to be handed to the operating system, which
+  // is faster but does not survive a crash.
+  bool sync_on_flush;
 };
 
+namespace fwrapper_internal {
+
+// Writes buffers to a file descriptor from a background thread.
+class BufferedWriter;
+
+}  // namespace fwrapper_internal
+
 class FWrapper {
  public:
   struct FileRegion {
@@ -41,12 +154,38 @@ class FWrapper {
   static StatusOr<FWrapper> Open(const std::string& file,
                                  const std::string& fopen_mode);
 
-  FWrapper() : file_(nullptr) {}
+  FWrapper();
 
-  FWrapper(FWrapper&& other) : file_(other.file_) { other.file_ = nullptr; }
+  FWrapper(FWrapper&& other);
 
   ~FWrapper();
 
+  // Switches to buffered write mode. Writes are copied into large buffers
+  // that a background thread writes to the file, so the calling thread does
+  // not wait for the file system unless all buffers are full. Any other
+  // operation (reads, seeks, Tell) first waits for pending writes.
+  Status EnableBufferedWrites(
+      const BufferedWriteOptions& options = BufferedWriteOptions());
+
+  // Writes all pending data and switches back to unbuffered writes.
+  Status DisableBufferedWrites();
+
+  // Writes the bytes of a trivially copyable record (in host byte order). In
+  // buffered write mode this is usually a single copy into the current
+  // buffer.
+  template <typename T>
+  Status WriteRecord(const T& record) {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "Records should be trivially copyable");
+    if (static_cast<size_t>(write_end_ - write_pos_) >= sizeof(T)) {
+      memcpy(write_pos_, &record, sizeof(T));
+      write_pos_ += sizeof(T);
+      return Status::OK;
+    }
+
+    return Write(&record, sizeof(T));
+  }
+
   // Writes a uint32_t to a file.
   Status WriteUint32(uint32_t value);
 
@@ -74,7 +213,8 @@ class FWrapper {
   // Reads bytes from the current offset.
   Status Read(uint64_t count_bytes, void* destination);
 
-  // Performs all outstanding writes.
+  // Performs all outstanding writes. In buffered write mode blocks until all
+  // buffers are written and, unless sync_on_flush is off, are on disk.
   Status Flush();
 
   // Returns the size of the file.
@@ -86,13 +226,55 @@ class FWrapper {
   // not return until all reads are complete. The regions must not overlap.
   Status ReadBulk(const std::vector<FileRegion>& regions, Processor processor);
 
-  const FWRapperStats& stats() const { return stats_; }
+  // Same as ReadBulk, but issues multiple positional reads at the same time,
+  // which is much faster on devices that can serve many requests in parallel
+  // (SSDs). Regions close to each other are merged into a single read. Each
+  // read's regions are processed on the thread that read them as soon as the
+  // read completes, so the processor may be called from multiple threads at
+  // the same time. Returns the first error encountered; regions after a
+  // failed read may not be processed.
+  Status ParallelReadBulk(
+      const std::vector<FileRegion>& regions, Processor processor,
+      const ParallelReadOptions& options = ParallelReadOptions());
+
+  // Maps the file into memory, see MappedFile. Completes pending writes
+  // first; the mapping does not reflect writes made after this call. The
+  // file should be open for reading.
+  StatusOr<MappedFile> Map(MappedFileOptions options = {});
+
+  const FWRapperStats& stats() const;
 
  private:
-  FWrapper(FILE* file) : file_(file) { CHECK(file != nullptr); }
+  FWrapper(FILE* file);
+
+  // Copies bytes into the buffers, handing full buffers to the writer.
+  Status BufferedWrite(const void* bytes, uint64_t count);
+
+  // In buffered write mode waits for all pending writes and moves the stream
+  // to the offset they left the file at, so that stream operations can be
+  // used.
+  Status WaitForBufferedWrites();
+
+  // Hands all outstanding writes to the operating system, so that they are
+  // visible to reads that bypass the stream. Unlike Flush does not sync.
+  Status FlushToSystem();
 
   FILE* file_;
-  FWRapperStats stats_;
+
+  // Stats from the background writer are added when stats() is called.
+  mutable FWRapperStats stats_;
+
+  // Set in buffered write mode. The current buffer is [write_begin_,
+  // write_end_), bytes before write_pos_ are filled.
+  std::unique_ptr<fwrapper_internal::BufferedWriter> writer_;
+  uint8_t* write_pos_;
+  uint8_t* write_end_;
+  uint8_t* write_begin_;
+
+  // In buffered write mode, true if there are no pending writes and the
+  // stream is at the descriptor's offset. The stream owns the offset until
+  // the next buffered write.
+  bool stream_in_sync_;
 
   DISALLOW_COPY_AND_ASSIGN(FWrapper);
 };
@@ -1,6 +1,8 @@
 #include "fwrapper.h"
 
 #include <gtest/gtest.h>
+#include <mutex>
+#include <random>
 
 #include "file.h"
 #include "port.h"
@@ -83,6 +85,156 @@ TEST_F(FWrapperFixture, WriteRead) {
   }
 }
 
+// Writes a mix of values, records and byte ranges.
+static void WriteMixed(FWrapper* fw) {
+  struct Record {
+    uint64_t a;
+    uint32_t b;
+    uint32_t c;
+  };
+
+  std::vector<uint8_t> bytes(10000, 7);
+  for (size_t i = 0; i < 10000; ++i) {
+    ASSERT_TRUE(fw->WriteUint32(i).ok());
+    ASSERT_TRUE(fw->WriteUint64(i * 1000).ok());
+    ASSERT_TRUE(fw->WriteRecord(Record{i, 1, 2}).ok());
+    if (i % 1000 == 0) {
+      ASSERT_TRUE(fw->Write(bytes.data(), bytes.size()).ok());
+    }
+  }
+}
+
+TEST_F(FWrapperFixture, BufferedWrites) {
+  static constexpr char kModelFile[] = "test_file_model";
+  {
+    FWrapper fw = FWrapper::Open(kModelFile, "w").ConsumeValueOrDie();
+    WriteMixed(&fw);
+  }
+
+  uint64_t bytes_written = 0;
+  {
+    FWrapper fw = FWrapper::Open(kTestFile, "w").ConsumeValueOrDie();
+    BufferedWriteOptions options;
+    options.buffer_bytes = 1000;
+    options.buffer_count = 3;
+    ASSERT_TRUE(fw.EnableBufferedWrites(options).ok());
+    ASSERT_FALSE(fw.EnableBufferedWrites(options).ok());
+    WriteMixed(&fw);
+
+    bytes_written = fw.Tell().ValueOrDie();
+    ASSERT_TRUE(fw.Flush().ok());
+
+    // Buffers are rounded up to 4096 bytes, only the last write (on Tell) is
+    // partial.
+    const FWRapperStats& stats = fw.stats();
+    ASSERT_EQ(bytes_written, stats.buffered_bytes_written);
+    ASSERT_EQ(bytes_written / 4096, stats.writes.counts().at(4096));
+    ASSERT_LE(0, stats.BufferedWriteBandwidth());
+    ASSERT_LE(stats.buffered_write_time, stats.total_write_time);
+    if (stats.buffered_write_time.count() > 0) {
+      ASSERT_DOUBLE_EQ(stats.buffered_bytes_written /
+                           (stats.buffered_write_time.count() / 1e9),
+                       stats.BufferedWriteBandwidth());
+    }
+  }
+
+  ASSERT_EQ(File::ReadFileToStringOrDie(kModelFile),
+            File::ReadFileToStringOrDie(kTestFile));
+  ASSERT_EQ(bytes_written, File::ReadFileToStringOrDie(kTestFile).size());
+  File::DeleteRecursively(kModelFile, nullptr, nullptr);
+}
+
+TEST_F(FWrapperFixture, BufferedWritesDirect) {
+  std::vector<uint8_t> bytes;
+  for (size_t i = 0; i < 100000; ++i) {
+    bytes.emplace_back(i % 13);
+  }
+
+  {
+    FWrapper fw = FWrapper::Open(kTestFile, "w").ConsumeValueOrDie();
+    BufferedWriteOptions options;
+    options.buffer_bytes = 8192;
+    options.direct_io = true;
+    options.sync_on_flush = true;
+    ASSERT_TRUE(fw.EnableBufferedWrites(options).ok());
+    ASSERT_TRUE(fw.Write(bytes.data(), 50000).ok());
+
+    // Leaves the offset unaligned.
+    ASSERT_TRUE(fw.Flush().ok());
+    ASSERT_TRUE(fw.Write(bytes.data() + 50000, 50000).ok());
+  }
+
+  std::string contents = File::ReadFileToStringOrDie(kTestFile);
+  ASSERT_EQ(std::string(bytes.begin(), bytes.end()), contents);
+}
+
+TEST_F(FWrapperFixture, BufferedWritesThenRead) {
+  auto result = FWrapper::Open(kTestFile, "w+");
+  ASSERT_TRUE(result.ok());
+  FWrapper fw = result.ConsumeValueOrDie();
+  ASSERT_TRUE(fw.EnableBufferedWrites().ok());
+  ASSERT_TRUE(fw.WriteUint32(2).ok());
+  ASSERT_TRUE(fw.WriteUint32(3).ok());
+
+  // Pending writes complete before the seek.
+  ASSERT_TRUE(fw.Seek(4).ok());
+  ASSERT_EQ(3ul, fw.ReadUint32().ValueOrDie());
+  ASSERT_EQ(8ul, fw.FileSize().ValueOrDie());
+
+  ASSERT_TRUE(fw.DisableBufferedWrites().ok());
+  ASSERT_TRUE(fw.WriteUint32(4).ok());
+  ASSERT_EQ(12ul, fw.FileSize().ValueOrDie());
+}
+
+TEST_F(FWrapperFixture, BufferedWritesSeekAndSkip) {
+  {
+    FWrapper fw = FWrapper::Open(kTestFile, "w").ConsumeValueOrDie();
+    ASSERT_TRUE(fw.EnableBufferedWrites().ok());
+    ASSERT_TRUE(fw.Write(std::string(100, 'a').data(), 100).ok());
+    ASSERT_EQ(100ul, fw.Tell().ValueOrDie());
+
+    ASSERT_TRUE(fw.Seek(0).ok());
+    ASSERT_TRUE(fw.Write(std::string(10, 'b').data(), 10).ok());
+    ASSERT_EQ(10ul, fw.Tell().ValueOrDie());
+    ASSERT_TRUE(fw.Skip(5).ok());
+    ASSERT_TRUE(fw.Write(std::string(3, 'c').data(), 3).ok());
+    ASSERT_EQ(18ul, fw.Tell().ValueOrDie());
+
+    // Writes after switching back to the stream continue at the same offset.
+    ASSERT_TRUE(fw.DisableBufferedWrites().ok());
+    ASSERT_TRUE(fw.Write(std::string(7, 'd').data(), 7).ok());
+    ASSERT_EQ(25ul, fw.Tell().ValueOrDie());
+  }
+
+  std::string model(100, 'a');
+  model.replace(0, 10, std::string(10, 'b'));
+  model.replace(15, 3, std::string(3, 'c'));
+  model.replace(18, 7, std::string(7, 'd'));
+  ASSERT_EQ(model, File::ReadFileToStringOrDie(kTestFile));
+}
+
+TEST_F(FWrapperFixture, BufferedWritesAfterRead) {
+  {
+    FWrapper fw = FWrapper::Open(kTestFile, "w+").ConsumeValueOrDie();
+    ASSERT_TRUE(fw.Write(std::string(100, 'a').data(), 100).ok());
+    ASSERT_TRUE(fw.Seek(0).ok());
+
+    // The read leaves the rest of the file buffered in the stream.
+    ASSERT_TRUE(fw.EnableBufferedWrites().ok());
+    char read[4];
+    ASSERT_TRUE(fw.Read(4, read).ok());
+    ASSERT_EQ("aaaa", std::string(read, 4));
+    ASSERT_TRUE(fw.Write(std::string(2, 'b').data(), 2).ok());
+    ASSERT_EQ(6ul, fw.Tell().ValueOrDie());
+    ASSERT_TRUE(fw.Read(4, read).ok());
+    ASSERT_EQ("aaaa", std::string(read, 4));
+  }
+
+  std::string model(100, 'a');
+  model.replace(4, 2, std::string(2, 'b'));
+  ASSERT_EQ(model, File::ReadFileToStringOrDie(kTestFile));
+}
+
 class BulkReadFixture : public ::testing::Test {
  protected:
   BulkReadFixture()
@@ -198,5 +350,172 @@ TEST_F(BulkReadFixture, BadReadOverlapping) {
                ".*");
 }
 
+// Processes regions from multiple threads and records their sizes.
+class ParallelReadFixture : public BulkReadFixture {
+ protected:
+  ParallelReadFixture()
+      : locked_p_([this](std::vector<uint8_t>::const_iterator from,
+                         std::vector<uint8_t>::const_iterator to, size_t i) {
+          std::lock_guard<std::mutex> lock(mu_);
+          p_(from, to, i);
+        }) {}
+
+  // Processed (size, index) pairs, sorted by index.
+  std::vector<std::pair<size_t, size_t>> SortedProcessed() {
+    std::vector<std::pair<size_t, size_t>> out = processed_;
+    std::sort(out.begin(), out.end(),
+              [](const std::pair<size_t, size_t>& lhs,
+                 const std::pair<size_t, size_t>& rhs) {
+                return lhs.second < rhs.second;
+              });
+    return out;
+  }
+
+  std::mutex mu_;
+  FWrapper::Processor locked_p_;
+};
+
+TEST_F(ParallelReadFixture, NoReads) {
+  auto result = FWrapper::Open(kTestFile, "r");
+  FWrapper fw = result.ConsumeValueOrDie();
+
+  ASSERT_TRUE(fw.ParallelReadBulk({}, locked_p_).ok());
+  ASSERT_TRUE(processed_.empty());
+}
+
+TEST_F(ParallelReadFixture, MergedReads) {
+  auto result = FWrapper::Open(kTestFile, "r");
+  FWrapper fw = result.ConsumeValueOrDie();
+
+  // With the default gap all regions are read at once.
+  ASSERT_TRUE(fw.ParallelReadBulk({{300, 50},
+                                   {500, 500},
+                                   {5000, 500},
+                                   {1000, 10},
+                                   {100, 200},
+                                   {0, 100}},
+                                  locked_p_)
+                  .ok());
+  std::vector<std::pair<size_t, size_t>> model = {
+      {50, 0}, {500, 1}, {500, 2}, {10, 3}, {200, 4}, {100, 5}};
+  ASSERT_EQ(model, SortedProcessed());
+
+  std::map<uint64_t, uint64_t> reads_model = {{5500, 1}};
+  ASSERT_EQ(reads_model, fw.stats().reads.counts());
+  ASSERT_EQ(5500ul, fw.stats().parallel_bytes_read);
+  ASSERT_LT(0, fw.stats().ParallelReadBandwidth());
+}
+
+TEST_F(ParallelReadFixture, NoGap) {
+  auto result = FWrapper::Open(kTestFile, "r");
+  FWrapper fw = result.ConsumeValueOrDie();
+
+  // Without gaps the reads are the same as the ones ReadBulk performs.
+  ParallelReadOptions options;
+  options.max_gap_bytes = 0;
+  options.max_reads_in_flight = 3;
+  ASSERT_TRUE(fw.ParallelReadBulk({{300, 50},
+                                   {500, 500},
+                                   {5000, 500},
+                                   {1000, 10},
+                                   {100, 200},
+                                   {0, 100}},
+                                  locked_p_, options)
+                  .ok());
+  ASSERT_EQ(6ul, processed_.size());
+
+  std::map<uint64_t, uint64_t> model = {{350, 1}, {510, 1}, {500, 1}};
+  ASSERT_EQ(model, fw.stats().reads.counts());
+  ASSERT_EQ(3ul, fw.stats().read_queue_depth.summary_stats().count());
+  ASSERT_GE(3ul, fw.stats().read_queue_depth.summary_stats().max());
+}
+
+TEST_F(ParallelReadFixture, MaxReadSize) {
+  auto result = FWrapper::Open(kTestFile, "r");
+  FWrapper fw = result.ConsumeValueOrDie();
+
+  // Adjacent regions are not merged beyond the maximum read size, but a
+  // single large region is still read at once.
+  ParallelReadOptions options;
+  options.max_read_bytes = 1000;
+  ASSERT_TRUE(
+      fw.ParallelReadBulk({{0, 600}, {600, 600}, {1200, 5000}}, locked_p_,
+                          options)
+          .ok());
+  std::map<uint64_t, uint64_t> model = {{600, 2}, {5000, 1}};
+  ASSERT_EQ(model, fw.stats().reads.counts());
+}
+
+TEST_F(ParallelReadFixture, PastEnd) {
+  auto result = FWrapper::Open(kTestFile, "r");
+  FWrapper fw = result.ConsumeValueOrDie();
+
+  ASSERT_FALSE(fw.ParallelReadBulk({{999990, 100}}, locked_p_).ok());
+  ASSERT_TRUE(processed_.empty());
+}
+
+TEST_F(ParallelReadFixture, Overlapping) {
+  auto result = FWrapper::Open(kTestFile, "r");
+  FWrapper fw = result.ConsumeValueOrDie();
+
+  ASSERT_DEATH(fw.ParallelReadBulk({{300, 4750}, {500, 500}}, locked_p_),
+               "overlap");
+}
+
+TEST_F(FWrapperFixture, ParallelReadContents) {
+  std::vector<uint8_t> data;
+  for (size_t i = 0; i < 1000000; ++i) {
+    data.emplace_back(i % 251);
+  }
+
+  {
+    auto result = FWrapper::Open(kTestFile, "w");
+    FWrapper fw = result.ConsumeValueOrDie();
+    ASSERT_TRUE(fw.Write(data.data(), data.size()).ok());
+  }
+
+  // Random non-overlapping regions.
+  std::mt19937 rnd(1);
+  std::uniform_int_distribution<uint64_t> dist(1, 5000);
+  std::vector<FWrapper::FileRegion> regions;
+  uint64_t offset = 0;
+  while (true) {
+    offset += dist(rnd) % 10 == 0 ? dist(rnd) : 0;
+    uint64_t size = dist(rnd);
+    if (offset + size > data.size()) {
+      break;
+    }
+
+    regions.push_back({offset, size});
+    offset += size;
+  }
+  std::shuffle(regions.begin(), regions.end(), rnd);
+
+  auto result = FWrapper::Open(kTestFile, "r");
+  FWrapper fw = result.ConsumeValueOrDie();
+
+  ParallelReadOptions options;
+  options.max_read_bytes = 100000;
+  std::vector<size_t> seen(regions.size(), 0);
+  std::mutex mu;
+  ASSERT_TRUE(
+      fw.ParallelReadBulk(
+            regions, [&data, &regions, &seen, &mu](
+                         std::vector<uint8_t>::const_iterator from,
+                         std::vector<uint8_t>::const_iterator to, size_t i) {
+              const FWrapper::FileRegion& region = regions[i];
+              ASSERT_EQ(region.numer_of_bytes,
+                        static_cast<uint64_t>(std::distance(from, to)));
+              ASSERT_TRUE(std::equal(
+                  from, to, data.begin() + region.offset_from_start));
+
+              std::lock_guard<std::mutex> lock(mu);
+              ++seen[i];
+            },
+            options)
+          .ok());
+  ASSERT_EQ(std::vector<size_t>(regions.size(), 1), seen);
+}
+
 }  // namespace test
 }  // namespace nc
@@ -119,7 +119,7 @@ class BulkPacketGenerator : public BulkPacketGeneratorBase,
 
   // Passes batches between the thread that generates them and the one that
   // consumes them.
-  PtrQueue<Batch, 1> ptr_queue_;
+  SPSCPtrQueue<Batch, 1> ptr_queue_;
 
   // The current batch.
   Batch current_batch_;
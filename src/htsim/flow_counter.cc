@@ -7,8 +7,26 @@
 namespace nc {
 namespace htsim {
 
+FlowCounter::FlowCounter(EventQueue* event_queue, EventQueueTime window)
+    : FlowCounter(event_queue) {
+  CHECK(window > EventQueueTime::ZeroTime());
+  window_ = window;
+  sketch_ = make_unique<SlidingHyperLogLog>(window.Raw());
+  last_sample_time_ = event_queue->CurrentTime();
+}
+
 void FlowCounter::NewPacket(const net::FiveTuple& five_tuple) {
   EventQueueTime now = event_queue_->CurrentTime();
+  if (sketch_) {
+    sketch_->Add(five_tuple.hash(), now.Raw());
+    if (now - last_sample_time_ >= window_) {
+      samples_sum_ += sketch_->Estimate(window_.Raw(), now.Raw());
+      ++num_samples_;
+      last_sample_time_ = now;
+    }
+    return;
+  }
+
   auto it_and_rest = flows_.emplace(five_tuple, now);
   auto it = it_and_rest.first;
   FirstAndLast& first_and_last_timestamps = it->second;
@@ -21,7 +39,30 @@ double FlowCounter::EstimateCount() {
   return count;
 }
 
+void FlowCounter::Clear() {
+  flows_.clear();
+  samples_sum_ = 0;
+  num_samples_ = 0;
+  if (sketch_) {
+    sketch_->Clear();
+    last_sample_time_ = event_queue_->CurrentTime();
+  }
+}
+
 double FlowCounter::EstimateCountConst() const {
+  if (sketch_) {
+    // If no full window has passed since the last call to Clear the count is
+    // estimated from the flows active right now.
+    double count;
+    if (num_samples_ == 0) {
+      uint64_t now = event_queue_->CurrentTime().Raw();
+      count = sketch_->Estimate(window_.Raw(), now);
+    } else {
+      count = samples_sum_ / num_samples_;
+    }
+    return std::max(1.0, count);
+  }
+
   EventQueueTime period_len = event_queue_->CurrentTime() - period_start_;
   uint64_t period_len_millis = event_queue_->TimeToRawMillis(period_len);
 
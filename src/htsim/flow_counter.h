@@ -2,17 +2,32 @@
 #define FLOW_COUNTER_PCAP_DATA_H
 
 #include <map>
+#include <memory>
 
 #include "../event_queue.h"
 #include "../net/net_common.h"
+#include "../sketch.h"
 
 namespace nc {
 namespace htsim {
 
 class FlowCounter {
  public:
+  // Keeps exact per-flow state.
   FlowCounter(EventQueue* event_queue)
-      : period_start_(event_queue->CurrentTime()), event_queue_(event_queue) {}
+      : period_start_(event_queue->CurrentTime()),
+        event_queue_(event_queue),
+        window_(EventQueueTime::ZeroTime()),
+        last_sample_time_(EventQueueTime::ZeroTime()),
+        samples_sum_(0),
+        num_samples_(0) {}
+
+  // Keeps no per-flow state. A flow is considered active if it has sent a
+  // packet within the last 'window'. The number of active flows is estimated
+  // with a SlidingHyperLogLog once per window, and EstimateCount returns the
+  // average of these estimates. Memory use is independent of the number of
+  // flows.
+  FlowCounter(EventQueue* event_queue, EventQueueTime window);
 
   // Adds a new packet. This assumes that now is
   void NewPacket(const net::FiveTuple& five_tuple);
@@ -26,10 +41,16 @@ class FlowCounter {
   // flows. Should call Clear() later.
   double EstimateCountConst() const;
 
-  void Clear() { flows_.clear(); }
+  void Clear();
 
   EventQueue* event_queue() { return event_queue_; }
 
+  // True if the counter uses a sketch instead of keeping per-flow state.
+  bool sketched() const { return static_cast<bool>(sketch_); }
+
+  // The activity window used if the counter is sketched.
+  EventQueueTime window() const { return window_; }
+
  private:
   struct FirstAndLast {
     FirstAndLast(EventQueueTime first) : first(first), last(first) {}
@@ -46,6 +67,16 @@ class FlowCounter {
 
   // The event queue -- used for getting timestamps.
   EventQueue* event_queue_;
+
+  // Set iff the counter is sketched.
+  std::unique_ptr<SlidingHyperLogLog> sketch_;
+  EventQueueTime window_;
+
+  // Time the active flow count was last sampled from the sketch, and the sum
+  // and number of samples taken since the last call to Clear.
+  EventQueueTime last_sample_time_;
+  double samples_sum_;
+  size_t num_samples_;
 };
 
 }  // namespace htsim
@@ -0,0 +1,59 @@
+#include "flow_counter.h"
+
+#include <chrono>
+#include "gtest/gtest.h"
+
+namespace nc {
+namespace htsim {
+namespace {
+
+using namespace std::chrono;
+
+static net::FiveTuple Tuple(uint32_t i) {
+  return net::FiveTuple(net::IPAddress(i), net::IPAddress(1), net::IPProto(6),
+                        net::AccessLayerPort(100), net::AccessLayerPort(200));
+}
+
+class FlowCounterFixture : public ::testing::Test {
+ protected:
+  // Sends a packet from each of 'num_flows' flows every millisecond, for
+  // 'millis' milliseconds.
+  void SendPackets(uint32_t first_flow, uint32_t num_flows, size_t millis,
+                   FlowCounter* counter) {
+    for (size_t i = 0; i < millis; ++i) {
+      for (uint32_t flow = first_flow; flow < first_flow + num_flows; ++flow) {
+        counter->NewPacket(Tuple(flow));
+      }
+      event_queue_.RunAndStopIn(milliseconds(1));
+    }
+  }
+
+  SimTimeEventQueue event_queue_;
+};
+
+TEST_F(FlowCounterFixture, Sketched) {
+  FlowCounter counter(&event_queue_, event_queue_.ToTime(milliseconds(2)));
+  ASSERT_TRUE(counter.sketched());
+  SendPackets(0, 1000, 10, &counter);
+  ASSERT_NEAR(1000, counter.EstimateCountConst(), 100);
+}
+
+TEST_F(FlowCounterFixture, SketchedClear) {
+  FlowCounter counter(&event_queue_, event_queue_.ToTime(milliseconds(2)));
+  SendPackets(0, 1000, 10, &counter);
+  counter.Clear();
+
+  // Flows from before Clear are still within the window, but should not be
+  // counted.
+  for (uint32_t flow = 1000; flow < 1010; ++flow) {
+    counter.NewPacket(Tuple(flow));
+  }
+  ASSERT_NEAR(10, counter.EstimateCountConst(), 2);
+
+  SendPackets(1000, 10, 10, &counter);
+  ASSERT_NEAR(10, counter.EstimateCountConst(), 2);
+}
+
+}  // namespace
+}  // namespace htsim
+}  // namespace nc
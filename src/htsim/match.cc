@@ -48,8 +48,13 @@ MatchRuleAction::MatchRuleAction(const MatchRuleAction& other)
   preferential_drop_ = other.preferential_drop_;
   if (other.sample_prob_ != 0) {
     CHECK(other.flow_counter_);
-    EnableFlowCounter(1 / other.sample_prob_,
-                      other.flow_counter_->event_queue());
+    if (other.flow_counter_->sketched()) {
+      EnableSketchedFlowCounter(other.flow_counter_->window(),
+                                other.flow_counter_->event_queue());
+    } else {
+      EnableFlowCounter(1 / other.sample_prob_,
+                        other.flow_counter_->event_queue());
+    }
   }
 }
 
@@ -59,6 +64,12 @@ void MatchRuleAction::EnableFlowCounter(size_t n, EventQueue* event_queue) {
   flow_counter_ = make_unique<FlowCounter>(event_queue);
 }
 
+void MatchRuleAction::EnableSketchedFlowCounter(EventQueueTime window,
+                                                EventQueue* event_queue) {
+  sample_prob_ = 1.0;
+  flow_counter_ = make_unique<FlowCounter>(event_queue, window);
+}
+
 ActionStats MatchRuleAction::Stats(bool include_flow_count) const {
   if (!include_flow_count || !flow_counter_) {
     return stats_;
@@ -127,6 +127,12 @@ class MatchRuleAction {
   // Enables flow counting for this action. The counter will see 1 in N packets.
   void EnableFlowCounter(size_t n, EventQueue* event_queue);
 
+  // Enables sketch-based flow counting for this action. The counter keeps no
+  // per-flow state, so it sees all packets. A flow is counted as active if it
+  // has sent a packet within the last 'window' (see FlowCounter).
+  void EnableSketchedFlowCounter(EventQueueTime window,
+                                 EventQueue* event_queue);
+
   double flow_counter_sample_prob() const { return sample_prob_; }
 
  private:
@@ -10,6 +10,7 @@
 
 #include "../common.h"
 #include "../event_queue.h"
+#include "../quantile_sketch.h"
 #include "../stats.h"
 #include "../net/net_common.h"
 #include "packet.h"
@@ -141,6 +142,11 @@ class FIFOQueue : public Queue {
 
   net::Bandwidth GetRate() const override { return rate_; }
 
+  // Distribution of the (raw) times packets waited in the queue.
+  const LogLinearHistogram<uint64_t>& time_waiting() const {
+    return time_waiting_;
+  }
+
  protected:
   inline EventQueueTime PacketDrainTime(const Packet& pkt) {
     return EventQueueTime(time_per_bit_.Raw() * pkt.size_bytes() * 8);
@@ -159,7 +165,7 @@ class FIFOQueue : public Queue {
   std::deque<PacketPtr> queue_;
 
   // Keeps track of the amounts of time packets are waiting.
-  SummaryStats time_waiting_;
+  LogLinearHistogram<uint64_t> time_waiting_;
 
   DISALLOW_COPY_AND_ASSIGN(FIFOQueue);
 };
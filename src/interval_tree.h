@@ -3,10 +3,12 @@
 #ifndef NCODE_INTERVAL_TREE
 #define NCODE_INTERVAL_TREE
 
+#include <algorithm>
 #include <set>
 #include <vector>
 #include "common.h"
 #include "stats.h"
+#include "thread_runner.h"
 
 namespace nc {
 namespace interval_tree {
@@ -327,6 +329,653 @@ class TreeRoot {
   std::vector<std::pair<T, const IndexedInterval<T, V>*>> intervals_sorted_;
 };
 
+
+// An interval tree stored in a few flat arrays instead of a tree of
+// heap-allocated nodes. Split points are every kLeafSize-th distinct endpoint
+// of all intervals, arranged as an implicit balanced binary search tree in
+// Eytzinger (BFS) order -- the children of node k are at 2k and 2k + 1, so the
+// top levels of the tree share a few cache lines. Each interval is stored at
+// the first node on the path from the root whose split point it contains.
+// Intervals that contain no split point end up in the leaf (the missing child
+// at which the search path ends) and are scanned linearly. Unlike TreeRoot the
+// construction is deterministic and can use multiple threads.
+template <typename T, typename V>
+class FlatTree {
+ public:
+  // Number of distinct endpoints between consecutive split points.
+  static constexpr size_t kLeafSize = 16;
+
+  FlatTree(const std::vector<Interval<T, V>>& intervals, size_t threads = 1)
+      : FlatTree(intervals, {}, threads) {}
+
+  // Same as above, but lookups will report indices[i] as the index of
+  // intervals[i], instead of i.
+  FlatTree(const std::vector<Interval<T, V>>& intervals,
+           const std::vector<uint32_t>& indices, size_t threads = 1) {
+    CHECK(threads > 0);
+    CHECK(intervals.size() < std::numeric_limits<uint32_t>::max());
+    CHECK(indices.empty() || indices.size() == intervals.size());
+    for (const auto& interval : intervals) {
+      CHECK(interval.low <= interval.high);
+    }
+
+    BuildSplits(intervals);
+    BuildNodes(intervals, indices, threads);
+  }
+
+  // Looks up intervals that contain single point. The signature of LookupF
+  // should be bool(const Interval<T, V>&, uint32_t), where the second argument
+  // is the index of the interval in the vector the tree was built from.
+  template <typename LookupF>
+  void Lookup(T point, LookupF consumer) const {
+    size_t k = 1;
+    while (k <= num_nodes_) {
+      T split = nodes_[k].split;
+      uint32_t from = nodes_[k].begin;
+      uint32_t to = nodes_[k + 1].begin;
+      if (point < split) {
+        for (uint32_t i = from; i < to && intervals_[i].first.low <= point;
+             ++i) {
+          if (!consumer(intervals_[i].first, intervals_[i].second)) {
+            return;
+          }
+        }
+        k = 2 * k;
+      } else if (point > split) {
+        for (uint32_t i = from; i < to; ++i) {
+          const IndexedInterval<T, V>& interval = intervals_[by_high_[i]];
+          if (interval.first.high < point) {
+            break;
+          }
+
+          if (!consumer(interval.first, interval.second)) {
+            return;
+          }
+        }
+        k = 2 * k + 1;
+      } else {
+        for (uint32_t i = from; i < to; ++i) {
+          if (!consumer(intervals_[i].first, intervals_[i].second)) {
+            return;
+          }
+        }
+        return;
+      }
+    }
+
+    for (uint32_t i = nodes_[k].begin;
+         i < nodes_[k + 1].begin && intervals_[i].first.low <= point; ++i) {
+      if (intervals_[i].first.high >= point &&
+          !consumer(intervals_[i].first, intervals_[i].second)) {
+        return;
+      }
+    }
+  }
+
+  // Looks up intervals that have at least one value contained in a range. The
+  // signature of LookupF should be bool(const Interval<T, V>&).
+  template <typename LookupF>
+  void Lookup(T min_point, T max_point, LookupF consumer) const {
+    LookupIndexed(min_point, max_point,
+                  [&consumer](const Interval<T, V>& interval,
+                              uint32_t interval_index) {
+                    Unused(interval_index);
+                    return consumer(interval);
+                  });
+  }
+
+  // Same as above, but the signature of LookupF should be
+  // bool(const Interval<T, V>&, uint32_t), as for point lookups.
+  template <typename LookupF>
+  void LookupIndexed(T min_point, T max_point, LookupF consumer) const {
+    bool done = false;
+    Lookup(min_point, [&consumer, &done](const Interval<T, V>& interval,
+                                         uint32_t interval_index) {
+      done = !consumer(interval, interval_index);
+      return !done;
+    });
+    if (done) {
+      return;
+    }
+
+    // Intervals that do not contain min_point but intersect the range start
+    // in (min_point, max_point].
+    auto it = std::upper_bound(all_by_low_.begin(), all_by_low_.end(),
+                               min_point, [this](T lhs, uint32_t rhs) {
+                                 return lhs < intervals_[rhs].first.low;
+                               });
+    for (; it != all_by_low_.end(); ++it) {
+      const IndexedInterval<T, V>& interval = intervals_[*it];
+      if (interval.first.low > max_point) {
+        break;
+      }
+
+      if (!consumer(interval.first, interval.second)) {
+        return;
+      }
+    }
+  }
+
+  // Looks up the intervals that contain each of a sorted list of points.
+  // Instead of descending the tree once per point the points are swept
+  // through the tree together, visiting each node at most once. The
+  // signature of LookupF should be void(size_t, const Interval<T, V>&,
+  // uint32_t), where the first argument is the index of the point in
+  // 'points' and the last one the index of the interval.
+  template <typename LookupF>
+  void LookupSorted(const std::vector<T>& points, LookupF consumer) const {
+    CHECK(std::is_sorted(points.begin(), points.end())) << "Points not sorted";
+    SweepNode(1, points, 0, points.size(), consumer);
+  }
+
+  // Calls a function with each interval in the tree and its index, in no
+  // particular order.
+  void Walk(std::function<void(const Interval<T, V>&, uint32_t)> consumer)
+      const {
+    for (const auto& interval : intervals_) {
+      consumer(interval.first, interval.second);
+    }
+  }
+
+  // Number of intervals in the tree.
+  size_t size() const { return intervals_.size(); }
+
+  uint64_t ByteEstimate() const {
+    return sizeof(this) + sizeof(Node) * nodes_.capacity() +
+           sizeof(IndexedInterval<T, V>) * intervals_.capacity() +
+           sizeof(uint32_t) * (by_high_.capacity() + all_by_low_.capacity());
+  }
+
+ private:
+  // The split point of a node is kept next to the offset of its intervals,
+  // so that each level of a lookup touches a single cache line.
+  struct Node {
+    T split;
+    uint32_t begin;
+  };
+
+  // Calls f(from, to) on consecutive chunks of [0, count), possibly in
+  // parallel.
+  static void ForEachChunk(size_t count, size_t threads,
+                           std::function<void(size_t, size_t)> f) {
+    static constexpr size_t kMinChunkSize = 1 << 14;
+    if (threads == 1 || count <= kMinChunkSize) {
+      f(0, count);
+      return;
+    }
+
+    size_t chunk_size = std::max(kMinChunkSize, count / (threads * 4) + 1);
+    std::vector<size_t> chunk_starts;
+    for (size_t i = 0; i < count; i += chunk_size) {
+      chunk_starts.emplace_back(i);
+    }
+
+    RunInParallel<size_t>(chunk_starts, [count, chunk_size, &f](size_t from) {
+      f(from, std::min(count, from + chunk_size));
+    }, threads);
+  }
+
+  // Lays out split points, taken from sorted endpoints starting at *next, as
+  // the subtree rooted at node k. Visiting the nodes in order assigns the
+  // split points in increasing order.
+  void FillSplits(const std::vector<T>& sorted, size_t* next, size_t k) {
+    if (k > num_nodes_) {
+      return;
+    }
+
+    FillSplits(sorted, next, 2 * k);
+    nodes_[k].split = sorted[*next + kLeafSize / 2];
+    *next += kLeafSize;
+    FillSplits(sorted, next, 2 * k + 1);
+  }
+
+  void BuildSplits(const std::vector<Interval<T, V>>& intervals) {
+    std::vector<T> endpoints;
+    endpoints.reserve(intervals.size() * 2);
+    for (const auto& interval : intervals) {
+      endpoints.emplace_back(interval.low);
+      endpoints.emplace_back(interval.high);
+    }
+    std::sort(endpoints.begin(), endpoints.end());
+    endpoints.erase(std::unique(endpoints.begin(), endpoints.end()),
+                    endpoints.end());
+
+    // Node 0 is unused. Nodes past num_nodes_ are leaves, and the last node
+    // only marks the end of the intervals.
+    num_nodes_ = endpoints.size() / kLeafSize;
+    nodes_.resize(2 * num_nodes_ + 3);
+    size_t next = 0;
+    FillSplits(endpoints, &next, 1);
+  }
+
+  // Returns the node or leaf an interval should be stored at.
+  size_t NodeFor(T low, T high) const {
+    size_t k = 1;
+    while (k <= num_nodes_) {
+      T split = nodes_[k].split;
+      if (high < split) {
+        k = 2 * k;
+      } else if (low > split) {
+        k = 2 * k + 1;
+      } else {
+        return k;
+      }
+    }
+
+    return k;
+  }
+
+  void BuildNodes(const std::vector<Interval<T, V>>& intervals,
+                  const std::vector<uint32_t>& indices, size_t threads) {
+    // Inner nodes and leaves.
+    size_t num_nodes = nodes_.size() - 2;
+    std::vector<uint32_t> node_of(intervals.size());
+    ForEachChunk(intervals.size(), threads,
+                 [this, &intervals, &node_of](size_t from, size_t to) {
+                   for (size_t i = from; i < to; ++i) {
+                     const Interval<T, V>& interval = intervals[i];
+                     node_of[i] = NodeFor(interval.low, interval.high);
+                   }
+                 });
+
+    // Counting sort of intervals by node.
+    std::vector<uint32_t> offsets(num_nodes + 2, 0);
+    for (uint32_t node : node_of) {
+      ++offsets[node + 1];
+    }
+    for (size_t k = 1; k < offsets.size(); ++k) {
+      offsets[k] += offsets[k - 1];
+    }
+    for (size_t k = 0; k < nodes_.size(); ++k) {
+      nodes_[k].begin = offsets[k];
+    }
+
+    intervals_.resize(intervals.size());
+    for (size_t i = 0; i < intervals.size(); ++i) {
+      intervals_[offsets[node_of[i]]++] =
+          std::make_pair(intervals[i], indices.empty()
+                                           ? static_cast<uint32_t>(i)
+                                           : indices[i]);
+    }
+
+    by_high_.resize(intervals.size());
+    ForEachChunk(num_nodes, threads, [this](size_t from, size_t to) {
+      for (size_t k = from + 1; k < to + 1; ++k) {
+        uint32_t node_from = nodes_[k].begin;
+        uint32_t node_to = nodes_[k + 1].begin;
+        std::sort(intervals_.begin() + node_from, intervals_.begin() + node_to,
+                  [](const IndexedInterval<T, V>& lhs,
+                     const IndexedInterval<T, V>& rhs) {
+                    return lhs.first.low < rhs.first.low;
+                  });
+
+        for (uint32_t i = node_from; i < node_to; ++i) {
+          by_high_[i] = i;
+        }
+        std::sort(by_high_.begin() + node_from, by_high_.begin() + node_to,
+                  [this](uint32_t lhs, uint32_t rhs) {
+                    return intervals_[lhs].first.high >
+                           intervals_[rhs].first.high;
+                  });
+      }
+    });
+
+    // Sorting (low, position) pairs avoids random accesses to intervals_ in
+    // the comparator.
+    std::vector<std::pair<T, uint32_t>> low_and_position;
+    low_and_position.reserve(intervals_.size());
+    for (size_t i = 0; i < intervals_.size(); ++i) {
+      low_and_position.emplace_back(intervals_[i].first.low, i);
+    }
+    std::sort(low_and_position.begin(), low_and_position.end());
+
+    all_by_low_.resize(intervals.size());
+    for (size_t i = 0; i < low_and_position.size(); ++i) {
+      all_by_low_[i] = low_and_position[i].second;
+    }
+  }
+
+  // Looks up the points in [from, to) in the subtree rooted at node k.
+  template <typename LookupF>
+  void SweepNode(size_t k, const std::vector<T>& points, size_t from,
+                 size_t to, LookupF& consumer) const {
+    while (k <= num_nodes_ && from < to) {
+      T split = nodes_[k].split;
+      auto points_begin = points.begin();
+      size_t split_from =
+          std::lower_bound(points_begin + from, points_begin + to, split) -
+          points_begin;
+      size_t split_to =
+          std::upper_bound(points_begin + split_from, points_begin + to,
+                           split) -
+          points_begin;
+
+      uint32_t node_from = nodes_[k].begin;
+      uint32_t node_to = nodes_[k + 1].begin;
+
+      // Points less than the split match a prefix of the intervals sorted by
+      // low endpoint that grows as the points grow.
+      uint32_t prefix_end = node_from;
+      for (size_t i = from; i < split_from; ++i) {
+        while (prefix_end < node_to &&
+               intervals_[prefix_end].first.low <= points[i]) {
+          ++prefix_end;
+        }
+
+        for (uint32_t j = node_from; j < prefix_end; ++j) {
+          consumer(i, intervals_[j].first, intervals_[j].second);
+        }
+      }
+
+      for (size_t i = split_from; i < split_to; ++i) {
+        for (uint32_t j = node_from; j < node_to; ++j) {
+          consumer(i, intervals_[j].first, intervals_[j].second);
+        }
+      }
+
+      // Points more than the split match a prefix of the intervals sorted by
+      // high endpoint that grows as the points shrink.
+      prefix_end = node_from;
+      for (size_t i = to; i > split_to; --i) {
+        while (prefix_end < node_to &&
+               intervals_[by_high_[prefix_end]].first.high >= points[i - 1]) {
+          ++prefix_end;
+        }
+
+        for (uint32_t j = node_from; j < prefix_end; ++j) {
+          const IndexedInterval<T, V>& interval = intervals_[by_high_[j]];
+          consumer(i - 1, interval.first, interval.second);
+        }
+      }
+
+      SweepNode(2 * k, points, from, split_from, consumer);
+      k = 2 * k + 1;
+      from = split_to;
+    }
+
+    if (from == to) {
+      return;
+    }
+
+    // At a leaf, intervals are sorted by low endpoint but have not been
+    // checked against any split point.
+    uint32_t leaf_from = nodes_[k].begin;
+    uint32_t leaf_to = nodes_[k + 1].begin;
+    uint32_t prefix_end = leaf_from;
+    for (size_t i = from; i < to; ++i) {
+      while (prefix_end < leaf_to &&
+             intervals_[prefix_end].first.low <= points[i]) {
+        ++prefix_end;
+      }
+
+      for (uint32_t j = leaf_from; j < prefix_end; ++j) {
+        if (intervals_[j].first.high >= points[i]) {
+          consumer(i, intervals_[j].first, intervals_[j].second);
+        }
+      }
+    }
+  }
+
+  // Number of inner nodes (nodes with a split point).
+  size_t num_nodes_;
+
+  // The nodes of the tree: inner nodes at [1, num_nodes_], followed by the
+  // leaves at [num_nodes_ + 1, 2 * num_nodes_ + 1]. Index 0 is unused and the
+  // last node is a sentinel whose 'begin' is the total number of intervals.
+  std::vector<Node> nodes_;
+
+  // Intervals grouped by node (the intervals of node k are at
+  // [nodes_[k].begin, nodes_[k + 1].begin)) and sorted by increasing low
+  // endpoint within each node.
+  std::vector<IndexedInterval<T, V>> intervals_;
+
+  // Positions in intervals_, grouped by node in the same way, sorted by
+  // decreasing high endpoint within each node.
+  std::vector<uint32_t> by_high_;
+
+  // Positions in intervals_ sorted by increasing low endpoint. Used for range
+  // lookups.
+  std::vector<uint32_t> all_by_low_;
+};
+
+// An interval index that supports inserts and erases. Intervals are kept in a
+// small unsorted buffer and in a few immutable FlatTrees ("levels"), each at
+// least kGrowthFactor times larger than the previous one. When the buffer
+// fills up it is merged with the smallest levels into a new level, so there
+// are O(log n) levels and each interval is rebuilt O(log n) times over its
+// lifetime. Erased intervals are only marked as such and are dropped the next
+// time their level is rebuilt. If more than half of all stored intervals are
+// erased everything is rebuilt into a single level. A lookup visits every
+// level, so the large growth factor trades insert cost for lookup speed.
+//
+// Levels are rebuilt by constructing a new FlatTree, which sorts its m
+// intervals in O(m log m) time. Inserts and erases therefore take O(log^2 n)
+// amortized time, not O(log n). An augmented balanced tree would insert in
+// O(log n), at the cost of lookups that chase pointers between nodes instead
+// of scanning FlatTree's contiguous arrays.
+template <typename T, typename V>
+class DynamicTree {
+ public:
+  // Maximum number of intervals in the buffer.
+  static constexpr size_t kBufferSize = 32;
+
+  // Ratio between the capacities of consecutive levels.
+  static constexpr size_t kGrowthFactor = 16;
+
+  // Identifies an interval. The low 32 bits are the slot the interval is
+  // stored in, the high 32 bits the slot's generation, which changes every
+  // time the slot is freed, so that stale handles can be told apart from the
+  // handles of intervals that reuse the slot.
+  using Handle = uint64_t;
+
+  // The threads argument is passed to FlatTree when levels are rebuilt.
+  explicit DynamicTree(size_t threads = 1)
+      : threads_(threads), erased_count_(0) {}
+
+  // Adds an interval. Returns a handle that identifies the interval until it
+  // is erased. Takes O(log^2 n) amortized time.
+  Handle Insert(const Interval<T, V>& interval) {
+    CHECK(interval.low <= interval.high);
+    uint32_t slot;
+    if (free_slots_.empty()) {
+      CHECK(erased_.size() < std::numeric_limits<uint32_t>::max());
+      slot = erased_.size();
+      erased_.emplace_back(false);
+      generations_.emplace_back(0);
+    } else {
+      slot = free_slots_.back();
+      free_slots_.pop_back();
+    }
+
+    buffer_.emplace_back(interval, slot);
+    if (buffer_.size() >= kBufferSize) {
+      Flush();
+    }
+    return ToHandle(slot);
+  }
+
+  // Erases an interval, given the handle returned by Insert. Dies if the
+  // interval has already been erased. Takes O(log n) amortized time, for the
+  // compactions that drop erased intervals.
+  void Erase(Handle handle) {
+    uint32_t slot = static_cast<uint32_t>(handle);
+    CHECK(slot < erased_.size() && !erased_[slot] &&
+          generations_[slot] == static_cast<uint32_t>(handle >> 32))
+        << "Bad handle";
+    erased_[slot] = true;
+    ++erased_count_;
+
+    if (erased_count_ > size()) {
+      Compact();
+    }
+  }
+
+  // Looks up intervals that contain single point. The signature of LookupF
+  // should be bool(const Interval<T, V>&, Handle), where the second argument
+  // is the handle of the interval.
+  template <typename LookupF>
+  void Lookup(T point, LookupF consumer) const {
+    for (const IndexedInterval<T, V>& interval : buffer_) {
+      if (interval.first.low <= point && interval.first.high >= point &&
+          !erased_[interval.second]) {
+        if (!consumer(interval.first, ToHandle(interval.second))) {
+          return;
+        }
+      }
+    }
+
+    for (const auto& level : levels_) {
+      bool done = false;
+      level->Lookup(point, [this, &consumer, &done](
+                               const Interval<T, V>& interval,
+                               uint32_t slot) {
+        if (erased_[slot]) {
+          return true;
+        }
+
+        done = !consumer(interval, ToHandle(slot));
+        return !done;
+      });
+
+      if (done) {
+        return;
+      }
+    }
+  }
+
+  // Looks up intervals that have at least one value contained in a range. The
+  // signature of LookupF should be bool(const Interval<T, V>&).
+  template <typename LookupF>
+  void Lookup(T min_point, T max_point, LookupF consumer) const {
+    for (const IndexedInterval<T, V>& interval : buffer_) {
+      if (interval.first.low <= max_point && interval.first.high >= min_point &&
+          !erased_[interval.second]) {
+        if (!consumer(interval.first)) {
+          return;
+        }
+      }
+    }
+
+    for (const auto& level : levels_) {
+      bool done = false;
+      level->LookupIndexed(
+          min_point, max_point,
+          [this, &consumer, &done](const Interval<T, V>& interval,
+                                   uint32_t slot) {
+            if (erased_[slot]) {
+              return true;
+            }
+
+            done = !consumer(interval);
+            return !done;
+          });
+
+      if (done) {
+        return;
+      }
+    }
+  }
+
+  // Number of intervals that have been inserted and not erased.
+  size_t size() const {
+    return erased_.size() - free_slots_.size() - erased_count_;
+  }
+
+  // Number of levels, not counting the buffer.
+  size_t LevelCount() const { return levels_.size(); }
+
+  uint64_t ByteEstimate() const {
+    uint64_t total = sizeof(this) +
+                     sizeof(IndexedInterval<T, V>) * buffer_.capacity() +
+                     erased_.capacity() / 8 +
+                     sizeof(uint32_t) * generations_.capacity() +
+                     sizeof(uint32_t) * free_slots_.capacity();
+    for (const auto& level : levels_) {
+      total += level->ByteEstimate();
+    }
+    return total;
+  }
+
+ private:
+  Handle ToHandle(uint32_t slot) const {
+    return (static_cast<Handle>(generations_[slot]) << 32) | slot;
+  }
+
+  // Moves a live interval to a vector, or frees the slot of an erased one.
+  void Collect(const Interval<T, V>& interval, uint32_t slot,
+               std::vector<Interval<T, V>>* intervals,
+               std::vector<uint32_t>* slots) {
+    if (erased_[slot]) {
+      erased_[slot] = false;
+      ++generations_[slot];
+      --erased_count_;
+      free_slots_.emplace_back(slot);
+      return;
+    }
+
+    intervals->emplace_back(interval);
+    slots->emplace_back(slot);
+  }
+
+  // Merges the buffer and the 'count' smallest levels into a single level.
+  void MergeSmallest(size_t count) {
+    std::vector<Interval<T, V>> intervals;
+    std::vector<uint32_t> slots;
+    for (const IndexedInterval<T, V>& interval : buffer_) {
+      Collect(interval.first, interval.second, &intervals, &slots);
+    }
+    buffer_.clear();
+
+    for (size_t i = 0; i < count; ++i) {
+      levels_[i]->Walk([this, &intervals, &slots](
+                           const Interval<T, V>& interval, uint32_t slot) {
+        Collect(interval, slot, &intervals, &slots);
+      });
+    }
+    levels_.erase(levels_.begin(), levels_.begin() + count);
+
+    if (!intervals.empty()) {
+      levels_.insert(levels_.begin(), make_unique<FlatTree<T, V>>(
+                                          intervals, slots, threads_));
+    }
+  }
+
+  // Merges the buffer with the smallest levels, for as long as the next level
+  // is less than kGrowthFactor times larger than what has been merged so far.
+  // This keeps consecutive levels at least kGrowthFactor apart in size.
+  void Flush() {
+    size_t total = buffer_.size();
+    size_t i = 0;
+    while (i < levels_.size() && levels_[i]->size() < kGrowthFactor * total) {
+      total += levels_[i]->size();
+      ++i;
+    }
+
+    MergeSmallest(i);
+  }
+
+  // Rebuilds all levels into one, dropping erased intervals.
+  void Compact() { MergeSmallest(levels_.size()); }
+
+  size_t threads_;
+
+  // Intervals inserted since the last flush, with their slots.
+  std::vector<IndexedInterval<T, V>> buffer_;
+
+  // Levels in increasing order of size. The index of each interval in a
+  // level's tree is its slot.
+  std::vector<std::unique_ptr<FlatTree<T, V>>> levels_;
+
+  // Erased flag and generation of each slot ever used.
+  std::vector<bool> erased_;
+  std::vector<uint32_t> generations_;
+
+  // Slots that can be reused and the number of intervals that are erased but
+  // not yet dropped.
+  std::vector<uint32_t> free_slots_;
+  size_t erased_count_;
+};
+
 }  // namespace interval_tree
 }  // namespace nc
 #endif
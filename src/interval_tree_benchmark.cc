@@ -0,0 +1,187 @@
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <random>
+#include <vector>
+
+#include "common.h"
+#include "interval_tree.h"
+#include "logging.h"
+
+static constexpr size_t kIntervalCount = 1000000;
+static constexpr size_t kPointCount = 5000000;
+
+using namespace std::chrono;
+using TestInterval = nc::interval_tree::Interval<uint64_t, uint32_t>;
+
+template <typename Callback>
+static void Bench(const std::string& name, size_t count, Callback callback) {
+  auto start = high_resolution_clock::now();
+  uint64_t total = callback();
+  auto end = high_resolution_clock::now();
+
+  size_t duration_ms = duration_cast<milliseconds>(end - start).count();
+  double ns_per_value = duration_cast<nanoseconds>(end - start).count() /
+                        static_cast<double>(count);
+  LOG(INFO) << name << ": " << duration_ms << "ms, " << ns_per_value
+            << "ns per item, checksum " << total;
+}
+
+int main(int argc, char** argv) {
+  nc::Unused(argc);
+  nc::Unused(argv);
+
+  // Intervals with uniformly distributed start times and exponentially
+  // distributed durations, like flows in a trace.
+  std::mt19937_64 gen(1);
+  std::uniform_int_distribution<uint64_t> start_dist(0, 1000000000);
+  std::exponential_distribution<double> len_dist(1.0 / 10000);
+  std::vector<TestInterval> intervals;
+  for (size_t i = 0; i < kIntervalCount; ++i) {
+    uint64_t low = start_dist(gen);
+    uint64_t high = low + static_cast<uint64_t>(len_dist(gen));
+    intervals.push_back({low, high, static_cast<uint32_t>(i)});
+  }
+
+  std::vector<uint64_t> points;
+  for (size_t i = 0; i < kPointCount; ++i) {
+    points.emplace_back(start_dist(gen));
+  }
+  std::sort(points.begin(), points.end());
+
+  std::unique_ptr<nc::interval_tree::TreeRoot<uint64_t, uint32_t>> tree;
+  Bench("TreeRoot build", kIntervalCount, [&intervals, &tree] {
+    tree = nc::make_unique<nc::interval_tree::TreeRoot<uint64_t, uint32_t>>(
+        intervals);
+    return 0;
+  });
+
+  std::unique_ptr<nc::interval_tree::FlatTree<uint64_t, uint32_t>> flat_tree;
+  Bench("FlatTree build", kIntervalCount, [&intervals, &flat_tree] {
+    flat_tree =
+        nc::make_unique<nc::interval_tree::FlatTree<uint64_t, uint32_t>>(
+            intervals);
+    return 0;
+  });
+  Bench("FlatTree build (4 threads)", kIntervalCount, [&intervals,
+                                                       &flat_tree] {
+    flat_tree =
+        nc::make_unique<nc::interval_tree::FlatTree<uint64_t, uint32_t>>(
+            intervals, 4);
+    return 0;
+  });
+  LOG(INFO) << "TreeRoot " << tree->ByteEstimate() << " bytes, FlatTree "
+            << flat_tree->ByteEstimate() << " bytes";
+
+  Bench("TreeRoot::Lookup", kPointCount, [&points, &tree] {
+    uint64_t total = 0;
+    for (uint64_t point : points) {
+      tree->Lookup(point, [&total](const TestInterval& interval,
+                                   uint32_t index) {
+        nc::Unused(index);
+        total += interval.value;
+        return true;
+      });
+    }
+    return total;
+  });
+
+  Bench("FlatTree::Lookup", kPointCount, [&points, &flat_tree] {
+    uint64_t total = 0;
+    for (uint64_t point : points) {
+      flat_tree->Lookup(point, [&total](const TestInterval& interval,
+                                        uint32_t index) {
+        nc::Unused(index);
+        total += interval.value;
+        return true;
+      });
+    }
+    return total;
+  });
+
+  Bench("FlatTree::LookupSorted", kPointCount, [&points, &flat_tree] {
+    uint64_t total = 0;
+    flat_tree->LookupSorted(points, [&total](size_t point_index,
+                                             const TestInterval& interval,
+                                             uint32_t index) {
+      nc::Unused(point_index);
+      nc::Unused(index);
+      total += interval.value;
+    });
+    return total;
+  });
+
+  // Inserts all intervals, then replaces 10% of them.
+  using DynamicTree = nc::interval_tree::DynamicTree<uint64_t, uint32_t>;
+  DynamicTree dynamic_tree;
+  std::vector<DynamicTree::Handle> handles;
+  Bench("DynamicTree::Insert", kIntervalCount, [&intervals, &dynamic_tree,
+                                                &handles] {
+    for (const TestInterval& interval : intervals) {
+      handles.emplace_back(dynamic_tree.Insert(interval));
+    }
+    return 0;
+  });
+  Bench("DynamicTree::Erase + Insert", kIntervalCount / 10,
+        [&intervals, &dynamic_tree, &handles] {
+          for (size_t i = 0; i < kIntervalCount / 10; ++i) {
+            size_t index = i * 10;
+            dynamic_tree.Erase(handles[index]);
+            handles[index] = dynamic_tree.Insert(intervals[index]);
+          }
+          return 0;
+        });
+  LOG(INFO) << "DynamicTree " << dynamic_tree.ByteEstimate() << " bytes, "
+            << dynamic_tree.LevelCount() << " levels";
+
+  Bench("DynamicTree::Lookup", kPointCount, [&points, &dynamic_tree] {
+    uint64_t total = 0;
+    for (uint64_t point : points) {
+      dynamic_tree.Lookup(point, [&total](const TestInterval& interval,
+                                          DynamicTree::Handle handle) {
+        nc::Unused(handle);
+        total += interval.value;
+        return true;
+      });
+    }
+    return total;
+  });
+
+  // Range lookups over ranges about as long as the average interval.
+  std::vector<uint64_t> range_starts(points.begin(),
+                                     points.begin() + kPointCount / 10);
+  auto range_bench = [&range_starts](const std::string& name,
+                                     const std::function<void(
+                                         uint64_t, uint64_t, uint64_t*)>& f) {
+    Bench(name, range_starts.size(), [&range_starts, &f] {
+      uint64_t total = 0;
+      for (uint64_t point : range_starts) {
+        f(point, point + 10000, &total);
+      }
+      return total;
+    });
+  };
+  range_bench("TreeRoot::Lookup range",
+              [&tree](uint64_t min, uint64_t max, uint64_t* total) {
+                tree->Lookup(min, max, [total](const TestInterval& interval) {
+                  *total += interval.value;
+                  return true;
+                });
+              });
+  range_bench("FlatTree::Lookup range",
+              [&flat_tree](uint64_t min, uint64_t max, uint64_t* total) {
+                flat_tree->Lookup(min, max,
+                                  [total](const TestInterval& interval) {
+                                    *total += interval.value;
+                                    return true;
+                                  });
+              });
+  range_bench("DynamicTree::Lookup range",
+              [&dynamic_tree](uint64_t min, uint64_t max, uint64_t* total) {
+                dynamic_tree.Lookup(min, max,
+                                    [total](const TestInterval& interval) {
+                                      *total += interval.value;
+                                      return true;
+                                    });
+              });
+}
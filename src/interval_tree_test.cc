@@ -1,5 +1,7 @@
 #include "interval_tree.h"
 
+#include <map>
+#include <random>
 #include <thread>
 #include "gtest/gtest.h"
 
@@ -104,5 +106,305 @@ TEST(IntervalTree, TwoIntervalsOverlapping) {
   ASSERT_EQ(single_interval, LookupWrapper(tree, 150.0));
 }
 
+using TestFlatTree = FlatTree<double, bool>;
+using IntFlatTree = FlatTree<uint64_t, uint32_t>;
+using IntInterval = Interval<uint64_t, uint32_t>;
+
+static std::vector<TestInterval> LookupWrapper(const TestFlatTree& tree,
+                                               double point) {
+  std::vector<TestInterval> out;
+  tree.Lookup(point, [&out](const TestInterval& interval, uint32_t i) {
+    Unused(i);
+    out.emplace_back(interval);
+    return true;
+  });
+
+  return out;
+}
+
+TEST(FlatIntervalTree, Empty) {
+  std::vector<TestInterval> intervals = {};
+  TestFlatTree tree(intervals);
+  ASSERT_TRUE(LookupWrapper(tree, 0.0).empty());
+}
+
+TEST(FlatIntervalTree, TwoIntervals) {
+  std::vector<TestInterval> intervals = {{10.0, 100.0, true},
+                                         {-10.0, 0.0, false}};
+  TestFlatTree tree(intervals);
+  ASSERT_TRUE(LookupWrapper(tree, 1.0).empty());
+  ASSERT_TRUE(LookupWrapper(tree, -100.0).empty());
+  ASSERT_TRUE(LookupWrapper(tree, 101.0).empty());
+
+  std::vector<TestInterval> single_interval = {{10.0, 100.0, true}};
+  ASSERT_EQ(single_interval, LookupWrapper(tree, 10.0));
+  ASSERT_EQ(single_interval, LookupWrapper(tree, 100.0));
+  ASSERT_EQ(single_interval, LookupWrapper(tree, 50.0));
+
+  single_interval = {{-10.0, 0.0, false}};
+  ASSERT_EQ(single_interval, LookupWrapper(tree, -10.0));
+  ASSERT_EQ(single_interval, LookupWrapper(tree, 0.0));
+  ASSERT_EQ(single_interval, LookupWrapper(tree, -5.0));
+}
+
+static std::vector<IntInterval> RandomIntervals(size_t count, size_t seed) {
+  std::mt19937 rnd(seed);
+  std::uniform_int_distribution<uint64_t> start_dist(0, 100000);
+  std::exponential_distribution<double> len_dist(0.01);
+  std::vector<IntInterval> out;
+  for (size_t i = 0; i < count; ++i) {
+    uint64_t low = start_dist(rnd);
+    uint64_t high = low + static_cast<uint64_t>(len_dist(rnd));
+    out.push_back({low, high, static_cast<uint32_t>(i)});
+  }
+  return out;
+}
+
+// Indices of the intervals that intersect [min, max], sorted.
+static std::vector<uint32_t> BruteForce(
+    const std::vector<IntInterval>& intervals, uint64_t min, uint64_t max) {
+  std::vector<uint32_t> out;
+  for (const IntInterval& interval : intervals) {
+    if (interval.low <= max && interval.high >= min) {
+      out.emplace_back(interval.value);
+    }
+  }
+  return out;
+}
+
+TEST(FlatIntervalTree, Random) {
+  std::vector<IntInterval> intervals = RandomIntervals(100000, 1);
+  IntFlatTree tree(intervals);
+  IntFlatTree tree_parallel(intervals, 4);
+  ASSERT_EQ(intervals.size(), tree.size());
+
+  std::mt19937 rnd(2);
+  std::uniform_int_distribution<uint64_t> point_dist(0, 101000);
+  for (size_t i = 0; i < 1000; ++i) {
+    uint64_t point = point_dist(rnd);
+    for (const IntFlatTree* tree_ptr : {&tree, &tree_parallel}) {
+      std::vector<uint32_t> model;
+      tree_ptr->Lookup(point, [&model](const IntInterval& interval,
+                                       uint32_t index) {
+        CHECK(interval.value == index);
+        model.emplace_back(index);
+        return true;
+      });
+      std::sort(model.begin(), model.end());
+      ASSERT_EQ(BruteForce(intervals, point, point), model);
+    }
+
+    uint64_t max_point = point + point_dist(rnd) % 100;
+    std::vector<uint32_t> model;
+    tree.Lookup(point, max_point, [&model](const IntInterval& interval) {
+      model.emplace_back(interval.value);
+      return true;
+    });
+    std::sort(model.begin(), model.end());
+    ASSERT_EQ(BruteForce(intervals, point, max_point), model);
+  }
+}
+
+TEST(FlatIntervalTree, LookupSorted) {
+  std::vector<IntInterval> intervals = RandomIntervals(10000, 1);
+  IntFlatTree tree(intervals);
+
+  std::mt19937 rnd(2);
+  std::uniform_int_distribution<uint64_t> point_dist(0, 101000);
+  std::vector<uint64_t> points;
+  for (size_t i = 0; i < 10000; ++i) {
+    points.emplace_back(point_dist(rnd));
+  }
+
+  // Some duplicates and some points that are endpoints.
+  points.emplace_back(points.front());
+  for (size_t i = 0; i < 100; ++i) {
+    points.emplace_back(intervals[i].low);
+    points.emplace_back(intervals[i].high);
+  }
+  std::sort(points.begin(), points.end());
+
+  std::vector<std::vector<uint32_t>> model(points.size());
+  tree.LookupSorted(points, [&model](size_t point_index,
+                                     const IntInterval& interval,
+                                     uint32_t index) {
+    CHECK(interval.value == index);
+    model[point_index].emplace_back(index);
+  });
+
+  for (size_t i = 0; i < points.size(); ++i) {
+    std::sort(model[i].begin(), model[i].end());
+    ASSERT_EQ(BruteForce(intervals, points[i], points[i]), model[i]);
+  }
+
+  std::vector<uint64_t> unsorted = {2, 1};
+  ASSERT_DEATH(tree.LookupSorted(unsorted, [](size_t, const IntInterval&,
+                                              uint32_t) {}),
+               "not sorted");
+}
+
+TEST(FlatIntervalTree, EarlyStop) {
+  std::vector<IntInterval> intervals = {{0, 10, 0}, {5, 15, 1}, {8, 9, 2}};
+  IntFlatTree tree(intervals);
+
+  size_t count = 0;
+  tree.Lookup(8, [&count](const IntInterval& interval, uint32_t index) {
+    Unused(interval);
+    Unused(index);
+    ++count;
+    return false;
+  });
+  ASSERT_EQ(1ul, count);
+
+  count = 0;
+  tree.Lookup(11, 20, [&count](const IntInterval& interval) {
+    Unused(interval);
+    ++count;
+    return true;
+  });
+  ASSERT_EQ(1ul, count);
+}
+
+using IntDynamicTree = DynamicTree<uint64_t, uint32_t>;
+using Handle = IntDynamicTree::Handle;
+
+TEST(DynamicIntervalTree, Empty) {
+  IntDynamicTree tree;
+  ASSERT_EQ(0ul, tree.size());
+  tree.Lookup(10, [](const IntInterval& interval, Handle handle) {
+    Unused(interval);
+    Unused(handle);
+    LOG(FATAL) << "Should not be called";
+    return true;
+  });
+}
+
+TEST(DynamicIntervalTree, InsertErase) {
+  IntDynamicTree tree;
+  Handle handle_one = tree.Insert({0, 10, 1});
+  Handle handle_two = tree.Insert({5, 15, 2});
+  ASSERT_EQ(2ul, tree.size());
+
+  std::vector<uint32_t> values;
+  tree.Lookup(7, [&values](const IntInterval& interval, Handle handle) {
+    Unused(handle);
+    values.emplace_back(interval.value);
+    return true;
+  });
+  std::sort(values.begin(), values.end());
+  ASSERT_EQ(std::vector<uint32_t>({1, 2}), values);
+
+  tree.Erase(handle_one);
+  ASSERT_EQ(1ul, tree.size());
+  values.clear();
+  tree.Lookup(7, [&values, handle_two](const IntInterval& interval,
+                                       Handle handle) {
+    CHECK(handle == handle_two);
+    values.emplace_back(interval.value);
+    return true;
+  });
+  ASSERT_EQ(std::vector<uint32_t>({2}), values);
+  ASSERT_DEATH(tree.Erase(handle_one), "Bad handle");
+}
+
+TEST(DynamicIntervalTree, StaleHandle) {
+  IntDynamicTree tree;
+  Handle handle_one = tree.Insert({0, 10, 1});
+
+  // Erasing the only interval compacts the tree, which frees its slot. The
+  // next insert reuses the slot.
+  tree.Erase(handle_one);
+  Handle handle_two = tree.Insert({5, 15, 2});
+  ASSERT_EQ(static_cast<uint32_t>(handle_one),
+            static_cast<uint32_t>(handle_two));
+  ASSERT_NE(handle_one, handle_two);
+
+  ASSERT_DEATH(tree.Erase(handle_one), "Bad handle");
+  ASSERT_EQ(1ul, tree.size());
+  tree.Erase(handle_two);
+  ASSERT_EQ(0ul, tree.size());
+}
+
+// Checks a dynamic tree against a set of live intervals.
+static void CheckDynamicTree(
+    const IntDynamicTree& tree,
+    const std::map<Handle, IntInterval>& live_intervals, size_t seed) {
+  ASSERT_EQ(live_intervals.size(), tree.size());
+
+  std::mt19937 rnd(seed);
+  std::uniform_int_distribution<uint64_t> point_dist(0, 101000);
+  for (size_t i = 0; i < 100; ++i) {
+    uint64_t point = point_dist(rnd);
+    uint64_t max_point = point + point_dist(rnd) % 100;
+
+    std::vector<uint32_t> model_point;
+    std::vector<uint32_t> model_range;
+    for (const auto& handle_and_interval : live_intervals) {
+      const IntInterval& interval = handle_and_interval.second;
+      if (interval.low <= point && interval.high >= point) {
+        model_point.emplace_back(interval.value);
+      }
+      if (interval.low <= max_point && interval.high >= point) {
+        model_range.emplace_back(interval.value);
+      }
+    }
+
+    std::sort(model_point.begin(), model_point.end());
+    std::sort(model_range.begin(), model_range.end());
+
+    std::vector<uint32_t> values;
+    tree.Lookup(point, [&values, &live_intervals](const IntInterval& interval,
+                                                  Handle handle) {
+      CHECK(live_intervals.at(handle) == interval);
+      values.emplace_back(interval.value);
+      return true;
+    });
+    std::sort(values.begin(), values.end());
+    ASSERT_EQ(model_point, values);
+
+    values.clear();
+    tree.Lookup(point, max_point, [&values](const IntInterval& interval) {
+      values.emplace_back(interval.value);
+      return true;
+    });
+    std::sort(values.begin(), values.end());
+    ASSERT_EQ(model_range, values);
+  }
+}
+
+TEST(DynamicIntervalTree, Random) {
+  IntDynamicTree tree;
+  std::map<Handle, IntInterval> live_intervals;
+  std::vector<IntInterval> intervals = RandomIntervals(50000, 1);
+
+  std::mt19937 rnd(1);
+  for (size_t i = 0; i < intervals.size(); ++i) {
+    Handle handle = tree.Insert(intervals[i]);
+    ASSERT_TRUE(live_intervals.emplace(handle, intervals[i]).second);
+
+    // Erases a random interval every third insert.
+    if (i % 3 == 0) {
+      auto it = live_intervals.lower_bound(rnd() % (i + 1));
+      if (it != live_intervals.end()) {
+        tree.Erase(it->first);
+        live_intervals.erase(it);
+      }
+    }
+
+    if (i % 10000 == 0) {
+      CheckDynamicTree(tree, live_intervals, i);
+    }
+  }
+  CheckDynamicTree(tree, live_intervals, 1);
+  ASSERT_LT(1ul, tree.LevelCount());
+
+  // Erasing most intervals triggers a rebuild.
+  while (live_intervals.size() > 1000) {
+    tree.Erase(live_intervals.begin()->first);
+    live_intervals.erase(live_intervals.begin());
+  }
+  CheckDynamicTree(tree, live_intervals, 2);
+}
+
 }  // namespace interval_tree
 }  // namespace nc
@@ -0,0 +1,32 @@
+#include "line_reader.h"
+
+#include "logging.h"
+
+namespace nc {
+
+std::vector<StringPiece> SplitAtLineBoundaries(StringPiece text,
+                                               size_t chunk_bytes) {
+  CHECK(chunk_bytes > 0);
+
+  std::vector<StringPiece> chunks;
+  const char* begin = text.data();
+  const char* end = text.data() + text.size();
+  while (begin != end) {
+    if (static_cast<size_t>(end - begin) <= chunk_bytes) {
+      chunks.emplace_back(begin, end - begin);
+      break;
+    }
+
+    // Extends the chunk to the end of the line it ends in.
+    const char* chunk_end = begin + chunk_bytes - 1;
+    const char* newline = static_cast<const char*>(
+        memchr(chunk_end, '\n', end - chunk_end));
+    chunk_end = newline == nullptr ? end : newline + 1;
+    chunks.emplace_back(begin, chunk_end - begin);
+    begin = chunk_end;
+  }
+
+  return chunks;
+}
+
+}  // namespace nc
@@ -0,0 +1,128 @@
+#ifndef NCODE_LINE_READER_H
+#define NCODE_LINE_READER_H
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "file.h"
+#include "mapped_file.h"
+#include "stringpiece.h"
+#include "thread_runner.h"
+
+// Splits large in-memory (or memory-mapped) text into lines. Lines are
+// returned as StringPieces that point into the text, so nothing is copied or
+// allocated per line. Newlines are found with memchr, which the C library
+// implements with vector instructions.
+
+namespace nc {
+
+// Default size of the chunks that ParallelParseLines splits text into.
+static constexpr size_t kDefaultLineChunkBytes = 1 << 20;
+
+class LineReader {
+ public:
+  explicit LineReader(StringPiece text)
+      : next_(text.data()), end_(text.data() + text.size()) {}
+
+  // Sets 'line' to the next line, without the terminating '\n'. The last line
+  // need not be terminated. Returns false if there are no more lines. Like
+  // std::getline a text that ends in '\n' does not have an empty last line.
+  bool Next(StringPiece* line) {
+    if (next_ == end_) {
+      return false;
+    }
+
+    const char* newline =
+        static_cast<const char*>(memchr(next_, '\n', end_ - next_));
+    if (newline == nullptr) {
+      *line = StringPiece(next_, end_ - next_);
+      next_ = end_;
+      return true;
+    }
+
+    *line = StringPiece(next_, newline - next_);
+    next_ = newline + 1;
+    return true;
+  }
+
+  // Same as Next, but skips empty lines.
+  bool NextNonEmpty(StringPiece* line) {
+    while (Next(line)) {
+      if (!line->empty()) {
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  // The part of the text that has not been returned yet.
+  StringPiece remaining() const { return StringPiece(next_, end_ - next_); }
+
+ private:
+  const char* next_;
+  const char* end_;
+};
+
+// Calls f(StringPiece line) for each line of a text.
+template <typename F>
+void ForEachLine(StringPiece text, F f) {
+  LineReader reader(text);
+  StringPiece line;
+  while (reader.Next(&line)) {
+    f(line);
+  }
+}
+
+// Calls f(StringPiece line) for each line of a file. The file is memory
+// mapped if possible. Returns false if the file cannot be read.
+template <typename F>
+bool ForEachLineInFile(const std::string& name, F f) {
+  MappedFileOptions options;
+  options.access = MappedFileOptions::SEQUENTIAL;
+  StatusOr<MappedFile> mapped_file = MappedFile::Open(name, options);
+  if (mapped_file.ok() && mapped_file.ValueOrDie().size() > 0) {
+    ForEachLine(mapped_file.ValueOrDie().data(), f);
+    return true;
+  }
+
+  // Empty files and files that cannot be mapped (or report a size of 0, like
+  // the ones in /proc).
+  std::string contents;
+  if (!File::ReadFileToString(name, &contents)) {
+    return false;
+  }
+
+  ForEachLine(contents, f);
+  return true;
+}
+
+// Splits a text into consecutive chunks of about 'chunk_bytes' each. Each
+// chunk except the last one ends right after a newline, so that no line spans
+// two chunks.
+std::vector<StringPiece> SplitAtLineBoundaries(StringPiece text,
+                                               size_t chunk_bytes);
+
+// Parses a text in parallel. The text is split into line-aligned chunks and
+// parse(StringPiece chunk, T* result) is called for each chunk from multiple
+// threads. The per-chunk results are returned in the order in which the
+// chunks appear in the text, so that merging them in order gives the same
+// result as parsing the text sequentially.
+template <typename T, typename F>
+std::vector<T> ParallelParseLines(StringPiece text, F parse,
+                                  size_t chunk_bytes = kDefaultLineChunkBytes,
+                                  ThreadPool* pool = ThreadPool::Default()) {
+  std::vector<StringPiece> chunks = SplitAtLineBoundaries(text, chunk_bytes);
+  std::vector<T> results(chunks.size());
+  ParallelFor(0, chunks.size(),
+              [&chunks, &results, &parse](size_t i) {
+                parse(chunks[i], &results[i]);
+              },
+              1, pool);
+  return results;
+}
+
+}  // namespace nc
+
+#endif
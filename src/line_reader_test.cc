@@ -0,0 +1,143 @@
+#include "line_reader.h"
+
+#include <random>
+#include <sstream>
+#include "gtest/gtest.h"
+
+#include "strutil.h"
+
+namespace nc {
+namespace {
+
+static std::vector<std::string> AllLines(StringPiece text) {
+  std::vector<std::string> out;
+  ForEachLine(text,
+              [&out](StringPiece line) { out.emplace_back(line.ToString()); });
+  return out;
+}
+
+TEST(LineReader, Empty) { ASSERT_TRUE(AllLines("").empty()); }
+
+TEST(LineReader, Lines) {
+  using Lines = std::vector<std::string>;
+  ASSERT_EQ(Lines({"a"}), AllLines("a"));
+  ASSERT_EQ(Lines({"a"}), AllLines("a\n"));
+  ASSERT_EQ(Lines({"a", "", "bc"}), AllLines("a\n\nbc"));
+  ASSERT_EQ(Lines({"", ""}), AllLines("\n\n"));
+  ASSERT_EQ(Lines({"a\r", "b"}), AllLines("a\r\nb\n"));
+}
+
+TEST(LineReader, SameAsGetline) {
+  std::mt19937 rnd(1);
+  std::uniform_int_distribution<int> char_dist(0, 9);
+  for (size_t i = 0; i < 100; ++i) {
+    std::string text;
+    for (size_t j = 0; j < i * 10; ++j) {
+      int value = char_dist(rnd);
+      text.push_back(value < 2 ? '\n' : 'a' + value);
+    }
+
+    std::istringstream stream(text);
+    std::vector<std::string> model;
+    std::string line;
+    while (std::getline(stream, line)) {
+      model.emplace_back(line);
+    }
+    ASSERT_EQ(model, AllLines(text));
+  }
+}
+
+TEST(LineReader, NonEmpty) {
+  LineReader reader("\n\na\n\nb\n\n");
+  StringPiece line;
+  ASSERT_TRUE(reader.NextNonEmpty(&line));
+  ASSERT_EQ("a", line);
+  ASSERT_EQ("\nb\n\n", reader.remaining());
+  ASSERT_TRUE(reader.NextNonEmpty(&line));
+  ASSERT_EQ("b", line);
+  ASSERT_FALSE(reader.NextNonEmpty(&line));
+}
+
+TEST(LineReader, File) {
+  static constexpr char kTestFile[] = "line_reader_test_file";
+  File::WriteStringToFileOrDie("a\nbb\n\nccc", kTestFile);
+
+  std::vector<std::string> lines;
+  ASSERT_TRUE(ForEachLineInFile(kTestFile, [&lines](StringPiece line) {
+    lines.emplace_back(line.ToString());
+  }));
+  ASSERT_EQ(std::vector<std::string>({"a", "bb", "", "ccc"}), lines);
+
+  lines.clear();
+  ASSERT_TRUE(File::ReadLines(kTestFile, [&lines](const std::string& line) {
+    lines.emplace_back(line);
+  }));
+  ASSERT_EQ(std::vector<std::string>({"a", "bb", "", "ccc"}), lines);
+
+  File::WriteStringToFileOrDie("", kTestFile);
+  lines.clear();
+  ASSERT_TRUE(File::ReadLines(kTestFile, [&lines](const std::string& line) {
+    lines.emplace_back(line);
+  }));
+  ASSERT_TRUE(lines.empty());
+
+  File::DeleteRecursively(kTestFile, nullptr, nullptr);
+  ASSERT_FALSE(ForEachLineInFile(kTestFile, [](StringPiece) {}));
+  ASSERT_FALSE(File::ReadLines(kTestFile, [](const std::string&) {}));
+}
+
+TEST(LineReader, SplitAtLineBoundaries) {
+  std::string text;
+  for (size_t i = 0; i < 10000; ++i) {
+    text += std::to_string(i) + "\n";
+  }
+  text += "last";
+
+  for (size_t chunk_bytes : {1ul, 2ul, 7ul, 100ul, 1000ul, 1000000ul}) {
+    std::vector<StringPiece> chunks = SplitAtLineBoundaries(text, chunk_bytes);
+    std::string joined;
+    for (size_t i = 0; i < chunks.size(); ++i) {
+      ASSERT_FALSE(chunks[i].empty());
+      if (i != chunks.size() - 1) {
+        ASSERT_EQ('\n', chunks[i][chunks[i].size() - 1]);
+        ASSERT_GE(chunks[i].size(), chunk_bytes);
+      }
+      joined += chunks[i].ToString();
+    }
+    ASSERT_EQ(text, joined);
+  }
+
+  ASSERT_TRUE(SplitAtLineBoundaries("", 10).empty());
+}
+
+TEST(LineReader, ParallelParse) {
+  std::string text;
+  std::vector<uint64_t> model;
+  for (size_t i = 0; i < 100000; ++i) {
+    text += std::to_string(i * 3) + "\n";
+    model.emplace_back(i * 3);
+  }
+
+  ThreadPool pool(4);
+  std::vector<std::vector<uint64_t>> results =
+      ParallelParseLines<std::vector<uint64_t>>(
+          text,
+          [](StringPiece chunk, std::vector<uint64_t>* values) {
+            ForEachLine(chunk, [values](StringPiece line) {
+              uint64_t value;
+              CHECK(safe_strtou64(line, &value));
+              values->emplace_back(value);
+            });
+          },
+          1000, &pool);
+  ASSERT_LT(1ul, results.size());
+
+  std::vector<uint64_t> all;
+  for (const std::vector<uint64_t>& values : results) {
+    all.insert(all.end(), values.begin(), values.end());
+  }
+  ASSERT_EQ(model, all);
+}
+
+}  // namespace
+}  // namespace nc
@@ -5,7 +5,9 @@
 #include <tuple>
 
 #include "../file.h"
+#include "../line_reader.h"
 #include "../map_util.h"
+#include "../mapped_file.h"
 #include "../perfect_hash.h"
 #include "../stats.h"
 #include "../strutil.h"
@@ -308,9 +310,9 @@ std::string DemandMatrix::ToString() const {
 }
 
 // Parses a line of the form <tag> <count> and returns count.
-static uint32_t ParseCountOrDie(const std::string& tag,
-                                const std::string& line) {
-  std::vector<std::string> line_split = Split(line, " ");
+static uint32_t ParseCountOrDie(const std::string& tag, StringPiece line) {
+  std::vector<StringPiece> line_split;
+  Splitter(" ").Split(line, &line_split);
   CHECK(line_split.size() == 2);
   CHECK(line_split[0] == tag);
 
@@ -320,25 +322,29 @@ static uint32_t ParseCountOrDie(const std::string& tag,
 }
 
 std::unique_ptr<DemandMatrix> DemandMatrix::LoadRepetitaStringOrDie(
-    const std::string& matrix_string,
-    const std::vector<std::string>& node_names,
+    StringPiece matrix_string, const std::vector<std::string>& node_names,
     const net::GraphStorage* graph) {
-  std::vector<std::string> all_lines = Split(matrix_string, "\n");
-  auto it = all_lines.begin();
+  // Empty lines are ignored.
+  LineReader reader(matrix_string);
+  auto next_line = [&reader] {
+    StringPiece line;
+    CHECK(reader.NextNonEmpty(&line)) << "Demand matrix too short";
+    return line;
+  };
 
-  const std::string& demands_line = *it;
-  uint32_t num_demands = ParseCountOrDie("DEMANDS", demands_line);
+  uint32_t num_demands = ParseCountOrDie("DEMANDS", next_line());
 
   // Skip free form line.
-  ++it;
+  next_line();
 
   std::map<std::pair<net::GraphNodeIndex, net::GraphNodeIndex>, double>
       total_demands;
+  Splitter splitter(" ");
+  std::vector<StringPiece> line_split;
   for (uint32_t i = 0; i < num_demands; ++i) {
-    ++it;
-
-    std::vector<std::string> line_split = Split(*it, " ");
-    CHECK(line_split.size() == 4) << *it << " demand " << i;
+    StringPiece line = next_line();
+    splitter.Split(line, &line_split);
+    CHECK(line_split.size() == 4) << line << " demand " << i;
 
     uint32_t src_index;
     uint32_t dst_index;
@@ -348,8 +354,8 @@ std::unique_ptr<DemandMatrix> DemandMatrix::LoadRepetitaStringOrDie(
     CHECK(safe_strtou32(line_split[2], &dst_index));
     CHECK(safe_strtod(line_split[3], &demand_kbps));
 
-    CHECK(src_index < node_names.size()) << src_index << " line " << *it;
-    CHECK(dst_index < node_names.size()) << dst_index << " line " << *it;
+    CHECK(src_index < node_names.size()) << src_index << " line " << line;
+    CHECK(dst_index < node_names.size()) << dst_index << " line " << line;
 
     const net::GraphNodeIndex* src_ptr =
         graph->NodeFromStringOrNull(node_names[src_index]);
@@ -395,8 +401,11 @@ static std::string GetPropertiesFileName(const std::string& matrix_file) {
 std::unique_ptr<DemandMatrix> DemandMatrix::LoadRepetitaFileOrDie(
     const std::string& matrix_file, const std::vector<std::string>& node_names,
     const net::GraphStorage* graph) {
+  StatusOr<MappedFile> mapped_file = MappedFile::Open(matrix_file);
+  CHECK(mapped_file.ok()) << "Could not read: " << matrix_file << ": "
+                          << mapped_file.status();
   std::unique_ptr<DemandMatrix> demand_matrix = LoadRepetitaStringOrDie(
-      nc::File::ReadFileToStringOrDie(matrix_file), node_names, graph);
+      mapped_file.ValueOrDie().data(), node_names, graph);
 
   std::string prop_file = GetPropertiesFileName(matrix_file);
   if (File::Exists(prop_file)) {
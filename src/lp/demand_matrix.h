@@ -16,6 +16,7 @@
 #include "../logging.h"
 #include "../net/algorithm.h"
 #include "../net/net_common.h"
+#include "../stringpiece.h"
 
 namespace nc {
 namespace lp {
@@ -41,7 +42,7 @@ class DemandMatrix {
   // pointer if there is a mismatch between the topology and the TM. Will die if
   // there is a parsing error.
   static std::unique_ptr<DemandMatrix> LoadRepetitaStringOrDie(
-      const std::string& matrix_string,
+      StringPiece matrix_string,
       const std::vector<std::string>& node_names,
       const net::GraphStorage* graph);
 
@@ -2,9 +2,11 @@
 #define NCODE_LRU_H
 
 #include <stddef.h>
+#include <condition_variable>
 #include <functional>
 #include <list>
 #include <memory>
+#include <mutex>
 #include <unordered_map>
 #include <utility>
 
@@ -145,6 +147,660 @@ class LRUCache {
   CacheMap cache_map_;
 };
 
+namespace internal {
+
+// Mixes the bits of a hash value, so that the low bits can be used to index
+// into a power-of-two-sized table even if the hash function is the identity.
+inline uint64_t MixHash(uint64_t hash) {
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdUL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+// An open-addressing (linear probing) table that maps hashes to 32-bit
+// values. The table has a fixed capacity and never allocates after
+// construction. It only stores hashes, so callers that need to tell apart keys
+// with the same hash have to supply a predicate that checks the value.
+class FlatHashIndex {
+ public:
+  static constexpr uint32_t kNotFound = std::numeric_limits<uint32_t>::max();
+
+  // The table will hold up to 'max_size' entries at a load factor of at most
+  // 0.5.
+  explicit FlatHashIndex(size_t max_size) : mask_(0) {
+    size_t table_size = 2;
+    while (table_size < 2 * max_size) {
+      table_size *= 2;
+    }
+
+    table_.resize(table_size, {0, kNotFound});
+    mask_ = table_size - 1;
+  }
+
+  // Returns the value associated with a hash, for which 'matches' returns
+  // true, or kNotFound.
+  template <typename Matches>
+  uint32_t Find(uint64_t hash, Matches matches) const {
+    size_t pos = Position(hash, matches);
+    return table_[pos].value;
+  }
+
+  // Adds a new entry. Does not check if an equivalent entry already exists.
+  void Insert(uint64_t hash, uint32_t value) {
+    size_t pos = hash & mask_;
+    while (table_[pos].value != kNotFound) {
+      pos = (pos + 1) & mask_;
+    }
+
+    table_[pos] = {hash, value};
+  }
+
+  // Removes the entry for which 'matches' returns true, if there is one.
+  // Returns the value of the removed entry, or kNotFound.
+  template <typename Matches>
+  uint32_t Erase(uint64_t hash, Matches matches) {
+    size_t hole = Position(hash, matches);
+    uint32_t value = table_[hole].value;
+    if (value == kNotFound) {
+      return kNotFound;
+    }
+
+    // Backward-shift deletion -- moves any entries after the hole that would
+    // not be reachable from their ideal position otherwise.
+    for (size_t i = (hole + 1) & mask_; table_[i].value != kNotFound;
+         i = (i + 1) & mask_) {
+      size_t ideal = table_[i].hash & mask_;
+      if (((i - ideal) & mask_) >= ((i - hole) & mask_)) {
+        table_[hole] = table_[i];
+        hole = i;
+      }
+    }
+
+    table_[hole].value = kNotFound;
+    return value;
+  }
+
+  // Changes the value of the entry for which 'matches' returns true. The entry
+  // must exist.
+  template <typename Matches>
+  void Update(uint64_t hash, Matches matches, uint32_t new_value) {
+    size_t pos = Position(hash, matches);
+    CHECK(table_[pos].value != kNotFound);
+    table_[pos].value = new_value;
+  }
+
+  size_t ByteEstimate() const { return table_.capacity() * sizeof(Entry); }
+
+ private:
+  struct Entry {
+    uint64_t hash;
+    uint32_t value;
+  };
+
+  // Returns the position of the entry for which 'matches' returns true, or
+  // the position of the first empty entry in its probe sequence.
+  template <typename Matches>
+  size_t Position(uint64_t hash, Matches matches) const {
+    size_t pos = hash & mask_;
+    while (table_[pos].value != kNotFound) {
+      const Entry& entry = table_[pos];
+      if (entry.hash == hash && matches(entry.value)) {
+        break;
+      }
+
+      pos = (pos + 1) & mask_;
+    }
+
+    return pos;
+  }
+
+  std::vector<Entry> table_;
+  size_t mask_;
+};
+
+// A fixed-capacity FIFO queue.
+template <typename T>
+class FixedFIFO {
+ public:
+  explicit FixedFIFO(size_t capacity)
+      : values_(capacity), head_(0), size_(0) {}
+
+  void PushBack(T value) {
+    CHECK(size_ < values_.size());
+    values_[(head_ + size_) % values_.size()] = value;
+    ++size_;
+  }
+
+  T PopFront() {
+    CHECK(size_ > 0);
+    T value = values_[head_];
+    head_ = (head_ + 1) % values_.size();
+    --size_;
+    return value;
+  }
+
+  size_t size() const { return size_; }
+
+  bool empty() const { return size_ == 0; }
+
+  bool full() const { return size_ == values_.size(); }
+
+ private:
+  std::vector<T> values_;
+  size_t head_;
+  size_t size_;
+};
+
+}  // namespace internal
+
+// A cache with the same interface as LRUCache, but that uses the S3-FIFO
+// eviction policy (Yang et al., SOSP'23) instead of LRU. New entries go to a
+// small FIFO queue that holds 10% of the entries. Entries that are evicted
+// from it without having been accessed again are forgotten, but their hashes
+// are remembered in a "ghost" queue. Entries that have been accessed, or whose
+// hashes are in the ghost queue when inserted, go to the main FIFO queue, which
+// evicts CLOCK-style: entries that have been accessed since they were last
+// considered for eviction are given another chance. This means that a single
+// scan over many keys cannot flush frequently accessed entries from the cache,
+// and that a cache hit only increments a small counter in the entry instead of
+// relinking a list node. Entries live in a preallocated array and are found
+// via an open-addressing table, so apart from the values themselves nothing is
+// allocated after construction. Unlike LRUCache, K has to be
+// default-constructible.
+template <typename K, typename V, class Hash = std::hash<K>,
+          class Pred = std::equal_to<K>>
+class S3FIFOCache {
+ public:
+  virtual ~S3FIFOCache() {}
+  S3FIFOCache(size_t max_cache_size)
+      : small_max_size_(std::max(1ul, max_cache_size / 10)),
+        slots_(max_cache_size),
+        index_(max_cache_size),
+        small_(max_cache_size),
+        main_(max_cache_size),
+        ghost_(std::max(1ul, max_cache_size - max_cache_size / 10)),
+        ghost_index_(std::max(1ul, max_cache_size - max_cache_size / 10)) {
+    CHECK(max_cache_size > 0) << "Zero cache size";
+    CHECK(max_cache_size < internal::FlatHashIndex::kNotFound);
+    for (size_t i = 0; i < max_cache_size; ++i) {
+      free_slots_.emplace_back(max_cache_size - i - 1);
+    }
+  }
+
+  // Inserts a new item in the cache, or inserts a new one with the given
+  // arguments to the constructor. This call will only result in a constructor
+  // being called if there is no entry associated with 'key'.
+  template <class... Args>
+  V& Emplace(const K& key, Args&&... args) {
+    uint64_t hash = internal::MixHash(Hash()(key));
+    uint32_t slot_index = FindSlot(key, hash);
+    if (slot_index != internal::FlatHashIndex::kNotFound) {
+      Touch(&slots_[slot_index]);
+      return *slots_[slot_index].value;
+    }
+
+    return *slots_[AddSlot(key, hash, make_unique<V>(args...))].value;
+  }
+
+  // Like Emplace, but always constructs a new entry and evicts the entry that
+  // has the same key (if any).
+  template <class... Args>
+  V& InsertNew(const K& key, Args&&... args) {
+    return InsertNew(key, make_unique<V>(args...));
+  }
+
+  // Inserts a new entry and evicts the entry that has the same key (if any).
+  V& InsertNew(const K& key, std::unique_ptr<V> value) {
+    uint64_t hash = internal::MixHash(Hash()(key));
+    uint32_t slot_index = FindSlot(key, hash);
+    if (slot_index != internal::FlatHashIndex::kNotFound) {
+      Slot& slot = slots_[slot_index];
+      ItemEvicted(key, std::move(slot.value));
+      slot.value = std::move(value);
+      Touch(&slot);
+      return *slot.value;
+    }
+
+    return *slots_[AddSlot(key, hash, std::move(value))].value;
+  }
+
+  V* FindOrNull(const K& key) {
+    uint64_t hash = internal::MixHash(Hash()(key));
+    uint32_t slot_index = FindSlot(key, hash);
+    if (slot_index == internal::FlatHashIndex::kNotFound) {
+      return nullptr;
+    }
+
+    Slot& slot = slots_[slot_index];
+    Touch(&slot);
+    return slot.value.get();
+  }
+
+  // Evicts the entire cache.
+  void EvictAll() {
+    while (!small_.empty()) {
+      EvictSlot(small_.PopFront());
+    }
+
+    while (!main_.empty()) {
+      EvictSlot(main_.PopFront());
+    }
+  }
+
+  // Called when an item is evicted from the cache.
+  virtual void ItemEvicted(const K& key, std::unique_ptr<V> value) {
+    Unused(key);
+    Unused(value);
+  };
+
+  std::unordered_map<K, const V*, Hash, Pred> Values() const {
+    std::unordered_map<K, const V*, Hash, Pred> out;
+    for (const Slot& slot : slots_) {
+      if (slot.value) {
+        out[slot.key] = slot.value.get();
+      }
+    }
+
+    return out;
+  }
+
+ private:
+  // Accesses beyond this are not counted.
+  static constexpr uint8_t kMaxFrequency = 3;
+
+  struct Slot {
+    Slot() : hash(0), frequency(0) {}
+
+    K key;
+    std::unique_ptr<V> value;
+    uint64_t hash;
+    uint8_t frequency;
+  };
+
+  static void Touch(Slot* slot) {
+    if (slot->frequency < kMaxFrequency) {
+      ++slot->frequency;
+    }
+  }
+
+  uint32_t FindSlot(const K& key, uint64_t hash) const {
+    return index_.Find(hash, [this, &key](uint32_t slot_index) {
+      return Pred()(slots_[slot_index].key, key);
+    });
+  }
+
+  // Adds a new entry, evicting another one if the cache is full. Returns the
+  // index of the new entry's slot.
+  uint32_t AddSlot(const K& key, uint64_t hash, std::unique_ptr<V> value) {
+    if (free_slots_.empty()) {
+      EvictOne();
+    }
+
+    uint32_t slot_index = free_slots_.back();
+    free_slots_.pop_back();
+
+    Slot& slot = slots_[slot_index];
+    slot.key = key;
+    slot.value = std::move(value);
+    slot.hash = hash;
+    slot.frequency = 0;
+    index_.Insert(hash, slot_index);
+
+    // Entries that were recently evicted from the small queue go straight to
+    // the main one.
+    auto any = [](uint32_t) { return true; };
+    if (ghost_index_.Find(hash, any) != internal::FlatHashIndex::kNotFound) {
+      main_.PushBack(slot_index);
+    } else {
+      small_.PushBack(slot_index);
+    }
+
+    return slot_index;
+  }
+
+  void EvictOne() {
+    while (true) {
+      if (small_.size() >= small_max_size_ || main_.empty()) {
+        uint32_t slot_index = small_.PopFront();
+        Slot& slot = slots_[slot_index];
+        if (slot.frequency > 0) {
+          slot.frequency = 0;
+          main_.PushBack(slot_index);
+          continue;
+        }
+
+        AddToGhost(slot.hash);
+        EvictSlot(slot_index);
+        return;
+      }
+
+      uint32_t slot_index = main_.PopFront();
+      Slot& slot = slots_[slot_index];
+      if (slot.frequency > 0) {
+        --slot.frequency;
+        main_.PushBack(slot_index);
+        continue;
+      }
+
+      EvictSlot(slot_index);
+      return;
+    }
+  }
+
+  // Remembers a hash in the ghost queue. The ghost index maps each hash to the
+  // number of times it is in the queue.
+  void AddToGhost(uint64_t hash) {
+    auto any = [](uint32_t) { return true; };
+    if (ghost_.full()) {
+      uint64_t oldest = ghost_.PopFront();
+      uint32_t count = ghost_index_.Erase(oldest, any);
+      if (count > 1) {
+        ghost_index_.Insert(oldest, count - 1);
+      }
+    }
+
+    uint32_t count = ghost_index_.Find(hash, any);
+    if (count == internal::FlatHashIndex::kNotFound) {
+      ghost_index_.Insert(hash, 1);
+    } else {
+      ghost_index_.Update(hash, any, count + 1);
+    }
+
+    ghost_.PushBack(hash);
+  }
+
+  void EvictSlot(uint32_t slot_index) {
+    Slot& slot = slots_[slot_index];
+    const K& key = slot.key;
+    index_.Erase(slot.hash, [this, &key](uint32_t other_slot_index) {
+      return Pred()(slots_[other_slot_index].key, key);
+    });
+    free_slots_.emplace_back(slot_index);
+    ItemEvicted(slot.key, std::move(slot.value));
+  }
+
+  // Maximum size of the small queue.
+  const size_t small_max_size_;
+
+  // Storage for all entries and the indices of the ones that are unused.
+  std::vector<Slot> slots_;
+  std::vector<uint32_t> free_slots_;
+
+  // Maps key hashes to slots.
+  internal::FlatHashIndex index_;
+
+  // The small and main queues contain slot indices.
+  internal::FixedFIFO<uint32_t> small_;
+  internal::FixedFIFO<uint32_t> main_;
+
+  // Hashes of entries recently evicted from the small queue.
+  internal::FixedFIFO<uint64_t> ghost_;
+  internal::FlatHashIndex ghost_index_;
+
+  DISALLOW_COPY_AND_ASSIGN(S3FIFOCache);
+};
+
+// Statistics about the use of a ShardedLRUCache.
+struct LRUCacheStats {
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  uint64_t evictions = 0;
+
+  // Calls to GetOrCompute that missed, but found another thread computing the
+  // same value and waited for it. Counted neither as hits nor as misses.
+  uint64_t pending_waits = 0;
+
+  // Number of entries and total cost of all entries currently in the cache.
+  uint64_t entries = 0;
+  uint64_t total_cost = 0;
+};
+
+// A thread-safe LRU cache that maps K to V. Keys are partitioned among a
+// number of shards, each protected by its own mutex and each with its own LRU
+// list, so threads that access different shards do not contend. Each entry has
+// a cost (by default 1, or as returned by a user-supplied function, e.g. the
+// size of the value in bytes) and each shard evicts its least recently used
+// entries when the total cost of its entries exceeds its share of the overall
+// budget. Values are handed out as shared pointers, so they remain valid after
+// being evicted.
+template <typename K, typename V, class Hash = std::hash<K>,
+          class Pred = std::equal_to<K>>
+class ShardedLRUCache {
+ public:
+  using ValuePtr = std::shared_ptr<const V>;
+  using CostFunction = std::function<uint64_t(const K&, const V&)>;
+  using ComputeFunction = std::function<std::unique_ptr<V>()>;
+
+  // The cache will hold at most 'max_total_cost' worth of entries, split
+  // evenly among 'num_shards' shards. If no cost function is provided each
+  // entry has a cost of 1.
+  ShardedLRUCache(uint64_t max_total_cost, size_t num_shards = 16,
+                  CostFunction cost_function = CostFunction())
+      : max_shard_cost_(max_total_cost / CheckedShardCount(num_shards)),
+        cost_function_(cost_function),
+        shards_(num_shards) {}
+
+  // Returns the value associated with a key, or null if there is no entry for
+  // the key. If there is an entry it becomes the most recently used one in its
+  // shard.
+  ValuePtr Find(const K& key) {
+    Shard& shard = ShardFor(key);
+    std::lock_guard<std::mutex> lock(shard.mu);
+    ValuePtr value = shard.FindAndTouch(key);
+    if (value) {
+      ++shard.stats.hits;
+    } else {
+      ++shard.stats.misses;
+    }
+
+    return value;
+  }
+
+  // Inserts a new entry, replacing the current one for the same key (if any).
+  // Returns the inserted value. If the cost of the value exceeds the budget of
+  // its shard it is returned, but not cached.
+  ValuePtr Insert(const K& key, std::unique_ptr<V> value) {
+    ValuePtr value_ptr(std::move(value));
+    Shard& shard = ShardFor(key);
+    std::lock_guard<std::mutex> lock(shard.mu);
+    shard.Insert(key, value_ptr, Cost(key, *value_ptr), max_shard_cost_);
+    return value_ptr;
+  }
+
+  // Returns the value associated with a key. If there is no entry 'compute'
+  // is called to produce one, which is inserted in the cache. Concurrent calls
+  // for the same key that miss the cache result in a single call to 'compute'
+  // and all of them return its result. 'compute' is called without holding any
+  // locks and can return null, in which case nothing is cached.
+  ValuePtr GetOrCompute(const K& key, ComputeFunction compute) {
+    Shard& shard = ShardFor(key);
+    std::shared_ptr<PendingComputation> pending;
+    {
+      std::unique_lock<std::mutex> lock(shard.mu);
+      ValuePtr value = shard.FindAndTouch(key);
+      if (value) {
+        ++shard.stats.hits;
+        return value;
+      }
+
+      std::shared_ptr<PendingComputation>* pending_ptr =
+          ::nc::FindOrNull(shard.pending, key);
+      if (pending_ptr != nullptr) {
+        // Someone else is already computing the value, will wait for them.
+        pending = *pending_ptr;
+        ++shard.stats.pending_waits;
+        shard.computed.wait(lock, [&pending] { return pending->done; });
+        return pending->value;
+      }
+
+      ++shard.stats.misses;
+      pending = std::make_shared<PendingComputation>();
+      shard.pending.emplace(key, pending);
+    }
+
+    std::unique_ptr<V> computed = compute();
+    ValuePtr value_ptr(std::move(computed));
+    uint64_t cost = value_ptr ? Cost(key, *value_ptr) : 0;
+
+    {
+      std::lock_guard<std::mutex> lock(shard.mu);
+      if (value_ptr) {
+        shard.Insert(key, value_ptr, cost, max_shard_cost_);
+      }
+
+      pending->value = value_ptr;
+      pending->done = true;
+      shard.pending.erase(key);
+    }
+    shard.computed.notify_all();
+
+    return value_ptr;
+  }
+
+  // Removes the entry associated with a key, if there is one. Returns true if
+  // an entry was removed.
+  bool Erase(const K& key) {
+    Shard& shard = ShardFor(key);
+    std::lock_guard<std::mutex> lock(shard.mu);
+    auto it = shard.entries.find(key);
+    if (it == shard.entries.end()) {
+      return false;
+    }
+
+    shard.total_cost -= it->second->cost;
+    shard.lru.erase(it->second);
+    shard.entries.erase(it);
+    return true;
+  }
+
+  // Evicts the entire cache.
+  void EvictAll() {
+    for (Shard& shard : shards_) {
+      std::lock_guard<std::mutex> lock(shard.mu);
+      shard.EvictUntil(0);
+    }
+  }
+
+  // Returns the statistics of all shards combined.
+  LRUCacheStats GetStats() const {
+    LRUCacheStats out;
+    for (const Shard& shard : shards_) {
+      std::lock_guard<std::mutex> lock(shard.mu);
+      out.hits += shard.stats.hits;
+      out.misses += shard.stats.misses;
+      out.evictions += shard.stats.evictions;
+      out.pending_waits += shard.stats.pending_waits;
+      out.entries += shard.entries.size();
+      out.total_cost += shard.total_cost;
+    }
+
+    return out;
+  }
+
+ private:
+  // An entry in a shard's LRU list.
+  struct Entry {
+    Entry(const K& key, ValuePtr value, uint64_t cost)
+        : key(key), value(value), cost(cost) {}
+
+    K key;
+    ValuePtr value;
+    uint64_t cost;
+  };
+
+  // A value that is being computed by a call to GetOrCompute.
+  struct PendingComputation {
+    PendingComputation() : done(false) {}
+
+    bool done;
+    ValuePtr value;
+  };
+
+  using LRUList = std::list<Entry>;
+
+  struct Shard {
+    Shard() : total_cost(0) {}
+
+    // Returns the value for a key and moves it to the front of the LRU list.
+    ValuePtr FindAndTouch(const K& key) {
+      auto it = entries.find(key);
+      if (it == entries.end()) {
+        return ValuePtr();
+      }
+
+      lru.splice(lru.begin(), lru, it->second);
+      return it->second->value;
+    }
+
+    void Insert(const K& key, ValuePtr value, uint64_t cost,
+                uint64_t max_cost) {
+      auto it = entries.find(key);
+      if (it != entries.end()) {
+        total_cost -= it->second->cost;
+        lru.erase(it->second);
+        entries.erase(it);
+      }
+
+      if (cost > max_cost) {
+        return;
+      }
+
+      EvictUntil(max_cost - cost);
+      lru.emplace_front(key, value, cost);
+      entries.emplace(key, lru.begin());
+      total_cost += cost;
+    }
+
+    // Evicts entries from the back of the LRU list until the total cost is at
+    // most 'max_cost'.
+    void EvictUntil(uint64_t max_cost) {
+      while (total_cost > max_cost && !lru.empty()) {
+        const Entry& entry = lru.back();
+        total_cost -= entry.cost;
+        entries.erase(entry.key);
+        lru.pop_back();
+        ++stats.evictions;
+      }
+    }
+
+    mutable std::mutex mu;
+    std::condition_variable computed;
+
+    LRUList lru;
+    std::unordered_map<K, typename LRUList::iterator, Hash, Pred> entries;
+    std::unordered_map<K, std::shared_ptr<PendingComputation>, Hash, Pred>
+        pending;
+
+    uint64_t total_cost;
+    LRUCacheStats stats;
+  };
+
+  // Used in the constructor's initializer list, before dividing by the
+  // number of shards.
+  static size_t CheckedShardCount(size_t num_shards) {
+    CHECK(num_shards > 0) << "Zero shards";
+    return num_shards;
+  }
+
+  uint64_t Cost(const K& key, const V& value) const {
+    return cost_function_ ? cost_function_(key, value) : 1;
+  }
+
+  Shard& ShardFor(const K& key) {
+    // The hash is mixed so that shards are not correlated with the buckets of
+    // the per-shard hash maps.
+    uint64_t hash = Hash()(key) * 0x9E3779B97F4A7C15UL;
+    return shards_[(hash >> 32) % shards_.size()];
+  }
+
+  const uint64_t max_shard_cost_;
+  const CostFunction cost_function_;
+  std::vector<Shard> shards_;
+
+  DISALLOW_COPY_AND_ASSIGN(ShardedLRUCache);
+};
+
 }  // namespace nc
 
 #endif
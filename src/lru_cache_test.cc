@@ -1,5 +1,6 @@
 #include "lru_cache.h"
 
+#include <atomic>
 #include <thread>
 #include "gtest/gtest.h"
 
@@ -135,6 +136,279 @@ TEST(CompileTest, CompositeValue) {
   LRUCache<int, CompositeValue> cache(kCacheSize);
   cache.Emplace(1, 2ul, 3.0);
   cache.EvictAll();
+
+  S3FIFOCache<int, CompositeValue> s3_fifo_cache(kCacheSize);
+  s3_fifo_cache.Emplace(1, 2ul, 3.0);
+  s3_fifo_cache.EvictAll();
+}
+
+// Caches with the same interface can be swapped via a template parameter.
+template <template <typename, typename, typename, typename> class Cache>
+class GenericCacheForTest
+    : public Cache<int, double, std::hash<int>, std::equal_to<int>> {
+ public:
+  GenericCacheForTest()
+      : Cache<int, double, std::hash<int>, std::equal_to<int>>(kCacheSize) {}
+
+  void ItemEvicted(const int& key, std::unique_ptr<double> value_ptr) override {
+    evicted_items_.emplace_back(key, *value_ptr);
+  }
+
+  const std::vector<std::pair<int, double>>& evicted_items() {
+    return evicted_items_;
+  }
+
+ private:
+  std::vector<std::pair<int, double>> evicted_items_;
+};
+
+template <typename T>
+class AnyCacheTest : public ::testing::Test {
+ protected:
+  T cache_;
+};
+
+using CacheTypes = ::testing::Types<GenericCacheForTest<LRUCache>,
+                                    GenericCacheForTest<S3FIFOCache>>;
+TYPED_TEST_CASE(AnyCacheTest, CacheTypes);
+
+TYPED_TEST(AnyCacheTest, UpToSize) {
+  for (size_t i = 0; i < kCacheSize; ++i) {
+    this->cache_.Emplace(i, 10.0 + i);
+  }
+  ASSERT_TRUE(this->cache_.evicted_items().empty());
+
+  for (size_t i = 0; i < kCacheSize; ++i) {
+    ASSERT_EQ(10.0 + i, this->cache_.Emplace(i, 1.0));
+    ASSERT_EQ(10.0 + i, *this->cache_.FindOrNull(i));
+  }
+  ASSERT_TRUE(this->cache_.evicted_items().empty());
+  ASSERT_EQ(kCacheSize, this->cache_.Values().size());
+  ASSERT_EQ(nullptr, this->cache_.FindOrNull(kCacheSize));
+}
+
+TYPED_TEST(AnyCacheTest, Overflow) {
+  for (size_t i = 0; i < 10 * kCacheSize; ++i) {
+    this->cache_.Emplace(i, 10.0 + i);
+  }
+
+  auto values = this->cache_.Values();
+  ASSERT_EQ(kCacheSize, values.size());
+  ASSERT_EQ(9 * kCacheSize, this->cache_.evicted_items().size());
+  for (const auto& key_and_value : values) {
+    ASSERT_EQ(10.0 + key_and_value.first, *key_and_value.second);
+  }
+
+  this->cache_.EvictAll();
+  ASSERT_TRUE(this->cache_.Values().empty());
+  ASSERT_EQ(10 * kCacheSize, this->cache_.evicted_items().size());
+}
+
+TYPED_TEST(AnyCacheTest, InsertNew) {
+  this->cache_.Emplace(10, 10.0);
+  this->cache_.InsertNew(10, 11.0);
+  ASSERT_EQ(11.0, *this->cache_.FindOrNull(10));
+  this->cache_.EvictAll();
+
+  std::vector<std::pair<int, double>> model = {{10, 10.0}, {10, 11.0}};
+  ASSERT_EQ(model, this->cache_.evicted_items());
+}
+
+TEST(S3FIFOCache, ScanResistant) {
+  S3FIFOCache<int, int> cache(kCacheSize);
+
+  // A working set that is accessed repeatedly.
+  for (size_t pass = 0; pass < 3; ++pass) {
+    for (int i = 0; i < 500; ++i) {
+      cache.Emplace(i, i);
+    }
+  }
+
+  // A one-off scan over many more keys than fit in the cache.
+  for (int i = 0; i < 100 * static_cast<int>(kCacheSize); ++i) {
+    cache.Emplace(1000000 + i, i);
+  }
+
+  for (int i = 0; i < 500; ++i) {
+    ASSERT_NE(nullptr, cache.FindOrNull(i)) << i;
+  }
+
+  // An LRU cache would have lost the entire working set.
+  LRUCache<int, int> lru_cache(kCacheSize);
+  for (int i = 0; i < 500; ++i) {
+    lru_cache.Emplace(i, i);
+  }
+  for (int i = 0; i < 100 * static_cast<int>(kCacheSize); ++i) {
+    lru_cache.Emplace(1000000 + i, i);
+  }
+  ASSERT_EQ(nullptr, lru_cache.FindOrNull(0));
+}
+
+TEST(S3FIFOCache, Random) {
+  S3FIFOCache<int, int> cache(100);
+  std::mt19937 rnd(1);
+  std::uniform_int_distribution<int> dist(0, 1000);
+
+  for (size_t i = 0; i < 1000000; ++i) {
+    int key = dist(rnd);
+    ASSERT_EQ(key * 2, cache.Emplace(key, key * 2));
+  }
+
+  auto values = cache.Values();
+  ASSERT_EQ(100ul, values.size());
+  for (const auto& key_and_value : values) {
+    ASSERT_EQ(key_and_value.first * 2, *key_and_value.second);
+    ASSERT_EQ(key_and_value.second, cache.FindOrNull(key_and_value.first));
+  }
+}
+
+TEST(S3FIFOCache, SizeOne) {
+  S3FIFOCache<int, int> cache(1);
+  cache.Emplace(1, 1);
+  cache.Emplace(2, 2);
+  ASSERT_EQ(nullptr, cache.FindOrNull(1));
+  ASSERT_EQ(2, *cache.FindOrNull(2));
+}
+
+TEST(ShardedCache, FindInsert) {
+  ShardedLRUCache<int, double> cache(kCacheSize);
+  ASSERT_FALSE(cache.Find(1));
+
+  cache.Insert(1, make_unique<double>(10.0));
+  ASSERT_EQ(10.0, *cache.Find(1));
+
+  cache.Insert(1, make_unique<double>(11.0));
+  ASSERT_EQ(11.0, *cache.Find(1));
+
+  LRUCacheStats stats = cache.GetStats();
+  ASSERT_EQ(2ul, stats.hits);
+  ASSERT_EQ(1ul, stats.misses);
+  ASSERT_EQ(0ul, stats.evictions);
+  ASSERT_EQ(1ul, stats.entries);
+  ASSERT_EQ(1ul, stats.total_cost);
+
+  ASSERT_TRUE(cache.Erase(1));
+  ASSERT_FALSE(cache.Erase(1));
+  ASSERT_FALSE(cache.Find(1));
+  ASSERT_EQ(0ul, cache.GetStats().entries);
+}
+
+TEST(ShardedCache, LeastRecentSingleShard) {
+  ShardedLRUCache<int, double> cache(kCacheSize, 1);
+  for (size_t i = 0; i < kCacheSize; ++i) {
+    cache.Insert(i, make_unique<double>(10.0 + i));
+  }
+
+  // This will make key 0 the most recently used.
+  ASSERT_TRUE(cache.Find(0));
+  cache.Insert(kCacheSize, make_unique<double>(10.0 + kCacheSize));
+
+  ASSERT_TRUE(cache.Find(0));
+  ASSERT_FALSE(cache.Find(1));
+  ASSERT_TRUE(cache.Find(2));
+  ASSERT_EQ(1ul, cache.GetStats().evictions);
+  ASSERT_EQ(kCacheSize, cache.GetStats().entries);
+}
+
+TEST(ShardedCache, CostBudget) {
+  // Values are vectors, the cost is their size in bytes.
+  using Vector = std::vector<char>;
+  ShardedLRUCache<int, Vector> cache(
+      10000, 4, [](const int& key, const Vector& value) {
+        Unused(key);
+        return value.size();
+      });
+
+  for (size_t i = 0; i < 1000; ++i) {
+    cache.Insert(i, make_unique<Vector>(100));
+    ASSERT_GE(10000ul, cache.GetStats().total_cost);
+  }
+
+  LRUCacheStats stats = cache.GetStats();
+  ASSERT_LT(0ul, stats.evictions);
+  ASSERT_EQ(stats.total_cost, stats.entries * 100);
+  ASSERT_EQ(1000ul, stats.entries + stats.evictions);
+
+  // A value that exceeds the budget of its shard is not cached.
+  auto value = cache.Insert(5000, make_unique<Vector>(5000));
+  ASSERT_EQ(5000ul, value->size());
+  ASSERT_FALSE(cache.Find(5000));
+
+  cache.EvictAll();
+  ASSERT_EQ(0ul, cache.GetStats().entries);
+  ASSERT_EQ(0ul, cache.GetStats().total_cost);
+}
+
+TEST(ShardedCache, GetOrComputeCollapses) {
+  ShardedLRUCache<int, double> cache(kCacheSize);
+  std::atomic<size_t> compute_count(0);
+
+  std::vector<std::thread> threads;
+  std::vector<double> results(10);
+  for (size_t i = 0; i < 10; ++i) {
+    threads.emplace_back([&cache, &compute_count, &results, i] {
+      auto value = cache.GetOrCompute(42, [&cache, &compute_count] {
+        ++compute_count;
+
+        // Does not complete until all other threads wait for the value.
+        while (cache.GetStats().pending_waits < 9) {
+          std::this_thread::yield();
+        }
+        return make_unique<double>(42.0);
+      });
+      results[i] = *value;
+    });
+  }
+
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  ASSERT_EQ(1ul, compute_count);
+  ASSERT_EQ(std::vector<double>(10, 42.0), results);
+  LRUCacheStats stats = cache.GetStats();
+  ASSERT_EQ(1ul, stats.misses);
+  ASSERT_EQ(9ul, stats.hits + stats.pending_waits);
+  ASSERT_EQ(9ul, stats.pending_waits);
+}
+
+TEST(ShardedCache, ZeroShards) {
+  using Cache = ShardedLRUCache<int, double>;
+  ASSERT_DEATH(Cache(kCacheSize, 0), "Zero shards");
+}
+
+TEST(ShardedCache, GetOrComputeNull) {
+  ShardedLRUCache<int, double> cache(kCacheSize);
+  auto value =
+      cache.GetOrCompute(1, [] { return std::unique_ptr<double>(); });
+  ASSERT_FALSE(value);
+  ASSERT_EQ(0ul, cache.GetStats().entries);
+}
+
+TEST(ShardedCache, ManyThreads) {
+  ShardedLRUCache<int, int> cache(100);
+
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < 8; ++i) {
+    threads.emplace_back([&cache, i] {
+      std::mt19937 rnd(i);
+      std::uniform_int_distribution<int> dist(0, 1000);
+      for (size_t j = 0; j < 10000; ++j) {
+        int key = dist(rnd);
+        auto value = cache.GetOrCompute(
+            key, [key] { return make_unique<int>(key * 2); });
+        ASSERT_EQ(key * 2, *value);
+      }
+    });
+  }
+
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  LRUCacheStats stats = cache.GetStats();
+  ASSERT_EQ(80000ul, stats.hits + stats.misses + stats.pending_waits);
+  ASSERT_GE(100ul, stats.entries);
 }
 
 }  // namespace
@@ -0,0 +1,104 @@
+#include "mapped_file.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "logging.h"
+#include "strutil.h"
+
+namespace nc {
+
+StatusOr<MappedFile> MappedFile::Open(const std::string& name,
+                                      MappedFileOptions options) {
+  int fd = open(name.c_str(), O_RDONLY);
+  if (fd == -1) {
+    return Status(error::INVALID_ARGUMENT,
+                  StrCat("Unable to open ", name, ", ", strerror(errno)));
+  }
+
+  StatusOr<MappedFile> mapped_file = FromDescriptor(fd, options);
+  close(fd);
+  return mapped_file;
+}
+
+StatusOr<MappedFile> MappedFile::FromDescriptor(int fd,
+                                                MappedFileOptions options) {
+  struct stat statbuf;
+  if (fstat(fd, &statbuf) != 0) {
+    return Status(error::INTERNAL,
+                  StrCat("Unable to fstat, ", strerror(errno)));
+  }
+
+  if (!S_ISREG(statbuf.st_mode)) {
+    return Status(error::INVALID_ARGUMENT, "Not a regular file");
+  }
+
+  uint64_t size = statbuf.st_size;
+  if (size == 0) {
+    // Cannot map 0 bytes.
+    return MappedFile();
+  }
+
+  int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+  if (options.populate) {
+    flags |= MAP_POPULATE;
+  }
+#endif
+
+  void* data = mmap(nullptr, size, PROT_READ, flags, fd, 0);
+  if (data == MAP_FAILED) {
+    return Status(error::INTERNAL, StrCat("Unable to mmap, ", strerror(errno)));
+  }
+
+  int advice = MADV_NORMAL;
+  if (options.access == MappedFileOptions::SEQUENTIAL) {
+    advice = MADV_SEQUENTIAL;
+  } else if (options.access == MappedFileOptions::RANDOM) {
+    advice = MADV_RANDOM;
+  }
+  madvise(data, size, advice);
+
+#ifdef MADV_HUGEPAGE
+  if (options.huge_pages) {
+    // Fails on file systems that do not support it, which is fine.
+    madvise(data, size, MADV_HUGEPAGE);
+  }
+#endif
+
+  return MappedFile(static_cast<const char*>(data), size);
+}
+
+MappedFile::~MappedFile() {
+  if (data_ != nullptr &&
+      munmap(const_cast<char*>(data_), static_cast<size_t>(size_)) != 0) {
+    LOG(ERROR) << "Unable to munmap: " << strerror(errno);
+  }
+}
+
+void MappedFile::WillNeed(uint64_t offset, uint64_t count) const {
+  Advise(offset, count, MADV_WILLNEED);
+}
+
+void MappedFile::DontNeed(uint64_t offset, uint64_t count) const {
+  Advise(offset, count, MADV_DONTNEED);
+}
+
+void MappedFile::Advise(uint64_t offset, uint64_t count, int advice) const {
+  CHECK(offset <= size_ && count <= size_ - offset);
+  if (count == 0) {
+    return;
+  }
+
+  // madvise needs a page-aligned address.
+  uint64_t page_size = sysconf(_SC_PAGESIZE);
+  uint64_t aligned_offset = offset / page_size * page_size;
+  madvise(const_cast<char*>(data_) + aligned_offset,
+          offset + count - aligned_offset, advice);
+}
+
+}  // namespace nc
@@ -0,0 +1,91 @@
+#ifndef NCODE_MAPPED_FILE_H
+#define NCODE_MAPPED_FILE_H
+
+#include <cstdint>
+#include <string>
+
+#include "common.h"
+#include "statusor.h"
+#include "stringpiece.h"
+
+namespace nc {
+
+struct MappedFileOptions {
+  // How the mapping is expected to be accessed. Controls the kernel's
+  // read-ahead (madvise).
+  enum Access { NORMAL, SEQUENTIAL, RANDOM };
+  Access access = NORMAL;
+
+  // Reads the whole file in when it is mapped, instead of on first access.
+  bool populate = false;
+
+  // Asks for the mapping to be backed by huge pages, reducing TLB misses on
+  // random access to large files. Only honored by some kernels / file
+  // systems, ignored otherwise.
+  bool huge_pages = false;
+};
+
+// A read-only memory mapping of a file. Mapping a file is fast regardless of
+// its size and uses no heap memory -- pages are read in (and can be evicted
+// by the kernel) as they are accessed. All views returned are valid for the
+// lifetime of the MappedFile.
+class MappedFile {
+ public:
+  // Maps an entire file.
+  static StatusOr<MappedFile> Open(const std::string& name,
+                                   MappedFileOptions options = {});
+
+  // Maps an entire file that is already open. The descriptor is not used
+  // after the call returns.
+  static StatusOr<MappedFile> FromDescriptor(int fd,
+                                             MappedFileOptions options = {});
+
+  MappedFile() : data_(nullptr), size_(0) {}
+
+  MappedFile(MappedFile&& other) : data_(other.data_), size_(other.size_) {
+    other.data_ = nullptr;
+    other.size_ = 0;
+  }
+
+  ~MappedFile();
+
+  // The contents of the file.
+  StringPiece data() const { return StringPiece(data_, size_); }
+
+  // A part of the file. The range should be within the file.
+  StringPiece View(uint64_t offset, uint64_t count) const {
+    CHECK(offset <= size_ && count <= size_ - offset)
+        << "View " << offset << "+" << count << " past end " << size_;
+    return StringPiece(data_ + offset, count);
+  }
+
+  // Bytes of the file, for binary data.
+  const uint8_t* bytes() const {
+    return reinterpret_cast<const uint8_t*>(data_);
+  }
+
+  uint64_t size() const { return size_; }
+
+  // Hints that a range will be accessed soon, so that the kernel can start
+  // reading it in.
+  void WillNeed(uint64_t offset, uint64_t count) const;
+
+  // Hints that a range will not be accessed soon, so that the kernel can
+  // drop its pages. The contents remain accessible.
+  void DontNeed(uint64_t offset, uint64_t count) const;
+
+ private:
+  MappedFile(const char* data, uint64_t size) : data_(data), size_(size) {}
+
+  // Applies an madvise hint to the pages that overlap a range.
+  void Advise(uint64_t offset, uint64_t count, int advice) const;
+
+  const char* data_;
+  uint64_t size_;
+
+  DISALLOW_COPY_AND_ASSIGN(MappedFile);
+};
+
+}  // namespace nc
+
+#endif
@@ -0,0 +1,98 @@
+#include "mapped_file.h"
+
+#include <gtest/gtest.h>
+
+#include "file.h"
+#include "fwrapper.h"
+#include "port.h"
+
+namespace nc {
+namespace {
+
+static constexpr char kTestFile[] = "mapped_file_test_file";
+
+class MappedFileTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    File::DeleteRecursively(kTestFile, nullptr, nullptr);
+  }
+
+  void TearDown() override {
+    File::DeleteRecursively(kTestFile, nullptr, nullptr);
+  }
+};
+
+TEST_F(MappedFileTest, Missing) {
+  ASSERT_FALSE(MappedFile::Open(kTestFile).ok());
+}
+
+TEST_F(MappedFileTest, Directory) { ASSERT_FALSE(MappedFile::Open(".").ok()); }
+
+TEST_F(MappedFileTest, Empty) {
+  File::WriteStringToFileOrDie("", kTestFile);
+  MappedFile mapped_file = MappedFile::Open(kTestFile).ConsumeValueOrDie();
+  ASSERT_EQ(0ul, mapped_file.size());
+  ASSERT_TRUE(mapped_file.data().empty());
+}
+
+TEST_F(MappedFileTest, Contents) {
+  std::string contents;
+  for (size_t i = 0; i < 100000; ++i) {
+    contents.push_back('a' + i % 26);
+  }
+  File::WriteStringToFileOrDie(contents, kTestFile);
+
+  for (auto access : {MappedFileOptions::NORMAL, MappedFileOptions::SEQUENTIAL,
+                      MappedFileOptions::RANDOM}) {
+    MappedFileOptions options;
+    options.access = access;
+    options.populate = true;
+    options.huge_pages = true;
+    MappedFile mapped_file =
+        MappedFile::Open(kTestFile, options).ConsumeValueOrDie();
+    ASSERT_EQ(contents.size(), mapped_file.size());
+    ASSERT_EQ(contents, mapped_file.data().ToString());
+    ASSERT_EQ("bcd", mapped_file.View(1, 3).ToString());
+    ASSERT_EQ("", mapped_file.View(contents.size(), 0).ToString());
+    ASSERT_EQ('a', mapped_file.bytes()[0]);
+    ASSERT_DEATH(mapped_file.View(contents.size(), 1), "past end");
+
+    // Hints do not change the contents.
+    mapped_file.WillNeed(5000, 10000);
+    mapped_file.DontNeed(0, contents.size());
+    ASSERT_EQ(contents, mapped_file.data().ToString());
+  }
+}
+
+TEST_F(MappedFileTest, Move) {
+  File::WriteStringToFileOrDie("abc", kTestFile);
+  MappedFile mapped_file = MappedFile::Open(kTestFile).ConsumeValueOrDie();
+  MappedFile other(std::move(mapped_file));
+  ASSERT_EQ(0ul, mapped_file.size());
+  ASSERT_EQ("abc", other.data().ToString());
+}
+
+TEST_F(MappedFileTest, ReadFileToString) {
+  File::WriteStringToFileOrDie("abc\ndef", kTestFile);
+  ASSERT_EQ("abc\ndef", File::ReadFileToStringOrDie(kTestFile));
+
+  // Files in /proc report a size of 0.
+  std::string status;
+  ASSERT_TRUE(File::ReadFileToString("/proc/self/status", &status));
+  ASSERT_FALSE(status.empty());
+}
+
+TEST_F(MappedFileTest, FWrapper) {
+  FWrapper fw = FWrapper::Open(kTestFile, "w+").ConsumeValueOrDie();
+  ASSERT_TRUE(fw.WriteUint32(1).ok());
+  ASSERT_TRUE(fw.WriteUint32(2).ok());
+
+  MappedFile mapped_file = fw.Map().ConsumeValueOrDie();
+  ASSERT_EQ(8ul, mapped_file.size());
+  uint32_t second;
+  memcpy(&second, mapped_file.bytes() + 4, 4);
+  ASSERT_EQ(2ul, BigEndian::ToHost32(second));
+}
+
+}  // namespace
+}  // namespace nc
@@ -15,6 +15,7 @@
 #include "../logging.h"
 #include "../perfect_hash.h"
 #include "../strutil.h"
+#include "../thread_runner.h"
 
 namespace nc {
 namespace net {
@@ -978,9 +979,23 @@ static void Merge(const std::vector<GraphNodeIndex>& to_merge,
 static GraphNodeMap<std::unique_ptr<ShortestPath>> GetSPTrees(
     const GraphNodeSet& nodes, const ExclusionSet& exclusion_set,
     const AdjacencyList& adj_list) {
-  GraphNodeMap<std::unique_ptr<ShortestPath>> out;
+  std::vector<GraphNodeIndex> roots;
   for (GraphNodeIndex node : nodes) {
-    out[node] = make_unique<ShortestPath>(node, nodes, exclusion_set, adj_list);
+    roots.emplace_back(node);
+  }
+
+  std::vector<std::unique_ptr<ShortestPath>> trees(roots.size());
+
+  // Trees are independent of each other, each one is a separate task.
+  ParallelFor(0, roots.size(), [&roots, &trees, &nodes, &exclusion_set,
+                                &adj_list](size_t i) {
+    trees[i] = make_unique<ShortestPath>(roots[i], nodes, exclusion_set,
+                                         adj_list);
+  }, 1);
+
+  GraphNodeMap<std::unique_ptr<ShortestPath>> out;
+  for (size_t i = 0; i < roots.size(); ++i) {
+    out[roots[i]] = std::move(trees[i]);
   }
 
   return out;
@@ -11,6 +11,7 @@
 #include <vector>
 
 #include "net_common.h"
+#include "../line_reader.h"
 #include "../strutil.h"
 
 namespace nc {
@@ -491,9 +492,9 @@ GraphBuilder GenerateBraess(Bandwidth bw) {
 }
 
 // Parses a line of the form <tag> <count> and returns count.
-static uint32_t ParseCountOrDie(const std::string& tag,
-                                const std::string& line) {
-  std::vector<std::string> line_split = Split(line, " ");
+static uint32_t ParseCountOrDie(const std::string& tag, StringPiece line) {
+  std::vector<StringPiece> line_split;
+  Splitter(" ").Split(line, &line_split);
   CHECK(line_split.size() == 2) << line;
   CHECK(line_split[0] == tag) << line_split[0] << " vs " << tag;
 
@@ -503,25 +504,31 @@ static uint32_t ParseCountOrDie(const std::string& tag,
 }
 
 GraphBuilder LoadRepetitaOrDie(
-    const std::string& topology_string, std::vector<std::string>* node_order,
+    StringPiece topology_string, std::vector<std::string>* node_order,
     std::map<std::string, std::pair<double, double>>* locations) {
-  std::vector<std::string> all_lines = Split(topology_string, "\n");
-  auto it = all_lines.begin();
+  // Empty lines are ignored.
+  LineReader reader(topology_string);
+  auto next_line = [&reader] {
+    StringPiece line;
+    CHECK(reader.NextNonEmpty(&line)) << "Topology too short";
+    return line;
+  };
 
-  const std::string& nodes_line = *it;
-  uint32_t num_nodes = ParseCountOrDie("NODES", nodes_line);
+  uint32_t num_nodes = ParseCountOrDie("NODES", next_line());
 
   // Skip free form line.
-  ++it;
+  next_line();
+
+  // Reused for all lines.
+  Splitter splitter(" ");
+  std::vector<StringPiece> line_split;
 
   std::vector<std::string> nodes;
   std::set<std::string> nodes_set;
   for (uint32_t i = 0; i < num_nodes; ++i) {
-    ++it;
-
-    std::vector<std::string> line_split = Split(*it, " ");
+    splitter.Split(next_line(), &line_split);
     CHECK(line_split.size() == 3);
-    std::string node_id = line_split[0];
+    std::string node_id = line_split[0].ToString();
 
     // If the node id is not unique, need to make it unique.
     uint32_t k = 1;
@@ -547,21 +554,14 @@ GraphBuilder LoadRepetitaOrDie(
     *node_order = nodes;
   }
 
-  // Skip line.
-  ++it;
-
-  const std::string& edges_line = *it;
-  uint32_t num_edges = ParseCountOrDie("EDGES", edges_line);
+  uint32_t num_edges = ParseCountOrDie("EDGES", next_line());
 
   // Skip free form line.
-  ++it;
+  next_line();
 
   GraphBuilder builder;
   for (uint32_t i = 0; i < num_edges; ++i) {
-    ++it;
-    CHECK(it != all_lines.end());
-
-    std::vector<std::string> line_split = Split(*it, " ");
+    splitter.Split(next_line(), &line_split);
     CHECK(line_split.size() == 6);
 
     uint32_t src_index;
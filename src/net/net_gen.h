@@ -7,6 +7,7 @@
 #include <vector>
 
 #include "net_common.h"
+#include "../stringpiece.h"
 
 namespace nc {
 namespace net {
@@ -64,7 +65,7 @@ GraphBuilder GenerateBraess(Bandwidth bw);
 // supplied, will populate it with the nodes from the graph in the same order in
 // which they appear in the topology string.
 GraphBuilder LoadRepetitaOrDie(
-    const std::string& topology_string,
+    StringPiece topology_string,
     std::vector<std::string>* node_order = nullptr,
     std::map<std::string, std::pair<double, double>>* locations = nullptr);
 
@@ -5,6 +5,7 @@
 
 #include "../common.h"
 #include "../logging.h"
+#include "../quantile_sketch.h"
 #include "../stats.h"
 #include "../substitute.h"
 #include "net_common.h"
@@ -60,9 +61,9 @@ class Trie {
     TrieStats stats;
     stats.size_bytes = sizeof(std::vector<V>) + sizeof(TrieNode<T, V>);
 
-    std::vector<size_t> children_counts;
+    LogLinearHistogram<size_t> children_counts;
     PopulateStatsRecursive(root_, &stats, &children_counts);
-    stats.children_per_node_percentiles = Percentiles(&children_counts);
+    stats.children_per_node_percentiles = children_counts.Percentiles();
     return stats;
   }
 
@@ -118,12 +119,13 @@ class Trie {
     return HasPrefixRecursive(prefix, from + 1, in_trie);
   }
 
-  void PopulateStatsRecursive(const TrieNode<T, V>& at, TrieStats* stats,
-                              std::vector<size_t>* children_counts) const {
+  void PopulateStatsRecursive(
+      const TrieNode<T, V>& at, TrieStats* stats,
+      LogLinearHistogram<size_t>* children_counts) const {
     stats->size_bytes +=
         at.children.size() * sizeof(std::pair<T, TrieNode<T, V>>);
     stats->size_bytes += at.values.size() * sizeof(V);
-    children_counts->emplace_back(at.children.size());
+    children_counts->Add(at.children.size());
     stats->num_nodes += at.children.size();
 
     for (const auto& child : at.children) {
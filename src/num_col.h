@@ -8,6 +8,7 @@
 #include "common.h"
 #include "interval_tree.h"
 #include "packer.h"
+#include "quantile_sketch.h"
 #include "stats.h"
 #include "thread_runner.h"
 
@@ -41,6 +42,26 @@ std::string IndexTypeToString(IndexType index_type);
 std::string BytesToString(uint64_t bytes);
 std::string NumericalQuantityToString(uint64_t value);
 
+// Number of values decoded at a time when computing summary stats.
+static constexpr size_t kSummaryStatsBlockSize = 1024;
+
+// Adds the values at indices [from, from + count) to 'stats' without
+// decoding all of them at once. restore(size_t i, size_t n, T* out) should
+// store the n values starting at index i in 'out'.
+template <typename T, typename RestoreF>
+void AddBlocksToSummaryStats(size_t from, size_t count, RestoreF restore,
+                             SummaryStats* stats) {
+  T values[kSummaryStatsBlockSize];
+  double values_as_doubles[kSummaryStatsBlockSize];
+  for (size_t i = 0; i < count; i += kSummaryStatsBlockSize) {
+    size_t block_size =
+        std::min(count - i, static_cast<size_t>(kSummaryStatsBlockSize));
+    restore(from + i, block_size, values);
+    std::copy(values, values + block_size, values_as_doubles);
+    stats->AddMany(values_as_doubles, block_size);
+  }
+}
+
 // A range of indices. The first value is the starting index, the second is the
 // number of indices from the starting one. The range is empty if this value is
 // equal to 0.
@@ -286,6 +307,9 @@ class ImmutableDoubleVector {
   // Returns the value at a given index.
   double at(size_t index) const { return data_[index]; }
 
+  // Returns the values.
+  const double* data() const { return data_.data(); }
+
   // Estaimates memory consumption.
   uint64_t ByteEstimate() const {
     return data_.capacity() * sizeof(double) + sizeof(this);
@@ -426,6 +450,12 @@ class IntegerStorageChunk {
 
   int64_t at(I index) const;
 
+  // Appends the values at indices [from, from + count) to 'out'.
+  void AppendValues(I from, size_t count, std::vector<int64_t>* out) const;
+
+  // Adds the values at indices [from, from + count) to 'stats'.
+  void AddToSummaryStats(I from, size_t count, SummaryStats* stats) const;
+
   I size() const;
 
   int64_t MinValue() const;
@@ -470,6 +500,9 @@ class BoolStorageChunk {
 
   bool at(I index) const;
 
+  // Appends the values at indices [from, from + count) to 'out'.
+  void AppendValues(I from, size_t count, std::vector<bool>* out) const;
+
   I size() const;
 
   uint64_t StorageByteEstimate() const;
@@ -507,6 +540,12 @@ class DoubleStorageChunk {
 
   double at(I index) const;
 
+  // Appends the values at indices [from, from + count) to 'out'.
+  void AppendValues(I from, size_t count, std::vector<double>* out) const;
+
+  // Adds the values at indices [from, from + count) to 'stats'.
+  void AddToSummaryStats(I from, size_t count, SummaryStats* stats) const;
+
   I size() const;
 
   uint64_t StorageByteEstimate() const;
@@ -556,14 +595,68 @@ class Storage {
   // Returns all values at a given set of ranges.
   std::vector<T> ValuesAtRanges(const RangeSet<>& ranges) const {
     std::vector<T> out;
+    out.reserve(ranges.ElementCount());
+    for (const auto& range : ranges.ranges()) {
+      size_t i = range.first;
+      size_t to = i + range.second;
+      while (i < to) {
+        size_t base = i / kChunkSize;
+        size_t offset = i % kChunkSize;
+        size_t count = std::min(to - i, kChunkSize - offset);
+
+        if (base == chunks_.size()) {
+          out.insert(out.end(), latest_.begin() + offset,
+                     latest_.begin() + offset + count);
+        } else {
+          chunks_[base]->AppendValues(offset, count, &out);
+        }
+
+        i += count;
+      }
+    }
+
+    return out;
+  }
+
+  // Returns summary stats of the values at a given set of ranges, without
+  // copying the values out. Parts of the ranges that fall in different chunks
+  // are processed in parallel.
+  SummaryStats SummaryStatsAtRanges(
+      const RangeSet<>& ranges,
+      ThreadPool* pool = ThreadPool::Default()) const {
+    // Splits the ranges at chunk boundaries.
+    std::vector<Range<>> pieces;
     for (const auto& range : ranges.ranges()) {
-      size_t from = range.first;
-      size_t to = from + range.second;
-      for (size_t i = from; i < to; ++i) {
-        out.push_back(at(i));
+      size_t i = range.first;
+      size_t to = i + range.second;
+      while (i < to) {
+        size_t count = std::min(to - i, kChunkSize - i % kChunkSize);
+        pieces.emplace_back(i, count);
+        i += count;
       }
     }
 
+    std::vector<SummaryStats> piece_stats(pieces.size());
+    ParallelFor(0, pieces.size(), [this, &pieces, &piece_stats](size_t i) {
+      size_t base = pieces[i].first / kChunkSize;
+      size_t offset = pieces[i].first % kChunkSize;
+      size_t count = pieces[i].second;
+      if (base != chunks_.size()) {
+        chunks_[base]->AddToSummaryStats(offset, count, &piece_stats[i]);
+        return;
+      }
+
+      AddBlocksToSummaryStats<T>(
+          offset, count, [this](size_t from, size_t n, T* out) {
+            std::copy(latest_.begin() + from, latest_.begin() + from + n, out);
+          }, &piece_stats[i]);
+    }, 1, pool);
+
+    SummaryStats out;
+    for (const SummaryStats& stats : piece_stats) {
+      out.Merge(stats);
+    }
+
     return out;
   }
 
@@ -594,8 +687,12 @@ class Storage {
   }
 
   static std::string DistBytes(const std::vector<uint64_t>& bytes) {
-    std::vector<uint64_t> bytes_copy = bytes;
-    std::vector<uint64_t> p = Percentiles(&bytes_copy);
+    LogLinearHistogram<uint64_t> histogram;
+    for (uint64_t value : bytes) {
+      histogram.Add(value);
+    }
+
+    std::vector<uint64_t> p = histogram.Percentiles();
     return Substitute("(min $0, med $1, 90p $2, max $3)", BytesToString(p[0]),
                       BytesToString(p[50]), BytesToString(p[90]),
                       BytesToString(p[100]));
@@ -967,6 +1064,50 @@ int64_t IntegerStorageChunk<I>::at(I index) const {
   return 0;
 }
 
+template <typename I>
+void IntegerStorageChunk<I>::AppendValues(I from, size_t count,
+                                          std::vector<int64_t>* out) const {
+  if (packed_int_vector_) {
+    for (size_t i = from; i < from + count; ++i) {
+      out->emplace_back(packed_int_vector_->at(i));
+    }
+    return;
+  }
+
+  if (rle_) {
+    size_t initial_size = out->size();
+    out->resize(initial_size + count);
+    rle_->RestoreRange(from, from + count, out->data() + initial_size);
+    return;
+  }
+
+  LOG(FATAL) << "Storage not set";
+}
+
+template <typename I>
+void IntegerStorageChunk<I>::AddToSummaryStats(I from, size_t count,
+                                               SummaryStats* stats) const {
+  if (packed_int_vector_) {
+    AddBlocksToSummaryStats<int64_t>(
+        from, count, [this](size_t i, size_t n, int64_t* out) {
+          for (size_t j = 0; j < n; ++j) {
+            out[j] = packed_int_vector_->at(i + j);
+          }
+        }, stats);
+    return;
+  }
+
+  if (rle_) {
+    AddBlocksToSummaryStats<int64_t>(
+        from, count, [this](size_t i, size_t n, int64_t* out) {
+          rle_->RestoreRange(i, i + n, out);
+        }, stats);
+    return;
+  }
+
+  LOG(FATAL) << "Storage not set";
+}
+
 template <typename I>
 I IntegerStorageChunk<I>::size() const {
   if (packed_int_vector_) {
@@ -1209,6 +1350,28 @@ bool BoolStorageChunk<I>::at(I index) const {
   return false;
 }
 
+template <typename I>
+void BoolStorageChunk<I>::AppendValues(I from, size_t count,
+                                       std::vector<bool>* out) const {
+  if (bool_vector_) {
+    out->insert(out->end(), bool_vector_->begin() + from,
+                bool_vector_->begin() + from + count);
+    return;
+  }
+
+  if (rle_) {
+    RLEFieldIterator<bool> it(*rle_, from);
+    bool value;
+    for (size_t i = 0; i < count; ++i) {
+      CHECK(it.Next(&value));
+      out->emplace_back(value);
+    }
+    return;
+  }
+
+  LOG(FATAL) << "Storage not set";
+}
+
 template <typename I>
 I BoolStorageChunk<I>::size() const {
   if (bool_vector_) {
@@ -1343,6 +1506,45 @@ double DoubleStorageChunk<I>::at(I index) const {
   return 0;
 }
 
+template <typename I>
+void DoubleStorageChunk<I>::AppendValues(I from, size_t count,
+                                         std::vector<double>* out) const {
+  if (double_vector_) {
+    for (size_t i = from; i < from + count; ++i) {
+      out->emplace_back(double_vector_->at(i));
+    }
+    return;
+  }
+
+  if (rle_) {
+    size_t initial_size = out->size();
+    out->resize(initial_size + count);
+    rle_->RestoreRange(from, from + count, out->data() + initial_size);
+    return;
+  }
+
+  LOG(FATAL) << "Storage not set";
+}
+
+template <typename I>
+void DoubleStorageChunk<I>::AddToSummaryStats(I from, size_t count,
+                                              SummaryStats* stats) const {
+  if (double_vector_) {
+    stats->AddMany(double_vector_->data() + from, count);
+    return;
+  }
+
+  if (rle_) {
+    AddBlocksToSummaryStats<double>(
+        from, count, [this](size_t i, size_t n, double* out) {
+          rle_->RestoreRange(i, i + n, out);
+        }, stats);
+    return;
+  }
+
+  LOG(FATAL) << "Storage not set";
+}
+
 template <typename I>
 I DoubleStorageChunk<I>::size() const {
   if (double_vector_) {
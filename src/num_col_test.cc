@@ -623,6 +623,109 @@ TYPED_TEST(StorageTest, RandomValues) {
   }
 }
 
+TYPED_TEST(StorageTest, ValuesAtRanges) {
+  using ValueType = typename std::tuple_element<0, TypeParam>::type;
+  using StorageType = typename std::tuple_element<1, TypeParam>::type;
+
+  std::mt19937 rnd(1);
+
+  // Runs of repeated values so that some chunks end up run-length encoded.
+  std::vector<ValueType> values;
+  while (values.size() < 300000) {
+    ValueType value = GenerateRandom<ValueType>(&rnd);
+    size_t run = GenerateRandom<int64_t>(&rnd, 1, 1000);
+    for (size_t i = 0; i < run; ++i) {
+      values.push_back(value);
+    }
+  }
+
+  StorageType storage;
+  for (ValueType value : values) {
+    storage.Add(value);
+  }
+
+  for (size_t i = 0; i < 100; ++i) {
+    std::vector<Range<>> ranges;
+    for (size_t j = 0; j < 10; ++j) {
+      size_t from = GenerateRandom<int64_t>(&rnd, 0, values.size() - 1);
+      size_t len = GenerateRandom<int64_t>(&rnd, 0, 200000);
+      len = std::min(len, values.size() - from);
+      ranges.emplace_back(from, len);
+    }
+
+    RangeSet<> range_set(ranges);
+    std::vector<ValueType> model;
+    for (const auto& range : range_set.ranges()) {
+      model.insert(model.end(), values.begin() + range.first,
+                   values.begin() + range.first + range.second);
+    }
+
+    ASSERT_EQ(model, storage.ValuesAtRanges(range_set));
+  }
+}
+
+// Checks SummaryStatsAtRanges against summary stats of ValuesAtRanges.
+template <typename ValueType, typename StorageType>
+static void CheckSummaryStatsAtRanges() {
+  std::mt19937 rnd(1);
+
+  // Both runs of repeated values and random values, so that chunks are stored
+  // in different ways.
+  // Values need to be small enough for SummaryStats.
+  std::vector<ValueType> values;
+  ValueType min = -1000000;
+  ValueType max = 1000000;
+  while (values.size() < 300000) {
+    ValueType value = GenerateRandom<ValueType>(&rnd, min, max);
+    size_t run = GenerateRandom<int64_t>(&rnd, 1, 1000);
+    for (size_t i = 0; i < run; ++i) {
+      values.push_back(value);
+    }
+  }
+  while (values.size() < 400000) {
+    values.push_back(GenerateRandom<ValueType>(&rnd, min, max));
+  }
+
+  StorageType storage;
+  for (ValueType value : values) {
+    storage.Add(value);
+  }
+
+  ThreadPool pool(4);
+  for (size_t i = 0; i < 20; ++i) {
+    std::vector<Range<>> ranges;
+    for (size_t j = 0; j < 10; ++j) {
+      size_t from = GenerateRandom<int64_t>(&rnd, 0, values.size() - 1);
+      size_t len = GenerateRandom<int64_t>(&rnd, 0, 200000);
+      len = std::min(len, values.size() - from);
+      ranges.emplace_back(from, len);
+    }
+
+    RangeSet<> range_set(ranges);
+    SummaryStats model;
+    for (ValueType value : storage.ValuesAtRanges(range_set)) {
+      model.Add(value);
+    }
+
+    SummaryStats stats = storage.SummaryStatsAtRanges(range_set, &pool);
+    ASSERT_EQ(model.count(), stats.count());
+    ASSERT_EQ(model.min(), stats.min());
+    ASSERT_EQ(model.max(), stats.max());
+    ASSERT_NEAR(model.mean(), stats.mean(), std::abs(model.mean()) * 1e-9);
+    ASSERT_NEAR(model.var(), stats.var(), model.var() * 1e-9);
+  }
+
+  ASSERT_EQ(0ul, storage.SummaryStatsAtRanges(RangeSet<>()).count());
+}
+
+TEST(Storage, SummaryStatsAtRangesInteger) {
+  CheckSummaryStatsAtRanges<int64_t, IntegerStorage>();
+}
+
+TEST(Storage, SummaryStatsAtRangesDouble) {
+  CheckSummaryStatsAtRanges<double, DoubleStorage>();
+}
+
 }  // namespace
 }  // namespace num_col
 }  // namespace nc
@@ -0,0 +1,73 @@
+#ifndef NCODE_NUMBER_PARSER_H
+#define NCODE_NUMBER_PARSER_H
+
+#include <cstdint>
+#include <cstring>
+
+#include "port.h"
+
+// Locale-independent number parsers that work on [begin, end) ranges, so
+// that callers do not need a NUL-terminated copy of their input. The
+// safe_strto* functions in strutil.h are built on top of these and are what
+// most code should use.
+
+namespace nc {
+
+// Loads 8 chars so that the first one ends up in the least significant byte.
+inline uint64_t LoadEightChars(const char* chars) {
+  uint64_t value;
+#ifdef PROTOBUF_LITTLE_ENDIAN
+  memcpy(&value, chars, sizeof(value));
+#else
+  value = 0;
+  for (int i = 7; i >= 0; --i) {
+    value = (value << 8) | static_cast<unsigned char>(chars[i]);
+  }
+#endif
+  return value;
+}
+
+// True if all 8 chars at 'chars' are ASCII decimal digits. Bytes below '0'
+// borrow into their top bit when '0' is subtracted and bytes above '9' carry
+// into it when 0x46 is added, so a single mask checks all of them.
+inline bool IsEightDigits(const char* chars) {
+  uint64_t value = LoadEightChars(chars);
+  return !(((value + 0x4646464646464646ull) |
+            (value - 0x3030303030303030ull)) &
+           0x8080808080808080ull);
+}
+
+// Value of the 8 decimal digits at 'chars' (checked with IsEightDigits),
+// most significant digit first. Adjacent digits are combined into 2-digit
+// values with one multiply, then pairs of those into 4-digit and 8-digit
+// values with two more.
+inline uint32_t ParseEightDigits(const char* chars) {
+  uint64_t value = LoadEightChars(chars) - 0x3030303030303030ull;
+  value = (value * 10) + (value >> 8);
+  value = (((value & 0x000000FF000000FFull) * 0x000F424000000064ull) +
+           (((value >> 16) & 0x000000FF000000FFull) * 0x0000271000000001ull)) >>
+          32;
+  return static_cast<uint32_t>(value);
+}
+
+// Parses the longest prefix of [begin, end) that is a decimal floating point
+// number -- an optional sign, digits with an optional '.' (at least one digit
+// in total) and an optional exponent -- and sets 'value' to the nearest
+// double, ties to even, like strtod does in the C locale. Returns the end of
+// the parsed prefix. Returns 'begin' and leaves 'value' unchanged if there is
+// no such prefix, or if the number has more than 19 significant digits and
+// they are not enough to decide the rounding; callers should use strtod in
+// that case. Leading whitespace, infinities, NaNs and hexadecimal floats are
+// not recognized.
+const char* ParseDecimalDouble(const char* begin, const char* end,
+                               double* value);
+
+// Same as above for floats, except that 'begin' is also returned when the
+// result would overflow, or underflow to a subnormal number or to zero, since
+// strtof is needed to find out if it reports a range error.
+const char* ParseDecimalFloat(const char* begin, const char* end,
+                              float* value);
+
+}  // namespace nc
+
+#endif
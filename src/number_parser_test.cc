@@ -0,0 +1,273 @@
+#include "number_parser.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include "gtest/gtest.h"
+
+namespace nc {
+namespace {
+
+static uint64_t DoubleBits(double value) {
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  return bits;
+}
+
+static uint32_t FloatBits(float value) {
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  return bits;
+}
+
+// Checks that ParseDecimalDouble consumes all of 'text' and agrees with
+// strtod to the bit. Returns false if it defers to strtod instead.
+static bool CheckDouble(const std::string& text) {
+  const char* begin = text.data();
+  const char* end = begin + text.size();
+  double value;
+  const char* parsed_end = ParseDecimalDouble(begin, end, &value);
+  if (parsed_end == begin) {
+    return false;
+  }
+
+  EXPECT_EQ(end, parsed_end) << text;
+  EXPECT_EQ(DoubleBits(strtod(text.c_str(), nullptr)), DoubleBits(value))
+      << text;
+  return true;
+}
+
+static bool CheckFloat(const std::string& text) {
+  const char* begin = text.data();
+  const char* end = begin + text.size();
+  float value;
+  const char* parsed_end = ParseDecimalFloat(begin, end, &value);
+  if (parsed_end == begin) {
+    return false;
+  }
+
+  EXPECT_EQ(end, parsed_end) << text;
+  EXPECT_EQ(FloatBits(strtof(text.c_str(), nullptr)), FloatBits(value))
+      << text;
+  return true;
+}
+
+static std::string Format(const char* format, double value) {
+  char buffer[64];
+  snprintf(buffer, sizeof(buffer), format, value);
+  return buffer;
+}
+
+// A random decimal number with up to 'max_digits' digits and an exponent
+// close to 'exponent'.
+static std::string RandomDecimal(size_t max_digits, int exponent,
+                                 std::mt19937_64* rnd) {
+  std::uniform_int_distribution<size_t> digit_count_dist(1, max_digits);
+  std::uniform_int_distribution<int> digit_dist(0, 9);
+  size_t digit_count = digit_count_dist(*rnd);
+  std::uniform_int_distribution<size_t> point_dist(0, digit_count);
+  size_t point = point_dist(*rnd);
+
+  std::string out = (*rnd)() % 2 ? "-" : "";
+  for (size_t i = 0; i < digit_count; ++i) {
+    if (i == point) {
+      out.push_back('.');
+    }
+    out.push_back('0' + digit_dist(*rnd));
+  }
+  return out + "e" + std::to_string(exponent);
+}
+
+TEST(EightDigits, Detect) {
+  ASSERT_TRUE(IsEightDigits("01234567"));
+  ASSERT_TRUE(IsEightDigits("99999999"));
+  ASSERT_FALSE(IsEightDigits("0123456."));
+  ASSERT_FALSE(IsEightDigits("/1234567"));
+  ASSERT_FALSE(IsEightDigits("0123:567"));
+  ASSERT_FALSE(IsEightDigits("0123\xb0" "567"));
+  ASSERT_FALSE(IsEightDigits("1234567e"));
+
+  // Every single non-digit in every position.
+  for (size_t i = 0; i < 8; ++i) {
+    for (int c = 0; c < 256; ++c) {
+      std::string text = "12345678";
+      text[i] = static_cast<char>(c);
+      ASSERT_EQ(c >= '0' && c <= '9', IsEightDigits(text.c_str())) << c;
+    }
+  }
+}
+
+TEST(EightDigits, Parse) {
+  std::mt19937_64 rnd(1);
+  std::uniform_int_distribution<uint32_t> dist(0, 99999999);
+  for (size_t i = 0; i < 100000; ++i) {
+    uint32_t value = dist(rnd);
+    char buffer[16];
+    snprintf(buffer, sizeof(buffer), "%08u", value);
+    ASSERT_EQ(value, ParseEightDigits(buffer));
+  }
+  ASSERT_EQ(12345678u, ParseEightDigits("12345678"));
+}
+
+TEST(ParseDecimalDouble, Simple) {
+  for (const char* text :
+       {"0", "-0", "+0", "0.0", ".5", "5.", "1", "-1", "123.456", "1e10",
+        "1E10", "1e+10", "1e-10", "0.1", "0.3", "3.14159265358979",
+        "9007199254740992", "9007199254740993", "9007199254740995",
+        "18446744073709551615", "0000000000000000000000001.5",
+        "0.00000000000000000000000000000000001", "1e22", "1e23",
+        "123456789012345678e-20", "0e999999999999", "1e-400", "-1e-400",
+        "1e400", "-1e400", "1.7976931348623157e308", "1.7976931348623158e308",
+        "1.7976931348623159e308", "2.2250738585072011e-308",
+        "2.2250738585072014e-308", "4.9406564584124654e-324",
+        "2.4703282292062328e-324", "5e-324", "3e-324", "2e-324",
+        "7.2057594037927933e16", "1448997445238699", "8.589973e9"}) {
+    ASSERT_TRUE(CheckDouble(text)) << text;
+  }
+}
+
+TEST(ParseDecimalDouble, Prefix) {
+  auto parsed_length = [](const std::string& text) {
+    double value;
+    const char* begin = text.data();
+    return ParseDecimalDouble(begin, begin + text.size(), &value) - begin;
+  };
+
+  ASSERT_EQ(0, parsed_length(""));
+  ASSERT_EQ(0, parsed_length("."));
+  ASSERT_EQ(0, parsed_length("-"));
+  ASSERT_EQ(0, parsed_length("+."));
+  ASSERT_EQ(0, parsed_length("e5"));
+  ASSERT_EQ(0, parsed_length(" 1"));
+  ASSERT_EQ(0, parsed_length("inf"));
+  ASSERT_EQ(0, parsed_length("nan"));
+  ASSERT_EQ(1, parsed_length("1e"));
+  ASSERT_EQ(1, parsed_length("1e+"));
+  ASSERT_EQ(1, parsed_length("1x"));
+  ASSERT_EQ(1, parsed_length("0x10"));
+  ASSERT_EQ(2, parsed_length("1.e"));
+  ASSERT_EQ(4, parsed_length("1e-5 "));
+  ASSERT_EQ(3, parsed_length("1.5.5"));
+}
+
+TEST(ParseDecimalDouble, DoesNotReadPastEnd) {
+  std::string text = "1234567890123456789";
+  double value;
+  const char* begin = text.data();
+  ASSERT_EQ(begin + 9, ParseDecimalDouble(begin, begin + 9, &value));
+  ASSERT_EQ(123456789.0, value);
+}
+
+TEST(ParseDecimalDouble, RandomDoubles) {
+  std::mt19937_64 rnd(1);
+  for (size_t i = 0; i < 200000; ++i) {
+    uint64_t bits = rnd();
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    if (!std::isfinite(value)) {
+      continue;
+    }
+
+    for (const char* format : {"%.17g", "%.16g", "%.15g", "%.6g", "%.3e"}) {
+      ASSERT_TRUE(CheckDouble(Format(format, value)))
+          << Format(format, value);
+    }
+  }
+}
+
+TEST(ParseDecimalDouble, RandomDecimals) {
+  std::mt19937_64 rnd(2);
+  std::uniform_int_distribution<int> exponent_dist(-360, 330);
+  size_t fallbacks = 0;
+  size_t count = 0;
+  for (size_t max_digits : {5, 10, 19, 25, 40}) {
+    for (size_t i = 0; i < 200000; ++i) {
+      ++count;
+      if (!CheckDouble(RandomDecimal(max_digits, exponent_dist(rnd), &rnd))) {
+        ++fallbacks;
+      }
+    }
+  }
+
+  // Only numbers with more than 19 digits can fall back, and only rarely.
+  ASSERT_GT(count / 1000, fallbacks);
+}
+
+TEST(ParseDecimalDouble, Integers) {
+  std::mt19937_64 rnd(3);
+  for (size_t i = 0; i < 1000000; ++i) {
+    // 20 digit values can defer to strtod.
+    uint64_t value = rnd() >> (rnd() % 64);
+    ASSERT_TRUE(CheckDouble(std::to_string(value)) ||
+                value >= 10000000000000000000ull);
+  }
+}
+
+// Halfway between two adjacent doubles; these need all of their digits.
+TEST(ParseDecimalDouble, Halfway) {
+  std::mt19937_64 rnd(4);
+  for (size_t i = 0; i < 100000; ++i) {
+    // Odd integers in [2^53, 2^54) are halfway between two doubles.
+    uint64_t value = (uint64_t(1) << 53) | rnd() | 1;
+    value &= (uint64_t(1) << 54) - 1;
+    ASSERT_TRUE(CheckDouble(std::to_string(value)));
+    ASSERT_TRUE(CheckDouble(std::to_string(value) + "0e-1"));
+  }
+}
+
+TEST(ParseDecimalDouble, LongInput) {
+  std::string digits(1000, '3');
+  ASSERT_TRUE(CheckDouble(digits));
+  ASSERT_TRUE(CheckDouble("0." + digits));
+  ASSERT_TRUE(CheckDouble("0." + std::string(1000, '0') + "1e1000"));
+  ASSERT_TRUE(CheckDouble("1" + std::string(1000, '0') + "e-1000"));
+}
+
+TEST(ParseDecimalFloat, Simple) {
+  for (const char* text :
+       {"0", "-0", "1", "-1", "0.1", "3.4028234e38", "1.1754944e-38",
+        "16777216", "16777217", "16777219", "3.14159", "1e10", "1e-10",
+        "1e11", "123456789012345678901234567890"}) {
+    ASSERT_TRUE(CheckFloat(text)) << text;
+  }
+
+  // strtof is needed to tell if these are range errors.
+  for (const char* text : {"1e39", "3.5e38", "1e-40", "1e-50"}) {
+    float value;
+    ASSERT_EQ(text, ParseDecimalFloat(text, text + strlen(text), &value));
+  }
+  float value;
+  const char* zero = "0e-50";
+  ASSERT_EQ(zero + 5, ParseDecimalFloat(zero, zero + 5, &value));
+}
+
+// Every 4099th float, printed with enough digits to round trip and with
+// fewer.
+TEST(ParseDecimalFloat, SweepFloats) {
+  for (uint64_t bits = 0; bits < (uint64_t(1) << 32); bits += 4099) {
+    float value;
+    uint32_t bits32 = static_cast<uint32_t>(bits);
+    memcpy(&value, &bits32, sizeof(value));
+    if (!std::isnormal(value)) {
+      continue;
+    }
+
+    ASSERT_TRUE(CheckFloat(Format("%.9g", value))) << Format("%.9g", value);
+    CheckFloat(Format("%.7g", value));
+  }
+}
+
+TEST(ParseDecimalFloat, RandomDecimals) {
+  std::mt19937_64 rnd(5);
+  std::uniform_int_distribution<int> exponent_dist(-50, 45);
+  for (size_t max_digits : {5, 10, 19, 30}) {
+    for (size_t i = 0; i < 200000; ++i) {
+      CheckFloat(RandomDecimal(max_digits, exponent_dist(rnd), &rnd));
+    }
+  }
+}
+
+}  // namespace
+}  // namespace nc
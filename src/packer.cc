@@ -4,6 +4,11 @@
 
 #include <string>
 #include "logging.h"
+#include "thread_runner.h"
+
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
 
 namespace nc {
 
@@ -22,6 +27,11 @@ void PackedUintSeq::Append(uint64_t value, size_t* bytes) {
                                       " new is " + std::to_string(value);
   const uint64_t diff = value - last_append_;
 
+  if (indexed_ && len_ % kIndexStride == 0) {
+    index_.push_back({data_.size(), last_append_});
+    *bytes += sizeof(IndexEntry);
+  }
+
   if (diff < kOneByteLimit) {
     data_.push_back(diff);
 
@@ -162,6 +172,12 @@ size_t PackedUintSeq::DeflateSingleInteger(const size_t offset,
 }
 
 void PackedUintSeq::Restore(std::vector<uint64_t>* vector) const {
+  size_t initial_size = vector->size();
+  vector->resize(initial_size + len_);
+  RestoreInto(vector->data() + initial_size);
+}
+
+void PackedUintSeq::RestoreInto(uint64_t* out) const {
   uint64_t prev_value = 0;
   size_t offset = 0;
   uint64_t diff = 0;
@@ -170,10 +186,69 @@ void PackedUintSeq::Restore(std::vector<uint64_t>* vector) const {
     offset += DeflateSingleInteger(offset, &diff);
     prev_value += diff;
 
-    vector->push_back(prev_value);
+    out[i] = prev_value;
+  }
+}
+
+void PackedUintSeq::RestoreInto(uint64_t* out, size_t threads) const {
+  CHECK(indexed_) << "Parallel decoding requires an index";
+  CHECK(threads > 0) << "Zero threads";
+
+  // Each thread gets a contiguous run of blocks.
+  size_t num_blocks = index_.size();
+  size_t blocks_per_thread = (num_blocks + threads - 1) / threads;
+  std::vector<std::pair<size_t, size_t>> ranges;
+  for (size_t block = 0; block < num_blocks; block += blocks_per_thread) {
+    size_t from = block * kIndexStride;
+    size_t to = std::min(len_, (block + blocks_per_thread) * kIndexStride);
+    ranges.emplace_back(from, to);
+  }
+
+  RunInParallel<std::pair<size_t, size_t>>(
+      ranges,
+      [this, out](const std::pair<size_t, size_t>& range) {
+        RestoreRange(range.first, range.second, out + range.first);
+      },
+      threads);
+}
+
+void PackedUintSeq::RestoreRange(size_t from, size_t to, uint64_t* out) const {
+  CHECK(from <= to && to <= len_) << "Bad range [" << from << ", " << to
+                                  << ") in sequence of length " << len_;
+  if (from == to) {
+    return;
+  }
+
+  size_t i = 0;
+  size_t offset = 0;
+  uint64_t prev_value = 0;
+  if (indexed_) {
+    const IndexEntry& entry = index_[from / kIndexStride];
+    i = (from / kIndexStride) * kIndexStride;
+    offset = entry.offset;
+    prev_value = entry.prev_value;
+  }
+
+  uint64_t diff = 0;
+  for (; i < from; ++i) {
+    offset += DeflateSingleInteger(offset, &diff);
+    prev_value += diff;
+  }
+
+  for (; i < to; ++i) {
+    offset += DeflateSingleInteger(offset, &diff);
+    prev_value += diff;
+    *out++ = prev_value;
   }
 }
 
+uint64_t PackedUintSeq::at(size_t index) const {
+  CHECK(index < len_);
+  uint64_t value;
+  RestoreRange(index, index + 1, &value);
+  return value;
+}
+
 bool PackedUintSeqIterator::Next(uint64_t* value) {
   if (element_count_ >= parent_.len_) {
     return false;
@@ -189,4 +264,161 @@ bool PackedUintSeqIterator::Next(uint64_t* value) {
   return true;
 }
 
+namespace {
+
+// Widths of deltas, indexed by their 2-bit codes.
+constexpr uint8_t kStreamVByteWidths[] = {1, 2, 4, 8};
+
+#ifdef __SSSE3__
+// Precomputed information about each of the 256 possible control bytes.
+struct StreamVByteTable {
+  StreamVByteTable() {
+    for (size_t control = 0; control < 256; ++control) {
+      uint8_t offset = 0;
+      for (size_t i = 0; i < 4; ++i) {
+        if (i == 2) {
+          first_pair_len[control] = offset;
+        }
+
+        // Each pair of deltas is shuffled into the two 64-bit lanes of a
+        // register. Bytes are addressed relative to the start of the pair.
+        uint8_t pair_offset = i < 2 ? 0 : first_pair_len[control];
+        uint8_t width = kStreamVByteWidths[(control >> (2 * i)) & 0x3];
+        uint8_t* mask = shuffle[control][i / 2] + 8 * (i % 2);
+        for (uint8_t b = 0; b < 8; ++b) {
+          mask[b] = b < width ? offset - pair_offset + b : 0x80;
+        }
+
+        offset += width;
+      }
+
+      group_len[control] = offset;
+    }
+  }
+
+  // Number of data bytes used by all 4 deltas.
+  uint8_t group_len[256];
+
+  // Number of data bytes used by the first 2 deltas.
+  uint8_t first_pair_len[256];
+
+  // Shuffle masks that expand each pair of deltas to 2 64-bit integers.
+  uint8_t shuffle[256][2][16];
+};
+
+const StreamVByteTable& GetStreamVByteTable() {
+  static StreamVByteTable* table = new StreamVByteTable();
+  return *table;
+}
+#endif
+
+}  // namespace
+
+std::string StreamVByteUintSeq::MemString() const {
+  std::string return_string;
+
+  return_string += "num_elements: " + std::to_string(len_) + ", size: " +
+                   std::to_string(SizeBytes()) + "bytes, control_len: " +
+                   std::to_string(control_.size()) + ", data_len: " +
+                   std::to_string(data_.size());
+  return return_string;
+}
+
+void StreamVByteUintSeq::Append(uint64_t value, size_t* bytes) {
+  CHECK(value >= last_append_) << "Sequence non-incrementing last is " +
+                                      std::to_string(last_append_) +
+                                      " new is " + std::to_string(value);
+  const uint64_t diff = value - last_append_;
+
+  uint8_t code;
+  if (diff <= std::numeric_limits<uint8_t>::max()) {
+    code = kOneByteCode;
+  } else if (diff <= std::numeric_limits<uint16_t>::max()) {
+    code = kTwoBytesCode;
+  } else if (diff <= std::numeric_limits<uint32_t>::max()) {
+    code = kFourBytesCode;
+  } else {
+    code = kEightBytesCode;
+  }
+
+  size_t shift = 2 * (len_ % 4);
+  if (shift == 0) {
+    control_.push_back(0);
+    *bytes += sizeof(uint8_t);
+  }
+  control_.back() |= code << shift;
+
+  uint8_t width = kStreamVByteWidths[code];
+  for (uint8_t i = 0; i < width; ++i) {
+    data_.push_back(diff >> (8 * i));
+  }
+  *bytes += width * sizeof(uint8_t);
+
+  len_++;
+  last_append_ = value;
+}
+
+void StreamVByteUintSeq::Restore(std::vector<uint64_t>* vector) const {
+  size_t initial_size = vector->size();
+  vector->resize(initial_size + len_);
+  RestoreInto(vector->data() + initial_size);
+}
+
+void StreamVByteUintSeq::RestoreInto(uint64_t* out) const {
+  const uint8_t* control = control_.data();
+  const uint8_t* data = data_.data();
+  uint64_t prev_value = 0;
+  size_t i = 0;
+
+#ifdef __SSSE3__
+  const uint8_t* data_end = data + data_.size();
+
+  // Decodes full groups of 4 as long as both 16-byte loads stay within the
+  // data array. The rest of the sequence is handled by the scalar loop below.
+  const StreamVByteTable& table = GetStreamVByteTable();
+  __m128i prev = _mm_setzero_si128();
+  while (i + 4 <= len_ && data + 32 <= data_end) {
+    uint8_t c = control[i / 4];
+    const __m128i* masks =
+        reinterpret_cast<const __m128i*>(table.shuffle[c]);
+
+    __m128i first = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+    first = _mm_shuffle_epi8(first, _mm_loadu_si128(masks));
+    __m128i second = _mm_loadu_si128(
+        reinterpret_cast<const __m128i*>(data + table.first_pair_len[c]));
+    second = _mm_shuffle_epi8(second, _mm_loadu_si128(masks + 1));
+
+    // Prefix sums within each pair, then carry the last value over.
+    first = _mm_add_epi64(first, _mm_slli_si128(first, 8));
+    first = _mm_add_epi64(first, prev);
+    prev = _mm_unpackhi_epi64(first, first);
+    second = _mm_add_epi64(second, _mm_slli_si128(second, 8));
+    second = _mm_add_epi64(second, prev);
+    prev = _mm_unpackhi_epi64(second, second);
+
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), first);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i + 2), second);
+    data += table.group_len[c];
+    i += 4;
+  }
+
+  if (i > 0) {
+    prev_value = out[i - 1];
+  }
+#endif
+
+  for (; i < len_; ++i) {
+    uint8_t code = (control[i / 4] >> (2 * (i % 4))) & 0x3;
+    uint8_t width = kStreamVByteWidths[code];
+    uint64_t diff = 0;
+    for (uint8_t b = 0; b < width; ++b) {
+      diff |= static_cast<uint64_t>(data[b]) << (8 * b);
+    }
+
+    data += width;
+    prev_value += diff;
+    out[i] = prev_value;
+  }
+}
+
 }  // namespace nc
@@ -15,10 +15,24 @@ namespace nc {
 // A packed sequence of unsigned integers.
 class PackedUintSeq {
  public:
-  PackedUintSeq() : len_(0), last_append_(0) {}
+  // Number of values between consecutive entries of the optional index.
+  static constexpr size_t kIndexStride = 128;
+
+  // If 'indexed' is true a sparse index is maintained alongside the sequence,
+  // with an entry every kIndexStride values. The index allows random access
+  // via at() and RestoreRange() without decoding from the start of the
+  // sequence and allows the sequence to be decoded in parallel.
+  explicit PackedUintSeq(bool indexed = false)
+      : indexed_(indexed), len_(0), last_append_(0) {}
+
+  // The amount of memory (in bytes) occupied by the sequence, including the
+  // index, if there is one.
+  size_t SizeBytes() const {
+    return data_.size() * sizeof(char) + IndexSizeBytes();
+  }
 
-  // The amount of memory (in bytes) occupied by the sequence.
-  size_t SizeBytes() const { return data_.size() * sizeof(char); }
+  // The amount of memory (in bytes) occupied by the index alone.
+  size_t IndexSizeBytes() const { return index_.size() * sizeof(IndexEntry); }
 
   // Returns a string representing the memory footprint of this sequence.
   std::string MemString() const;
@@ -37,7 +51,8 @@ class PackedUintSeq {
     Append(value, &dummy);
   }
 
-  // Copies out the sequence in a standard vector.
+  // Copies out the sequence in a standard vector. Values are appended to
+  // whatever is already in the vector.
   void Restore(std::vector<uint64_t>* vector) const;
 
   std::vector<uint64_t> Restore() const {
@@ -46,7 +61,41 @@ class PackedUintSeq {
     return out;
   }
 
+  // Decodes the entire sequence into an array that must have room for at least
+  // size() values.
+  void RestoreInto(uint64_t* out) const;
+
+  // Same as above, but splits the sequence in blocks that are decoded by up to
+  // 'threads' threads in parallel. The sequence must be indexed.
+  void RestoreInto(uint64_t* out, size_t threads) const;
+
+  // Decodes the values at indices [from, to) into an array that must have room
+  // for at least to - from values. If the sequence is indexed decoding starts
+  // at the closest index entry before 'from', otherwise it starts at the
+  // beginning of the sequence.
+  void RestoreRange(size_t from, size_t to, uint64_t* out) const;
+
+  // Returns the value at a given index. If the sequence is indexed this will
+  // decode at most kIndexStride values.
+  uint64_t at(size_t index) const;
+
+  // Number of integers in the sequence.
+  size_t size() const { return len_; }
+
+  // True if the sequence maintains an index.
+  bool indexed() const { return indexed_; }
+
  private:
+  // An entry in the index.
+  struct IndexEntry {
+    // Offset into data_ of the value at index i * kIndexStride.
+    size_t offset;
+
+    // The value at index i * kIndexStride - 1 (or 0 for the first entry),
+    // which is what the delta at 'offset' is relative to.
+    uint64_t prev_value;
+  };
+
   // The limits on how many bytes can be used to encode an integer.
   static constexpr uint64_t kOneByteLimit = 32;              // 2 ** (8 - 3)
   static constexpr uint64_t kTwoByteLimit = 8192;            // 2 ** (16 - 3)
@@ -74,9 +123,15 @@ class PackedUintSeq {
   // the next integer.
   size_t DeflateSingleInteger(size_t offset, uint64_t* value) const;
 
+  // Whether or not index_ is populated.
+  const bool indexed_;
+
   // The sequence.
   std::vector<uint8_t> data_;
 
+  // Entry i of the index points to the value at index i * kIndexStride.
+  std::vector<IndexEntry> index_;
+
   // Length in terms of number of integers stored.
   size_t len_;
 
@@ -114,6 +169,74 @@ class PackedUintSeqIterator {
   DISALLOW_COPY_AND_ASSIGN(PackedUintSeqIterator);
 };
 
+// Same as PackedUintSeq, but stores the sequence in a layout that is faster to
+// decode in bulk, at the cost of slightly more memory for small deltas. Each
+// delta occupies 1, 2, 4 or 8 bytes and its length is recorded as a 2-bit code
+// in a separate stream of control bytes (one control byte per 4 integers), as
+// in stream-vbyte. Since the data bytes carry no length information a group of
+// 4 integers can be decoded with a single table lookup and, when SSSE3 is
+// available, two byte shuffles instead of a branch per integer.
+class StreamVByteUintSeq {
+ public:
+  StreamVByteUintSeq() : len_(0), last_append_(0) {}
+
+  // The amount of memory (in bytes) occupied by the sequence.
+  size_t SizeBytes() const { return control_.size() + data_.size(); }
+
+  // Returns a string representing the memory footprint of this sequence.
+  std::string MemString() const;
+
+  // Appends a value at the end of the sequence. Unlike PackedUintSeq any
+  // difference between consecutive values can be stored, but the sequence still
+  // has to be non-decreasing. The second argument is incremented with the
+  // number of additional bytes of memory required to store the value.
+  void Append(uint64_t value, size_t* bytes);
+
+  void Append(uint64_t value) {
+    size_t dummy = 0;
+    Append(value, &dummy);
+  }
+
+  // Copies out the sequence in a standard vector. Values are appended to
+  // whatever is already in the vector.
+  void Restore(std::vector<uint64_t>* vector) const;
+
+  std::vector<uint64_t> Restore() const {
+    std::vector<uint64_t> out;
+    Restore(&out);
+    return out;
+  }
+
+  // Decodes the entire sequence into an array that must have room for at least
+  // size() values.
+  void RestoreInto(uint64_t* out) const;
+
+  // Number of integers in the sequence.
+  size_t size() const { return len_; }
+
+ private:
+  // Codes stored in the control bytes for each delta width.
+  static constexpr uint8_t kOneByteCode = 0;
+  static constexpr uint8_t kTwoBytesCode = 1;
+  static constexpr uint8_t kFourBytesCode = 2;
+  static constexpr uint8_t kEightBytesCode = 3;
+
+  // 2-bit codes for the widths of the deltas, 4 per byte. The delta at index i
+  // uses bits 2 * (i % 4) and 2 * (i % 4) + 1 of control byte i / 4.
+  std::vector<uint8_t> control_;
+
+  // Little-endian deltas, without any length information.
+  std::vector<uint8_t> data_;
+
+  // Length in terms of number of integers stored.
+  size_t len_;
+
+  // The last appended integer.
+  uint64_t last_append_;
+
+  DISALLOW_COPY_AND_ASSIGN(StreamVByteUintSeq);
+};
+
 template <typename T>
 class RLEFieldIterator;
 
@@ -121,28 +244,32 @@ class RLEFieldIterator;
 // (X1, X1 + t1, X1 + 2t1, X1 + 3t1 ...), (X2, X2 + t2, X2 + 2t2, X2 + 3t2 ...),
 // ... When a new element is inserted it is first checked if it is part of the
 // current sub-sequence (stride) and if it is not a new stride is created.
+//
+// Random access is supported via a two-level directory over the starting
+// indices of strides. The first level has one entry every kStridesPerBlock
+// strides and is searched by interpolation. The second level is a dense array
+// with the starting index of each stride, and a block of it fits in a cache
+// line.
 template <typename T>
 class RLEField {
  private:
   // A stride is a sequence X, X + t, X + 2t, X + 3t ...
   class Stride {
    public:
-    Stride(T value, size_t starting_index)
-        : value_(value),
-          increment_(0),
-          len_(0),
-          starting_index_(starting_index) {}
+    explicit Stride(T value) : value_(value), increment_(0), len_(0) {}
 
    private:
-    const T value_;          // The base of the stride (X).
-    T increment_;            // The increment (t).
-    size_t len_;             // How many elements there are in the sequence.
-    size_t starting_index_;  // The index of the first item in the sequence.
+    const T value_;  // The base of the stride (X).
+    T increment_;    // The increment (t).
+    size_t len_;     // How many elements there are in the sequence.
 
     friend class RLEField<T>;
     friend class RLEFieldIterator<T>;
   };
 
+  // Number of strides per first-level directory entry.
+  static constexpr size_t kStridesPerBlock = 8;
+
  public:
   using value_type = T;
 
@@ -160,8 +287,7 @@ class RLEField {
   void Append(T value, size_t* bytes) {
     ++total_num_elements_;
     if (strides_.empty()) {
-      strides_.emplace_back(value, 0);
-      *bytes += sizeof(Stride);
+      AddStride(value, 0, bytes);
       return;
     }
 
@@ -179,11 +305,10 @@ class RLEField {
       return;
     }
 
-    strides_.emplace_back(value,
-                          last_stride.starting_index_ + last_stride.len_ + 1);
+    size_t starting_index = stride_starts_.back() + last_stride.len_ + 1;
+    AddStride(value, starting_index, bytes);
     min_value_ = std::min(min_value_, value);
     max_value_ = std::min(max_value_, value);
-    *bytes += sizeof(Stride);
   }
 
   void Append(T value) {
@@ -192,7 +317,10 @@ class RLEField {
   }
 
   // The amount of memory (in terms of bytes) used to store the sequence.
-  size_t SizeBytes() const { return strides_.size() * sizeof(Stride); }
+  size_t SizeBytes() const {
+    return strides_.size() * (sizeof(Stride) + sizeof(size_t)) +
+           directory_.size() * sizeof(size_t);
+  }
 
   // Returns a string representing the memory footprint of this sequence.
   std::string MemString() const {
@@ -239,21 +367,40 @@ class RLEField {
 
   T at(size_t index) const {
     CHECK(index < total_num_elements_);
-    auto it = std::upper_bound(strides_.begin(), strides_.end(), index,
-                               [](const size_t& lhs, const Stride& rhs) {
-                                 return lhs < rhs.starting_index_;
-                               });
-    CHECK(it != strides_.begin());
-    it = std::next(it, -1);
-
-    const Stride& stride = *it;
-    size_t delta = index - stride.starting_index_;
+    size_t stride_index = StrideIndexOf(index);
+    const Stride& stride = strides_[stride_index];
+    size_t delta = index - stride_starts_[stride_index];
     return stride.value_ + delta * stride.increment_;
   }
 
+  // Copies the values at indices [from, to) to an array that must have room
+  // for at least to - from values. Unlike calling at() for each index this
+  // only looks up the first stride and then walks strides sequentially.
+  void RestoreRange(size_t from, size_t to, T* out) const {
+    CHECK(from <= to && to <= total_num_elements_)
+        << "Bad range [" << from << ", " << to << ") in sequence of length "
+        << total_num_elements_;
+    if (from == to) {
+      return;
+    }
+
+    size_t i = from;
+    for (size_t stride_index = StrideIndexOf(from); i < to; ++stride_index) {
+      const Stride& stride = strides_[stride_index];
+      size_t stride_start = stride_starts_[stride_index];
+      size_t stride_end = std::min(to, stride_start + stride.len_ + 1);
+      for (size_t delta = i - stride_start; i < stride_end; ++i, ++delta) {
+        *out++ = stride.value_ + delta * stride.increment_;
+      }
+    }
+  }
+
   // Number of bytes occupied by the sequence.
   size_t ByteEstimate() const {
-    return sizeof(Stride) * strides_.capacity() + sizeof(this);
+    size_t directory_capacity =
+        stride_starts_.capacity() + directory_.capacity();
+    return sizeof(Stride) * strides_.capacity() +
+           sizeof(size_t) * directory_capacity + sizeof(this);
   }
 
   // Measures how well the sequence compresses; the higher the better.
@@ -272,10 +419,89 @@ class RLEField {
     return DiscreteDistribution<uint32_t>(all_lengths);
   }
 
+  // Same as SequenceLengths, but cheaper to build for many sequences. Lengths
+  // of 2^significant_bits and more are only approximate, see
+  // FlatDiscreteDistribution.
+  FlatDiscreteDistribution<uint32_t> FlatSequenceLengths(
+      uint8_t significant_bits =
+          FlatDiscreteDistribution<uint32_t>::kDefaultSignificantBits) const {
+    FlatDiscreteDistribution<uint32_t> out(significant_bits);
+    for (const Stride& stride : strides_) {
+      out.Add(stride.len_);
+    }
+
+    return out;
+  }
+
  private:
+  // Adds a new stride that starts at a given index.
+  void AddStride(T value, size_t starting_index, size_t* bytes) {
+    if (strides_.size() % kStridesPerBlock == 0) {
+      directory_.emplace_back(starting_index);
+      *bytes += sizeof(size_t);
+    }
+
+    strides_.emplace_back(value);
+    stride_starts_.emplace_back(starting_index);
+    *bytes += sizeof(Stride) + sizeof(size_t);
+  }
+
+  // Returns the index of the stride that contains the element at 'index'.
+  size_t StrideIndexOf(size_t index) const {
+    // Looks for the last directory entry that is <= index. Interpolation steps
+    // are interleaved with bisection steps, so the search takes at most twice
+    // as many steps as binary search would, even if the strides are very
+    // unevenly sized. Invariant: directory_[lo] <= index < directory_[hi].
+    size_t lo = 0;
+    size_t hi = directory_.size() - 1;
+    if (directory_[hi] <= index) {
+      lo = hi;
+    }
+
+    bool bisect = false;
+    while (lo < hi) {
+      size_t mid;
+      if (bisect) {
+        mid = lo + (hi - lo) / 2;
+      } else {
+        double fraction = static_cast<double>(index - directory_[lo]) /
+                          (directory_[hi] - directory_[lo]);
+        mid = lo + static_cast<size_t>(fraction * (hi - lo));
+        mid = std::min(mid, hi - 1);
+      }
+      bisect = !bisect;
+
+      if (directory_[mid] > index) {
+        hi = mid;
+      } else if (directory_[mid + 1] <= index) {
+        lo = mid + 1;
+      } else {
+        lo = mid;
+        break;
+      }
+    }
+
+    // A linear scan over the starting indices of the strides in the block.
+    size_t stride_index = lo * kStridesPerBlock;
+    size_t block_end =
+        std::min(stride_index + kStridesPerBlock, stride_starts_.size());
+    while (stride_index + 1 < block_end &&
+           stride_starts_[stride_index + 1] <= index) {
+      ++stride_index;
+    }
+
+    return stride_index;
+  }
+
   // The entire sequence is stored as a sequence of strides.
   std::vector<Stride> strides_;
 
+  // The index of the first element of each stride.
+  std::vector<size_t> stride_starts_;
+
+  // The index of the first element of every kStridesPerBlock-th stride.
+  std::vector<size_t> directory_;
+
   // Total number of elements.
   size_t total_num_elements_;
 
@@ -298,6 +524,21 @@ class RLEFieldIterator {
         stride_index_(0),
         index_in_stride_(0) {}
 
+  // An iterator whose first call to Next will return the element at 'index'.
+  RLEFieldIterator(const RLEField<T>& parent, size_t index)
+      : RLEFieldIterator(parent) {
+    CHECK(index <= parent.size());
+    if (index == parent.size()) {
+      stride_index_ = parent_.strides_.size();
+      return;
+    }
+
+    size_t stride_index = parent_.StrideIndexOf(index);
+    curr_stride_ = &parent_.strides_[stride_index];
+    stride_index_ = stride_index + 1;
+    index_in_stride_ = index - parent_.stride_starts_[stride_index];
+  }
+
   bool Next(T* value) {
     if (curr_stride_ == nullptr || index_in_stride_ > curr_stride_->len_) {
       if (stride_index_ == parent_.strides_.size()) {
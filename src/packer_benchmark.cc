@@ -0,0 +1,80 @@
+#include <chrono>
+#include <random>
+#include <vector>
+
+#include "common.h"
+#include "logging.h"
+#include "packer.h"
+
+static constexpr size_t kCount = 50000000;
+static constexpr size_t kPasses = 10;
+
+using namespace std::chrono;
+
+template <typename Sequence, typename Callback>
+static void Bench(const std::string& name, const Sequence& seq,
+                  Callback callback) {
+  auto start = high_resolution_clock::now();
+  for (size_t i = 0; i < kPasses; ++i) {
+    callback(seq);
+  }
+  auto end = high_resolution_clock::now();
+
+  size_t duration_ms = duration_cast<milliseconds>(end - start).count();
+  double ns_per_value = duration_cast<nanoseconds>(end - start).count() /
+                        static_cast<double>(kPasses * seq.size());
+  LOG(INFO) << name << ": " << duration_ms / kPasses << "ms per pass, "
+            << ns_per_value << "ns per value";
+}
+
+// Benchmarks decoding of a sequence whose deltas are uniformly distributed in
+// [0, max_delta].
+static void BenchDeltas(uint64_t max_delta) {
+  std::mt19937_64 gen(1);
+  std::uniform_int_distribution<uint64_t> dist(0, max_delta);
+
+  nc::PackedUintSeq packed;
+  nc::PackedUintSeq packed_indexed(true);
+  nc::StreamVByteUintSeq stream_vbyte;
+  uint64_t value = 0;
+  for (size_t i = 0; i < kCount; ++i) {
+    value += dist(gen);
+    packed.Append(value);
+    packed_indexed.Append(value);
+    stream_vbyte.Append(value);
+  }
+
+  LOG(INFO) << "Max delta " << max_delta << ", packed "
+            << packed.SizeBytes() << " bytes, stream-vbyte "
+            << stream_vbyte.SizeBytes() << " bytes";
+
+  std::vector<uint64_t> out(kCount);
+  Bench("PackedUintSeqIterator::Next", packed,
+        [&out](const nc::PackedUintSeq& seq) {
+          nc::PackedUintSeqIterator it(seq);
+          uint64_t* out_ptr = out.data();
+          while (it.Next(out_ptr)) {
+            ++out_ptr;
+          }
+        });
+  Bench("PackedUintSeq::RestoreInto", packed,
+        [&out](const nc::PackedUintSeq& seq) { seq.RestoreInto(out.data()); });
+  Bench("PackedUintSeq::RestoreInto, 4 threads", packed_indexed,
+        [&out](const nc::PackedUintSeq& seq) {
+          seq.RestoreInto(out.data(), 4);
+        });
+  Bench("StreamVByteUintSeq::RestoreInto", stream_vbyte,
+        [&out](const nc::StreamVByteUintSeq& seq) {
+          seq.RestoreInto(out.data());
+        });
+}
+
+int main(int argc, char** argv) {
+  nc::Unused(argc);
+  nc::Unused(argv);
+
+  BenchDeltas(20);
+  BenchDeltas(1000);
+  BenchDeltas(1000000);
+  BenchDeltas(1000000000);
+}
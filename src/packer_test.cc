@@ -12,6 +12,12 @@ class PackerFixture : public ::testing::Test {
   std::vector<uint64_t> vec_;
 };
 
+class StreamVByteFixture : public ::testing::Test {
+ protected:
+  StreamVByteUintSeq seq_;
+  std::vector<uint64_t> vec_;
+};
+
 class RLEFixture : public ::testing::Test {
  protected:
   RLEField<uint64_t> seq_;
@@ -109,6 +115,222 @@ TEST_F(PackerFixture, Append1MIter) {
   ASSERT_EQ(model, vec_);
 }
 
+TEST_F(PackerFixture, RestoreInto) {
+  std::default_random_engine e(3);
+  std::vector<uint64_t> model;
+
+  uint64_t prev = 0;
+  for (uint64_t i = 0; i < 100000L; ++i) {
+    uint64_t val = prev + e() % 10000;
+    prev = val;
+
+    seq_.Append(val);
+    model.push_back(val);
+  }
+
+  ASSERT_EQ(model.size(), seq_.size());
+  vec_.resize(seq_.size());
+  seq_.RestoreInto(vec_.data());
+  ASSERT_EQ(model, vec_);
+}
+
+TEST_F(PackerFixture, RestoreAppends) {
+  seq_.Append(10);
+  seq_.Append(20);
+
+  vec_ = {1, 2};
+  seq_.Restore(&vec_);
+  std::vector<uint64_t> model = {1, 2, 10, 20};
+  ASSERT_EQ(model, vec_);
+}
+
+class IndexedPackerFixture : public ::testing::Test {
+ protected:
+  IndexedPackerFixture() : seq_(true) {
+    std::default_random_engine e(4);
+
+    uint64_t prev = 0;
+    for (uint64_t i = 0; i < 100000L; ++i) {
+      uint64_t val = prev + e() % 100000;
+      prev = val;
+
+      seq_.Append(val);
+      model_.push_back(val);
+    }
+  }
+
+  PackedUintSeq seq_;
+  std::vector<uint64_t> model_;
+};
+
+TEST(IndexedPacker, IndexSize) {
+  PackedUintSeq seq(true);
+  ASSERT_EQ(0ul, seq.SizeBytes());
+
+  // The index gets a new entry every kIndexStride values.
+  size_t stride = PackedUintSeq::kIndexStride;
+  size_t bytes = 0;
+  seq.Append(1, &bytes);
+  ASSERT_LT(0ul, seq.IndexSizeBytes());
+  ASSERT_EQ(bytes, seq.SizeBytes());
+  size_t one_entry = seq.IndexSizeBytes();
+
+  for (size_t i = 1; i < stride; ++i) {
+    seq.Append(1, &bytes);
+  }
+  ASSERT_EQ(one_entry, seq.IndexSizeBytes());
+
+  seq.Append(1, &bytes);
+  ASSERT_EQ(2 * one_entry, seq.IndexSizeBytes());
+  ASSERT_EQ(bytes, seq.SizeBytes());
+  ASSERT_EQ(stride + 1 + 2 * one_entry, seq.SizeBytes());
+}
+
+TEST_F(IndexedPackerFixture, At) {
+  std::default_random_engine e(5);
+  std::uniform_int_distribution<size_t> index(0, model_.size() - 1);
+  for (size_t i = 0; i < 100000; ++i) {
+    size_t j = index(e);
+    ASSERT_EQ(model_[j], seq_.at(j));
+  }
+
+  ASSERT_EQ(model_.front(), seq_.at(0));
+  ASSERT_EQ(model_.back(), seq_.at(model_.size() - 1));
+}
+
+TEST_F(IndexedPackerFixture, RestoreRange) {
+  std::vector<std::pair<size_t, size_t>> ranges = {
+      {0, 0}, {0, 1}, {0, 128}, {127, 129}, {128, 256}, {1000, 5000},
+      {5, model_.size()}, {model_.size(), model_.size()}};
+  for (const auto& range : ranges) {
+    std::vector<uint64_t> out(range.second - range.first);
+    seq_.RestoreRange(range.first, range.second, out.data());
+
+    std::vector<uint64_t> model(model_.begin() + range.first,
+                                model_.begin() + range.second);
+    ASSERT_EQ(model, out);
+  }
+
+  std::vector<uint64_t> out(1);
+  ASSERT_DEATH(seq_.RestoreRange(10, 5, out.data()), "Bad range");
+  ASSERT_DEATH(seq_.RestoreRange(0, model_.size() + 1, out.data()),
+               "Bad range");
+}
+
+TEST_F(IndexedPackerFixture, ParallelRestore) {
+  for (size_t threads : {1, 2, 3, 8, 10000}) {
+    std::vector<uint64_t> out(seq_.size());
+    seq_.RestoreInto(out.data(), threads);
+    ASSERT_EQ(model_, out);
+  }
+}
+
+TEST(IndexedPacker, Unindexed) {
+  PackedUintSeq seq;
+  for (size_t i = 0; i < 1000; ++i) {
+    seq.Append(i * 10);
+  }
+
+  ASSERT_EQ(0ul, seq.IndexSizeBytes());
+  ASSERT_EQ(5000ul, seq.at(500));
+
+  std::vector<uint64_t> out(2);
+  seq.RestoreRange(998, 1000, out.data());
+  std::vector<uint64_t> model = {9980, 9990};
+  ASSERT_EQ(model, out);
+
+  ASSERT_DEATH(seq.RestoreInto(out.data(), 2), "index");
+}
+
+TEST_F(StreamVByteFixture, Empty) {
+  ASSERT_EQ(0ul, seq_.SizeBytes());
+
+  seq_.Restore(&vec_);
+  ASSERT_EQ(0ul, vec_.size());
+}
+
+TEST(StreamVByte, AppendByteSizes) {
+  // Each group of 4 values needs one control byte.
+  StreamVByteUintSeq seq;
+  seq.Append(0xff);
+  ASSERT_EQ(2ul, seq.SizeBytes());
+  seq.Append(0xff + 0xffff);
+  ASSERT_EQ(4ul, seq.SizeBytes());
+  seq.Append(0xfful + 0xffff + 0xffffffff);
+  ASSERT_EQ(8ul, seq.SizeBytes());
+  seq.Append(std::numeric_limits<uint64_t>::max());
+  ASSERT_EQ(16ul, seq.SizeBytes());
+
+  std::vector<uint64_t> model = {0xff, 0xff + 0xffff,
+                                 0xfful + 0xffff + 0xffffffff,
+                                 std::numeric_limits<uint64_t>::max()};
+  ASSERT_EQ(model, seq.Restore());
+}
+
+TEST(StreamVByte, AppendNonIncrementing) {
+  StreamVByteUintSeq seq;
+
+  seq.Append(1000);
+  ASSERT_DEATH(seq.Append(1), "increment");
+}
+
+TEST(StreamVByte, PartialGroups) {
+  // Sequences whose length is not a multiple of the group size and that are
+  // too short for the bulk decoder.
+  for (size_t len = 1; len < 50; ++len) {
+    StreamVByteUintSeq seq;
+    std::vector<uint64_t> model;
+    for (size_t i = 0; i < len; ++i) {
+      uint64_t val = i * i * i * 1000;
+      seq.Append(val);
+      model.push_back(val);
+    }
+
+    ASSERT_EQ(len, seq.size());
+    ASSERT_EQ(model, seq.Restore());
+  }
+}
+
+TEST_F(StreamVByteFixture, Append10M) {
+  std::default_random_engine e(1);
+  std::uniform_int_distribution<size_t> shift(0, 40);
+  std::vector<uint64_t> model;
+
+  // Deltas of all widths, mixed together.
+  uint64_t prev = 0;
+  for (uint64_t i = 0; i < 10000000L; ++i) {
+    uint64_t val = prev + (e() >> shift(e));
+    prev = val;
+
+    seq_.Append(val);
+    model.push_back(val);
+  }
+
+  seq_.Restore(&vec_);
+  ASSERT_EQ(model, vec_);
+}
+
+TEST_F(StreamVByteFixture, SameAsPacked) {
+  std::default_random_engine e(2);
+  PackedUintSeq packed;
+
+  uint64_t prev = 0;
+  for (uint64_t i = 0; i < 1000000L; ++i) {
+    uint64_t val = prev + e() % 1000;
+    prev = val;
+
+    seq_.Append(val);
+    packed.Append(val);
+  }
+
+  std::vector<uint64_t> from_packed(packed.size());
+  packed.RestoreInto(from_packed.data());
+
+  vec_.resize(seq_.size());
+  seq_.RestoreInto(vec_.data());
+  ASSERT_EQ(from_packed, vec_);
+}
+
 TEST_F(RLEFixture, Empty) {
   seq_.Restore(&vec_);
 
@@ -125,6 +347,27 @@ TEST_F(RLEFixture, One) {
   ASSERT_EQ(1ul, vec_.at(0));
 }
 
+TEST_F(RLEFixture, SequenceLengths) {
+  for (size_t i = 0; i < 5000; ++i) {
+    seq_.Append(7);
+  }
+  for (size_t i = 0; i < 3; ++i) {
+    seq_.Append(100 * i);
+  }
+
+  // Long sequences are only counted exactly by SequenceLengths.
+  DiscreteDistribution<uint32_t> lengths = seq_.SequenceLengths();
+  std::map<uint32_t, uint64_t> model = {{2, 1}, {4999, 1}};
+  ASSERT_EQ(model, lengths.counts());
+  ASSERT_EQ(4999u, lengths.Percentile(1.0));
+
+  FlatDiscreteDistribution<uint32_t> flat_lengths = seq_.FlatSequenceLengths();
+  ASSERT_FALSE(flat_lengths.IsExact());
+  ASSERT_EQ(2u, flat_lengths.Min());
+  ASSERT_EQ(4999u, flat_lengths.Max());
+  ASSERT_NEAR(4999, flat_lengths.Percentile(1.0), 4999 / 1024.0);
+}
+
 TEST_F(RLEFixture, Append1M) {
   std::vector<uint64_t> model;
   for (size_t i = 0; i < 1000000; i++) {
@@ -203,5 +446,76 @@ TEST_F(RLEFixture, RandomAccess) {
   }
 }
 
+TEST_F(RLEFixture, RestoreRange) {
+  std::default_random_engine e(3);
+
+  std::vector<uint64_t> model;
+  std::uniform_int_distribution<size_t> stride_len(1, 100);
+  for (size_t i = 0; i < 1000; i++) {
+    size_t base = e() % 1000000;
+    size_t len = stride_len(e);
+    for (size_t i = 0; i < len; ++i) {
+      seq_.Append(base + i * 3);
+      model.emplace_back(base + i * 3);
+    }
+  }
+
+  for (size_t i = 0; i < 10000; ++i) {
+    std::uniform_int_distribution<size_t> rnd_index(0, model.size());
+    size_t from = rnd_index(e);
+    size_t to = rnd_index(e);
+    if (to < from) {
+      std::swap(from, to);
+    }
+
+    std::vector<uint64_t> out(to - from);
+    seq_.RestoreRange(from, to, out.data());
+    ASSERT_EQ(std::vector<uint64_t>(model.begin() + from, model.begin() + to),
+              out);
+  }
+
+  std::vector<uint64_t> out(1);
+  ASSERT_DEATH(seq_.RestoreRange(0, model.size() + 1, out.data()),
+               "Bad range");
+}
+
+TEST_F(RLEFixture, IteratorFromIndex) {
+  std::vector<uint64_t> model;
+  for (size_t i = 0; i < 1000; i++) {
+    uint64_t val = (i / 10) * (i % 10);
+    seq_.Append(val);
+    model.push_back(val);
+  }
+
+  for (size_t from = 0; from <= model.size(); from += 7) {
+    RLEFieldIterator<uint64_t> it(seq_, from);
+    std::vector<uint64_t> values;
+    uint64_t value;
+    while (it.Next(&value)) {
+      values.push_back(value);
+    }
+
+    ASSERT_EQ(std::vector<uint64_t>(model.begin() + from, model.end()),
+              values);
+  }
+}
+
+TEST(RLE, UnevenStrides) {
+  // A few very long strides mixed with many short ones.
+  RLEField<uint64_t> seq;
+  std::vector<uint64_t> model;
+  for (size_t i = 0; i < 100; i++) {
+    size_t len = i % 10 == 0 ? 100000 : 1;
+    for (size_t j = 0; j < len; ++j) {
+      seq.Append(i * 1000 + j);
+      model.emplace_back(i * 1000 + j);
+    }
+  }
+
+  for (size_t i = 0; i < model.size(); i += 13) {
+    ASSERT_EQ(model[i], seq.at(i));
+  }
+}
+
 }  // namespace
 }  // namespace nc
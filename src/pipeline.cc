@@ -0,0 +1,183 @@
+#include "pipeline.h"
+
+#include <algorithm>
+
+#include "strutil.h"
+#include "substitute.h"
+
+namespace nc {
+
+double PipelineStageStats::Utilization() const {
+  if (wall.count() == 0 || threads == 0) {
+    return 0;
+  }
+
+  return busy.count() / static_cast<double>(wall.count() * threads);
+}
+
+double PipelineStageStats::ItemsPerSecond() const {
+  if (wall.count() == 0) {
+    return 0;
+  }
+
+  uint64_t items = batches_in == 0 ? items_out : items_in;
+  return items / (wall.count() / 1000000000.0);
+}
+
+namespace pipeline_internal {
+
+StageBase::StageBase(const std::string& name, size_t threads)
+    : name_(name),
+      thread_count_(threads),
+      batches_in_(0),
+      items_in_(0),
+      batches_out_(0),
+      items_out_(0),
+      busy_ns_(0),
+      waiting_for_input_ns_(0),
+      waiting_for_output_ns_(0),
+      queue_size_sum_(0),
+      max_queue_size_(0) {}
+
+void StageBase::Start() {
+  for (size_t i = 0; i < thread_count_; ++i) {
+    threads_.emplace_back([this] { Work(); });
+  }
+}
+
+void StageBase::Join() {
+  for (std::thread& thread : threads_) {
+    thread.join();
+  }
+  threads_.clear();
+}
+
+void StageBase::AddInput(size_t items, size_t queue_size,
+                         std::chrono::nanoseconds waiting) {
+  batches_in_.fetch_add(1, std::memory_order_relaxed);
+  items_in_.fetch_add(items, std::memory_order_relaxed);
+  waiting_for_input_ns_.fetch_add(waiting.count(), std::memory_order_relaxed);
+  queue_size_sum_.fetch_add(queue_size, std::memory_order_relaxed);
+
+  uint64_t max_queue_size = max_queue_size_.load(std::memory_order_relaxed);
+  while (queue_size > max_queue_size &&
+         !max_queue_size_.compare_exchange_weak(max_queue_size, queue_size,
+                                                std::memory_order_relaxed)) {
+  }
+}
+
+void StageBase::AddBusy(std::chrono::nanoseconds busy) {
+  busy_ns_.fetch_add(busy.count(), std::memory_order_relaxed);
+}
+
+void StageBase::AddOutput(size_t items, std::chrono::nanoseconds waiting) {
+  if (items > 0) {
+    batches_out_.fetch_add(1, std::memory_order_relaxed);
+    items_out_.fetch_add(items, std::memory_order_relaxed);
+  }
+  waiting_for_output_ns_.fetch_add(waiting.count(), std::memory_order_relaxed);
+}
+
+PipelineStageStats StageBase::Stats() const {
+  PipelineStageStats stats;
+  stats.name = name_;
+  stats.threads = thread_count_;
+  stats.batches_in = batches_in_.load(std::memory_order_relaxed);
+  stats.items_in = items_in_.load(std::memory_order_relaxed);
+  stats.batches_out = batches_out_.load(std::memory_order_relaxed);
+  stats.items_out = items_out_.load(std::memory_order_relaxed);
+  stats.busy = std::chrono::nanoseconds(busy_ns_.load());
+  stats.waiting_for_input =
+      std::chrono::nanoseconds(waiting_for_input_ns_.load());
+  stats.waiting_for_output =
+      std::chrono::nanoseconds(waiting_for_output_ns_.load());
+  stats.mean_input_queue_size =
+      stats.batches_in == 0 ? 0 : queue_size_sum_.load() /
+                                      static_cast<double>(stats.batches_in);
+  stats.max_input_queue_size = max_queue_size_.load();
+  stats.wall = std::chrono::nanoseconds::zero();
+  return stats;
+}
+
+}  // namespace pipeline_internal
+
+Pipeline::~Pipeline() {
+  if (started_) {
+    Wait();
+  }
+}
+
+void Pipeline::Start() {
+  CHECK(!started_) << "Pipeline already started";
+  for (const auto& channel : channels_) {
+    CHECK(channel->consumers == 1) << "Stream not consumed";
+  }
+
+  started_ = true;
+  start_time_ = std::chrono::steady_clock::now();
+  for (const auto& stage : stages_) {
+    stage->Start();
+  }
+}
+
+void Pipeline::Wait() {
+  CHECK(started_) << "Pipeline not started";
+  if (joined_) {
+    return;
+  }
+
+  for (const auto& stage : stages_) {
+    stage->Join();
+  }
+  joined_ = true;
+  end_time_ = std::chrono::steady_clock::now();
+}
+
+std::vector<PipelineStageStats> Pipeline::Stats() const {
+  std::chrono::nanoseconds wall = std::chrono::nanoseconds::zero();
+  if (started_) {
+    auto end = joined_ ? end_time_ : std::chrono::steady_clock::now();
+    wall = std::chrono::duration_cast<std::chrono::nanoseconds>(end -
+                                                                start_time_);
+  }
+
+  std::vector<PipelineStageStats> out;
+  for (const auto& stage : stages_) {
+    out.emplace_back(stage->Stats());
+    out.back().wall = wall;
+  }
+  return out;
+}
+
+std::string Pipeline::StatsToString() const {
+  std::vector<PipelineStageStats> all_stats = Stats();
+  size_t bottleneck = 0;
+  for (size_t i = 0; i < all_stats.size(); ++i) {
+    if (all_stats[i].Utilization() > all_stats[bottleneck].Utilization()) {
+      bottleneck = i;
+    }
+  }
+
+  std::string out;
+  for (size_t i = 0; i < all_stats.size(); ++i) {
+    const PipelineStageStats& stats = all_stats[i];
+    auto to_ms = [](std::chrono::nanoseconds duration) {
+      return std::chrono::duration_cast<std::chrono::milliseconds>(duration)
+          .count();
+    };
+
+    SubstituteAndAppend(
+        &out, "$0 ($1 threads): $2 items/s, utilization $3, busy $4ms, "
+              "waiting for input $5ms, waiting for output $6ms, input queue "
+              "mean $7 max $8$9\n",
+        stats.name, stats.threads, stats.ItemsPerSecond(),
+        stats.Utilization(), to_ms(stats.busy),
+        to_ms(stats.waiting_for_input), to_ms(stats.waiting_for_output),
+        stats.mean_input_queue_size, stats.max_input_queue_size,
+        i == bottleneck ? " (bottleneck)" : "");
+  }
+
+  return out;
+}
+
+}  // namespace nc
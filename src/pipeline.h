@@ -0,0 +1,535 @@
+// A framework for pipeline-parallel processing. A pipeline is a chain of
+// stages -- a source that produces items, any number of stages that
+// transform them and a sink that consumes them. Each stage runs on its own
+// thread(s) and stages are connected by bounded queues that pass batches of
+// items, so that a slow stage applies back-pressure to the stages before it.
+// Stages that have no state can run on multiple threads.
+//
+// Pipeline pipeline;
+// Stream<std::string> lines = pipeline.AddSource<std::string>(
+//     "read", [&file](std::vector<std::string>* batch) { ... });
+// Stream<Record> records = pipeline.AddStage<Record>(
+//     "parse", lines, [](std::vector<std::string>* in,
+//                        std::vector<Record>* out) { ... }, 4);
+// pipeline.AddSink<Record>("store", records,
+//                          [&storage](std::vector<Record>* batch) { ... });
+// pipeline.Run();
+// LOG(INFO) << pipeline.StatsToString();
+
+#ifndef NCODE_PIPELINE_H
+#define NCODE_PIPELINE_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "common.h"
+#include "logging.h"
+#include "ptr_queue.h"
+
+namespace nc {
+
+// Maximum number of batches in the queue between two stages.
+static constexpr size_t kPipelineQueueSize = 64;
+
+// Statistics about a single stage of a pipeline.
+struct PipelineStageStats {
+  std::string name;
+
+  // Number of threads that run the stage.
+  size_t threads;
+
+  // Batches and items consumed and produced.
+  uint64_t batches_in;
+  uint64_t items_in;
+  uint64_t batches_out;
+  uint64_t items_out;
+
+  // Total time (across all threads) spent running the stage's function,
+  // waiting for input and waiting for the next stage to accept output.
+  std::chrono::nanoseconds busy;
+  std::chrono::nanoseconds waiting_for_input;
+  std::chrono::nanoseconds waiting_for_output;
+
+  // Number of batches in the input queue, sampled every time a batch is
+  // consumed. A queue that is always full means this stage is a bottleneck,
+  // one that is always empty means that a stage before it is.
+  double mean_input_queue_size;
+  size_t max_input_queue_size;
+
+  // Time since the pipeline was started.
+  std::chrono::nanoseconds wall;
+
+  // Fraction of the time the stage's threads spend running the function.
+  double Utilization() const;
+
+  // Items consumed (or produced, for sources) per second.
+  double ItemsPerSecond() const;
+};
+
+namespace pipeline_internal {
+
+// Identity type, used to keep template arguments from being deduced from
+// function arguments.
+template <typename T>
+struct NonDeduced {
+  using type = T;
+};
+
+template <typename T>
+struct SequencedBatch {
+  // Position of the batch in the stream.
+  uint64_t sequence;
+  std::vector<T> items;
+};
+
+// Base class for the queues that connect stages.
+class ChannelBase {
+ public:
+  ChannelBase() : consumers(0) {}
+
+  virtual ~ChannelBase() {}
+
+  // Number of stages that read from the channel (should be 1).
+  size_t consumers;
+};
+
+// A bounded queue of batches. Sequence numbers are consecutive. If the
+// channel is in order batches are added to the queue in order of sequence
+// number, otherwise consumers should number batches in the order in which
+// they take them, see Sequence.
+template <typename T>
+class Channel : public ChannelBase {
+ public:
+  Channel() : producers_(0), in_order_(true), next_taken_(0) {}
+
+  void AddProducers(size_t count) { producers_ += count; }
+
+  // Called before the pipeline starts by a producer that does not add
+  // batches in order.
+  void SetOutOfOrder() { in_order_ = false; }
+
+  // Returns the sequence number of a batch just taken from the queue. Batches
+  // of a channel that is out of order are numbered as they are taken, so
+  // that every batch with a lower number has already been taken by some
+  // consumer.
+  uint64_t Sequence(const SequencedBatch<T>& batch) {
+    if (in_order_) {
+      return batch.sequence;
+    }
+
+    return next_taken_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // Called by each producer thread when it is done. The queue is closed when
+  // all producers are done.
+  void ProducerDone() {
+    if (--producers_ == 0) {
+      queue_.Close();
+    }
+  }
+
+  MPMCPtrQueue<SequencedBatch<T>, kPipelineQueueSize>* queue() {
+    return &queue_;
+  }
+
+ private:
+  std::atomic<size_t> producers_;
+  bool in_order_;
+  std::atomic<uint64_t> next_taken_;
+  MPMCPtrQueue<SequencedBatch<T>, kPipelineQueueSize> queue_;
+};
+
+// Base class for stages, keeps track of threads and statistics.
+class StageBase {
+ public:
+  StageBase(const std::string& name, size_t threads);
+
+  virtual ~StageBase() {}
+
+  // Starts all threads of the stage.
+  void Start();
+
+  // Waits for all threads of the stage to finish.
+  void Join();
+
+  PipelineStageStats Stats() const;
+
+ protected:
+  using Clock = std::chrono::steady_clock;
+
+  // Body of each of the stage's threads.
+  virtual void Work() = 0;
+
+  // Updates the statistics.
+  void AddInput(size_t items, size_t queue_size,
+                std::chrono::nanoseconds waiting);
+  void AddBusy(std::chrono::nanoseconds busy);
+  void AddOutput(size_t items, std::chrono::nanoseconds waiting);
+
+  static std::chrono::nanoseconds Since(Clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() -
+                                                                start);
+  }
+
+ private:
+  std::string name_;
+  size_t thread_count_;
+  std::vector<std::thread> threads_;
+
+  std::atomic<uint64_t> batches_in_;
+  std::atomic<uint64_t> items_in_;
+  std::atomic<uint64_t> batches_out_;
+  std::atomic<uint64_t> items_out_;
+  std::atomic<uint64_t> busy_ns_;
+  std::atomic<uint64_t> waiting_for_input_ns_;
+  std::atomic<uint64_t> waiting_for_output_ns_;
+  std::atomic<uint64_t> queue_size_sum_;
+  std::atomic<uint64_t> max_queue_size_;
+
+  DISALLOW_COPY_AND_ASSIGN(StageBase);
+};
+
+// Adds the output batches of a stage to a channel. If the output is ordered,
+// output batches are added in the same order as the input batches they were
+// produced from, even if multiple threads produce them. Empty batches are not
+// added.
+template <typename T>
+class Emitter {
+ public:
+  Emitter(Channel<T>* channel, bool ordered, size_t window)
+      : channel_(channel),
+        ordered_(ordered),
+        window_(window),
+        next_input_(0),
+        next_output_(0) {
+    if (!ordered) {
+      channel->SetOutOfOrder();
+    }
+  }
+
+  // Emits the output produced from the input batch with a given sequence
+  // number. Blocks if the output channel is full or if (when ordered) the
+  // batch is too far ahead of the next one to emit.
+  void Emit(uint64_t input_sequence, std::vector<T> items) {
+    if (!ordered_) {
+      // Only numbering the batch needs the lock, so a thread blocked on a
+      // full channel does not hold up the others.
+      std::unique_ptr<SequencedBatch<T>> batch;
+      {
+        std::lock_guard<std::mutex> lock(mu_);
+        batch = NewBatch(std::move(items));
+      }
+
+      if (batch) {
+        channel_->queue()->ProduceOrBlock(std::move(batch));
+      }
+      return;
+    }
+
+    std::unique_lock<std::mutex> lock(mu_);
+
+    // Bounds the number of batches held back while waiting for an earlier
+    // one. The thread that has the earliest batch never waits here.
+    can_add_.wait(lock, [this, input_sequence] {
+      return input_sequence < next_input_ + window_;
+    });
+
+    pending_.emplace(input_sequence, std::move(items));
+    bool emitted = false;
+    while (!pending_.empty() && pending_.begin()->first == next_input_) {
+      Push(std::move(pending_.begin()->second));
+      pending_.erase(pending_.begin());
+      ++next_input_;
+      emitted = true;
+    }
+
+    if (emitted) {
+      can_add_.notify_all();
+    }
+  }
+
+ private:
+  // Returns the next output batch, or null if there are no items. Called
+  // with mu_ held.
+  std::unique_ptr<SequencedBatch<T>> NewBatch(std::vector<T> items) {
+    if (items.empty()) {
+      return nullptr;
+    }
+
+    auto batch = make_unique<SequencedBatch<T>>();
+    batch->sequence = next_output_++;
+    batch->items = std::move(items);
+    return batch;
+  }
+
+  // Adds a batch to the channel. Called with mu_ held, so that batches are
+  // added in order of sequence number.
+  void Push(std::vector<T> items) {
+    std::unique_ptr<SequencedBatch<T>> batch = NewBatch(std::move(items));
+    if (batch) {
+      channel_->queue()->ProduceOrBlock(std::move(batch));
+    }
+  }
+
+  Channel<T>* channel_;
+  bool ordered_;
+  size_t window_;
+
+  // Sequence number of the next input batch whose output should be emitted.
+  uint64_t next_input_;
+
+  // Sequence number of the next output batch.
+  uint64_t next_output_;
+
+  // Output batches waiting for earlier ones, by input sequence number.
+  std::map<uint64_t, std::vector<T>> pending_;
+
+  std::mutex mu_;
+  std::condition_variable can_add_;
+};
+
+template <typename Out>
+class SourceStage : public StageBase {
+ public:
+  using Function = std::function<bool(std::vector<Out>*)>;
+
+  SourceStage(const std::string& name, Function f, Channel<Out>* output)
+      : StageBase(name, 1), f_(f), output_(output), emitter_(output, true, 1) {
+    output->AddProducers(1);
+  }
+
+ private:
+  void Work() override {
+    uint64_t sequence = 0;
+    bool more = true;
+    while (more) {
+      std::vector<Out> batch;
+      auto start = Clock::now();
+      more = f_(&batch);
+      AddBusy(Since(start));
+
+      start = Clock::now();
+      size_t size = batch.size();
+      emitter_.Emit(sequence++, std::move(batch));
+      AddOutput(size, Since(start));
+    }
+
+    output_->ProducerDone();
+  }
+
+  Function f_;
+  Channel<Out>* output_;
+  Emitter<Out> emitter_;
+};
+
+template <typename In, typename Out>
+class TransformStage : public StageBase {
+ public:
+  using Function = std::function<void(std::vector<In>*, std::vector<Out>*)>;
+
+  TransformStage(const std::string& name, Function f, Channel<In>* input,
+                 Channel<Out>* output, size_t threads, bool ordered)
+      : StageBase(name, threads),
+        f_(f),
+        input_(input),
+        output_(output),
+        emitter_(output, ordered, 2 * threads) {
+    output->AddProducers(threads);
+  }
+
+ private:
+  void Work() override {
+    auto* queue = input_->queue();
+    while (true) {
+      auto start = Clock::now();
+      size_t queue_size = queue->size();
+      std::unique_ptr<SequencedBatch<In>> batch = queue->ConsumeOrBlock();
+      if (!batch) {
+        break;
+      }
+      AddInput(batch->items.size(), queue_size, Since(start));
+      uint64_t sequence = input_->Sequence(*batch);
+
+      std::vector<Out> out;
+      start = Clock::now();
+      f_(&batch->items, &out);
+      AddBusy(Since(start));
+
+      start = Clock::now();
+      size_t size = out.size();
+      emitter_.Emit(sequence, std::move(out));
+      AddOutput(size, Since(start));
+    }
+
+    output_->ProducerDone();
+  }
+
+  Function f_;
+  Channel<In>* input_;
+  Channel<Out>* output_;
+  Emitter<Out> emitter_;
+};
+
+template <typename In>
+class SinkStage : public StageBase {
+ public:
+  using Function = std::function<void(std::vector<In>*)>;
+
+  SinkStage(const std::string& name, Function f, Channel<In>* input,
+            size_t threads)
+      : StageBase(name, threads), f_(f), input_(input) {}
+
+ private:
+  void Work() override {
+    auto* queue = input_->queue();
+    while (true) {
+      auto start = Clock::now();
+      size_t queue_size = queue->size();
+      std::unique_ptr<SequencedBatch<In>> batch = queue->ConsumeOrBlock();
+      if (!batch) {
+        break;
+      }
+      AddInput(batch->items.size(), queue_size, Since(start));
+
+      start = Clock::now();
+      f_(&batch->items);
+      AddBusy(Since(start));
+    }
+  }
+
+  Function f_;
+  Channel<In>* input_;
+};
+
+}  // namespace pipeline_internal
+
+// The output of a stage. Each stream should be the input of exactly one
+// stage.
+template <typename T>
+class Stream {
+ public:
+  Stream() : channel_(nullptr) {}
+
+ private:
+  explicit Stream(pipeline_internal::Channel<T>* channel)
+      : channel_(channel) {}
+
+  pipeline_internal::Channel<T>* channel_;
+
+  friend class Pipeline;
+};
+
+class Pipeline {
+ public:
+  Pipeline() : started_(false), joined_(false) {}
+
+  // Waits for the pipeline to complete, if it has been started.
+  ~Pipeline();
+
+  // Adds a stage that produces items. The function is called repeatedly, each
+  // call should add items to the batch and return false once there are no
+  // more items.
+  template <typename Out>
+  Stream<Out> AddSource(
+      const std::string& name,
+      typename pipeline_internal::NonDeduced<
+          std::function<bool(std::vector<Out>*)>>::type f) {
+    auto* channel = NewChannel<Out>();
+    stages_.emplace_back(make_unique<pipeline_internal::SourceStage<Out>>(
+        name, f, channel));
+    return Stream<Out>(channel);
+  }
+
+  // Adds a stage that transforms each batch of a stream into a batch of the
+  // output stream. If 'threads' is more than 1, the function will be called
+  // from multiple threads at the same time. If 'ordered' is true the output
+  // batches are in the same order as the input ones, otherwise they are in
+  // the order in which they are produced.
+  template <typename Out, typename In>
+  Stream<Out> AddStage(
+      const std::string& name, Stream<In> input,
+      typename pipeline_internal::NonDeduced<
+          std::function<void(std::vector<In>*, std::vector<Out>*)>>::type f,
+      size_t threads = 1, bool ordered = true) {
+    CHECK(threads > 0) << "Zero threads";
+    Consume(input);
+    auto* channel = NewChannel<Out>();
+    stages_.emplace_back(
+        make_unique<pipeline_internal::TransformStage<In, Out>>(
+            name, f, input.channel_, channel, threads, ordered));
+    return Stream<Out>(channel);
+  }
+
+  // Adds a stage that consumes the batches of a stream. If 'threads' is more
+  // than 1 batches are consumed by multiple threads in no particular order.
+  template <typename In>
+  void AddSink(const std::string& name, Stream<In> input,
+               typename pipeline_internal::NonDeduced<
+                   std::function<void(std::vector<In>*)>>::type f,
+               size_t threads = 1) {
+    CHECK(threads > 0) << "Zero threads";
+    Consume(input);
+    stages_.emplace_back(make_unique<pipeline_internal::SinkStage<In>>(
+        name, f, input.channel_, threads));
+  }
+
+  // Starts all stages. No stages can be added after this call.
+  void Start();
+
+  // Waits for all stages to complete.
+  void Wait();
+
+  // Same as Start followed by Wait.
+  void Run() {
+    Start();
+    Wait();
+  }
+
+  // Statistics for all stages, in the order in which they were added. Can be
+  // called while the pipeline runs.
+  std::vector<PipelineStageStats> Stats() const;
+
+  // A table with the statistics of each stage. The stage with the highest
+  // utilization is marked as the bottleneck.
+  std::string StatsToString() const;
+
+ private:
+  template <typename T>
+  pipeline_internal::Channel<T>* NewChannel() {
+    CHECK(!started_) << "Pipeline already started";
+    auto channel = make_unique<pipeline_internal::Channel<T>>();
+    auto* raw_channel = channel.get();
+    channels_.emplace_back(std::move(channel));
+    return raw_channel;
+  }
+
+  template <typename T>
+  void Consume(Stream<T> stream) {
+    CHECK(!started_) << "Pipeline already started";
+    CHECK(stream.channel_ != nullptr) << "Bad stream";
+    CHECK(stream.channel_->consumers == 0) << "Stream already consumed";
+    ++stream.channel_->consumers;
+  }
+
+  bool started_;
+  bool joined_;
+  std::chrono::steady_clock::time_point start_time_;
+  std::chrono::steady_clock::time_point end_time_;
+
+  std::vector<std::unique_ptr<pipeline_internal::ChannelBase>> channels_;
+  std::vector<std::unique_ptr<pipeline_internal::StageBase>> stages_;
+
+  DISALLOW_COPY_AND_ASSIGN(Pipeline);
+};
+
+}  // namespace nc
+
+#endif
@@ -0,0 +1,221 @@
+#include "pipeline.h"
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include "gtest/gtest.h"
+
+namespace nc {
+namespace {
+
+// Returns a source function that produces the integers [0, count) in batches
+// of a given size.
+static std::function<bool(std::vector<int>*)> Counter(int count,
+                                                      int batch_size) {
+  auto next = std::make_shared<int>(0);
+  return [next, count, batch_size](std::vector<int>* batch) {
+    for (int i = 0; i < batch_size && *next < count; ++i) {
+      batch->emplace_back((*next)++);
+    }
+    return *next < count;
+  };
+}
+
+// Squares each value. Sleeps a bit on some batches so that threads finish out
+// of order.
+static void Square(std::vector<int>* in, std::vector<int>* out) {
+  if (!in->empty() && (in->front() / 10) % 3 == 0) {
+    std::this_thread::sleep_for(std::chrono::microseconds(100));
+  }
+
+  for (int value : *in) {
+    out->emplace_back(value * value);
+  }
+}
+
+TEST(Pipeline, Empty) {
+  Pipeline pipeline;
+  Stream<int> values = pipeline.AddSource<int>("source", Counter(0, 10));
+  std::vector<int> all;
+  pipeline.AddSink<int>("sink", values, [&all](std::vector<int>* batch) {
+    all.insert(all.end(), batch->begin(), batch->end());
+  });
+  pipeline.Run();
+  ASSERT_TRUE(all.empty());
+}
+
+TEST(Pipeline, Ordered) {
+  Pipeline pipeline;
+  Stream<int> values = pipeline.AddSource<int>("source", Counter(10000, 10));
+  Stream<int> squares = pipeline.AddStage<int>("square", values, Square, 4);
+  std::vector<int> all;
+  pipeline.AddSink<int>("sink", squares, [&all](std::vector<int>* batch) {
+    all.insert(all.end(), batch->begin(), batch->end());
+  });
+  pipeline.Run();
+
+  ASSERT_EQ(10000ul, all.size());
+  for (int i = 0; i < 10000; ++i) {
+    ASSERT_EQ(i * i, all[i]);
+  }
+}
+
+TEST(Pipeline, Unordered) {
+  Pipeline pipeline;
+  Stream<int> values = pipeline.AddSource<int>("source", Counter(10000, 10));
+  Stream<int> squares =
+      pipeline.AddStage<int>("square", values, Square, 4, false);
+  std::vector<int> all;
+  pipeline.AddSink<int>("sink", squares, [&all](std::vector<int>* batch) {
+    all.insert(all.end(), batch->begin(), batch->end());
+  });
+  pipeline.Run();
+
+  ASSERT_EQ(10000ul, all.size());
+  std::sort(all.begin(), all.end());
+  for (int i = 0; i < 10000; ++i) {
+    ASSERT_EQ(i * i, all[i]);
+  }
+}
+
+TEST(Pipeline, UnorderedThenOrdered) {
+  // Unordered output can reach the next stage out of sequence, the ordered
+  // stage after it keeps the order in which it takes batches.
+  Pipeline pipeline;
+  Stream<int> values = pipeline.AddSource<int>("source", Counter(10000, 10));
+  Stream<int> squares =
+      pipeline.AddStage<int>("square", values, Square, 4, false);
+  Stream<int> copies = pipeline.AddStage<int>(
+      "copy", squares,
+      [](std::vector<int>* in, std::vector<int>* out) { *out = *in; }, 4);
+  std::vector<int> all;
+  pipeline.AddSink<int>("sink", copies, [&all](std::vector<int>* batch) {
+    std::this_thread::sleep_for(std::chrono::microseconds(10));
+    all.insert(all.end(), batch->begin(), batch->end());
+  });
+  pipeline.Run();
+
+  ASSERT_EQ(10000ul, all.size());
+  std::sort(all.begin(), all.end());
+  for (int i = 0; i < 10000; ++i) {
+    ASSERT_EQ(i * i, all[i]);
+  }
+}
+
+TEST(Pipeline, ChangeType) {
+  Pipeline pipeline;
+  Stream<int> values = pipeline.AddSource<int>("source", Counter(100, 7));
+  Stream<std::string> strings = pipeline.AddStage<std::string>(
+      "to_string", values,
+      [](std::vector<int>* in, std::vector<std::string>* out) {
+        for (int value : *in) {
+          // Drops odd values.
+          if (value % 2 == 0) {
+            out->emplace_back(std::to_string(value));
+          }
+        }
+      },
+      2);
+
+  std::string all;
+  pipeline.AddSink<std::string>("sink", strings,
+                                [&all](std::vector<std::string>* batch) {
+                                  for (const std::string& value : *batch) {
+                                    all += value + ",";
+                                  }
+                                });
+  pipeline.Run();
+
+  std::string model;
+  for (int i = 0; i < 100; i += 2) {
+    model += std::to_string(i) + ",";
+  }
+  ASSERT_EQ(model, all);
+}
+
+TEST(Pipeline, BackPressure) {
+  std::atomic<size_t> produced(0);
+  std::atomic<size_t> consumed(0);
+  std::atomic<size_t> max_in_flight(0);
+
+  Pipeline pipeline;
+  Stream<int> values = pipeline.AddSource<int>(
+      "source", [&produced](std::vector<int>* batch) {
+        batch->emplace_back(0);
+        return ++produced < 1000;
+      });
+  pipeline.AddSink<int>("sink", values, [&produced, &consumed,
+                                         &max_in_flight](std::vector<int>*) {
+    size_t in_flight = produced - ++consumed;
+    max_in_flight = std::max(max_in_flight.load(), in_flight);
+    std::this_thread::sleep_for(std::chrono::microseconds(10));
+  });
+  pipeline.Run();
+
+  ASSERT_EQ(1000ul, consumed.load());
+
+  // At most a full queue, one batch being produced and one being emitted.
+  ASSERT_GE(kPipelineQueueSize + 2, max_in_flight.load());
+}
+
+TEST(Pipeline, Stats) {
+  Pipeline pipeline;
+  Stream<int> values = pipeline.AddSource<int>("source", Counter(1000, 10));
+  Stream<int> squares = pipeline.AddStage<int>("square", values, Square, 2);
+  pipeline.AddSink<int>("sink", squares, [](std::vector<int>*) {});
+  pipeline.Run();
+
+  std::vector<PipelineStageStats> stats = pipeline.Stats();
+  ASSERT_EQ(3ul, stats.size());
+  ASSERT_EQ("source", stats[0].name);
+  ASSERT_EQ(0ul, stats[0].batches_in);
+  ASSERT_EQ(100ul, stats[0].batches_out);
+  ASSERT_EQ(1000ul, stats[0].items_out);
+
+  ASSERT_EQ("square", stats[1].name);
+  ASSERT_EQ(2ul, stats[1].threads);
+  ASSERT_EQ(100ul, stats[1].batches_in);
+  ASSERT_EQ(1000ul, stats[1].items_in);
+  ASSERT_EQ(1000ul, stats[1].items_out);
+  ASSERT_LT(0, stats[1].busy.count());
+  ASSERT_GE(kPipelineQueueSize, stats[1].max_input_queue_size);
+
+  ASSERT_EQ(1000ul, stats[2].items_in);
+  for (const PipelineStageStats& stage_stats : stats) {
+    ASSERT_LE(0, stage_stats.Utilization());
+    ASSERT_GE(1.0, stage_stats.Utilization());
+  }
+
+  std::string stats_string = pipeline.StatsToString();
+  ASSERT_NE(std::string::npos, stats_string.find("square (2 threads)"));
+  ASSERT_NE(std::string::npos, stats_string.find("(bottleneck)"));
+}
+
+TEST(Pipeline, BadStreams) {
+  ASSERT_DEATH(
+      {
+        Pipeline pipeline;
+        Stream<int> values = pipeline.AddSource<int>("source", Counter(1, 1));
+        pipeline.AddSink<int>("sink", values, [](std::vector<int>*) {});
+        pipeline.AddSink<int>("sink", values, [](std::vector<int>*) {});
+      },
+      "Stream already consumed");
+
+  ASSERT_DEATH(
+      {
+        Pipeline pipeline;
+        pipeline.AddSource<int>("source", Counter(1, 1));
+        pipeline.Run();
+      },
+      "Stream not consumed");
+
+  ASSERT_DEATH(
+      {
+        Pipeline pipeline;
+        pipeline.AddSink<int>("sink", Stream<int>(), [](std::vector<int>*) {});
+      },
+      "Bad stream");
+}
+
+}  // namespace
+}  // namespace nc
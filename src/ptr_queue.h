@@ -1,10 +1,16 @@
 #ifndef NCODE_PTR_QUEUE_H
 #define NCODE_PTR_QUEUE_H
 
+#include <algorithm>
 #include <functional>
 #include <mutex>
 #include <array>
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <limits>
+#include <thread>
+#include <vector>
 
 #include "common.h"
 #include "logging.h"
@@ -186,6 +192,580 @@ class PtrQueue {
   DISALLOW_COPY_AND_ASSIGN(PtrQueue);
 };
 
+namespace ptr_queue_internal {
+
+// Size of a cache line. Indices that are written by different threads are
+// kept this far apart to avoid false sharing.
+static constexpr size_t kCacheLineSize = 64;
+
+// Timeout value that means "wait forever".
+static constexpr std::chrono::milliseconds kNoTimeout =
+    std::chrono::milliseconds::max();
+
+// Lets threads wait for a condition that other threads make true without
+// holding a lock. Waiting is adaptive -- the condition is first polled for a
+// while, and only if it is still false does the thread block on a condition
+// variable. Notify is cheap when no thread is blocked.
+class Waiter {
+ public:
+  Waiter() : waiters_(0) {}
+
+  // Waits until the condition evaluates to true or the timeout expires.
+  // Returns false on timeout.
+  template <typename Condition>
+  bool Wait(Condition condition, std::chrono::milliseconds timeout) {
+    for (size_t i = 0; i < kSpinCount; ++i) {
+      if (condition()) {
+        return true;
+      }
+
+      if (i >= kSpinCount / 2) {
+        std::this_thread::yield();
+      }
+    }
+
+    std::unique_lock<std::mutex> lock(mu_);
+    waiters_.fetch_add(1, std::memory_order_relaxed);
+
+    // Pairs with the fence in Notify. Either this thread sees the change to
+    // the condition, or the notifying thread sees that there is a waiter.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    bool result;
+    if (timeout == kNoTimeout) {
+      condition_.wait(lock, condition);
+      result = true;
+    } else {
+      result = condition_.wait_for(lock, timeout, condition);
+    }
+
+    waiters_.fetch_sub(1, std::memory_order_relaxed);
+    return result;
+  }
+
+  // Wakes up all blocked threads. Should be called after the condition that
+  // they may be waiting for has been changed.
+  void Notify() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiters_.load(std::memory_order_relaxed) == 0) {
+      return;
+    }
+
+    // Taking the lock makes sure that a thread that has registered as a waiter
+    // is either blocked or has not yet evaluated the condition.
+    { std::lock_guard<std::mutex> lock(mu_); }
+    condition_.notify_all();
+  }
+
+ private:
+  // Number of times the condition is polled before blocking.
+  static constexpr size_t kSpinCount = 256;
+
+  std::atomic<size_t> waiters_;
+  std::mutex mu_;
+  std::condition_variable condition_;
+
+  DISALLOW_COPY_AND_ASSIGN(Waiter);
+};
+
+// Time left from a timeout that started at a given time.
+inline std::chrono::milliseconds TimeLeft(
+    std::chrono::steady_clock::time_point start,
+    std::chrono::milliseconds timeout) {
+  if (timeout == kNoTimeout) {
+    return kNoTimeout;
+  }
+
+  auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - start);
+  return std::max(std::chrono::milliseconds::zero(), timeout - elapsed);
+}
+
+// Implements the blocking, close and timeout logic of the lock-free queues
+// below on top of the non-blocking TryProduce / TryConsume methods of a ring
+// (CRTP). The semantics are the same as those of PtrQueue: producing to a
+// closed queue fails and frees the item, consuming from a closed queue
+// returns the items left in it and then empty unique_ptrs. Null items are
+// skipped by consumers. Invalidate is not supported.
+template <typename Ring, typename T, typename Deleter>
+class LockFreePtrQueueBase {
+ public:
+  using ItemPtr = std::unique_ptr<T, Deleter>;
+
+  ~LockFreePtrQueueBase() { Close(); }
+
+  // Returns the number of items in the queue. Only an estimate if other
+  // threads are producing or consuming at the same time.
+  size_t size() const { return ring()->ApproximateSize(); }
+
+  bool empty() const { return size() == 0; }
+
+  // Same as PtrQueue::ProduceOrBlockWithTimeout.
+  bool ProduceOrBlockWithTimeout(ItemPtr item,
+                                 std::chrono::milliseconds timeout,
+                                 bool* timed_out) {
+    *timed_out = false;
+    auto start = std::chrono::steady_clock::now();
+    while (true) {
+      if (!BeginProduce()) {
+        return false;
+      }
+
+      bool produced = ring()->TryProduce(&item);
+      EndProduce();
+      if (produced) {
+        not_empty_.Notify();
+        return true;
+      }
+
+      if (!WaitNotFull(TimeLeft(start, timeout))) {
+        *timed_out = true;
+        return false;
+      }
+    }
+  }
+
+  bool ProduceOrBlock(ItemPtr item) {
+    bool dummy;
+    return ProduceOrBlockWithTimeout(std::move(item), kNoTimeout, &dummy);
+  }
+
+  // Produces all items in a vector, blocking while the queue is full. Items
+  // are added in batches, which is cheaper than adding them one by one.
+  // Returns false if the queue is closed before all items are produced, the
+  // items not produced are freed.
+  bool ProduceBatchOrBlock(std::vector<ItemPtr> items) {
+    size_t produced = 0;
+    while (produced != items.size()) {
+      if (!BeginProduce()) {
+        return false;
+      }
+
+      size_t count = ring()->TryProduceBatch(&items[produced],
+                                             items.size() - produced);
+      EndProduce();
+      if (count > 0) {
+        produced += count;
+        not_empty_.Notify();
+        continue;
+      }
+
+      WaitNotFull(kNoTimeout);
+    }
+
+    return true;
+  }
+
+  // Same as PtrQueue::ConsumeOrBlockWithTimeout.
+  ItemPtr ConsumeOrBlockWithTimeout(std::chrono::milliseconds timeout,
+                                    bool* timed_out) {
+    *timed_out = false;
+    auto start = std::chrono::steady_clock::now();
+    ItemPtr item;
+    while (true) {
+      // Items produced before the queue was closed are visible to TryConsume
+      // if the queue is seen closed first.
+      bool closed = ClosedAndProduced();
+      if (ring()->TryConsume(&item)) {
+        not_full_.Notify();
+        if (item) {
+          return item;
+        }
+
+        continue;
+      }
+
+      if (closed) {
+        return item;
+      }
+
+      if (!WaitNotEmpty(TimeLeft(start, timeout))) {
+        *timed_out = true;
+        return item;
+      }
+    }
+  }
+
+  ItemPtr ConsumeOrBlock() {
+    bool dummy;
+    return ConsumeOrBlockWithTimeout(kNoTimeout, &dummy);
+  }
+
+  // Blocks until at least one item is available and returns up to max_items
+  // items. Returns an empty vector only if the queue is closed and empty.
+  std::vector<ItemPtr> ConsumeBatchOrBlock(size_t max_items) {
+    CHECK(max_items > 0);
+    std::vector<ItemPtr> out(max_items);
+    while (true) {
+      bool closed = ClosedAndProduced();
+      size_t count = ring()->TryConsumeBatch(out.data(), max_items);
+      if (count > 0) {
+        not_full_.Notify();
+        out.resize(count);
+        out.erase(std::remove(out.begin(), out.end(), nullptr), out.end());
+        if (!out.empty()) {
+          return out;
+        }
+
+        out.resize(max_items);
+        continue;
+      }
+
+      if (closed) {
+        out.clear();
+        return out;
+      }
+
+      WaitNotEmpty(kNoTimeout);
+    }
+  }
+
+  // After this call no more items can be produced.
+  void Close() {
+    closed_.store(true, std::memory_order_seq_cst);
+    not_empty_.Notify();
+    not_full_.Notify();
+  }
+
+  // Consumes all items that are in the queue, without blocking.
+  std::vector<ItemPtr> Drain() {
+    std::vector<ItemPtr> out;
+    ItemPtr item;
+    while (ring()->TryConsume(&item)) {
+      out.emplace_back(std::move(item));
+    }
+
+    not_full_.Notify();
+    return out;
+  }
+
+ protected:
+  LockFreePtrQueueBase() : closed_(false), producing_(0) {}
+
+ private:
+  Ring* ring() { return static_cast<Ring*>(this); }
+  const Ring* ring() const { return static_cast<const Ring*>(this); }
+
+  // A producer registers in producing_ before it checks closed_ and stays
+  // registered until its items are in the ring. A producer that sees the
+  // queue open may still be adding items after Close returns, so consumers
+  // that see the queue closed wait for registered producers to finish before
+  // they look at the ring for the last time. Both sides use seq_cst, so
+  // either the producer sees closed_ or the consumer sees the producer.
+  bool BeginProduce() {
+    producing_.fetch_add(1, std::memory_order_seq_cst);
+    if (closed_.load(std::memory_order_seq_cst)) {
+      EndProduce();
+      return false;
+    }
+
+    return true;
+  }
+
+  void EndProduce() { producing_.fetch_sub(1, std::memory_order_release); }
+
+  // Returns true if the queue is closed, after waiting for producers that saw
+  // it open. The ring then holds all items that will ever be produced.
+  bool ClosedAndProduced() {
+    if (!closed_.load(std::memory_order_seq_cst)) {
+      return false;
+    }
+
+    while (producing_.load(std::memory_order_seq_cst) != 0) {
+      std::this_thread::yield();
+    }
+
+    return true;
+  }
+
+  bool WaitNotFull(std::chrono::milliseconds timeout) {
+    return not_full_.Wait([this] {
+      return closed_.load(std::memory_order_acquire) || !ring()->Full();
+    }, timeout);
+  }
+
+  bool WaitNotEmpty(std::chrono::milliseconds timeout) {
+    return not_empty_.Wait([this] {
+      return closed_.load(std::memory_order_acquire) || !ring()->Empty();
+    }, timeout);
+  }
+
+  std::atomic<bool> closed_;
+
+  // Number of producers between BeginProduce and EndProduce.
+  std::atomic<size_t> producing_;
+
+  // Consumers wait on not_empty_, producers on not_full_.
+  Waiter not_empty_;
+  Waiter not_full_;
+};
+
+}  // namespace ptr_queue_internal
+
+// A lock-free PtrQueue for a single producer thread and a single consumer
+// thread. Consumers and producers only block if the queue is empty / full.
+template <typename T, size_t Size, typename Deleter = std::default_delete<T>>
+class SPSCPtrQueue : public ptr_queue_internal::LockFreePtrQueueBase<
+                         SPSCPtrQueue<T, Size, Deleter>, T, Deleter> {
+ public:
+  using ItemPtr = std::unique_ptr<T, Deleter>;
+
+  static constexpr size_t kQueueSize = Size;
+
+  SPSCPtrQueue() : head_(0), cached_tail_(0), tail_(0), cached_head_(0) {
+    static_assert(IsPowerOfTwo(Size), "Queue size must be a power of 2");
+  }
+
+ private:
+  friend class ptr_queue_internal::LockFreePtrQueueBase<SPSCPtrQueue, T,
+                                                        Deleter>;
+
+  static constexpr size_t kMask = Size - 1;
+
+  bool TryProduce(ItemPtr* item) { return TryProduceBatch(item, 1) == 1; }
+
+  // Adds up to count items, publishing them with a single store. Returns the
+  // number of items added.
+  size_t TryProduceBatch(ItemPtr* items, size_t count) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - cached_head_ + count > Size) {
+      cached_head_ = head_.load(std::memory_order_acquire);
+    }
+
+    count = std::min(count, Size - (tail - cached_head_));
+    for (size_t i = 0; i < count; ++i) {
+      queue_[(tail + i) & kMask] = std::move(items[i]);
+    }
+
+    tail_.store(tail + count, std::memory_order_release);
+    return count;
+  }
+
+  bool TryConsume(ItemPtr* item) { return TryConsumeBatch(item, 1) == 1; }
+
+  size_t TryConsumeBatch(ItemPtr* items, size_t count) {
+    size_t head = head_.load(std::memory_order_relaxed);
+    if (cached_tail_ - head < count) {
+      cached_tail_ = tail_.load(std::memory_order_acquire);
+    }
+
+    count = std::min(count, cached_tail_ - head);
+    for (size_t i = 0; i < count; ++i) {
+      items[i] = std::move(queue_[(head + i) & kMask]);
+    }
+
+    head_.store(head + count, std::memory_order_release);
+    return count;
+  }
+
+  size_t ApproximateSize() const {
+    size_t head = head_.load(std::memory_order_acquire);
+    size_t tail = tail_.load(std::memory_order_acquire);
+    return tail - head;
+  }
+
+  bool Empty() const { return ApproximateSize() == 0; }
+
+  bool Full() const { return ApproximateSize() == Size; }
+
+  // Index of the next item to consume and the consumer's copy of tail_.
+  std::atomic<size_t> head_;
+  size_t cached_tail_;
+  char head_padding_[ptr_queue_internal::kCacheLineSize -
+                     sizeof(std::atomic<size_t>) - sizeof(size_t)];
+
+  // Index of the next item to produce and the producer's copy of head_.
+  std::atomic<size_t> tail_;
+  size_t cached_head_;
+  char tail_padding_[ptr_queue_internal::kCacheLineSize -
+                     sizeof(std::atomic<size_t>) - sizeof(size_t)];
+
+  std::array<ItemPtr, Size> queue_;
+
+  DISALLOW_COPY_AND_ASSIGN(SPSCPtrQueue);
+};
+
+// A lock-free PtrQueue for any number of producers and consumers. Based on
+// Vyukov's bounded MPMC queue -- each slot has a sequence number that tells
+// producers and consumers whether the slot is ready for them.
+template <typename T, size_t Size, typename Deleter = std::default_delete<T>>
+class MPMCPtrQueue : public ptr_queue_internal::LockFreePtrQueueBase<
+                         MPMCPtrQueue<T, Size, Deleter>, T, Deleter> {
+ public:
+  using ItemPtr = std::unique_ptr<T, Deleter>;
+
+  static constexpr size_t kQueueSize = Size;
+
+  MPMCPtrQueue() : head_(0), tail_(0) {
+    static_assert(IsPowerOfTwo(Size), "Queue size must be a power of 2");
+    static_assert(Size > 1, "Queue size must be at least 2");
+    for (size_t i = 0; i < Size; ++i) {
+      queue_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+ private:
+  friend class ptr_queue_internal::LockFreePtrQueueBase<MPMCPtrQueue, T,
+                                                        Deleter>;
+
+  static constexpr size_t kMask = Size - 1;
+
+  struct Slot {
+    // Equal to the position for an empty slot that can be produced to, and to
+    // the position + 1 for a full slot that can be consumed from.
+    std::atomic<size_t> sequence;
+    ItemPtr item;
+  };
+
+  bool TryProduce(ItemPtr* item) {
+    size_t position = tail_.load(std::memory_order_relaxed);
+    while (true) {
+      Slot& slot = queue_[position & kMask];
+      size_t sequence = slot.sequence.load(std::memory_order_acquire);
+      intptr_t diff = static_cast<intptr_t>(sequence - position);
+      if (diff == 0) {
+        if (tail_.compare_exchange_weak(position, position + 1,
+                                        std::memory_order_relaxed)) {
+          slot.item = std::move(*item);
+          slot.sequence.store(position + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        position = tail_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  bool TryConsume(ItemPtr* item) {
+    size_t position = head_.load(std::memory_order_relaxed);
+    while (true) {
+      Slot& slot = queue_[position & kMask];
+      size_t sequence = slot.sequence.load(std::memory_order_acquire);
+      intptr_t diff = static_cast<intptr_t>(sequence - (position + 1));
+      if (diff == 0) {
+        if (head_.compare_exchange_weak(position, position + 1,
+                                        std::memory_order_relaxed)) {
+          *item = std::move(slot.item);
+          slot.sequence.store(position + Size, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        position = head_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  // Claims up to count consecutive positions with a single CAS. Slots at
+  // claimed positions may still be in the process of being consumed, in which
+  // case this waits for the consumer to finish.
+  size_t TryProduceBatch(ItemPtr* items, size_t count) {
+    size_t position = tail_.load(std::memory_order_relaxed);
+    size_t claimed;
+    while (true) {
+      size_t head = head_.load(std::memory_order_acquire);
+      intptr_t used = static_cast<intptr_t>(position - head);
+      if (used < 0) {
+        // Consumers are ahead of a stale tail.
+        position = tail_.load(std::memory_order_relaxed);
+        continue;
+      }
+
+      if (static_cast<size_t>(used) >= Size) {
+        return 0;
+      }
+
+      claimed = std::min(count, Size - static_cast<size_t>(used));
+      if (tail_.compare_exchange_weak(position, position + claimed,
+                                      std::memory_order_relaxed)) {
+        break;
+      }
+    }
+
+    for (size_t i = 0; i < claimed; ++i) {
+      Slot& slot = queue_[(position + i) & kMask];
+      while (slot.sequence.load(std::memory_order_acquire) != position + i) {
+        std::this_thread::yield();
+      }
+
+      slot.item = std::move(items[i]);
+      slot.sequence.store(position + i + 1, std::memory_order_release);
+    }
+
+    return claimed;
+  }
+
+  size_t TryConsumeBatch(ItemPtr* items, size_t count) {
+    size_t position = head_.load(std::memory_order_relaxed);
+    size_t claimed;
+    while (true) {
+      size_t tail = tail_.load(std::memory_order_acquire);
+      intptr_t available = static_cast<intptr_t>(tail - position);
+      if (available <= 0) {
+        return 0;
+      }
+
+      claimed = std::min(count, static_cast<size_t>(available));
+      if (head_.compare_exchange_weak(position, position + claimed,
+                                      std::memory_order_relaxed)) {
+        break;
+      }
+    }
+
+    for (size_t i = 0; i < claimed; ++i) {
+      Slot& slot = queue_[(position + i) & kMask];
+      while (slot.sequence.load(std::memory_order_acquire) !=
+             position + i + 1) {
+        std::this_thread::yield();
+      }
+
+      items[i] = std::move(slot.item);
+      slot.sequence.store(position + i + Size, std::memory_order_release);
+    }
+
+    return claimed;
+  }
+
+  size_t ApproximateSize() const {
+    size_t head = head_.load(std::memory_order_acquire);
+    size_t tail = tail_.load(std::memory_order_acquire);
+    intptr_t size = static_cast<intptr_t>(tail - head);
+    if (size < 0) {
+      return 0;
+    }
+
+    return std::min(static_cast<size_t>(size), Size);
+  }
+
+  bool Empty() const {
+    size_t position = head_.load(std::memory_order_acquire);
+    const Slot& slot = queue_[position & kMask];
+    return slot.sequence.load(std::memory_order_acquire) != position + 1;
+  }
+
+  bool Full() const {
+    size_t position = tail_.load(std::memory_order_acquire);
+    const Slot& slot = queue_[position & kMask];
+    return slot.sequence.load(std::memory_order_acquire) != position;
+  }
+
+  // Index of the next item to consume.
+  std::atomic<size_t> head_;
+  char head_padding_[ptr_queue_internal::kCacheLineSize -
+                     sizeof(std::atomic<size_t>)];
+
+  // Index of the next item to produce.
+  std::atomic<size_t> tail_;
+  char tail_padding_[ptr_queue_internal::kCacheLineSize -
+                     sizeof(std::atomic<size_t>)];
+
+  std::array<Slot, Size> queue_;
+
+  DISALLOW_COPY_AND_ASSIGN(MPMCPtrQueue);
+};
+
 }  // namespace nc
 
 #endif /* NCODE_PTR_QUEUE_H */
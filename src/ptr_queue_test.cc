@@ -258,5 +258,281 @@ TEST(LargeQueue, MultiProducerMultiConsumer) {
   ASSERT_EQ(0ul, large_queue->size());
 }
 
+// Tests that should pass for both lock-free queues.
+template <typename Queue>
+class LockFreeQueue : public ::testing::Test {};
+
+using LockFreeQueueTypes =
+    ::testing::Types<SPSCPtrQueue<int, 2>, MPMCPtrQueue<int, 2>>;
+TYPED_TEST_CASE(LockFreeQueue, LockFreeQueueTypes);
+
+TYPED_TEST(LockFreeQueue, ProduceAfterClose) {
+  TypeParam queue;
+  queue.Close();
+  ASSERT_FALSE(queue.ProduceOrBlock(make_unique<int>(1)));
+  ASSERT_EQ(0ul, queue.size());
+  ASSERT_FALSE(queue.ConsumeOrBlock().get());
+}
+
+TYPED_TEST(LockFreeQueue, ConsumeAfterClose) {
+  TypeParam queue;
+  queue.ProduceOrBlock(make_unique<int>(1));
+  queue.Close();
+
+  // Items produced before the queue was closed can still be consumed.
+  ASSERT_EQ(1, *queue.ConsumeOrBlock());
+  ASSERT_FALSE(queue.ConsumeOrBlock().get());
+}
+
+TYPED_TEST(LockFreeQueue, ProduceConsumeSeq) {
+  TypeParam queue;
+  for (int i = 1; i <= 10000; i++) {
+    queue.ProduceOrBlock(make_unique<int>(i));
+
+    if (i % 2 == 0) {
+      ASSERT_EQ(2ul, queue.size());
+      auto result_one = queue.ConsumeOrBlock();
+      auto result_two = queue.ConsumeOrBlock();
+
+      ASSERT_EQ(i - 1, *result_one);
+      ASSERT_EQ(i, *result_two);
+    }
+  }
+
+  ASSERT_TRUE(queue.empty());
+}
+
+TYPED_TEST(LockFreeQueue, SkipNull) {
+  TypeParam queue;
+  queue.ProduceOrBlock(std::unique_ptr<int>());
+  queue.ProduceOrBlock(make_unique<int>(1));
+  ASSERT_EQ(1, *queue.ConsumeOrBlock());
+}
+
+TYPED_TEST(LockFreeQueue, Drain) {
+  TypeParam queue;
+  queue.ProduceOrBlock(make_unique<int>(1));
+  queue.ProduceOrBlock(make_unique<int>(2));
+
+  std::vector<std::unique_ptr<int>> contents = queue.Drain();
+  ASSERT_EQ(2ul, contents.size());
+  ASSERT_EQ(1, *contents.front());
+  ASSERT_EQ(2, *contents.back());
+  ASSERT_EQ(0ul, queue.size());
+}
+
+TYPED_TEST(LockFreeQueue, EmptyTimeout) {
+  TypeParam queue;
+
+  bool timed_out;
+  auto result = queue.ConsumeOrBlockWithTimeout(std::chrono::milliseconds(100),
+                                                &timed_out);
+  ASSERT_FALSE(result);
+  ASSERT_TRUE(timed_out);
+}
+
+TYPED_TEST(LockFreeQueue, FullTimeout) {
+  TypeParam queue;
+  ASSERT_TRUE(queue.ProduceOrBlock(make_unique<int>(1)));
+  ASSERT_TRUE(queue.ProduceOrBlock(make_unique<int>(2)));
+
+  bool timed_out;
+  ASSERT_FALSE(queue.ProduceOrBlockWithTimeout(
+      make_unique<int>(3), std::chrono::milliseconds(100), &timed_out));
+  ASSERT_TRUE(timed_out);
+}
+
+TYPED_TEST(LockFreeQueue, ProduceKill) {
+  TypeParam queue;
+  std::thread thread([&queue] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    queue.Close();
+  });
+
+  queue.ProduceOrBlock(make_unique<int>(1));
+  queue.ProduceOrBlock(make_unique<int>(2));
+  ASSERT_FALSE(queue.ProduceOrBlock(make_unique<int>(3)));
+  thread.join();
+
+  ASSERT_EQ(2ul, queue.size());
+}
+
+TYPED_TEST(LockFreeQueue, ConsumeKill) {
+  TypeParam queue;
+  std::thread thread([&queue] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    queue.Close();
+  });
+
+  // Should block until the queue is closed.
+  auto result = queue.ConsumeOrBlock();
+  thread.join();
+  ASSERT_FALSE(result);
+  ASSERT_TRUE(queue.ConsumeBatchOrBlock(10).empty());
+}
+
+TYPED_TEST(LockFreeQueue, Batch) {
+  TypeParam queue;
+  std::thread producer([&queue] {
+    std::vector<std::unique_ptr<int>> batch;
+    for (int i = 0; i < 1000; ++i) {
+      batch.emplace_back(make_unique<int>(i));
+    }
+    ASSERT_TRUE(queue.ProduceBatchOrBlock(std::move(batch)));
+    queue.Close();
+  });
+
+  int next = 0;
+  while (true) {
+    std::vector<std::unique_ptr<int>> batch = queue.ConsumeBatchOrBlock(3);
+    if (batch.empty()) {
+      break;
+    }
+
+    ASSERT_GE(2ul, batch.size());
+    for (const auto& item : batch) {
+      ASSERT_EQ(next++, *item);
+    }
+  }
+
+  producer.join();
+  ASSERT_EQ(1000, next);
+}
+
+TEST(SPSCQueue, Ordered) {
+  auto queue = make_unique<SPSCPtrQueue<uint64_t, 64>>();
+  std::thread producer([&queue] {
+    for (uint64_t i = 0; i < 100000; ++i) {
+      queue->ProduceOrBlock(make_unique<uint64_t>(i));
+    }
+    queue->Close();
+  });
+
+  uint64_t next = 0;
+  while (auto result = queue->ConsumeOrBlock()) {
+    ASSERT_EQ(next++, *result);
+  }
+
+  producer.join();
+  ASSERT_EQ(100000ul, next);
+}
+
+TEST(MPMCQueue, MultiProducerMultiConsumer) {
+  auto queue = make_unique<MPMCPtrQueue<uint64_t, 1 << 8>>();
+  static constexpr size_t kThreads = 8;
+  static constexpr size_t kPerThread = 20000;
+
+  std::vector<std::thread> producer_threads;
+  std::vector<std::thread> consumer_threads;
+  for (size_t thread_num = 0; thread_num < kThreads; thread_num++) {
+    producer_threads.push_back(std::thread([&queue, thread_num] {
+      std::vector<std::unique_ptr<uint64_t>> batch;
+      for (size_t count = 0; count < kPerThread; count++) {
+        if (thread_num % 2) {
+          queue->ProduceOrBlock(make_unique<uint64_t>(count));
+          continue;
+        }
+
+        batch.emplace_back(make_unique<uint64_t>(count));
+        if (batch.size() == 10) {
+          queue->ProduceBatchOrBlock(std::move(batch));
+          batch.clear();
+        }
+      }
+    }));
+  }
+
+  std::atomic<uint64_t> sum(0);
+  std::atomic<uint64_t> count(0);
+  for (size_t thread_num = 0; thread_num < kThreads; thread_num++) {
+    consumer_threads.push_back(std::thread([&queue, &sum, &count,
+                                            thread_num] {
+      while (true) {
+        if (thread_num % 2) {
+          auto result = queue->ConsumeOrBlock();
+          if (!result) {
+            break;
+          }
+
+          sum += *result;
+          ++count;
+          continue;
+        }
+
+        auto batch = queue->ConsumeBatchOrBlock(7);
+        if (batch.empty()) {
+          break;
+        }
+
+        for (const auto& result : batch) {
+          sum += *result;
+          ++count;
+        }
+      }
+    }));
+  }
+
+  for (auto& thread : producer_threads) {
+    thread.join();
+  }
+  queue->Close();
+
+  for (auto& thread : consumer_threads) {
+    thread.join();
+  }
+
+  ASSERT_EQ(kThreads * kPerThread, count.load());
+  ASSERT_EQ(kThreads * kPerThread * (kPerThread - 1) / 2, sum.load());
+  ASSERT_EQ(0ul, queue->size());
+}
+
+// Closes the queue while producers are running. Every item that a producer
+// was told is in the queue must be consumed before consumers see the end.
+template <typename Queue>
+void CloseWhileProducing(size_t num_producers, size_t num_consumers) {
+  for (size_t round = 0; round < 200; ++round) {
+    auto queue = make_unique<Queue>();
+    std::atomic<uint64_t> produced(0);
+    std::atomic<uint64_t> consumed(0);
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < num_producers; ++i) {
+      threads.emplace_back([&queue, &produced] {
+        while (queue->ProduceOrBlock(make_unique<uint64_t>(1))) {
+          ++produced;
+        }
+      });
+    }
+
+    for (size_t i = 0; i < num_consumers; ++i) {
+      threads.emplace_back([&queue, &consumed] {
+        while (auto result = queue->ConsumeOrBlock()) {
+          consumed += *result;
+        }
+      });
+    }
+
+    for (size_t i = 0; i < (round % 20) * 20; ++i) {
+      std::this_thread::yield();
+    }
+    queue->Close();
+
+    for (auto& thread : threads) {
+      thread.join();
+    }
+
+    ASSERT_EQ(produced.load(), consumed.load()) << "round " << round;
+    ASSERT_TRUE(queue->Drain().empty());
+  }
+}
+
+TEST(SPSCQueue, CloseWhileProducing) {
+  CloseWhileProducing<SPSCPtrQueue<uint64_t, 4>>(1, 1);
+}
+
+TEST(MPMCQueue, CloseWhileProducing) {
+  CloseWhileProducing<MPMCPtrQueue<uint64_t, 4>>(4, 4);
+}
+
 }  // namespace
 }  // namespace nc
@@ -0,0 +1,181 @@
+#include "quantile_sketch.h"
+
+#include <cmath>
+
+namespace nc {
+
+// Scale function k1 from the t-digest paper and its inverse. Centroids can
+// span at most one unit of k, which makes them small near q = 0 and q = 1.
+static double QuantileToK(double q, double compression) {
+  return compression / (2 * M_PI) * std::asin(2 * q - 1);
+}
+
+static double KToQuantile(double k, double compression) {
+  return (std::sin(k * 2 * M_PI / compression) + 1) / 2;
+}
+
+TDigest::TDigest(double compression)
+    : compression_(compression),
+      buffer_capacity_(static_cast<size_t>(5 * compression)) {
+  CHECK(compression >= 10) << "Compression too small";
+  Clear();
+}
+
+void TDigest::Clear() {
+  centroids_.clear();
+  buffer_.clear();
+  total_weight_ = 0;
+  min_ = std::numeric_limits<double>::max();
+  max_ = std::numeric_limits<double>::lowest();
+}
+
+void TDigest::Compress() const {
+  if (buffer_.empty()) {
+    return;
+  }
+
+  buffer_.insert(buffer_.end(), centroids_.begin(), centroids_.end());
+  std::sort(buffer_.begin(), buffer_.end(),
+            [](const Centroid& lhs, const Centroid& rhs) {
+              return lhs.mean < rhs.mean;
+            });
+
+  double total = 0;
+  for (const Centroid& centroid : buffer_) {
+    total += centroid.weight;
+  }
+
+  centroids_.clear();
+  Centroid current = buffer_.front();
+  double weight_so_far = 0;
+  double q_limit =
+      KToQuantile(QuantileToK(0, compression_) + 1, compression_) * total;
+  for (size_t i = 1; i < buffer_.size(); ++i) {
+    const Centroid& next = buffer_[i];
+    if (weight_so_far + current.weight + next.weight <= q_limit) {
+      current.weight += next.weight;
+      current.mean += (next.mean - current.mean) * next.weight / current.weight;
+      continue;
+    }
+
+    weight_so_far += current.weight;
+    centroids_.emplace_back(current);
+    current = next;
+    double k = QuantileToK(weight_so_far / total, compression_);
+    q_limit = KToQuantile(k + 1, compression_) * total;
+  }
+
+  centroids_.emplace_back(current);
+  buffer_.clear();
+}
+
+void TDigest::Merge(const TDigest& other) {
+  other.Compress();
+  for (const Centroid& centroid : other.centroids_) {
+    buffer_.emplace_back(centroid);
+  }
+
+  total_weight_ += other.total_weight_;
+  min_ = std::min(min_, other.min_);
+  max_ = std::max(max_, other.max_);
+  Compress();
+}
+
+size_t TDigest::CentroidCount() const {
+  Compress();
+  return centroids_.size();
+}
+
+double TDigest::Quantile(double q) const {
+  CHECK(total_weight_ > 0) << "Empty digest";
+  CHECK(q >= 0 && q <= 1) << "Bad quantile " << q;
+  Compress();
+
+  if (centroids_.size() == 1) {
+    return centroids_.front().mean;
+  }
+
+  // Each centroid's mean is assumed to be at the middle of its weight. The
+  // value is interpolated between the two centroids the target falls between,
+  // or between a centroid and min/max at the ends.
+  double target = q * total_weight_;
+  const Centroid& first = centroids_.front();
+  if (target < first.weight / 2) {
+    return min_ + (first.mean - min_) * target / (first.weight / 2);
+  }
+
+  double weight_so_far = first.weight / 2;
+  for (size_t i = 1; i < centroids_.size(); ++i) {
+    const Centroid& prev = centroids_[i - 1];
+    const Centroid& next = centroids_[i];
+    double step = (prev.weight + next.weight) / 2;
+    if (target < weight_so_far + step) {
+      double fraction = (target - weight_so_far) / step;
+      return prev.mean + (next.mean - prev.mean) * fraction;
+    }
+
+    weight_so_far += step;
+  }
+
+  const Centroid& last = centroids_.back();
+  double remaining = total_weight_ - weight_so_far;
+  if (remaining <= 0) {
+    return max_;
+  }
+
+  double fraction = std::min(1.0, (target - weight_so_far) / remaining);
+  return last.mean + (max_ - last.mean) * fraction;
+}
+
+std::vector<double> TDigest::Percentiles(size_t n) const {
+  std::vector<double> out;
+  if (total_weight_ == 0) {
+    return out;
+  }
+
+  for (size_t i = 0; i < n + 1; ++i) {
+    out.emplace_back(Quantile(i / static_cast<double>(n)));
+  }
+
+  return out;
+}
+
+double TDigest::Cdf(double value) const {
+  CHECK(total_weight_ > 0) << "Empty digest";
+  Compress();
+
+  if (value < min_) {
+    return 0;
+  }
+  if (value >= max_) {
+    return 1;
+  }
+
+  const Centroid& first = centroids_.front();
+  if (value < first.mean) {
+    double span = first.mean - min_;
+    double fraction = span == 0 ? 1 : (value - min_) / span;
+    return fraction * first.weight / 2 / total_weight_;
+  }
+
+  double weight_so_far = first.weight / 2;
+  for (size_t i = 1; i < centroids_.size(); ++i) {
+    const Centroid& prev = centroids_[i - 1];
+    const Centroid& next = centroids_[i];
+    double step = (prev.weight + next.weight) / 2;
+    if (value < next.mean) {
+      double fraction = (value - prev.mean) / (next.mean - prev.mean);
+      return (weight_so_far + fraction * step) / total_weight_;
+    }
+
+    weight_so_far += step;
+  }
+
+  const Centroid& last = centroids_.back();
+  double span = max_ - last.mean;
+  double fraction = span == 0 ? 1 : (value - last.mean) / span;
+  double remaining = total_weight_ - weight_so_far;
+  return (weight_so_far + fraction * remaining) / total_weight_;
+}
+
+}  // namespace nc
@@ -0,0 +1,505 @@
+#ifndef NCODE_QUANTILE_SKETCH_H
+#define NCODE_QUANTILE_SKETCH_H
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <random>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "common.h"
+#include "logging.h"
+
+// Streaming quantile sketches. Unlike Percentiles in stats.h, which keeps and
+// sorts all values, these use bounded memory and can be merged, so that each
+// thread (or each queue) can keep its own sketch and combine them at the
+// end. They differ in what they accept and in the error they guarantee:
+//
+// LogLinearHistogram -- unsigned integers. Exact for small values, bounded
+// relative error for larger ones. The cheapest to update.
+// KLLSketch -- any ordered type. Bounded rank error, returns values that
+// were actually added.
+// TDigest -- doubles. Rank error that shrinks towards the extreme quantiles,
+// good for the tails of delay distributions.
+//
+// All have a Percentiles function that returns the same n+1 values that
+// Percentiles in stats.h returns, up to the sketch's error.
+
+namespace nc {
+
+// Counts values in buckets whose width grows with the value (like
+// HdrHistogram). Values below 2^significant_bits have a bucket each, larger
+// values are reported with a relative error of at most 2^-significant_bits
+// (0.8% for the default of 7). Memory is 8 bytes per bucket, at most 30KB
+// for the default precision and 64-bit values.
+template <typename T = uint64_t>
+class LogLinearHistogram {
+ public:
+  static_assert(std::is_integral<T>::value && std::is_unsigned<T>::value,
+                "Need an unsigned integral type");
+  static constexpr uint8_t kMinSignificantBits = 1;
+  static constexpr uint8_t kMaxSignificantBits = 16;
+
+  explicit LogLinearHistogram(uint8_t significant_bits = 7)
+      : significant_bits_(significant_bits) {
+    CHECK(significant_bits >= kMinSignificantBits &&
+          significant_bits <= kMaxSignificantBits)
+        << "Bad precision " << static_cast<int>(significant_bits);
+    Clear();
+  }
+
+  // Adds a value 'count' times.
+  void Add(T value, uint64_t count = 1) {
+    size_t index = BucketIndex(value, significant_bits_);
+    if (index >= counts_.size()) {
+      counts_.resize(index + 1, 0);
+    }
+
+    counts_[index] += count;
+    count_ += count;
+    sum_ += static_cast<double>(value) * count;
+    min_ = std::min(min_, value);
+    max_ = std::max(max_, value);
+  }
+
+  // Returns the value at a given quantile (in [0, 1]). The minimum and the
+  // maximum are exact. There should be at least one value.
+  T Quantile(double q) const {
+    CHECK(count_ > 0) << "Empty histogram";
+    return ValueAtRank(Rank(q));
+  }
+
+  // Returns n+1 values, the i-th of which is the i/n quantile.
+  std::vector<T> Percentiles(size_t n = 100) const {
+    std::vector<T> out;
+    if (count_ == 0) {
+      return out;
+    }
+
+    // Ranks are increasing, so the buckets can be walked once.
+    size_t index = 0;
+    uint64_t cumulative = counts_[0];
+    for (size_t i = 0; i < n + 1; ++i) {
+      uint64_t rank = Rank(i / static_cast<double>(n));
+      while (cumulative <= rank) {
+        cumulative += counts_[++index];
+      }
+      out.emplace_back(BucketValue(index, rank));
+    }
+
+    return out;
+  }
+
+  // Adds all values from another histogram, which should have the same
+  // precision.
+  void Merge(const LogLinearHistogram& other) {
+    CHECK(significant_bits_ == other.significant_bits_)
+        << "Precision mismatch";
+    if (counts_.size() < other.counts_.size()) {
+      counts_.resize(other.counts_.size(), 0);
+    }
+
+    for (size_t i = 0; i < other.counts_.size(); ++i) {
+      counts_[i] += other.counts_[i];
+    }
+
+    count_ += other.count_;
+    sum_ += other.sum_;
+    min_ = std::min(min_, other.min_);
+    max_ = std::max(max_, other.max_);
+  }
+
+  void Clear() {
+    counts_.clear();
+    count_ = 0;
+    sum_ = 0;
+    min_ = std::numeric_limits<T>::max();
+    max_ = 0;
+  }
+
+  uint64_t count() const { return count_; }
+
+  T min() const { return min_; }
+
+  T max() const { return max_; }
+
+  double mean() const { return count_ == 0 ? 0 : sum_ / count_; }
+
+  uint8_t significant_bits() const { return significant_bits_; }
+
+  size_t SizeBytes() const { return counts_.size() * sizeof(uint64_t); }
+
+  // The bucket a value falls in.
+  static size_t BucketIndex(uint64_t value, uint8_t significant_bits) {
+    uint64_t exact_limit = 1ull << significant_bits;
+    if (value < exact_limit) {
+      return value;
+    }
+
+    // Position of the most significant bit, at least significant_bits.
+    uint8_t msb = 63 - __builtin_clzll(value);
+    uint8_t shift = msb - significant_bits + 1;
+    uint64_t half = exact_limit / 2;
+    return exact_limit + (msb - significant_bits) * half +
+           ((value >> shift) - half);
+  }
+
+  // The smallest and the largest value that fall in a bucket.
+  static std::pair<uint64_t, uint64_t> BucketRange(size_t index,
+                                                   uint8_t significant_bits) {
+    uint64_t exact_limit = 1ull << significant_bits;
+    if (index < exact_limit) {
+      return {index, index};
+    }
+
+    uint64_t half = exact_limit / 2;
+    uint64_t offset = index - exact_limit;
+    uint8_t shift = offset / half + 1;
+    uint64_t low = (half + offset % half) << shift;
+    return {low, low + ((1ull << shift) - 1)};
+  }
+
+ private:
+  // Same rank as Percentiles in stats.h.
+  uint64_t Rank(double q) const {
+    CHECK(q >= 0 && q <= 1) << "Bad quantile " << q;
+    return static_cast<uint64_t>(0.5 + (count_ - 1) * q);
+  }
+
+  T ValueAtRank(uint64_t rank) const {
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i < counts_.size(); ++i) {
+      cumulative += counts_[i];
+      if (cumulative > rank) {
+        return BucketValue(i, rank);
+      }
+    }
+
+    LOG(FATAL) << "Rank past end";
+    return 0;
+  }
+
+  // Middle of the bucket, limited to the values seen.
+  T BucketValue(size_t index, uint64_t rank) const {
+    if (rank == 0) {
+      return min_;
+    }
+    if (rank == count_ - 1) {
+      return max_;
+    }
+
+    std::pair<uint64_t, uint64_t> range =
+        BucketRange(index, significant_bits_);
+    uint64_t middle = range.first + (range.second - range.first) / 2;
+    middle = std::max(middle, static_cast<uint64_t>(min_));
+    middle = std::min(middle, static_cast<uint64_t>(max_));
+    return static_cast<T>(middle);
+  }
+
+  uint8_t significant_bits_;
+  std::vector<uint64_t> counts_;
+  uint64_t count_;
+  double sum_;
+  T min_;
+  T max_;
+};
+
+// A KLL sketch (Karnin, Lang and Liberty, "Optimal Quantile Approximation in
+// Streams"). Keeps about 3k values in levels of compactors -- when a level
+// fills up it is sorted and every other value (randomly the odd or the even
+// ones) moves to the next level with twice the weight. The rank of a returned
+// value differs from the requested one by less than about 1.7 / k * n with
+// 99% probability (1.65% for the default k of 200). Results are
+// deterministic for a given seed.
+template <typename T, typename Compare = std::less<T>>
+class KLLSketch {
+ public:
+  static constexpr size_t kMinK = 8;
+
+  explicit KLLSketch(size_t k = 200, uint64_t seed = 1,
+                     Compare compare = Compare())
+      : k_(k), count_(0), size_(0), rnd_(seed), compare_(compare) {
+    CHECK(k >= kMinK) << "k too small";
+    levels_.emplace_back();
+  }
+
+  void Add(const T& value) {
+    if (count_ == 0) {
+      min_ = value;
+      max_ = value;
+    } else {
+      if (compare_(value, min_)) {
+        min_ = value;
+      }
+      if (compare_(max_, value)) {
+        max_ = value;
+      }
+    }
+
+    levels_[0].emplace_back(value);
+    ++count_;
+    ++size_;
+    if (size_ >= Capacity()) {
+      Compress();
+    }
+  }
+
+  // Returns the value at a given quantile (in [0, 1]). The minimum and the
+  // maximum are exact. There should be at least one value.
+  T Quantile(double q) const {
+    CHECK(count_ > 0) << "Empty sketch";
+    return ValuesAtQuantiles({q}).front();
+  }
+
+  // Returns n+1 values, the i-th of which is the i/n quantile.
+  std::vector<T> Percentiles(size_t n = 100) const {
+    if (count_ == 0) {
+      return {};
+    }
+
+    std::vector<double> quantiles;
+    for (size_t i = 0; i < n + 1; ++i) {
+      quantiles.emplace_back(i / static_cast<double>(n));
+    }
+    return ValuesAtQuantiles(quantiles);
+  }
+
+  // Adds all values from another sketch, which should have the same k.
+  void Merge(const KLLSketch& other) {
+    CHECK(k_ == other.k_) << "k mismatch";
+    if (other.count_ == 0) {
+      return;
+    }
+
+    if (count_ == 0) {
+      min_ = other.min_;
+      max_ = other.max_;
+    } else {
+      if (compare_(other.min_, min_)) {
+        min_ = other.min_;
+      }
+      if (compare_(max_, other.max_)) {
+        max_ = other.max_;
+      }
+    }
+
+    if (levels_.size() < other.levels_.size()) {
+      levels_.resize(other.levels_.size());
+    }
+
+    for (size_t i = 0; i < other.levels_.size(); ++i) {
+      levels_[i].insert(levels_[i].end(), other.levels_[i].begin(),
+                        other.levels_[i].end());
+    }
+
+    count_ += other.count_;
+    size_ += other.size_;
+    while (size_ >= Capacity()) {
+      Compress();
+    }
+  }
+
+  void Clear() {
+    levels_.clear();
+    levels_.emplace_back();
+    count_ = 0;
+    size_ = 0;
+  }
+
+  uint64_t count() const { return count_; }
+
+  // Number of values retained.
+  size_t size() const { return size_; }
+
+  const T& min() const {
+    CHECK(count_ > 0) << "Empty sketch";
+    return min_;
+  }
+
+  const T& max() const {
+    CHECK(count_ > 0) << "Empty sketch";
+    return max_;
+  }
+
+ private:
+  // Returns the values at the given quantiles, which should be increasing.
+  std::vector<T> ValuesAtQuantiles(const std::vector<double>& quantiles) const {
+    // All retained values with their weights, sorted.
+    std::vector<std::pair<T, uint64_t>> weighted;
+    weighted.reserve(size_);
+    for (size_t level = 0; level < levels_.size(); ++level) {
+      for (const T& value : levels_[level]) {
+        weighted.emplace_back(value, 1ull << level);
+      }
+    }
+
+    std::sort(weighted.begin(), weighted.end(),
+              [this](const std::pair<T, uint64_t>& lhs,
+                     const std::pair<T, uint64_t>& rhs) {
+                return compare_(lhs.first, rhs.first);
+              });
+
+    std::vector<T> out;
+    size_t index = 0;
+    uint64_t cumulative = weighted[0].second;
+    for (double q : quantiles) {
+      CHECK(q >= 0 && q <= 1) << "Bad quantile " << q;
+      uint64_t rank = static_cast<uint64_t>(0.5 + (count_ - 1) * q);
+      if (rank == 0) {
+        out.emplace_back(min_);
+        continue;
+      }
+      if (rank == count_ - 1) {
+        out.emplace_back(max_);
+        continue;
+      }
+
+      while (cumulative <= rank && index + 1 < weighted.size()) {
+        cumulative += weighted[++index].second;
+      }
+      out.emplace_back(weighted[index].first);
+    }
+
+    return out;
+  }
+
+  // Capacity of a level. Lower levels are smaller, by a factor of 2/3 per
+  // level.
+  size_t LevelCapacity(size_t level) const {
+    size_t depth = levels_.size() - level - 1;
+    double capacity = k_;
+    for (size_t i = 0; i < depth && capacity > 2; ++i) {
+      capacity *= 2.0 / 3.0;
+    }
+
+    return std::max(static_cast<size_t>(2), static_cast<size_t>(capacity));
+  }
+
+  size_t Capacity() const {
+    size_t total = 0;
+    for (size_t level = 0; level < levels_.size(); ++level) {
+      total += LevelCapacity(level);
+    }
+    return total;
+  }
+
+  // Compacts the lowest level that is at capacity.
+  void Compress() {
+    for (size_t level = 0; level < levels_.size(); ++level) {
+      if (levels_[level].size() < LevelCapacity(level)) {
+        continue;
+      }
+
+      if (level + 1 == levels_.size()) {
+        levels_.emplace_back();
+      }
+
+      std::vector<T>& values = levels_[level];
+      std::sort(values.begin(), values.end(), compare_);
+
+      // With an odd number of values one stays at this level.
+      size_t begin = values.size() % 2;
+      size_t offset = rnd_() & 1;
+      std::vector<T>& next = levels_[level + 1];
+      for (size_t i = begin + offset; i < values.size(); i += 2) {
+        next.emplace_back(std::move(values[i]));
+      }
+
+      size_ -= (values.size() - begin) / 2;
+      values.resize(begin);
+      return;
+    }
+  }
+
+  size_t k_;
+  uint64_t count_;
+
+  // Number of values in all levels.
+  size_t size_;
+
+  // Values at level i have a weight of 2^i.
+  std::vector<std::vector<T>> levels_;
+
+  std::mt19937_64 rnd_;
+  Compare compare_;
+  T min_;
+  T max_;
+};
+
+// A merging t-digest (Dunning and Ertl, "Computing Extremely Accurate
+// Quantiles Using t-Digests"). Values are summarized by at most about
+// 'compression' centroids, smaller ones near the extremes. The rank error at
+// quantile q is at most about pi * sqrt(q * (1 - q)) / compression of the
+// total weight (1.6% at the median and 0.3% at the 99th percentile for the
+// default compression of 100), and usually much less.
+class TDigest {
+ public:
+  explicit TDigest(double compression = 100);
+
+  void Add(double value, double weight = 1) {
+    buffer_.push_back({value, weight});
+    total_weight_ += weight;
+    min_ = std::min(min_, value);
+    max_ = std::max(max_, value);
+    if (buffer_.size() >= buffer_capacity_) {
+      Compress();
+    }
+  }
+
+  // Returns the (interpolated) value at a given quantile (in [0, 1]). The
+  // minimum and the maximum are exact. There should be at least one value.
+  double Quantile(double q) const;
+
+  // Returns n+1 values, the i-th of which is the i/n quantile.
+  std::vector<double> Percentiles(size_t n = 100) const;
+
+  // Estimated fraction of the total weight at values less than or equal to
+  // 'value'.
+  double Cdf(double value) const;
+
+  // Adds all values from another digest.
+  void Merge(const TDigest& other);
+
+  void Clear();
+
+  double total_weight() const { return total_weight_; }
+
+  double min() const { return min_; }
+
+  double max() const { return max_; }
+
+  // Number of centroids, after merging buffered values.
+  size_t CentroidCount() const;
+
+  double compression() const { return compression_; }
+
+ private:
+  struct Centroid {
+    double mean;
+    double weight;
+  };
+
+  // Merges the buffered values into the centroids. Called from const member
+  // functions, so a TDigest should not be queried from multiple threads at
+  // the same time.
+  void Compress() const;
+
+  double compression_;
+  size_t buffer_capacity_;
+  double total_weight_;
+  double min_;
+  double max_;
+
+  // Sorted by mean.
+  mutable std::vector<Centroid> centroids_;
+
+  // Values added since the last call to Compress.
+  mutable std::vector<Centroid> buffer_;
+};
+
+}  // namespace nc
+
+#endif
@@ -0,0 +1,236 @@
+#include "quantile_sketch.h"
+
+#include <random>
+#include <string>
+#include "gtest/gtest.h"
+
+#include "stats.h"
+
+namespace nc {
+namespace {
+
+static std::vector<uint64_t> RandomValues(size_t count, uint64_t seed) {
+  std::mt19937_64 rnd(seed);
+  std::lognormal_distribution<double> dist(10, 2);
+  std::vector<uint64_t> out;
+  for (size_t i = 0; i < count; ++i) {
+    out.emplace_back(static_cast<uint64_t>(dist(rnd)));
+  }
+  return out;
+}
+
+// Fraction of 'sorted' that is less than or equal to 'value'.
+template <typename T>
+static double Rank(const std::vector<T>& sorted, T value) {
+  auto it = std::upper_bound(sorted.begin(), sorted.end(), value);
+  return std::distance(sorted.begin(), it) / static_cast<double>(sorted.size());
+}
+
+TEST(LogLinearHistogram, Empty) {
+  LogLinearHistogram<uint64_t> histogram;
+  ASSERT_EQ(0ul, histogram.count());
+  ASSERT_TRUE(histogram.Percentiles().empty());
+  ASSERT_DEATH(histogram.Quantile(0.5), ".*");
+}
+
+TEST(LogLinearHistogram, BadPrecision) {
+  ASSERT_DEATH(LogLinearHistogram<uint64_t>(0), "Bad precision");
+  ASSERT_DEATH(LogLinearHistogram<uint64_t>(17), "Bad precision");
+}
+
+TEST(LogLinearHistogram, Buckets) {
+  for (uint8_t bits : {1, 3, 7, 12}) {
+    size_t prev_index = 0;
+    for (uint64_t value = 1; value < 100000; ++value) {
+      size_t index = LogLinearHistogram<uint64_t>::BucketIndex(value, bits);
+      ASSERT_TRUE(index == prev_index || index == prev_index + 1);
+      prev_index = index;
+
+      std::pair<uint64_t, uint64_t> range =
+          LogLinearHistogram<uint64_t>::BucketRange(index, bits);
+      ASSERT_LE(range.first, value);
+      ASSERT_GE(range.second, value);
+      ASSERT_LE(range.second - range.first,
+                std::max(1.0, value / static_cast<double>(1 << bits) * 2));
+    }
+  }
+
+  uint64_t max = std::numeric_limits<uint64_t>::max();
+  size_t index = LogLinearHistogram<uint64_t>::BucketIndex(max, 7);
+  ASSERT_EQ(max, LogLinearHistogram<uint64_t>::BucketRange(index, 7).second);
+}
+
+TEST(LogLinearHistogram, SmallValuesExact) {
+  std::vector<uint64_t> values;
+  LogLinearHistogram<uint64_t> histogram;
+  for (uint64_t i = 0; i < 100; ++i) {
+    values.emplace_back(i % 17);
+    histogram.Add(i % 17);
+  }
+
+  ASSERT_EQ(Percentiles(&values), histogram.Percentiles());
+  ASSERT_EQ(0ul, histogram.min());
+  ASSERT_EQ(16ul, histogram.max());
+}
+
+TEST(LogLinearHistogram, RelativeError) {
+  std::vector<uint64_t> values = RandomValues(100000, 1);
+  LogLinearHistogram<uint64_t> histogram;
+  for (uint64_t value : values) {
+    histogram.Add(value);
+  }
+
+  std::vector<uint64_t> model = Percentiles(&values);
+  std::vector<uint64_t> percentiles = histogram.Percentiles();
+  ASSERT_EQ(model.size(), percentiles.size());
+  ASSERT_EQ(model.front(), percentiles.front());
+  ASSERT_EQ(model.back(), percentiles.back());
+  for (size_t i = 0; i < model.size(); ++i) {
+    ASSERT_NEAR(model[i], percentiles[i], model[i] / 128.0 + 1);
+  }
+  ASSERT_NEAR(50, histogram.Quantile(0.5) / (model[50] / 50.0), 0.5);
+}
+
+TEST(LogLinearHistogram, Merge) {
+  std::vector<uint64_t> values = RandomValues(10000, 1);
+  LogLinearHistogram<uint64_t> all;
+  LogLinearHistogram<uint64_t> first;
+  LogLinearHistogram<uint64_t> second;
+  for (size_t i = 0; i < values.size(); ++i) {
+    all.Add(values[i]);
+    (i % 3 == 0 ? first : second).Add(values[i]);
+  }
+
+  first.Merge(second);
+  ASSERT_EQ(all.Percentiles(), first.Percentiles());
+  ASSERT_EQ(all.count(), first.count());
+  ASSERT_DOUBLE_EQ(all.mean(), first.mean());
+
+  LogLinearHistogram<uint64_t> other_precision(3);
+  ASSERT_DEATH(first.Merge(other_precision), "mismatch");
+}
+
+TEST(KLLSketch, Empty) {
+  KLLSketch<double> sketch;
+  ASSERT_TRUE(sketch.Percentiles().empty());
+  ASSERT_DEATH(sketch.Quantile(0.5), ".*");
+}
+
+TEST(KLLSketch, SmallExact) {
+  std::vector<uint64_t> values = RandomValues(100, 1);
+  KLLSketch<uint64_t> sketch;
+  for (uint64_t value : values) {
+    sketch.Add(value);
+  }
+
+  ASSERT_EQ(Percentiles(&values), sketch.Percentiles());
+}
+
+TEST(KLLSketch, RankError) {
+  std::vector<uint64_t> values = RandomValues(1000000, 2);
+  KLLSketch<uint64_t> sketch;
+  for (uint64_t value : values) {
+    sketch.Add(value);
+  }
+  ASSERT_EQ(values.size(), sketch.count());
+  ASSERT_GT(2000ul, sketch.size());
+
+  std::sort(values.begin(), values.end());
+  std::vector<uint64_t> percentiles = sketch.Percentiles();
+  ASSERT_EQ(values.front(), percentiles.front());
+  ASSERT_EQ(values.back(), percentiles.back());
+  for (size_t i = 0; i < percentiles.size(); ++i) {
+    ASSERT_NEAR(i / 100.0, Rank(values, percentiles[i]), 0.0165);
+  }
+}
+
+TEST(KLLSketch, Merge) {
+  std::vector<uint64_t> values = RandomValues(100000, 3);
+  std::vector<KLLSketch<uint64_t>> sketches(8);
+  for (size_t i = 0; i < values.size(); ++i) {
+    sketches[i % sketches.size()].Add(values[i]);
+  }
+
+  KLLSketch<uint64_t> merged;
+  for (const KLLSketch<uint64_t>& sketch : sketches) {
+    merged.Merge(sketch);
+  }
+  ASSERT_EQ(values.size(), merged.count());
+
+  std::sort(values.begin(), values.end());
+  for (double q : {0.0, 0.01, 0.25, 0.5, 0.75, 0.99, 1.0}) {
+    ASSERT_NEAR(q, Rank(values, merged.Quantile(q)), 0.0165);
+  }
+
+  KLLSketch<uint64_t> other_k(100);
+  ASSERT_DEATH(merged.Merge(other_k), "mismatch");
+}
+
+TEST(KLLSketch, Strings) {
+  KLLSketch<std::string> sketch(16);
+  for (size_t i = 0; i < 1000; ++i) {
+    sketch.Add(std::to_string(i));
+  }
+
+  ASSERT_EQ("0", sketch.min());
+  ASSERT_EQ("999", sketch.max());
+  ASSERT_EQ("0", sketch.Quantile(0));
+  ASSERT_EQ("999", sketch.Quantile(1));
+}
+
+TEST(TDigest, Empty) {
+  TDigest digest;
+  ASSERT_TRUE(digest.Percentiles().empty());
+  ASSERT_DEATH(digest.Quantile(0.5), ".*");
+}
+
+TEST(TDigest, Single) {
+  TDigest digest;
+  digest.Add(42);
+  ASSERT_EQ(42, digest.Quantile(0));
+  ASSERT_EQ(42, digest.Quantile(0.5));
+  ASSERT_EQ(42, digest.Quantile(1));
+}
+
+TEST(TDigest, RankError) {
+  std::vector<uint64_t> values = RandomValues(1000000, 4);
+  TDigest digest;
+  for (uint64_t value : values) {
+    digest.Add(value);
+  }
+  ASSERT_GT(200ul, digest.CentroidCount());
+
+  std::sort(values.begin(), values.end());
+  ASSERT_EQ(values.front(), digest.Quantile(0));
+  ASSERT_EQ(values.back(), digest.Quantile(1));
+  for (double q : {0.001, 0.01, 0.1, 0.25, 0.5, 0.75, 0.9, 0.99, 0.999}) {
+    double value = digest.Quantile(q);
+    double bound = M_PI * std::sqrt(q * (1 - q)) / digest.compression();
+    ASSERT_NEAR(q, Rank(values, static_cast<uint64_t>(value)), bound);
+    ASSERT_NEAR(q, digest.Cdf(value), bound);
+  }
+}
+
+TEST(TDigest, Merge) {
+  std::vector<uint64_t> values = RandomValues(100000, 5);
+  std::vector<TDigest> digests(8);
+  for (size_t i = 0; i < values.size(); ++i) {
+    digests[i % digests.size()].Add(values[i]);
+  }
+
+  TDigest merged;
+  for (const TDigest& digest : digests) {
+    merged.Merge(digest);
+  }
+  ASSERT_DOUBLE_EQ(values.size(), merged.total_weight());
+
+  std::sort(values.begin(), values.end());
+  for (double q : {0.01, 0.25, 0.5, 0.75, 0.99}) {
+    double bound = M_PI * std::sqrt(q * (1 - q)) / merged.compression();
+    ASSERT_NEAR(q, Rank(values, static_cast<uint64_t>(merged.Quantile(q))),
+                bound);
+  }
+}
+
+}  // namespace
+}  // namespace nc
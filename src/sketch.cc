@@ -0,0 +1,232 @@
+#include "sketch.h"
+
+#include <cmath>
+#include <iterator>
+#include <limits>
+
+namespace nc {
+
+HyperLogLog::HyperLogLog(uint8_t precision)
+    : precision_(precision), registers_(1ul << precision, 0) {
+  CHECK(precision >= kMinPrecision && precision <= kMaxPrecision)
+      << "Bad precision " << static_cast<int>(precision);
+}
+
+double HyperLogLog::EstimateFromRegisters(const uint8_t* registers,
+                                          size_t num_registers) {
+  double m = num_registers;
+  double sum = 0;
+  size_t zeros = 0;
+  for (size_t i = 0; i < num_registers; ++i) {
+    sum += std::ldexp(1.0, -registers[i]);
+    zeros += (registers[i] == 0);
+  }
+
+  double alpha;
+  if (num_registers == 16) {
+    alpha = 0.673;
+  } else if (num_registers == 32) {
+    alpha = 0.697;
+  } else if (num_registers == 64) {
+    alpha = 0.709;
+  } else {
+    alpha = 0.7213 / (1.0 + 1.079 / m);
+  }
+
+  double estimate = alpha * m * m / sum;
+  if (estimate <= 2.5 * m && zeros != 0) {
+    // Linear counting is more accurate for small cardinalities.
+    return m * std::log(m / zeros);
+  }
+
+  return estimate;
+}
+
+double HyperLogLog::Estimate() const {
+  return EstimateFromRegisters(registers_.data(), registers_.size());
+}
+
+void HyperLogLog::Merge(const HyperLogLog& other) {
+  CHECK(precision_ == other.precision_) << "Precision mismatch";
+  for (size_t i = 0; i < registers_.size(); ++i) {
+    registers_[i] = std::max(registers_[i], other.registers_[i]);
+  }
+}
+
+void HyperLogLog::Clear() {
+  std::fill(registers_.begin(), registers_.end(), 0);
+}
+
+SlidingHyperLogLog::SlidingHyperLogLog(uint64_t max_window, uint8_t precision)
+    : precision_(precision),
+      max_window_(max_window),
+      latest_time_(0),
+      registers_(1ul << precision) {
+  CHECK(precision >= HyperLogLog::kMinPrecision &&
+        precision <= HyperLogLog::kMaxPrecision)
+      << "Bad precision " << static_cast<int>(precision);
+  CHECK(max_window > 0);
+}
+
+void SlidingHyperLogLog::Expire(std::vector<Entry>* entries) const {
+  if (latest_time_ < max_window_) {
+    return;
+  }
+
+  uint64_t min_time = latest_time_ - max_window_;
+  size_t num_expired = 0;
+  while (num_expired < entries->size() &&
+         (*entries)[num_expired].time <= min_time) {
+    ++num_expired;
+  }
+
+  if (num_expired > 0) {
+    entries->erase(entries->begin(), entries->begin() + num_expired);
+  }
+}
+
+void SlidingHyperLogLog::Insert(size_t index, uint64_t time, uint8_t rank) {
+  std::vector<Entry>& entries = registers_[index];
+
+  // Position of the first entry newer than this one.
+  auto it = entries.end();
+  while (it != entries.begin() && std::prev(it)->time > time) {
+    --it;
+  }
+
+  // Ranks decrease with time, so the entry at 'it' has the largest rank of all
+  // entries newer than this one. If it is not smaller this entry can never be
+  // the maximum of any window.
+  if (it != entries.end() && it->rank >= rank) {
+    return;
+  }
+
+  // Entries that are not newer and have a smaller or equal rank are dominated
+  // by this one.
+  auto first_dominated = it;
+  while (first_dominated != entries.begin() &&
+         std::prev(first_dominated)->rank <= rank) {
+    --first_dominated;
+  }
+
+  it = entries.erase(first_dominated, it);
+  entries.insert(it, {time, rank});
+}
+
+void SlidingHyperLogLog::Add(uint64_t hash, uint64_t time) {
+  uint64_t mixed = SketchMix(hash);
+  size_t index = mixed >> (64 - precision_);
+  uint8_t rank = HyperLogLog::Rank(mixed, precision_);
+
+  latest_time_ = std::max(latest_time_, time);
+  std::vector<Entry>& entries = registers_[index];
+  Expire(&entries);
+  if (latest_time_ >= max_window_ && time <= latest_time_ - max_window_) {
+    return;
+  }
+
+  if (entries.empty() || entries.back().time <= time) {
+    // Fast path for the common case of monotonic times.
+    while (!entries.empty() && entries.back().rank <= rank) {
+      entries.pop_back();
+    }
+    entries.push_back({time, rank});
+    return;
+  }
+
+  Insert(index, time, rank);
+}
+
+double SlidingHyperLogLog::Estimate(uint64_t window, uint64_t now) const {
+  CHECK(window <= max_window_) << "Window too large";
+  std::vector<uint8_t> max_ranks(registers_.size(), 0);
+  for (size_t i = 0; i < registers_.size(); ++i) {
+    for (const Entry& entry : registers_[i]) {
+      if (entry.time > now) {
+        break;
+      }
+
+      if (now - entry.time < window) {
+        // Ranks decrease with time, the first entry in the window has the
+        // largest rank.
+        max_ranks[i] = entry.rank;
+        break;
+      }
+    }
+  }
+
+  return HyperLogLog::EstimateFromRegisters(max_ranks.data(),
+                                            max_ranks.size());
+}
+
+void SlidingHyperLogLog::Merge(const SlidingHyperLogLog& other) {
+  CHECK(precision_ == other.precision_) << "Precision mismatch";
+  latest_time_ = std::max(latest_time_, other.latest_time_);
+  for (size_t i = 0; i < registers_.size(); ++i) {
+    for (const Entry& entry : other.registers_[i]) {
+      Insert(i, entry.time, entry.rank);
+    }
+    Expire(&registers_[i]);
+  }
+}
+
+void SlidingHyperLogLog::Clear() {
+  latest_time_ = 0;
+  for (std::vector<Entry>& entries : registers_) {
+    entries.clear();
+  }
+}
+
+size_t SlidingHyperLogLog::EntryCount() const {
+  size_t total = 0;
+  for (const std::vector<Entry>& entries : registers_) {
+    total += entries.size();
+  }
+  return total;
+}
+
+size_t SlidingHyperLogLog::SizeBytes() const {
+  size_t total = registers_.size() * sizeof(std::vector<Entry>);
+  for (const std::vector<Entry>& entries : registers_) {
+    total += entries.capacity() * sizeof(Entry);
+  }
+  return total;
+}
+
+CountMinSketch::CountMinSketch(size_t width, size_t depth)
+    : width_(width), depth_(depth), total_(0), counters_(width * depth, 0) {
+  CHECK(width > 0 && depth > 0);
+}
+
+void CountMinSketch::Add(uint64_t hash, uint64_t count) {
+  uint64_t mixed = SketchMix(hash);
+  for (size_t row = 0; row < depth_; ++row) {
+    counters_[Cell(mixed, row)] += count;
+  }
+  total_ += count;
+}
+
+uint64_t CountMinSketch::Estimate(uint64_t hash) const {
+  uint64_t mixed = SketchMix(hash);
+  uint64_t min_count = std::numeric_limits<uint64_t>::max();
+  for (size_t row = 0; row < depth_; ++row) {
+    min_count = std::min(min_count, counters_[Cell(mixed, row)]);
+  }
+  return min_count;
+}
+
+void CountMinSketch::Merge(const CountMinSketch& other) {
+  CHECK(width_ == other.width_ && depth_ == other.depth_)
+      << "Dimension mismatch";
+  for (size_t i = 0; i < counters_.size(); ++i) {
+    counters_[i] += other.counters_[i];
+  }
+  total_ += other.total_;
+}
+
+void CountMinSketch::Clear() {
+  std::fill(counters_.begin(), counters_.end(), 0);
+  total_ = 0;
+}
+
+}  // namespace nc
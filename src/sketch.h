@@ -0,0 +1,389 @@
+#ifndef NCODE_SKETCH_H
+#define NCODE_SKETCH_H
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+#include "common.h"
+#include "logging.h"
+
+// Fixed-size probabilistic summaries of large streams. All sketches in this
+// file operate on 64-bit hashes supplied by the caller and can be merged, so
+// that each thread can keep its own sketch and combine them at the end. The
+// supplied hashes are remixed internally, so weak hashes (e.g. the polynomial
+// hash of net::FiveTuple) are fine.
+
+namespace nc {
+
+// Bit mixer used to spread the bits of the hashes supplied to the sketches.
+// This is the finalizer of SplitMix64.
+inline uint64_t SketchMix(uint64_t x) {
+  x += 0x9e3779b97f4a7c15ull;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+  return x ^ (x >> 31);
+}
+
+// Estimates the number of distinct elements in a stream. Uses 2^precision
+// one-byte registers, the relative standard error is ~1.04 / sqrt(2^precision)
+// (1.6% for the default precision of 12, which takes 4KB).
+class HyperLogLog {
+ public:
+  static constexpr uint8_t kMinPrecision = 4;
+  static constexpr uint8_t kMaxPrecision = 18;
+
+  explicit HyperLogLog(uint8_t precision = 12);
+
+  // Adds an element, identified by its hash, to the sketch.
+  void Add(uint64_t hash) {
+    uint64_t mixed = SketchMix(hash);
+    size_t index = mixed >> (64 - precision_);
+    uint8_t rank = Rank(mixed, precision_);
+    if (registers_[index] < rank) {
+      registers_[index] = rank;
+    }
+  }
+
+  // Estimated number of distinct elements added so far.
+  double Estimate() const;
+
+  // Combines another sketch with this one. After the call this sketch will
+  // estimate the cardinality of the union of both streams. The other sketch
+  // should have the same precision.
+  void Merge(const HyperLogLog& other);
+
+  // Resets the sketch to its initial state.
+  void Clear();
+
+  uint8_t precision() const { return precision_; }
+
+  // Memory used by the registers.
+  size_t SizeBytes() const { return registers_.size(); }
+
+  // The rank of a hash value -- the position of the leftmost 1 bit after the
+  // first 'precision' bits (which are used as a register index).
+  static uint8_t Rank(uint64_t mixed_hash, uint8_t precision) {
+    uint64_t w = mixed_hash << precision;
+    if (w == 0) {
+      return 64 - precision + 1;
+    }
+
+    return __builtin_clzll(w) + 1;
+  }
+
+  // Returns the cardinality estimate given the values of all registers.
+  // Applies the linear counting correction for small cardinalities.
+  static double EstimateFromRegisters(const uint8_t* registers,
+                                      size_t num_registers);
+
+ private:
+  uint8_t precision_;
+  std::vector<uint8_t> registers_;
+};
+
+// A HyperLogLog that can estimate the number of distinct elements seen within
+// any time window up to a maximum window size ("Sliding HyperLogLog" by
+// Chabchoub and Hebrail). Each register keeps a short list of (time, rank)
+// pairs that could still become the maximum rank of some window. The list is
+// ordered by time and has strictly decreasing ranks, so its expected length
+// is logarithmic in the number of elements per window. Times are arbitrary
+// non-negative integers (e.g. EventQueueTime::Raw()).
+class SlidingHyperLogLog {
+ public:
+  SlidingHyperLogLog(uint64_t max_window, uint8_t precision = 10);
+
+  // Adds an element, seen at a given time, to the sketch. Times need not be
+  // monotonic, but entries older than max_window from the most recent time
+  // passed to this function are discarded.
+  void Add(uint64_t hash, uint64_t time);
+
+  // Estimates the number of distinct elements seen in the interval
+  // (now - window, now]. The window should not exceed max_window. Since
+  // entries are dropped once a newer one with a larger rank arrives, 'now'
+  // should not be earlier than the latest time passed to Add.
+  double Estimate(uint64_t window, uint64_t now) const;
+
+  // Combines another sketch with this one. Both should have the same
+  // precision.
+  void Merge(const SlidingHyperLogLog& other);
+
+  // Resets the sketch to its initial state.
+  void Clear();
+
+  uint64_t max_window() const { return max_window_; }
+
+  uint8_t precision() const { return precision_; }
+
+  // Number of (time, rank) pairs currently stored across all registers.
+  size_t EntryCount() const;
+
+  size_t SizeBytes() const;
+
+ private:
+  struct Entry {
+    uint64_t time;
+    uint8_t rank;
+  };
+
+  // Inserts a (time, rank) pair in a register's list, dropping pairs that are
+  // dominated by a newer pair with a larger or equal rank.
+  void Insert(size_t index, uint64_t time, uint8_t rank);
+
+  // Drops entries that are older than max_window from latest_time_.
+  void Expire(std::vector<Entry>* entries) const;
+
+  uint8_t precision_;
+  uint64_t max_window_;
+
+  // Largest time seen so far.
+  uint64_t latest_time_;
+
+  std::vector<std::vector<Entry>> registers_;
+};
+
+// Estimates the frequency of elements in a stream. An estimate never
+// underestimates the true count and with probability 1 - exp(-depth) it
+// overestimates by at most e / width * total count.
+class CountMinSketch {
+ public:
+  CountMinSketch(size_t width, size_t depth);
+
+  // Adds 'count' occurrences of an element.
+  void Add(uint64_t hash, uint64_t count = 1);
+
+  // Returns an upper bound on the number of times an element has been seen.
+  uint64_t Estimate(uint64_t hash) const;
+
+  // Combines another sketch with this one. Both should have the same
+  // dimensions.
+  void Merge(const CountMinSketch& other);
+
+  // Resets all counters to 0.
+  void Clear();
+
+  size_t width() const { return width_; }
+
+  size_t depth() const { return depth_; }
+
+  // Sum of all counts added.
+  uint64_t total() const { return total_; }
+
+  size_t SizeBytes() const { return counters_.size() * sizeof(uint64_t); }
+
+ private:
+  // The cell an element maps to in a given row.
+  size_t Cell(uint64_t mixed_hash, size_t row) const {
+    uint64_t h1 = mixed_hash;
+    uint64_t h2 = (mixed_hash >> 32) | 1;
+    return row * width_ + (h1 + row * h2) % width_;
+  }
+
+  size_t width_;
+  size_t depth_;
+  uint64_t total_;
+  std::vector<uint64_t> counters_;
+};
+
+// Tracks the most frequent elements of a stream using a fixed number of
+// counters (the SpaceSaving algorithm by Metwally et al.). Any element whose
+// count is more than total / capacity is guaranteed to be tracked. Each
+// tracked element's count is an upper bound on its true count, and count -
+// error is a lower bound.
+template <typename K, typename Hash = std::hash<K>>
+class SpaceSaving {
+ public:
+  struct Entry {
+    K key;
+    uint64_t count;
+    uint64_t error;
+  };
+
+  explicit SpaceSaving(size_t capacity) : capacity_(capacity), total_(0) {
+    CHECK(capacity > 0);
+    heap_.reserve(capacity);
+  }
+
+  // Adds 'count' occurrences of a key.
+  void Add(const K& key, uint64_t count = 1) {
+    total_ += count;
+    auto it = positions_.find(key);
+    if (it != positions_.end()) {
+      size_t position = it->second;
+      heap_[position].count += count;
+      SiftDown(position);
+      return;
+    }
+
+    if (heap_.size() < capacity_) {
+      heap_.push_back({key, count, 0});
+      positions_[key] = heap_.size() - 1;
+      SiftUp(heap_.size() - 1);
+      return;
+    }
+
+    // Replaces the element with the smallest count.
+    Entry& min_entry = heap_.front();
+    positions_.erase(min_entry.key);
+    min_entry.error = min_entry.count;
+    min_entry.count += count;
+    min_entry.key = key;
+    positions_[key] = 0;
+    SiftDown(0);
+  }
+
+  // Returns an upper bound on the count of a key.
+  uint64_t Estimate(const K& key) const {
+    auto it = positions_.find(key);
+    if (it != positions_.end()) {
+      return heap_[it->second].count;
+    }
+
+    return MinCount();
+  }
+
+  // Returns up to k tracked elements, sorted in decreasing order of count.
+  std::vector<Entry> TopK(size_t k) const {
+    std::vector<Entry> out = heap_;
+    std::sort(out.begin(), out.end(), [](const Entry& lhs, const Entry& rhs) {
+      return lhs.count > rhs.count;
+    });
+
+    if (out.size() > k) {
+      out.resize(k);
+    }
+    return out;
+  }
+
+  // Combines another summary with this one (Agarwal et al., "Mergeable
+  // Summaries"). An element missing from a full summary could have been seen
+  // up to that summary's minimum count times, so the minimum is added to both
+  // the count and the error of elements that only one of the summaries
+  // tracks.
+  void Merge(const SpaceSaving& other) {
+    uint64_t min_this = MinCount();
+    uint64_t min_other = other.MinCount();
+
+    std::unordered_map<K, Entry, Hash> combined;
+    for (const Entry& entry : heap_) {
+      combined[entry.key] = {entry.key, entry.count + min_other,
+                             entry.error + min_other};
+    }
+
+    for (const Entry& entry : other.heap_) {
+      auto it = combined.find(entry.key);
+      if (it != combined.end()) {
+        Entry& combined_entry = it->second;
+        combined_entry.count += entry.count - min_other;
+        combined_entry.error += entry.error - min_other;
+      } else {
+        combined[entry.key] = {entry.key, entry.count + min_this,
+                               entry.error + min_this};
+      }
+    }
+
+    heap_.clear();
+    for (const auto& key_and_entry : combined) {
+      heap_.push_back(key_and_entry.second);
+    }
+
+    auto by_count_desc = [](const Entry& lhs, const Entry& rhs) {
+      return lhs.count > rhs.count;
+    };
+    if (heap_.size() > capacity_) {
+      std::nth_element(heap_.begin(), heap_.begin() + capacity_, heap_.end(),
+                       by_count_desc);
+      heap_.resize(capacity_);
+    }
+
+    // A list sorted in increasing order of count is a valid min-heap.
+    std::sort(heap_.begin(), heap_.end(), [](const Entry& lhs,
+                                             const Entry& rhs) {
+      return lhs.count < rhs.count;
+    });
+    positions_.clear();
+    for (size_t i = 0; i < heap_.size(); ++i) {
+      positions_[heap_[i].key] = i;
+    }
+
+    total_ += other.total_;
+  }
+
+  // Resets the summary to its initial state.
+  void Clear() {
+    heap_.clear();
+    positions_.clear();
+    total_ = 0;
+  }
+
+  size_t capacity() const { return capacity_; }
+
+  // Number of elements currently tracked.
+  size_t size() const { return heap_.size(); }
+
+  // Sum of all counts added.
+  uint64_t total() const { return total_; }
+
+ private:
+  // The count that an untracked element may have been seen with.
+  uint64_t MinCount() const {
+    if (heap_.size() < capacity_) {
+      return 0;
+    }
+
+    return heap_.front().count;
+  }
+
+  void Swap(size_t i, size_t j) {
+    std::swap(heap_[i], heap_[j]);
+    positions_[heap_[i].key] = i;
+    positions_[heap_[j].key] = j;
+  }
+
+  void SiftUp(size_t i) {
+    while (i > 0) {
+      size_t parent = (i - 1) / 2;
+      if (heap_[parent].count <= heap_[i].count) {
+        break;
+      }
+
+      Swap(i, parent);
+      i = parent;
+    }
+  }
+
+  void SiftDown(size_t i) {
+    while (true) {
+      size_t smallest = i;
+      size_t left = 2 * i + 1;
+      size_t right = left + 1;
+      if (left < heap_.size() && heap_[left].count < heap_[smallest].count) {
+        smallest = left;
+      }
+      if (right < heap_.size() && heap_[right].count < heap_[smallest].count) {
+        smallest = right;
+      }
+      if (smallest == i) {
+        break;
+      }
+
+      Swap(i, smallest);
+      i = smallest;
+    }
+  }
+
+  size_t capacity_;
+  uint64_t total_;
+
+  // Min-heap of tracked elements, ordered by count.
+  std::vector<Entry> heap_;
+
+  // Position of each tracked element in heap_.
+  std::unordered_map<K, size_t, Hash> positions_;
+};
+
+}  // namespace nc
+
+#endif
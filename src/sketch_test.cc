@@ -0,0 +1,254 @@
+#include "sketch.h"
+
+#include <map>
+#include <random>
+#include <set>
+#include "gtest/gtest.h"
+
+namespace nc {
+namespace {
+
+TEST(HyperLogLog, BadPrecision) {
+  ASSERT_DEATH(HyperLogLog hll(2), ".*");
+  ASSERT_DEATH(HyperLogLog hll(30), ".*");
+}
+
+TEST(HyperLogLog, Empty) {
+  HyperLogLog hll;
+  ASSERT_EQ(0, hll.Estimate());
+}
+
+TEST(HyperLogLog, Duplicates) {
+  HyperLogLog hll;
+  for (size_t i = 0; i < 1000; ++i) {
+    hll.Add(42);
+  }
+  ASSERT_NEAR(1, hll.Estimate(), 0.01);
+}
+
+TEST(HyperLogLog, Accuracy) {
+  // Sequential values are a worst case for a weak hash -- the sketch should
+  // still be accurate since hashes are remixed.
+  for (size_t count : {100ul, 10000ul, 1000000ul}) {
+    HyperLogLog hll;
+    for (size_t i = 0; i < count; ++i) {
+      hll.Add(i);
+      hll.Add(i);
+    }
+    ASSERT_NEAR(count, hll.Estimate(), count * 0.05);
+  }
+}
+
+TEST(HyperLogLog, Merge) {
+  HyperLogLog hll_one;
+  HyperLogLog hll_two;
+  HyperLogLog hll_all;
+  for (size_t i = 0; i < 100000; ++i) {
+    hll_one.Add(i);
+    hll_all.Add(i);
+  }
+  for (size_t i = 50000; i < 200000; ++i) {
+    hll_two.Add(i);
+    hll_all.Add(i);
+  }
+
+  hll_one.Merge(hll_two);
+  ASSERT_EQ(hll_all.Estimate(), hll_one.Estimate());
+  ASSERT_NEAR(200000, hll_one.Estimate(), 200000 * 0.05);
+
+  HyperLogLog hll_other_precision(10);
+  ASSERT_DEATH(hll_one.Merge(hll_other_precision), "mismatch");
+}
+
+TEST(HyperLogLog, Clear) {
+  HyperLogLog hll;
+  for (size_t i = 0; i < 1000; ++i) {
+    hll.Add(i);
+  }
+  hll.Clear();
+  ASSERT_EQ(0, hll.Estimate());
+}
+
+TEST(SlidingHyperLogLog, Empty) {
+  SlidingHyperLogLog hll(100);
+  ASSERT_EQ(0, hll.Estimate(100, 1000));
+  ASSERT_DEATH(hll.Estimate(101, 1000), "Window too large");
+}
+
+TEST(SlidingHyperLogLog, Window) {
+  // 1000 new elements per time unit.
+  SlidingHyperLogLog hll(100, 12);
+  size_t next = 0;
+  for (uint64_t time = 0; time < 500; ++time) {
+    for (size_t i = 0; i < 1000; ++i) {
+      hll.Add(next++, time);
+    }
+  }
+
+  ASSERT_NEAR(1000, hll.Estimate(1, 499), 1000 * 0.05);
+  ASSERT_NEAR(10000, hll.Estimate(10, 499), 10000 * 0.05);
+  ASSERT_NEAR(100000, hll.Estimate(100, 499), 100000 * 0.05);
+
+  // Old entries are expired, the per-register lists should stay short.
+  ASSERT_GT(20, hll.EntryCount() / (1 << 12));
+}
+
+TEST(SlidingHyperLogLog, SameAsHyperLogLog) {
+  HyperLogLog hll;
+  SlidingHyperLogLog sliding_hll(1000, 12);
+  for (size_t i = 0; i < 10000; ++i) {
+    hll.Add(i);
+    sliding_hll.Add(i, i / 100);
+  }
+  ASSERT_EQ(hll.Estimate(), sliding_hll.Estimate(1000, 99));
+}
+
+TEST(SlidingHyperLogLog, Merge) {
+  std::mt19937 rnd(1);
+  std::uniform_int_distribution<uint64_t> time_dist(0, 1000);
+
+  // Two sketches with random, non-monotonic times, merged should be the same
+  // as one that has seen everything.
+  SlidingHyperLogLog hll_one(200, 8);
+  SlidingHyperLogLog hll_two(200, 8);
+  SlidingHyperLogLog hll_all(200, 8);
+  for (size_t i = 0; i < 100000; ++i) {
+    uint64_t time = time_dist(rnd);
+    if (i % 2) {
+      hll_one.Add(i, time);
+    } else {
+      hll_two.Add(i, time);
+    }
+    hll_all.Add(i, time);
+  }
+
+  hll_one.Merge(hll_two);
+  for (uint64_t window : {1, 10, 100, 200}) {
+    for (uint64_t now : {950, 1000, 1100}) {
+      ASSERT_EQ(hll_all.Estimate(window, now), hll_one.Estimate(window, now));
+    }
+  }
+}
+
+TEST(CountMinSketch, Bounds) {
+  CountMinSketch sketch(1000, 5);
+  std::map<uint64_t, uint64_t> counts;
+  std::mt19937 rnd(1);
+  std::geometric_distribution<uint64_t> dist(0.001);
+  for (size_t i = 0; i < 100000; ++i) {
+    uint64_t value = dist(rnd);
+    sketch.Add(value);
+    ++counts[value];
+  }
+
+  ASSERT_EQ(100000ul, sketch.total());
+  for (const auto& value_and_count : counts) {
+    uint64_t estimate = sketch.Estimate(value_and_count.first);
+    ASSERT_LE(value_and_count.second, estimate);
+    ASSERT_GE(value_and_count.second + 100000 * 2.72 / 1000, estimate);
+  }
+}
+
+TEST(CountMinSketch, Merge) {
+  CountMinSketch sketch_one(100, 4);
+  CountMinSketch sketch_two(100, 4);
+  CountMinSketch sketch_all(100, 4);
+  for (size_t i = 0; i < 10000; ++i) {
+    sketch_one.Add(i % 1000, 2);
+    sketch_two.Add(i % 300);
+    sketch_all.Add(i % 1000, 2);
+    sketch_all.Add(i % 300);
+  }
+
+  sketch_one.Merge(sketch_two);
+  ASSERT_EQ(sketch_all.total(), sketch_one.total());
+  for (size_t i = 0; i < 1000; ++i) {
+    ASSERT_EQ(sketch_all.Estimate(i), sketch_one.Estimate(i));
+  }
+
+  CountMinSketch sketch_other(10, 4);
+  ASSERT_DEATH(sketch_one.Merge(sketch_other), "mismatch");
+}
+
+TEST(SpaceSaving, Exact) {
+  SpaceSaving<std::string> top(10);
+  top.Add("A", 10);
+  top.Add("B", 5);
+  top.Add("A");
+  top.Add("C");
+
+  std::vector<SpaceSaving<std::string>::Entry> top_k = top.TopK(2);
+  ASSERT_EQ(2ul, top_k.size());
+  ASSERT_EQ("A", top_k[0].key);
+  ASSERT_EQ(11ul, top_k[0].count);
+  ASSERT_EQ(0ul, top_k[0].error);
+  ASSERT_EQ("B", top_k[1].key);
+  ASSERT_EQ(5ul, top_k[1].count);
+  ASSERT_EQ(0ul, top.Estimate("D"));
+}
+
+// Generates a skewed stream and checks that heavy hitters are found.
+static void AddSkewed(size_t seed, size_t count,
+                      SpaceSaving<uint64_t>* space_saving,
+                      std::map<uint64_t, uint64_t>* counts) {
+  std::mt19937 rnd(seed);
+  std::geometric_distribution<uint64_t> dist(0.1);
+  for (size_t i = 0; i < count; ++i) {
+    uint64_t value = dist(rnd);
+    space_saving->Add(value);
+    ++(*counts)[value];
+  }
+}
+
+static void CheckGuarantees(const SpaceSaving<uint64_t>& space_saving,
+                            const std::map<uint64_t, uint64_t>& counts) {
+  uint64_t threshold = space_saving.total() / space_saving.capacity();
+  std::vector<SpaceSaving<uint64_t>::Entry> all =
+      space_saving.TopK(space_saving.capacity());
+  std::set<uint64_t> tracked;
+  for (const auto& entry : all) {
+    tracked.insert(entry.key);
+    uint64_t true_count = counts.at(entry.key);
+    ASSERT_LE(true_count, entry.count);
+    ASSERT_GE(true_count, entry.count - entry.error);
+  }
+
+  for (const auto& value_and_count : counts) {
+    if (value_and_count.second > threshold) {
+      ASSERT_TRUE(tracked.count(value_and_count.first));
+    }
+  }
+}
+
+TEST(SpaceSaving, HeavyHitters) {
+  SpaceSaving<uint64_t> space_saving(50);
+  std::map<uint64_t, uint64_t> counts;
+  AddSkewed(1, 100000, &space_saving, &counts);
+  ASSERT_EQ(50ul, space_saving.size());
+  CheckGuarantees(space_saving, counts);
+
+  std::vector<SpaceSaving<uint64_t>::Entry> top_k = space_saving.TopK(3);
+  ASSERT_EQ(0ul, top_k[0].key);
+  ASSERT_EQ(1ul, top_k[1].key);
+  ASSERT_EQ(0ul, top_k[0].error);
+}
+
+TEST(SpaceSaving, Merge) {
+  SpaceSaving<uint64_t> space_saving_one(50);
+  SpaceSaving<uint64_t> space_saving_two(50);
+  std::map<uint64_t, uint64_t> counts;
+  AddSkewed(1, 100000, &space_saving_one, &counts);
+  AddSkewed(2, 50000, &space_saving_two, &counts);
+
+  space_saving_one.Merge(space_saving_two);
+  ASSERT_EQ(150000ul, space_saving_one.total());
+  ASSERT_EQ(50ul, space_saving_one.size());
+  CheckGuarantees(space_saving_one, counts);
+
+  // Adding after a merge should still work.
+  AddSkewed(3, 10000, &space_saving_one, &counts);
+  CheckGuarantees(space_saving_one, counts);
+}
+
+}  // namespace
+}  // namespace nc
@@ -1,5 +1,14 @@
 #include "stats.h"
 
+#include <cmath>
+#include <complex>
+#include <limits>
+#include <map>
+
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
+
 namespace nc {
 void Bin(size_t bin_size, std::vector<std::pair<double, double>>* data) {
   CHECK(bin_size != 0);
@@ -62,12 +71,13 @@ void Bin(size_t bin_size, std::vector<double>* data) {
   data->resize(bin_index);
 }
 
-static double LinearInterpolate(double x0, double y0, double x1, double y1,
-                                double x) {
+// Coefficients a and b such that a * x + b linearly interpolates between
+// (x0, y0) and (x1, y1).
+static std::pair<double, double> LinearCoefficients(double x0, double y0,
+                                                    double x1, double y1) {
   double a = (y1 - y0) / (x1 - x0);
   double b = -a * x0 + y0;
-  double y = a * x + b;
-  return y;
+  return {a, b};
 }
 
 Empirical2DFunction::Empirical2DFunction(
@@ -77,30 +87,45 @@ Empirical2DFunction::Empirical2DFunction(
       low_fill_value_set_(false),
       low_fill_value_(0),
       high_fill_value_set_(false),
-      high_fill_value_(0) {
+      high_fill_value_(0),
+      cells_per_unit_(0) {
   CHECK(!values.empty());
+
+  // If there are multiple points with the same x the first one is used.
+  std::map<double, double> sorted_values;
   for (const auto& x_and_y : values) {
-    values_.emplace(x_and_y);
+    sorted_values.emplace(x_and_y);
+  }
+
+  for (const auto& x_and_y : sorted_values) {
+    xs_.emplace_back(x_and_y.first);
+    ys_.emplace_back(x_and_y.second);
+  }
+
+  for (size_t i = 0; i + 1 < xs_.size(); ++i) {
+    std::pair<double, double> a_and_b =
+        LinearCoefficients(xs_[i], ys_[i], xs_[i + 1], ys_[i + 1]);
+    a_.emplace_back(a_and_b.first);
+    b_.emplace_back(a_and_b.second);
   }
 }
 
-Empirical2DFunction::Empirical2DFunction(const std::vector<double>& xs,
-                                         const std::vector<double>& ys,
-                                         Interpolation interpolation)
-    : interpolation_type_(interpolation),
-      low_fill_value_set_(false),
-      low_fill_value_(0),
-      high_fill_value_set_(false),
-      high_fill_value_(0) {
-  CHECK(!xs.empty());
+static std::vector<std::pair<double, double>> Zip(
+    const std::vector<double>& xs, const std::vector<double>& ys) {
   CHECK(xs.size() == ys.size());
+  std::vector<std::pair<double, double>> out;
   for (size_t i = 0; i < xs.size(); ++i) {
-    double x = xs[i];
-    double y = ys[i];
-    values_.emplace(x, y);
+    out.emplace_back(xs[i], ys[i]);
   }
+
+  return out;
 }
 
+Empirical2DFunction::Empirical2DFunction(const std::vector<double>& xs,
+                                         const std::vector<double>& ys,
+                                         Interpolation interpolation)
+    : Empirical2DFunction(Zip(xs, ys), interpolation) {}
+
 void Empirical2DFunction::SetLowFillValue(double value) {
   low_fill_value_set_ = true;
   low_fill_value_ = value;
@@ -111,58 +136,278 @@ void Empirical2DFunction::SetHighFillValue(double value) {
   high_fill_value_ = value;
 }
 
-double Empirical2DFunction::Eval(double x) {
-  auto lower_bound_it = values_.lower_bound(x);
-  if (lower_bound_it == values_.begin()) {
+void Empirical2DFunction::BuildLookupTable(size_t cell_count) {
+  CHECK(xs_.size() < std::numeric_limits<uint32_t>::max());
+  cell_starts_.clear();
+  double range = xs_.back() - xs_.front();
+  if (range == 0 || !std::isfinite(range)) {
+    return;
+  }
+
+  if (cell_count == 0) {
+    cell_count = kDefaultCellsPerPoint * xs_.size();
+  }
+
+  cells_per_unit_ = cell_count / range;
+  size_t index = 0;
+  for (size_t i = 0; i < cell_count; ++i) {
+    double cell_start = xs_.front() + i / cells_per_unit_;
+    while (index < xs_.size() && xs_[index] < cell_start) {
+      ++index;
+    }
+    cell_starts_.emplace_back(index);
+  }
+}
+
+size_t Empirical2DFunction::LowerBound(double x) const {
+  // Also true if x is NaN.
+  if (!(x > xs_.front())) {
+    return 0;
+  }
+  if (x > xs_.back()) {
+    return xs_.size();
+  }
+
+  if (cell_starts_.empty()) {
+    return std::distance(xs_.begin(),
+                         std::lower_bound(xs_.begin(), xs_.end(), x));
+  }
+
+  size_t cell = (x - xs_.front()) * cells_per_unit_;
+  cell = std::min(cell, cell_starts_.size() - 1);
+  size_t index = cell_starts_[cell];
+
+  // The cell's start may be off by a bit due to rounding, so the search can
+  // go in both directions.
+  while (index < xs_.size() && xs_[index] < x) {
+    ++index;
+  }
+  while (index > 0 && xs_[index - 1] >= x) {
+    --index;
+  }
+
+  return index;
+}
+
+double Empirical2DFunction::EvalAtIndex(double x, size_t index,
+                                        int64_t* segment) const {
+  *segment = -1;
+  if (index == 0) {
     // x is below the data range.
     if (low_fill_value_set_) {
       return low_fill_value_;
     }
 
-    return lower_bound_it->second;
+    return ys_.front();
   }
 
-  if (lower_bound_it == values_.end()) {
+  if (index == xs_.size()) {
     // x is above the data range.
     if (high_fill_value_set_) {
       return high_fill_value_;
     }
 
-    // Need to get to the previous element.
-    auto prev_it = std::prev(lower_bound_it);
-    return prev_it->second;
+    return ys_.back();
   }
 
-  if (lower_bound_it->first == x) {
-    return lower_bound_it->second;
+  if (xs_[index] == x) {
+    return ys_[index];
   }
 
-  // The range that we ended up in is between the previous element of the
-  // lower bound and the lower bound.
-  auto prev_it = std::prev(lower_bound_it);
-
-  double x0 = prev_it->first;
-  double x1 = lower_bound_it->first;
-  double y0 = prev_it->second;
-  double y1 = lower_bound_it->second;
-
-  CHECK(x0 <= x);
-  CHECK(x1 >= x);
+  // The range that we ended up in is between the previous point and the
+  // point at index.
   if (interpolation_type_ == Interpolation::NEARERST) {
-    double delta_one = x - x0;
-    double delta_two = x1 - x;
+    double delta_one = x - xs_[index - 1];
+    double delta_two = xs_[index] - x;
     if (delta_one > delta_two) {
-      return y1;
+      return ys_[index];
     }
-    return y0;
+    return ys_[index - 1];
   } else if (interpolation_type_ == Interpolation::LINEAR) {
-    return LinearInterpolate(x0, y0, x1, y1, x);
+    *segment = index - 1;
+    return 0;
   }
 
   LOG(FATAL) << "Bad interpolation type";
   return 0;
 }
 
+double Empirical2DFunction::Eval(double x) const {
+  int64_t segment;
+  double y = EvalAtIndex(x, LowerBound(x), &segment);
+  if (segment != -1) {
+    return a_[segment] * x + b_[segment];
+  }
+
+  return y;
+}
+
+void Empirical2DFunction::InterpolateSegments(const double* xs,
+                                              const int64_t* segments,
+                                              double* ys, size_t n) const {
+  size_t i = 0;
+#ifdef __AVX2__
+  __m256i none = _mm256_set1_epi64x(-1);
+  for (; i + 4 <= n; i += 4) {
+    __m256i segment =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(segments + i));
+    __m256d mask = _mm256_castsi256_pd(_mm256_cmpgt_epi64(segment, none));
+    __m256d zero = _mm256_setzero_pd();
+    __m256d a = _mm256_mask_i64gather_pd(zero, a_.data(), segment, mask, 8);
+    __m256d b = _mm256_mask_i64gather_pd(zero, b_.data(), segment, mask, 8);
+
+    // Same operations as the scalar version, so the results are the same.
+    __m256d x = _mm256_loadu_pd(xs + i);
+    __m256d y = _mm256_add_pd(_mm256_mul_pd(a, x), b);
+    __m256d current = _mm256_loadu_pd(ys + i);
+    _mm256_storeu_pd(ys + i, _mm256_blendv_pd(current, y, mask));
+  }
+#endif
+
+  for (; i < n; ++i) {
+    int64_t segment = segments[i];
+    if (segment != -1) {
+      ys[i] = a_[segment] * xs[i] + b_[segment];
+    }
+  }
+}
+
+void Empirical2DFunction::Eval(const double* xs, double* ys, size_t n) const {
+  // Points are found one by one, then the linear interpolation is done in
+  // bulk.
+  int64_t segments[kEvalBatchSize];
+  for (size_t from = 0; from < n; from += kEvalBatchSize) {
+    size_t count = n - from;
+    if (count > kEvalBatchSize) {
+      count = kEvalBatchSize;
+    }
+    for (size_t i = 0; i < count; ++i) {
+      double x = xs[from + i];
+      ys[from + i] = EvalAtIndex(x, LowerBound(x), &segments[i]);
+    }
+
+    InterpolateSegments(xs + from, segments, ys + from, count);
+  }
+}
+
+// In-place iterative radix-2 FFT. The number of values should be a power of
+// 2. The inverse transform is not scaled.
+static void FFT(bool inverse, std::vector<std::complex<double>>* values) {
+  std::vector<std::complex<double>>& a = *values;
+  size_t n = a.size();
+  for (size_t i = 1, j = 0; i < n; ++i) {
+    size_t bit = n >> 1;
+    for (; j & bit; bit >>= 1) {
+      j ^= bit;
+    }
+    j ^= bit;
+
+    if (i < j) {
+      std::swap(a[i], a[j]);
+    }
+  }
+
+  // The roots of unity are computed directly instead of by repeated
+  // multiplication, which would accumulate error.
+  std::vector<std::complex<double>> roots(n / 2);
+  double sign = inverse ? 1 : -1;
+  for (size_t i = 0; i < n / 2; ++i) {
+    double angle = sign * 2 * M_PI * i / n;
+    roots[i] = {std::cos(angle), std::sin(angle)};
+  }
+
+  for (size_t len = 2; len <= n; len <<= 1) {
+    size_t step = n / len;
+    for (size_t i = 0; i < n; i += len) {
+      for (size_t j = 0; j < len / 2; ++j) {
+        std::complex<double> u = a[i + j];
+        std::complex<double> v = a[i + j + len / 2] * roots[j * step];
+        a[i + j] = u + v;
+        a[i + j + len / 2] = u - v;
+      }
+    }
+  }
+}
+
+static std::vector<double> DirectConvolve(const std::vector<double>& x,
+                                          const std::vector<double>& y) {
+  std::vector<double> out(x.size() + y.size() - 1, 0);
+  for (size_t i = 0; i < x.size(); ++i) {
+    for (size_t j = 0; j < y.size(); ++j) {
+      out[i + j] += x[i] * y[j];
+    }
+  }
+
+  return out;
+}
+
+std::vector<double> Convolve(const std::vector<double>& x,
+                             const std::vector<double>& y) {
+  if (x.empty() || y.empty()) {
+    return {};
+  }
+
+  if (std::min(x.size(), y.size()) < kFFTConvolutionThreshold) {
+    return DirectConvolve(x, y);
+  }
+
+  size_t out_size = x.size() + y.size() - 1;
+  size_t n = 1;
+  while (n < out_size) {
+    n <<= 1;
+  }
+
+  // Both sequences are transformed at once, x as the real and y as the
+  // imaginary part. If Z = FFT(x + iy) then FFT(x) * FFT(y) at k is
+  // (Z[k]^2 - conj(Z[n - k])^2) / 4i.
+  std::vector<std::complex<double>> z(n);
+  for (size_t i = 0; i < x.size(); ++i) {
+    z[i].real(x[i]);
+  }
+  for (size_t i = 0; i < y.size(); ++i) {
+    z[i].imag(y[i]);
+  }
+  FFT(false, &z);
+
+  std::vector<std::complex<double>> product(n);
+  std::complex<double> four_i(0, 4);
+  for (size_t k = 0; k < n; ++k) {
+    std::complex<double> z_k = z[k];
+    std::complex<double> z_conj = std::conj(z[(n - k) & (n - 1)]);
+    product[k] = (z_k * z_k - z_conj * z_conj) / four_i;
+  }
+  FFT(true, &product);
+
+  // The absolute error of each output value is about log2(n) * epsilon *
+  // |x| * |y| (Euclidean norms). Values below that, and negative values if
+  // neither input has any, can only be round-off and are set to 0.
+  double x_norm = 0;
+  bool negative_inputs = false;
+  for (double value : x) {
+    x_norm += value * value;
+    negative_inputs |= (value < 0);
+  }
+  double y_norm = 0;
+  for (double value : y) {
+    y_norm += value * value;
+    negative_inputs |= (value < 0);
+  }
+  double noise = kFFTConvolutionErrorFactor * std::log2(n) *
+                 std::numeric_limits<double>::epsilon() *
+                 std::sqrt(x_norm * y_norm);
+
+  std::vector<double> out(out_size);
+  for (size_t i = 0; i < out_size; ++i) {
+    double value = product[i].real() / n;
+    if (std::abs(value) < noise || (value < 0 && !negative_inputs)) {
+      value = 0;
+    }
+    out[i] = value;
+  }
+
+  return out;
+}
+
 void SummaryStats::Add(double value) { AddCount(value, 1); }
 
 void SummaryStats::AddCount(double value, size_t count) {
@@ -191,12 +436,149 @@ void SummaryStats::AddCount(double value, size_t count) {
   sum_squared_ += value_squared * count;
 }
 
+static constexpr size_t kSummaryStatsLanes = 4;
+
+// Per-lane state of SummaryStats::AddMany.
+struct SummaryStatsLanes {
+  double sum[kSummaryStatsLanes];
+  double sum_error[kSummaryStatsLanes];
+  double sum_squared[kSummaryStatsLanes];
+  double sum_squared_error[kSummaryStatsLanes];
+  double min[kSummaryStatsLanes];
+  double max[kSummaryStatsLanes];
+};
+
+// Adds 'value' to the Kahan sum 'sum', whose lost low-order bits are in
+// 'error'.
+static inline void KahanAdd(double value, double* sum, double* error) {
+  double y = value - *error;
+  double t = *sum + y;
+  *error = (t - *sum) - y;
+  *sum = t;
+}
+
+// Adds values[0, count) to the lanes, count should be a multiple of the
+// number of lanes.
+static void AddToLanes(const double* values, size_t count,
+                       SummaryStatsLanes* lanes) {
+  size_t i = 0;
+#ifdef __AVX__
+  static_assert(kSummaryStatsLanes == 4, "Lanes should fit a __m256d");
+  __m256d sum = _mm256_loadu_pd(lanes->sum);
+  __m256d sum_error = _mm256_loadu_pd(lanes->sum_error);
+  __m256d sum_squared = _mm256_loadu_pd(lanes->sum_squared);
+  __m256d sum_squared_error = _mm256_loadu_pd(lanes->sum_squared_error);
+  __m256d min = _mm256_loadu_pd(lanes->min);
+  __m256d max = _mm256_loadu_pd(lanes->max);
+  for (; i < count; i += kSummaryStatsLanes) {
+    __m256d x = _mm256_loadu_pd(values + i);
+
+    // Same operations as KahanAdd.
+    __m256d y = _mm256_sub_pd(x, sum_error);
+    __m256d t = _mm256_add_pd(sum, y);
+    sum_error = _mm256_sub_pd(_mm256_sub_pd(t, sum), y);
+    sum = t;
+
+    y = _mm256_sub_pd(_mm256_mul_pd(x, x), sum_squared_error);
+    t = _mm256_add_pd(sum_squared, y);
+    sum_squared_error = _mm256_sub_pd(_mm256_sub_pd(t, sum_squared), y);
+    sum_squared = t;
+
+    // If x is NaN these return the second operand, so NaNs are ignored like
+    // in AddCount.
+    min = _mm256_min_pd(x, min);
+    max = _mm256_max_pd(x, max);
+  }
+
+  _mm256_storeu_pd(lanes->sum, sum);
+  _mm256_storeu_pd(lanes->sum_error, sum_error);
+  _mm256_storeu_pd(lanes->sum_squared, sum_squared);
+  _mm256_storeu_pd(lanes->sum_squared_error, sum_squared_error);
+  _mm256_storeu_pd(lanes->min, min);
+  _mm256_storeu_pd(lanes->max, max);
+#endif
+
+  for (; i < count; i += kSummaryStatsLanes) {
+    for (size_t lane = 0; lane < kSummaryStatsLanes; ++lane) {
+      double x = values[i + lane];
+      KahanAdd(x, &lanes->sum[lane], &lanes->sum_error[lane]);
+      KahanAdd(x * x, &lanes->sum_squared[lane],
+               &lanes->sum_squared_error[lane]);
+      lanes->min[lane] = x < lanes->min[lane] ? x : lanes->min[lane];
+      lanes->max[lane] = x > lanes->max[lane] ? x : lanes->max[lane];
+    }
+  }
+}
+
+void SummaryStats::AddMany(const double* values, size_t count) {
+  if (count == 0) {
+    return;
+  }
+
+  SummaryStatsLanes lanes;
+  for (size_t lane = 0; lane < kSummaryStatsLanes; ++lane) {
+    lanes.sum[lane] = 0;
+    lanes.sum_error[lane] = 0;
+    lanes.sum_squared[lane] = 0;
+    lanes.sum_squared_error[lane] = 0;
+    lanes.min[lane] = std::numeric_limits<double>::max();
+    lanes.max[lane] = std::numeric_limits<double>::lowest();
+  }
+
+  size_t bulk_count = count - count % kSummaryStatsLanes;
+  AddToLanes(values, bulk_count, &lanes);
+  for (size_t i = bulk_count; i < count; ++i) {
+    double x = values[i];
+    KahanAdd(x, &lanes.sum[0], &lanes.sum_error[0]);
+    KahanAdd(x * x, &lanes.sum_squared[0], &lanes.sum_squared_error[0]);
+    lanes.min[0] = x < lanes.min[0] ? x : lanes.min[0];
+    lanes.max[0] = x > lanes.max[0] ? x : lanes.max[0];
+  }
+
+  // The running totals are combined with the lanes, carrying over the errors.
+  double sum = sum_;
+  double sum_error = 0;
+  double sum_squared = sum_squared_;
+  double sum_squared_error = 0;
+  for (size_t lane = 0; lane < kSummaryStatsLanes; ++lane) {
+    KahanAdd(lanes.sum[lane], &sum, &sum_error);
+    KahanAdd(-lanes.sum_error[lane], &sum, &sum_error);
+    KahanAdd(lanes.sum_squared[lane], &sum_squared, &sum_squared_error);
+    KahanAdd(-lanes.sum_squared_error[lane], &sum_squared,
+             &sum_squared_error);
+    min_ = std::min(min_, lanes.min[lane]);
+    max_ = std::max(max_, lanes.max[lane]);
+  }
+
+  static double max_add_value =
+      std::pow(std::numeric_limits<double>::max(), 0.5);
+  CHECK(max_ < max_add_value) << "Value too large " << max_;
+  CHECK(std::isfinite(sum_squared) || std::isnan(sum_squared))
+      << "Addition overflowing";
+
+  count_ += count;
+  sum_ = sum;
+  sum_squared_ = sum_squared;
+}
+
+void SummaryStats::Merge(const SummaryStats& other) {
+  if (other.count_ == 0) {
+    return;
+  }
+
+  count_ += other.count_;
+  sum_ += other.sum_;
+  sum_squared_ += other.sum_squared_;
+  min_ = std::min(min_, other.min_);
+  max_ = std::max(max_, other.max_);
+}
+
 void SummaryStats::Reset() {
   sum_ = 0;
   count_ = 0;
   sum_squared_ = 0;
   min_ = std::numeric_limits<double>::max();
-  max_ = std::numeric_limits<double>::min();
+  max_ = std::numeric_limits<double>::lowest();
 }
 
 double SummaryStats::min() const {
@@ -3,7 +3,9 @@
 
 #include <vector>
 #include "common.h"
+#include "quantile_sketch.h"
 #include "substitute.h"
+#include "thread_runner.h"
 
 namespace nc {
 
@@ -16,7 +18,7 @@ std::vector<T> PercentilesWithCallback(std::vector<T>* values, Compare compare,
     return std::vector<T>();
   }
 
-  std::sort(values->begin(), values->end(), compare);
+  ParallelSort(values->begin(), values->end(), compare);
   double num_values_min_one = values->size() - 1;
 
   std::vector<T> return_vector(n + 1);
@@ -58,6 +60,15 @@ class SummaryStats {
   // Like calling Add count times.
   void AddCount(double value, size_t count);
 
+  // Like calling Add for each of 'count' values. The values are accumulated
+  // in multiple lanes (with SIMD instructions if available) using Kahan
+  // summation, so the sums are more precise than when calling Add.
+  void AddMany(const double* values, size_t count);
+
+  // Adds the values from another SummaryStats to this one. Can be used to
+  // combine SummaryStats computed over parts of the data in parallel.
+  void Merge(const SummaryStats& other);
+
   size_t count() const { return count_; };
 
   double mean() const;
@@ -89,7 +100,9 @@ class SummaryStats {
   double max_;
 };
 
-// A 2 dimensional empirical function. Can be used to interpolate values.
+// A 2 dimensional empirical function. Can be used to interpolate values. The
+// points are kept in sorted arrays, and Eval does a binary search over them
+// (or a lookup in a uniform grid if BuildLookupTable is called).
 class Empirical2DFunction {
  public:
   // The type of interpolation to use.
@@ -114,11 +127,40 @@ class Empirical2DFunction {
   // extrapolating above the data range.
   void SetHighFillValue(double value);
 
+  // Divides the data range into 'cell_count' equal cells and remembers where
+  // each cell starts in the points, so that Eval does not need to do a binary
+  // search. Works best when the points are roughly evenly spaced and there
+  // are a few cells per point. If 'cell_count' is 0 there will be
+  // kDefaultCellsPerPoint cells per point.
+  void BuildLookupTable(size_t cell_count = 0);
+
   // Returns the Y for a given X. If x is not in the original points the value
-  // of Y will be interpolated. If x is outside the domain of
-  double Eval(double x);
+  // of Y will be interpolated. If x is outside the domain of the function the
+  // fill values (or the closest point) are returned.
+  double Eval(double x) const;
+
+  // Same as calling Eval for each of 'n' values in 'xs' and storing the
+  // results in 'ys'.
+  void Eval(const double* xs, double* ys, size_t n) const;
 
  private:
+  static constexpr size_t kDefaultCellsPerPoint = 4;
+  static constexpr size_t kEvalBatchSize = 256;
+
+  // Index of the first point whose x is not less than 'x'.
+  size_t LowerBound(double x) const;
+
+  // Evaluates at 'x', given its LowerBound. Sets 'segment' to the segment to
+  // interpolate over if x is between two points and the interpolation is
+  // linear, in which case the return value is undefined. Otherwise 'segment'
+  // is set to -1.
+  double EvalAtIndex(double x, size_t index, int64_t* segment) const;
+
+  // Stores a_[segment] * xs[i] + b_[segment] into ys[i] for all i for which
+  // segments[i] is not -1.
+  void InterpolateSegments(const double* xs, const int64_t* segments,
+                           double* ys, size_t n) const;
+
   Interpolation interpolation_type_;
 
   bool low_fill_value_set_;
@@ -126,7 +168,18 @@ class Empirical2DFunction {
   bool high_fill_value_set_;
   double high_fill_value_;
 
-  std::map<double, double> values_;
+  // The points, sorted by x.
+  std::vector<double> xs_;
+  std::vector<double> ys_;
+
+  // Linear interpolation between points i and i+1 is a_[i] * x + b_[i].
+  std::vector<double> a_;
+  std::vector<double> b_;
+
+  // For each cell of the uniform grid the LowerBound of its start. Empty if
+  // there is no lookup table.
+  std::vector<uint32_t> cell_starts_;
+  double cells_per_unit_;
 };
 
 // Basic distribution information about a series of numbers.
@@ -223,55 +276,373 @@ class DiscreteDistribution {
   std::map<T, uint64_t> counts_;
 };
 
-// Returns the sum of two empirical distributions.
+// Same interface as DiscreteDistribution, but values are counted in a flat
+// array instead of a map, so that Add is O(1) and does not allocate (unless
+// the value is larger than any seen before). Values below 2^significant_bits
+// are counted exactly, larger ones in log-linear buckets that are reported with
+// a relative error of at most 2^-significant_bits (see LogLinearHistogram). The
+// summary stats, Min and Max are always exact. Percentile does a binary search
+// over prefix sums that are computed on first use after an Add, so it should
+// not be called concurrently with other member functions.
+template <typename T>
+class FlatDiscreteDistribution {
+ public:
+  static_assert(std::is_integral<T>::value && std::is_unsigned<T>::value,
+                "Need an unsigned integral type");
+  static constexpr uint8_t kDefaultSignificantBits = 10;
+
+  explicit FlatDiscreteDistribution(
+      uint8_t significant_bits = kDefaultSignificantBits)
+      : significant_bits_(significant_bits),
+        min_(std::numeric_limits<T>::max()),
+        max_(0),
+        prefix_sums_valid_(false) {
+    CHECK(significant_bits >= LogLinearHistogram<T>::kMinSignificantBits &&
+          significant_bits <= LogLinearHistogram<T>::kMaxSignificantBits)
+        << "Bad precision " << static_cast<int>(significant_bits);
+  }
+
+  // Converts from the map form. Lossless if all values are below
+  // 2^significant_bits.
+  explicit FlatDiscreteDistribution(
+      const DiscreteDistribution<T>& distribution,
+      uint8_t significant_bits = kDefaultSignificantBits)
+      : FlatDiscreteDistribution(significant_bits) {
+    for (const auto& value_and_count : distribution.counts()) {
+      Add(value_and_count.first, value_and_count.second);
+    }
+  }
+
+  void Add(T value, size_t count) {
+    size_t index = LogLinearHistogram<T>::BucketIndex(value, significant_bits_);
+    if (index >= counts_.size()) {
+      counts_.resize(index + 1, 0);
+    }
+
+    counts_[index] += count;
+    summary_stats_.AddCount(value, count);
+    min_ = std::min(min_, value);
+    max_ = std::max(max_, value);
+    prefix_sums_valid_ = false;
+  }
+
+  void Add(T value) { Add(value, 1); }
+
+  // Adds all values from another distribution, which should have the same
+  // precision, to this one.
+  void Add(const FlatDiscreteDistribution<T>& other) {
+    CHECK(significant_bits_ == other.significant_bits_)
+        << "Precision mismatch";
+    if (other.summary_stats_.count() == 0) {
+      return;
+    }
+
+    if (counts_.size() < other.counts_.size()) {
+      counts_.resize(other.counts_.size(), 0);
+    }
+    for (size_t i = 0; i < other.counts_.size(); ++i) {
+      counts_[i] += other.counts_[i];
+    }
+
+    MergeSummary(other);
+  }
+
+  // Same as DiscreteDistribution::Probabilities. Values that are not counted
+  // exactly are represented by the middle of their bucket.
+  std::map<T, double> Probabilities() const {
+    std::map<T, double> out;
+    double total = summary_stats_.count();
+    for (size_t i = 0; i < counts_.size(); ++i) {
+      if (counts_[i] != 0) {
+        out[BucketValue(i)] += counts_[i] / total;
+      }
+    }
+
+    return out;
+  }
+
+  // Same as DiscreteDistribution::Percentile.
+  T Percentile(double p) const {
+    CHECK(summary_stats_.count() > 0) << "No values in distribution";
+    if (!prefix_sums_valid_) {
+      prefix_sums_.resize(counts_.size());
+      uint64_t total = 0;
+      for (size_t i = 0; i < counts_.size(); ++i) {
+        total += counts_[i];
+        prefix_sums_[i] = total;
+      }
+      prefix_sums_valid_ = true;
+    }
+
+    // The first non-empty bucket at which the running total reaches the
+    // limit.
+    uint64_t limit = p * summary_stats_.count();
+    limit = std::max(limit, static_cast<uint64_t>(1));
+    limit = std::min(limit, prefix_sums_.back());
+    auto it = std::lower_bound(prefix_sums_.begin(), prefix_sums_.end(), limit);
+    return BucketValue(std::distance(prefix_sums_.begin(), it));
+  }
+
+  T Max() const { return max_; }
+
+  T Min() const { return min_; }
+
+  // Returns the percentiles of this distribution.
+  std::vector<T> Percentiles(size_t percentile_count = 100) const {
+    std::vector<T> out;
+    for (size_t i = 0; i < percentile_count + 1; ++i) {
+      double p = static_cast<double>(i) / percentile_count;
+      out.emplace_back(Percentile(p));
+    }
+
+    return out;
+  }
+
+  // Returns a string that describes this distribution.
+  std::string ToString(std::function<std::string(T)> fmt = [](T value) {
+    return std::to_string(value);
+  }) const {
+    std::vector<T> percentiles = Percentiles();
+    return Substitute("[min: $0, med: $1, 90p: $2, max: $3]",
+                      fmt(percentiles[0]), fmt(percentiles[50]),
+                      fmt(percentiles[90]), fmt(percentiles[100]));
+  }
+
+  // Converts to the map form. Lossless if all values are below
+  // 2^significant_bits (see IsExact), otherwise values are represented by
+  // the middle of their bucket.
+  DiscreteDistribution<T> ToDiscreteDistribution() const {
+    DiscreteDistribution<T> out;
+    for (size_t i = 0; i < counts_.size(); ++i) {
+      if (counts_[i] != 0) {
+        out.Add(BucketValue(i), counts_[i]);
+      }
+    }
+
+    return out;
+  }
+
+  // True if all values added so far are counted exactly.
+  bool IsExact() const {
+    return summary_stats_.count() == 0 ||
+           (max_ >> significant_bits_) == 0;
+  }
+
+  const SummaryStats& summary_stats() const { return summary_stats_; }
+
+  uint8_t significant_bits() const { return significant_bits_; }
+
+  // Number of counts per bucket.
+  const std::vector<uint64_t>& counts() const { return counts_; }
+
+ private:
+  template <typename U>
+  friend FlatDiscreteDistribution<U> MergeDistributions(
+      const std::vector<const FlatDiscreteDistribution<U>*>& distributions,
+      ThreadPool* pool);
+
+  void MergeSummary(const FlatDiscreteDistribution<T>& other) {
+    const SummaryStats& stats = other.summary_stats_;
+    if (stats.count() == 0) {
+      return;
+    }
+
+    if (summary_stats_.count() == 0) {
+      summary_stats_ = stats;
+    } else {
+      summary_stats_.Reset(summary_stats_.count() + stats.count(),
+                           summary_stats_.sum() + stats.sum(),
+                           summary_stats_.sum_squared() + stats.sum_squared(),
+                           std::min(summary_stats_.min(), stats.min()),
+                           std::max(summary_stats_.max(), stats.max()));
+    }
+
+    min_ = std::min(min_, other.min_);
+    max_ = std::max(max_, other.max_);
+    prefix_sums_valid_ = false;
+  }
+
+  // The value that represents a bucket.
+  T BucketValue(size_t index) const {
+    std::pair<uint64_t, uint64_t> range =
+        LogLinearHistogram<T>::BucketRange(index, significant_bits_);
+    uint64_t middle = range.first + (range.second - range.first) / 2;
+    middle = std::max(middle, static_cast<uint64_t>(min_));
+    middle = std::min(middle, static_cast<uint64_t>(max_));
+    return static_cast<T>(middle);
+  }
+
+  uint8_t significant_bits_;
+  std::vector<uint64_t> counts_;
+  SummaryStats summary_stats_;
+  T min_;
+  T max_;
+
+  // Running totals of counts_, rebuilt by Percentile when invalid.
+  mutable std::vector<uint64_t> prefix_sums_;
+  mutable bool prefix_sums_valid_;
+};
+
+// Combines distributions that were built independently (e.g. one per thread)
+// into one. The buckets are split into ranges, each of which is summed across
+// all distributions by a different thread, so no locking is needed. All
+// distributions should have the same precision.
+template <typename T>
+FlatDiscreteDistribution<T> MergeDistributions(
+    const std::vector<const FlatDiscreteDistribution<T>*>& distributions,
+    ThreadPool* pool = ThreadPool::Default()) {
+  static constexpr size_t kBucketsPerTask = 1024;
+  if (distributions.empty()) {
+    return FlatDiscreteDistribution<T>();
+  }
+
+  FlatDiscreteDistribution<T> out(distributions.front()->significant_bits());
+  size_t bucket_count = 0;
+  for (const FlatDiscreteDistribution<T>* distribution : distributions) {
+    CHECK(distribution->significant_bits() == out.significant_bits())
+        << "Precision mismatch";
+    bucket_count = std::max(bucket_count, distribution->counts_.size());
+    out.MergeSummary(*distribution);
+  }
+
+  out.counts_.resize(bucket_count, 0);
+  size_t task_count = (bucket_count + kBucketsPerTask - 1) / kBucketsPerTask;
+  ParallelFor(0, task_count, [&distributions, &out, bucket_count](size_t task) {
+    size_t from = task * kBucketsPerTask;
+    size_t to = std::min(bucket_count, from + kBucketsPerTask);
+    for (const FlatDiscreteDistribution<T>* distribution : distributions) {
+      const std::vector<uint64_t>& counts = distribution->counts_;
+      size_t limit = std::min(to, counts.size());
+      for (size_t i = from; i < limit; ++i) {
+        out.counts_[i] += counts[i];
+      }
+    }
+  }, 1, pool);
+
+  return out;
+}
+
+// Returns the convolution of two sequences (out[k] = sum x[i] * y[k - i]),
+// which has x.size() + y.size() - 1 elements. If both sequences have at
+// least kFFTConvolutionThreshold elements the convolution is computed with a
+// FFT in O(n log n) instead of directly in O(n * m). Results from the FFT
+// have an absolute error of about log2(n) * epsilon * |x| * |y| (Euclidean
+// norms). Output values below kFFTConvolutionErrorFactor times that cannot
+// be told apart from round-off and are set to 0, as are negative values when
+// all inputs are non-negative.
+static constexpr size_t kFFTConvolutionThreshold = 64;
+static constexpr double kFFTConvolutionErrorFactor = 2;
+std::vector<double> Convolve(const std::vector<double>& x,
+                             const std::vector<double>& y);
+
+namespace stats_internal {
+
+// Returns the sum of two empirical distributions by adding up all pairs of
+// values. Used when the distributions are sparse.
+template <typename T>
+std::map<T, double> SparseSumConvolute(
+    const std::map<T, double>& x_probabilities,
+    const std::map<T, double>& y_probabilities) {
+  std::map<T, double> out;
+  for (const auto& x_value_and_prob : x_probabilities) {
+    for (const auto& y_value_and_prob : y_probabilities) {
+      out[x_value_and_prob.first + y_value_and_prob.first] +=
+          x_value_and_prob.second * y_value_and_prob.second;
+    }
+  }
+
+  return out;
+}
+
+// Returns the probabilities of all values from the smallest to the largest.
+template <typename T>
+std::vector<double> ToDense(const std::map<T, double>& probabilities) {
+  T min = probabilities.begin()->first;
+  T max = std::prev(probabilities.end())->first;
+  std::vector<double> out(static_cast<size_t>(max - min) + 1, 0);
+  for (const auto& value_and_prob : probabilities) {
+    out[static_cast<size_t>(value_and_prob.first - min)] =
+        value_and_prob.second;
+  }
+
+  return out;
+}
+
+}  // namespace stats_internal
+
+// Returns the sum of two empirical distributions. If the values are dense
+// enough they are convolved as arrays (see Convolve), otherwise all pairs of
+// values are added up. The dense path is approximate: probabilities smaller
+// than about log2(n) * epsilon, where n is the size of the result's range,
+// are within FFT round-off and are dropped, so the result's total may be
+// short by up to that much per value in the range. Use
+// stats_internal::SparseSumConvolute if such tails matter.
 template <typename T>
 std::map<T, double> SumConvolute(const std::map<T, double>& x_probabilities,
                                  const std::map<T, double>& y_probabilities) {
-  T max_x = std::prev(x_probabilities.end())->first;
-  T max_y = std::prev(y_probabilities.end())->first;
+  static_assert(std::is_integral<T>::value, "Need an integral type");
   T min_x = x_probabilities.begin()->first;
   T min_y = y_probabilities.begin()->first;
+  double x_range = std::prev(x_probabilities.end())->first - min_x + 1.0;
+  double y_range = std::prev(y_probabilities.end())->first - min_y + 1.0;
+
+  // Both are O(n^2) for small inputs, for large ones the dense arrays are
+  // convolved in O(n log n).
+  double pairs =
+      static_cast<double>(x_probabilities.size()) * y_probabilities.size();
+  double dense_cost = std::max(x_range, y_range);
+  if (std::min(x_range, y_range) >= kFFTConvolutionThreshold) {
+    dense_cost *= std::log2(dense_cost) * 4;
+  } else {
+    dense_cost *= std::min(x_range, y_range);
+  }
 
-  T from = std::min(min_x, min_y);
-  T to = max_x + max_y;
+  if (dense_cost > pairs) {
+    return stats_internal::SparseSumConvolute(x_probabilities,
+                                              y_probabilities);
+  }
 
+  std::vector<double> sum = Convolve(stats_internal::ToDense(x_probabilities),
+                                     stats_internal::ToDense(y_probabilities));
   std::map<T, double> out;
-  for (T value = from; value <= to; ++value) {
-    double total = 0;
-    for (const auto& value_and_prob : x_probabilities) {
-      T x_value = value_and_prob.first;
-      T y_value = value - x_value;
-      const double* y_prob = FindOrNull(y_probabilities, y_value);
-      if (y_prob == nullptr) {
-        continue;
-      }
-
-      double x_prob = value_and_prob.second;
-      total += x_prob * (*y_prob);
-    }
-
-    if (total > 0) {
-      out[value] = total;
+  T min = min_x + min_y;
+  for (size_t i = 0; i < sum.size(); ++i) {
+    if (sum[i] > 0) {
+      out.emplace_hint(out.end(), min + static_cast<T>(i), sum[i]);
     }
   }
 
   return out;
 }
 
+// Returns the sum of multiple empirical distributions. Pairs of
+// distributions are summed in parallel, then pairs of the results and so on.
+// Each sum may drop round-off sized probabilities, as described above.
 template <typename T>
 std::map<T, double> SumConvolute(
-    const std::vector<std::map<T, double>>& probabilities) {
+    const std::vector<std::map<T, double>>& probabilities,
+    ThreadPool* pool = ThreadPool::Default()) {
   CHECK(!probabilities.empty());
-  auto it = probabilities.begin();
 
-  std::map<T, double>& current_map = *it;
-  ++it;
+  // The first level reads from the input directly.
+  const std::vector<std::map<T, double>>* level = &probabilities;
+  std::vector<std::map<T, double>> current;
+  while (level->size() > 1) {
+    std::vector<std::map<T, double>> next((level->size() + 1) / 2);
+    ParallelFor(0, next.size(), [level, &next](size_t i) {
+      if (2 * i + 1 == level->size()) {
+        next[i] = (*level)[2 * i];
+        return;
+      }
+
+      next[i] = SumConvolute((*level)[2 * i], (*level)[2 * i + 1]);
+    }, 1, pool);
 
-  for (; it != probabilities.end(); ++it) {
-    current_map = SumConvolute(current_map, *it);
+    current = std::move(next);
+    level = &current;
   }
 
-  return current_map;
+  return level->front();
 }
 
 }  // namespace nc
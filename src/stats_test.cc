@@ -1,4 +1,5 @@
 #include <chrono>
+#include <random>
 #include <thread>
 
 #include "stats.h"
@@ -126,6 +127,84 @@ TEST(SummaryStats, Overflow) {
   ASSERT_DEATH(summary_stats.Add(very_large_number), ".*");
 }
 
+TEST(SummaryStats, AddMany) {
+  std::mt19937 rnd(1);
+  std::uniform_real_distribution<double> dist(-1000, 1000);
+  for (size_t count : {0, 1, 3, 4, 5, 100, 1001}) {
+    std::vector<double> values;
+    SummaryStats model;
+    for (size_t i = 0; i < count; ++i) {
+      values.emplace_back(dist(rnd));
+      model.Add(values.back());
+    }
+
+    SummaryStats summary_stats;
+    summary_stats.AddMany(values.data(), values.size());
+    ASSERT_EQ(model.count(), summary_stats.count());
+    if (count == 0) {
+      continue;
+    }
+
+    ASSERT_EQ(model.min(), summary_stats.min());
+    ASSERT_EQ(model.max(), summary_stats.max());
+    ASSERT_NEAR(model.sum(), summary_stats.sum(), 1e-6);
+    ASSERT_NEAR(model.var(), summary_stats.var(), 1e-6);
+  }
+}
+
+TEST(SummaryStats, AddManyNegative) {
+  std::vector<double> values = {-3.0, -2.0, -1.0};
+  SummaryStats summary_stats;
+  summary_stats.AddMany(values.data(), values.size());
+  ASSERT_EQ(-3.0, summary_stats.min());
+  ASSERT_EQ(-1.0, summary_stats.max());
+
+  SummaryStats single;
+  single.Add(-5.0);
+  ASSERT_EQ(-5.0, single.max());
+}
+
+TEST(SummaryStats, AddManyPrecision) {
+  // Many small values added to a large one, each of which is partially lost
+  // when added on its own.
+  std::vector<double> values(1000000, 0.1);
+  values[0] = 1e9;
+
+  SummaryStats summary_stats;
+  summary_stats.AddMany(values.data(), values.size());
+  ASSERT_NEAR(1e9 + 0.1 * (values.size() - 1), summary_stats.sum(), 1e-6);
+}
+
+TEST(SummaryStats, AddManyOverflow) {
+  double very_large_number = std::pow(std::numeric_limits<double>::max(), 0.5);
+  std::vector<double> values = {1.0, very_large_number};
+  SummaryStats summary_stats;
+  ASSERT_DEATH(summary_stats.AddMany(values.data(), values.size()), ".*");
+}
+
+TEST(SummaryStats, Merge) {
+  std::mt19937 rnd(1);
+  std::uniform_real_distribution<double> dist(-1000, 1000);
+  SummaryStats model;
+  std::vector<SummaryStats> parts(4);
+  for (size_t i = 0; i < 1000; ++i) {
+    double value = dist(rnd);
+    model.Add(value);
+    parts[i % 3].Add(value);
+  }
+
+  SummaryStats merged;
+  for (const SummaryStats& part : parts) {
+    merged.Merge(part);
+  }
+
+  ASSERT_EQ(model.count(), merged.count());
+  ASSERT_EQ(model.min(), merged.min());
+  ASSERT_EQ(model.max(), merged.max());
+  ASSERT_NEAR(model.sum(), merged.sum(), 1e-6);
+  ASSERT_NEAR(model.var(), merged.var(), 1e-6);
+}
+
 TEST(EmpiricalFunction, NoValues) {
   ASSERT_DEATH(Empirical2DFunction tmp_one({}, Empirical2DFunction::NEARERST),
                ".*");
@@ -186,6 +265,191 @@ TEST(EmpiricalFunction, LinearMultiValues) {
   }
 }
 
+// The original map-based implementation of Empirical2DFunction::Eval.
+static double ModelEval(const std::map<double, double>& values,
+                        Empirical2DFunction::Interpolation interpolation,
+                        const double* low_fill, const double* high_fill,
+                        double x) {
+  auto lower_bound_it = values.lower_bound(x);
+  if (lower_bound_it == values.begin()) {
+    return low_fill != nullptr ? *low_fill : lower_bound_it->second;
+  }
+  if (lower_bound_it == values.end()) {
+    return high_fill != nullptr ? *high_fill
+                                : std::prev(lower_bound_it)->second;
+  }
+  if (lower_bound_it->first == x) {
+    return lower_bound_it->second;
+  }
+
+  auto prev_it = std::prev(lower_bound_it);
+  double x0 = prev_it->first;
+  double x1 = lower_bound_it->first;
+  double y0 = prev_it->second;
+  double y1 = lower_bound_it->second;
+  if (interpolation == Empirical2DFunction::NEARERST) {
+    return x - x0 > x1 - x ? y1 : y0;
+  }
+
+  double a = (y1 - y0) / (x1 - x0);
+  double b = -a * x0 + y0;
+  return a * x + b;
+}
+
+TEST(EmpiricalFunction, SameAsMap) {
+  std::mt19937 rnd(1);
+  std::uniform_real_distribution<double> x_dist(-100, 100);
+  std::uniform_int_distribution<int> int_dist(-100, 100);
+  for (auto interpolation :
+       {Empirical2DFunction::NEARERST, Empirical2DFunction::LINEAR}) {
+    for (size_t point_count : {1, 2, 10, 1000}) {
+      std::vector<std::pair<double, double>> points;
+      std::map<double, double> model;
+      for (size_t i = 0; i < point_count; ++i) {
+        // Integer xs to get some duplicates.
+        double x = i % 2 ? int_dist(rnd) : x_dist(rnd);
+        double y = x_dist(rnd);
+        points.emplace_back(x, y);
+        model.emplace(x, y);
+      }
+
+      std::vector<double> xs;
+      for (size_t i = 0; i < 10000; ++i) {
+        xs.emplace_back(x_dist(rnd) * 1.1);
+      }
+      for (const auto& point : points) {
+        xs.emplace_back(point.first);
+      }
+
+      double low_fill = -1000;
+      double high_fill = 1000;
+      for (bool fill : {false, true}) {
+        for (bool lookup_table : {false, true}) {
+          Empirical2DFunction f(points, interpolation);
+          if (fill) {
+            f.SetLowFillValue(low_fill);
+            f.SetHighFillValue(high_fill);
+          }
+          if (lookup_table) {
+            f.BuildLookupTable();
+          }
+
+          std::vector<double> ys(xs.size());
+          f.Eval(xs.data(), ys.data(), xs.size());
+          for (size_t i = 0; i < xs.size(); ++i) {
+            double model_y =
+                ModelEval(model, interpolation, fill ? &low_fill : nullptr,
+                          fill ? &high_fill : nullptr, xs[i]);
+            ASSERT_EQ(model_y, f.Eval(xs[i]));
+            ASSERT_EQ(model_y, ys[i]);
+          }
+        }
+      }
+    }
+  }
+}
+
+TEST(EmpiricalFunction, LookupTableSizes) {
+  std::vector<double> xs = {0, 0.001, 0.002, 5, 7, 1000};
+  std::vector<double> ys = {1, 2, 3, 4, 5, 6};
+  Empirical2DFunction model(xs, ys, Empirical2DFunction::LINEAR);
+  for (size_t cell_count : {1, 2, 3, 100, 100000}) {
+    Empirical2DFunction f(xs, ys, Empirical2DFunction::LINEAR);
+    f.BuildLookupTable(cell_count);
+    for (double x = -1; x < 1001; x += 0.0137) {
+      ASSERT_EQ(model.Eval(x), f.Eval(x));
+    }
+  }
+}
+
+TEST(FlatDiscreteDistribution, SameAsMap) {
+  std::mt19937 rnd(1);
+  std::geometric_distribution<uint32_t> dist(0.05);
+  DiscreteDistribution<uint32_t> model;
+  FlatDiscreteDistribution<uint32_t> distribution;
+  for (size_t i = 0; i < 10000; ++i) {
+    uint32_t value = dist(rnd);
+    model.Add(value);
+    distribution.Add(value);
+  }
+
+  ASSERT_TRUE(distribution.IsExact());
+  ASSERT_EQ(model.Percentiles(), distribution.Percentiles());
+  ASSERT_EQ(model.Probabilities(), distribution.Probabilities());
+  ASSERT_EQ(model.ToString(), distribution.ToString());
+  ASSERT_EQ(model.Min(), distribution.Min());
+  ASSERT_EQ(model.Max(), distribution.Max());
+  ASSERT_DOUBLE_EQ(model.summary_stats().mean(),
+                   distribution.summary_stats().mean());
+}
+
+TEST(FlatDiscreteDistribution, Conversion) {
+  DiscreteDistribution<uint64_t> model({1, 1, 5, 100, 1000, 1000, 1023});
+  FlatDiscreteDistribution<uint64_t> distribution(model);
+  ASSERT_TRUE(distribution.IsExact());
+  ASSERT_EQ(model.counts(), distribution.ToDiscreteDistribution().counts());
+
+  distribution.Add(1 << 20);
+  ASSERT_FALSE(distribution.IsExact());
+  ASSERT_EQ(static_cast<uint64_t>(1 << 20), distribution.Max());
+  ASSERT_EQ(8ul, distribution.ToDiscreteDistribution().summary_stats().count());
+}
+
+TEST(FlatDiscreteDistribution, LargeValues) {
+  std::mt19937_64 rnd(1);
+  std::lognormal_distribution<double> dist(20, 3);
+  std::vector<uint64_t> values;
+  FlatDiscreteDistribution<uint64_t> distribution;
+  for (size_t i = 0; i < 10000; ++i) {
+    values.emplace_back(dist(rnd));
+    distribution.Add(values.back());
+  }
+
+  DiscreteDistribution<uint64_t> model(values);
+  std::vector<uint64_t> model_percentiles = model.Percentiles();
+  std::vector<uint64_t> percentiles = distribution.Percentiles();
+  for (size_t i = 0; i < percentiles.size(); ++i) {
+    ASSERT_NEAR(model_percentiles[i], percentiles[i],
+                model_percentiles[i] / 1024.0);
+  }
+  ASSERT_EQ(model.Min(), distribution.Min());
+  ASSERT_EQ(model.Max(), distribution.Max());
+}
+
+TEST(FlatDiscreteDistribution, Merge) {
+  ThreadPool pool(4);
+  std::vector<FlatDiscreteDistribution<uint64_t>> per_thread(8);
+  DiscreteDistribution<uint64_t> model;
+  ParallelFor(0, per_thread.size(), [&per_thread](size_t i) {
+    for (uint64_t value = 0; value < 100000; value += i + 1) {
+      per_thread[i].Add(value);
+    }
+  }, 1, &pool);
+
+  FlatDiscreteDistribution<uint64_t> added;
+  std::vector<const FlatDiscreteDistribution<uint64_t>*> pointers;
+  for (size_t i = 0; i < per_thread.size(); ++i) {
+    for (uint64_t value = 0; value < 100000; value += i + 1) {
+      model.Add(value);
+    }
+    added.Add(per_thread[i]);
+    pointers.emplace_back(&per_thread[i]);
+  }
+
+  FlatDiscreteDistribution<uint64_t> merged =
+      MergeDistributions(pointers, &pool);
+  ASSERT_EQ(added.counts(), merged.counts());
+  ASSERT_EQ(model.summary_stats().count(), merged.summary_stats().count());
+  ASSERT_DOUBLE_EQ(model.summary_stats().mean(),
+                   merged.summary_stats().mean());
+  ASSERT_EQ(added.Percentiles(), merged.Percentiles());
+  ASSERT_EQ(model.Min(), merged.Min());
+  ASSERT_EQ(model.Max(), merged.Max());
+
+  FlatDiscreteDistribution<uint64_t> other_precision(4);
+  ASSERT_DEATH(merged.Add(other_precision), "mismatch");
+}
+
 TEST(SumConvolute, Simple) {
   std::map<int, double> prob_a = {{1, 1.0 / 6}, {2, 1.0 / 6}, {3, 1.0 / 6},
                                   {4, 1.0 / 6}, {5, 1.0 / 6}, {6, 1.0 / 6}};
@@ -205,5 +469,150 @@ TEST(SumConvolute, Simple) {
   ASSERT_NEAR(1.0/36, a_and_b[12], 0.0001);
 }
 
+TEST(SumConvolute, Negative) {
+  std::map<int, double> prob_a = {{-5, 0.5}, {1, 0.5}};
+  std::map<int, double> prob_b = {{-3, 0.25}, {0, 0.75}};
+  std::map<int, double> model = {
+      {-8, 0.125}, {-5, 0.375}, {-2, 0.125}, {1, 0.375}};
+  ASSERT_EQ(model, SumConvolute(prob_a, prob_b));
+}
+
+TEST(SumConvolute, Sparse) {
+  std::map<uint64_t, double> prob_a = {{0, 0.5}, {1000000000000ul, 0.5}};
+  std::map<uint64_t, double> sum = SumConvolute(prob_a, prob_a);
+  std::map<uint64_t, double> model = {
+      {0, 0.25}, {1000000000000ul, 0.5}, {2000000000000ul, 0.25}};
+  ASSERT_EQ(model, sum);
+}
+
+TEST(Convolve, SameAsDirect) {
+  std::mt19937 rnd(1);
+  std::uniform_real_distribution<double> dist(0, 1);
+  for (size_t x_size : {1, 10, 64, 100, 1000}) {
+    for (size_t y_size : {1, 63, 64, 65, 500, 3000}) {
+      std::vector<double> x(x_size);
+      std::vector<double> y(y_size);
+      for (double& value : x) {
+        value = dist(rnd);
+      }
+      for (double& value : y) {
+        value = dist(rnd);
+      }
+
+      std::vector<double> out = Convolve(x, y);
+      ASSERT_EQ(x_size + y_size - 1, out.size());
+      for (size_t k = 0; k < out.size(); ++k) {
+        double model = 0;
+        for (size_t i = 0; i < x_size; ++i) {
+          if (k >= i && k - i < y_size) {
+            model += x[i] * y[k - i];
+          }
+        }
+        ASSERT_NEAR(model, out[k], 1e-9 * std::max(1.0, model));
+      }
+    }
+  }
+
+  ASSERT_TRUE(Convolve({}, {1.0}).empty());
+}
+
+static std::map<int, double> RandomDistribution(size_t size, int offset,
+                                                std::mt19937* rnd) {
+  std::uniform_real_distribution<double> dist(0, 1);
+  std::map<int, double> out;
+  double total = 0;
+  for (size_t i = 0; i < size; ++i) {
+    double value = dist(*rnd);
+    out[offset + static_cast<int>(i)] = value;
+    total += value;
+  }
+
+  for (auto& value_and_prob : out) {
+    value_and_prob.second /= total;
+  }
+  return out;
+}
+
+TEST(SumConvolute, Large) {
+  std::mt19937 rnd(1);
+  std::map<int, double> prob_a = RandomDistribution(2000, -100, &rnd);
+  std::map<int, double> prob_b = RandomDistribution(3000, 50, &rnd);
+
+  std::map<int, double> model =
+      stats_internal::SparseSumConvolute(prob_a, prob_b);
+  std::map<int, double> sum = SumConvolute(prob_a, prob_b);
+  ASSERT_EQ(model.size(), sum.size());
+  for (const auto& value_and_prob : model) {
+    ASSERT_NEAR(value_and_prob.second, sum[value_and_prob.first], 1e-12);
+  }
+}
+
+TEST(SumConvolute, Many) {
+  std::mt19937 rnd(1);
+  std::vector<std::map<int, double>> distributions;
+  for (size_t i = 0; i < 37; ++i) {
+    distributions.emplace_back(RandomDistribution(100, i, &rnd));
+  }
+
+  std::map<int, double> model = distributions.front();
+  for (size_t i = 1; i < distributions.size(); ++i) {
+    model = stats_internal::SparseSumConvolute(model, distributions[i]);
+  }
+
+  ThreadPool pool(4);
+  std::map<int, double> sum = SumConvolute(distributions, &pool);
+  double total = 0;
+  for (const auto& value_and_prob : sum) {
+    ASSERT_NEAR(model[value_and_prob.first], value_and_prob.second, 1e-12);
+    total += value_and_prob.second;
+  }
+  ASSERT_NEAR(1.0, total, 1e-9);
+
+  std::map<int, double> single = SumConvolute(
+      std::vector<std::map<int, double>>({distributions.front()}), &pool);
+  ASSERT_EQ(distributions.front(), single);
+}
+
+// Distributions with long, thin tails keep their mass through a chain of
+// dense convolutions.
+TEST(SumConvolute, ChainKeepsMass) {
+  std::map<int, double> geometric;
+  double p = 0.1;
+  for (int i = 0; i < 300; ++i) {
+    geometric[i] = p * std::pow(1 - p, i);
+  }
+
+  std::vector<std::map<int, double>> distributions(32, geometric);
+  std::map<int, double> model = geometric;
+  for (size_t i = 1; i < distributions.size(); ++i) {
+    model = stats_internal::SparseSumConvolute(model, distributions[i]);
+  }
+
+  ThreadPool pool(4);
+  std::map<int, double> sum = SumConvolute(distributions, &pool);
+  double model_total = 0;
+  double model_tail = 0;
+  for (const auto& value_and_prob : model) {
+    model_total += value_and_prob.second;
+    if (value_and_prob.first >= 700) {
+      model_tail += value_and_prob.second;
+    }
+  }
+
+  double total = 0;
+  double tail = 0;
+  for (const auto& value_and_prob : sum) {
+    ASSERT_LE(0, value_and_prob.second);
+    total += value_and_prob.second;
+    if (value_and_prob.first >= 700) {
+      tail += value_and_prob.second;
+    }
+  }
+
+  ASSERT_NEAR(model_total, total, 2e-13);
+  ASSERT_LT(0, model_tail);
+  ASSERT_NEAR(model_tail, tail, model_tail * 1e-3);
+}
+
 }  // namespace
 }  // namespace nc
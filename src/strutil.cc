@@ -42,8 +42,16 @@
 #include <iterator>
 
 #include "logging.h"
+#include "number_parser.h"
 #include "port.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
 #ifdef _WIN32
 // MSVC has only _snprintf, not snprintf.
 //
@@ -266,6 +274,78 @@ void SplitStringAllowEmpty(const std::string &full, const char *delim,
   SplitStringToIteratorAllowEmpty(full, delim, 0, it);
 }
 
+Splitter::Splitter(StringPiece delimiters, bool skip_empty)
+    : delimiter_count_(delimiters.size()), skip_empty_(skip_empty) {
+  CHECK(!delimiters.empty()) << "No delimiters";
+  std::fill(is_delimiter_, is_delimiter_ + 256, false);
+  for (char c : delimiters) {
+    is_delimiter_[static_cast<unsigned char>(c)] = true;
+  }
+
+  for (size_t i = 0; i < kMaxVectorDelimiters; ++i) {
+    delimiters_[i] = i < static_cast<size_t>(delimiters.size())
+                         ? delimiters[i]
+                         : delimiters[0];
+  }
+}
+
+const char* Splitter::FindDelimiter(const char* begin, const char* end) const {
+  const char* p = begin;
+  if (delimiter_count_ == 1) {
+    // The C library's memchr is already vectorized.
+    const void* found = memchr(p, delimiters_[0], end - p);
+    return found == nullptr ? end : static_cast<const char*>(found);
+  }
+
+  if (delimiter_count_ <= kMaxVectorDelimiters) {
+#ifdef __AVX2__
+    __m256i d0 = _mm256_set1_epi8(delimiters_[0]);
+    __m256i d1 = _mm256_set1_epi8(delimiters_[1]);
+    __m256i d2 = _mm256_set1_epi8(delimiters_[2]);
+    __m256i d3 = _mm256_set1_epi8(delimiters_[3]);
+    for (; end - p >= 32; p += 32) {
+      __m256i chars = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+      __m256i matches = _mm256_or_si256(
+          _mm256_or_si256(_mm256_cmpeq_epi8(chars, d0),
+                          _mm256_cmpeq_epi8(chars, d1)),
+          _mm256_or_si256(_mm256_cmpeq_epi8(chars, d2),
+                          _mm256_cmpeq_epi8(chars, d3)));
+      uint32_t mask = _mm256_movemask_epi8(matches);
+      if (mask != 0) {
+        return p + __builtin_ctz(mask);
+      }
+    }
+#endif
+
+#ifdef __SSE2__
+    __m128i s0 = _mm_set1_epi8(delimiters_[0]);
+    __m128i s1 = _mm_set1_epi8(delimiters_[1]);
+    __m128i s2 = _mm_set1_epi8(delimiters_[2]);
+    __m128i s3 = _mm_set1_epi8(delimiters_[3]);
+    for (; end - p >= 16; p += 16) {
+      __m128i chars = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+      __m128i matches =
+          _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chars, s0),
+                                    _mm_cmpeq_epi8(chars, s1)),
+                       _mm_or_si128(_mm_cmpeq_epi8(chars, s2),
+                                    _mm_cmpeq_epi8(chars, s3)));
+      uint32_t mask = _mm_movemask_epi8(matches);
+      if (mask != 0) {
+        return p + __builtin_ctz(mask);
+      }
+    }
+#endif
+  }
+
+  for (; p != end; ++p) {
+    if (is_delimiter_[static_cast<unsigned char>(*p)]) {
+      return p;
+    }
+  }
+
+  return end;
+}
+
 // ----------------------------------------------------------------------
 // JoinStrings()
 //    This merges a std::vector of std::string components with delim inserted
@@ -747,7 +827,7 @@ uint32_t strtou32_adaptor(const char *nptr, char **endptr, int base) {
   return static_cast<uint32_t>(result);
 }
 
-inline bool safe_parse_sign(std::string *text /*inout*/,
+inline bool safe_parse_sign(StringPiece *text /*inout*/,
                             bool *negative_ptr /*output*/) {
   const char *start = text->data();
   const char *end = start + text->size();
@@ -771,105 +851,86 @@ inline bool safe_parse_sign(std::string *text /*inout*/,
       return false;
     }
   }
-  *text = text->substr(start - text->data(), end - start);
+  *text = StringPiece(start, end - start);
   return true;
 }
 
+// The value with magnitude 'magnitude' (at most that of IntType's minimum
+// if 'negative') and the given sign.
 template <typename IntType>
-bool safe_parse_positive_int(std::string text, IntType *value_p) {
-  int base = 10;
-  IntType value = 0;
-  const IntType vmax = std::numeric_limits<IntType>::max();
-  assert(vmax > 0);
-  assert(vmax >= static_cast<IntType>(base));
-  const IntType vmax_over_base = vmax / base;
-  const char *start = text.data();
-  const char *end = start + text.size();
-  // loop over digits
-  for (; start < end; ++start) {
-    unsigned char c = static_cast<unsigned char>(start[0]);
-    int digit = c - '0';
-    if (digit >= base || digit < 0) {
-      *value_p = value;
-      return false;
-    }
-    if (value > vmax_over_base) {
-      *value_p = vmax;
-      return false;
-    }
-    value *= base;
-    if (value > vmax - digit) {
-      *value_p = vmax;
-      return false;
-    }
-    value += digit;
+IntType safe_parse_signed_value(uint64_t magnitude, bool negative) {
+  if (!negative) {
+    return static_cast<IntType>(magnitude);
   }
-  *value_p = value;
-  return true;
+  if (magnitude == 0) {
+    return 0;
+  }
+  return -static_cast<IntType>(magnitude - 1) - 1;
 }
 
+// Parses the digits in 'text' as a value of the given sign. The magnitude
+// is accumulated as a uint64_t, 8 digits at a time for as long as that
+// cannot overflow it, and compared to that of the type's limit. On bad input
+// '*value_p' is set to the digits seen so far, on overflow to the limit.
 template <typename IntType>
-bool safe_parse_negative_int(const std::string &text, IntType *value_p) {
-  int base = 10;
-  IntType value = 0;
-  const IntType vmin = std::numeric_limits<IntType>::min();
-  assert(vmin < 0);
-  assert(vmin <= 0 - base);
-  IntType vmin_over_base = vmin / base;
-  // 2003 c++ standard [expr.mul]
-  // "... the sign of the remainder is implementation-defined."
-  // Although (vmin/base)*base + vmin%base is always vmin.
-  // 2011 c++ standard tightens the spec but we cannot rely on it.
-  if (vmin % base > 0) {
-    vmin_over_base += 1;
-  }
+bool safe_parse_int(StringPiece text, bool negative, IntType *value_p) {
+  const IntType vlimit = negative ? std::numeric_limits<IntType>::min()
+                                  : std::numeric_limits<IntType>::max();
+  const uint64_t limit =
+      negative ? static_cast<uint64_t>(-(vlimit + 1)) + 1
+               : static_cast<uint64_t>(vlimit);
+  const uint64_t max_before_eight_digits =
+      (std::numeric_limits<uint64_t>::max() - 99999999) / 100000000;
+
+  uint64_t value = 0;
   const char *start = text.data();
   const char *end = start + text.size();
-  // loop over digits
-  for (; start < end; ++start) {
-    unsigned char c = static_cast<unsigned char>(start[0]);
-    int digit = c - '0';
-    if (digit >= base || digit < 0) {
-      *value_p = value;
-      return false;
+  while (start < end) {
+    if (end - start >= 8 && value <= max_before_eight_digits &&
+        IsEightDigits(start)) {
+      value = value * 100000000 + ParseEightDigits(start);
+      if (value > limit) {
+        *value_p = vlimit;
+        return false;
+      }
+      start += 8;
+      continue;
     }
-    if (value < vmin_over_base) {
-      *value_p = vmin;
+
+    unsigned digit = static_cast<unsigned char>(start[0]) - '0';
+    if (digit > 9) {
+      *value_p = safe_parse_signed_value<IntType>(value, negative);
       return false;
     }
-    value *= base;
-    if (value < vmin + digit) {
-      *value_p = vmin;
+    if (value > (limit - digit) / 10) {
+      *value_p = vlimit;
       return false;
     }
-    value -= digit;
+    value = value * 10 + digit;
+    ++start;
   }
-  *value_p = value;
+  *value_p = safe_parse_signed_value<IntType>(value, negative);
   return true;
 }
 
 template <typename IntType>
-bool safe_int_internal(std::string text, IntType *value_p) {
+bool safe_int_internal(StringPiece text, IntType *value_p) {
   *value_p = 0;
   bool negative;
   if (!safe_parse_sign(&text, &negative)) {
     return false;
   }
-  if (!negative) {
-    return safe_parse_positive_int(text, value_p);
-  } else {
-    return safe_parse_negative_int(text, value_p);
-  }
+  return safe_parse_int(text, negative, value_p);
 }
 
 template <typename IntType>
-bool safe_uint_internal(std::string text, IntType *value_p) {
+bool safe_uint_internal(StringPiece text, IntType *value_p) {
   *value_p = 0;
   bool negative;
   if (!safe_parse_sign(&text, &negative) || negative) {
     return false;
   }
-  return safe_parse_positive_int(text, value_p);
+  return safe_parse_int(text, false, value_p);
 }
 
 // ----------------------------------------------------------------------
@@ -1389,42 +1450,75 @@ bool safe_strtob(StringPiece str, bool *value) {
   return false;
 }
 
-bool safe_strtof(const char *str, float *value) {
+// strto{f,d} need a NUL-terminated string, so they are only used for what
+// the in-place parsers do not handle -- hexadecimal, infinities, NaNs,
+// numbers whose rounding cannot be decided quickly and bad input.
+static bool safe_strtof_slow(const std::string &str, float *value) {
+  const char *start = str.c_str();
   char *endptr;
   errno = 0;                            // errno only gets set on errors
 #if defined(_WIN32) || defined(__hpux)  // has no strtof()
-  *value = strtod(str, &endptr);
+  *value = strtod(start, &endptr);
 #else
-  *value = strtof(str, &endptr);
+  *value = strtof(start, &endptr);
 #endif
-  return *str != 0 && *endptr == 0 && errno == 0;
+  return *start != 0 && *endptr == 0 && errno == 0;
 }
 
-bool safe_strtod(const char *str, double *value) {
+static bool safe_strtod_slow(const std::string &str, double *value) {
+  const char *start = str.c_str();
   char *endptr;
-  *value = strtod(str, &endptr);
-  if (endptr != str) {
+  *value = strtod(start, &endptr);
+  if (endptr != start) {
     while (ascii_isspace(*endptr)) ++endptr;
   }
   // Ignore range errors from strtod.  The values it
   // returns on underflow and overflow are the right
   // fallback in a robust setting.
-  return *str != '\0' && *endptr == '\0';
+  return *start != '\0' && *endptr == '\0';
+}
+
+bool safe_strtof(StringPiece str, float *value) {
+  const char *start = str.data();
+  const char *end = start + str.size();
+  while (start != end && ascii_isspace(*start)) ++start;
+  float parsed;
+  if (start != end && ParseDecimalFloat(start, end, &parsed) == end) {
+    *value = parsed;
+    return true;
+  }
+  return safe_strtof_slow(str.ToString(), value);
+}
+
+bool safe_strtod(StringPiece str, double *value) {
+  const char *start = str.data();
+  const char *end = start + str.size();
+  while (start != end && ascii_isspace(*start)) ++start;
+  double parsed;
+  const char *number_end = ParseDecimalDouble(start, end, &parsed);
+  if (number_end != start) {
+    while (number_end != end && ascii_isspace(*number_end)) ++number_end;
+    if (number_end == end) {
+      *value = parsed;
+      return true;
+    }
+  }
+  return safe_strtod_slow(str.ToString(), value);
 }
 
-bool safe_strto32(const std::string &str, int32_t *value) {
+bool safe_strto32(StringPiece str, int32_t *value) {
   return safe_int_internal(str, value);
 }
 
-bool safe_strtou32(const std::string &str, uint32_t *value) {
+bool safe_strtou32(StringPiece str, uint32_t *value) {
   return safe_uint_internal(str, value);
 }
 
-bool safe_strto64(const std::string &str, int64_t *value) {
+bool safe_strto64(StringPiece str, int64_t *value) {
   return safe_int_internal(str, value);
 }
 
-bool safe_strtou64(const std::string &str, uint64_t *value) {
+bool safe_strtou64(StringPiece str, uint64_t *value) {
   return safe_uint_internal(str, value);
 }
 
@@ -237,6 +237,61 @@ inline std::vector<std::string> Split(const std::string& full,
   return result;
 }
 
+// ----------------------------------------------------------------------
+// Splitter
+//    Splits a string at any of a set of delimiter characters without
+//    allocating. Pieces are returned as StringPieces that point into the
+//    original string. With up to kMaxVectorDelimiters delimiters they are
+//    searched for 16 or 32 bytes at a time with SSE2/AVX2 instructions. If
+//    'skip_empty' is true consecutive delimiters are skipped like in
+//    SplitStringUsing, otherwise empty pieces are returned like in
+//    SplitStringAllowEmpty.
+// ----------------------------------------------------------------------
+class Splitter {
+ public:
+  static constexpr size_t kMaxVectorDelimiters = 4;
+
+  explicit Splitter(StringPiece delimiters, bool skip_empty = true);
+
+  // Calls f(StringPiece piece) for each piece of 'text'.
+  template <typename F>
+  void ForEach(StringPiece text, F f) const {
+    const char* begin = text.data();
+    const char* end = begin + text.size();
+    while (true) {
+      const char* delimiter = FindDelimiter(begin, end);
+      if (!skip_empty_ || delimiter != begin) {
+        f(StringPiece(begin, delimiter - begin));
+      }
+
+      if (delimiter == end) {
+        return;
+      }
+      begin = delimiter + 1;
+    }
+  }
+
+  // Replaces the contents of 'pieces' with the pieces of 'text'. Reusing the
+  // same vector across calls avoids allocating.
+  void Split(StringPiece text, std::vector<StringPiece>* pieces) const {
+    pieces->clear();
+    ForEach(text, [pieces](StringPiece piece) { pieces->emplace_back(piece); });
+  }
+
+  // Returns the first delimiter in [begin, end), or 'end' if there is none.
+  const char* FindDelimiter(const char* begin, const char* end) const;
+
+ private:
+  // Up to kMaxVectorDelimiters delimiters, unused slots repeat the first one.
+  char delimiters_[kMaxVectorDelimiters];
+  size_t delimiter_count_;
+
+  // Indexed by unsigned char.
+  bool is_delimiter_[256];
+
+  bool skip_empty_;
+};
+
 // ----------------------------------------------------------------------
 // JoinStrings()
 //    These methods concatenate a vector of strings into a C++ string, using
@@ -386,49 +441,55 @@ inline uint64_t strtou64(const char* nptr, char** endptr, int base) {
 // ----------------------------------------------------------------------
 bool safe_strtob(StringPiece str, bool* value);
 
-bool safe_strto32(const std::string& str, int32_t* value);
-bool safe_strtou32(const std::string& str, uint32_t* value);
+// The integer versions accept decimal digits with an optional sign and
+// surrounding spaces. On overflow they return false and set 'value' to the
+// largest or smallest value of the type. The floating point versions accept
+// what strto{f,d} do, but decimal numbers are parsed in place, without a
+// copy and regardless of the locale; the rest goes through strto{f,d}. Only
+// safe_strtod allows trailing whitespace and ignores range errors.
+bool safe_strto32(StringPiece str, int32_t* value);
+bool safe_strtou32(StringPiece str, uint32_t* value);
 inline bool safe_strto32(const char* str, int32_t* value) {
-  return safe_strto32(std::string(str), value);
+  return safe_strto32(StringPiece(str), value);
 }
-inline bool safe_strto32(StringPiece str, int32_t* value) {
-  return safe_strto32(str.ToString(), value);
+inline bool safe_strto32(const std::string& str, int32_t* value) {
+  return safe_strto32(StringPiece(str), value);
 }
 inline bool safe_strtou32(const char* str, uint32_t* value) {
-  return safe_strtou32(std::string(str), value);
+  return safe_strtou32(StringPiece(str), value);
 }
-inline bool safe_strtou32(StringPiece str, uint32_t* value) {
-  return safe_strtou32(str.ToString(), value);
+inline bool safe_strtou32(const std::string& str, uint32_t* value) {
+  return safe_strtou32(StringPiece(str), value);
 }
 
-bool safe_strto64(const std::string& str, int64_t* value);
-bool safe_strtou64(const std::string& str, uint64_t* value);
+bool safe_strto64(StringPiece str, int64_t* value);
+bool safe_strtou64(StringPiece str, uint64_t* value);
 inline bool safe_strto64(const char* str, int64_t* value) {
-  return safe_strto64(std::string(str), value);
+  return safe_strto64(StringPiece(str), value);
 }
-inline bool safe_strto64(StringPiece str, int64_t* value) {
-  return safe_strto64(str.ToString(), value);
+inline bool safe_strto64(const std::string& str, int64_t* value) {
+  return safe_strto64(StringPiece(str), value);
 }
 inline bool safe_strtou64(const char* str, uint64_t* value) {
-  return safe_strtou64(std::string(str), value);
+  return safe_strtou64(StringPiece(str), value);
 }
-inline bool safe_strtou64(StringPiece str, uint64_t* value) {
-  return safe_strtou64(str.ToString(), value);
+inline bool safe_strtou64(const std::string& str, uint64_t* value) {
+  return safe_strtou64(StringPiece(str), value);
 }
 
-bool safe_strtof(const char* str, float* value);
-bool safe_strtod(const char* str, double* value);
-inline bool safe_strtof(const std::string& str, float* value) {
-  return safe_strtof(str.c_str(), value);
+bool safe_strtof(StringPiece str, float* value);
+bool safe_strtod(StringPiece str, double* value);
+inline bool safe_strtof(const char* str, float* value) {
+  return safe_strtof(StringPiece(str), value);
 }
-inline bool safe_strtod(const std::string& str, double* value) {
-  return safe_strtod(str.c_str(), value);
+inline bool safe_strtod(const char* str, double* value) {
+  return safe_strtod(StringPiece(str), value);
 }
-inline bool safe_strtof(StringPiece str, float* value) {
-  return safe_strtof(str.ToString(), value);
+inline bool safe_strtof(const std::string& str, float* value) {
+  return safe_strtof(StringPiece(str), value);
 }
-inline bool safe_strtod(StringPiece str, double* value) {
-  return safe_strtod(str.ToString(), value);
+inline bool safe_strtod(const std::string& str, double* value) {
+  return safe_strtod(StringPiece(str), value);
 }
 
 // ----------------------------------------------------------------------
@@ -33,6 +33,9 @@
 #include "strutil.h"
 
 #include <locale.h>
+#include <cmath>
+#include <limits>
+#include <random>
 #include "gtest/gtest.h"
 #include "logging.h"
 
@@ -64,12 +67,116 @@ TEST(StringUtilityTest, ImmuneToLocales) {
   } else {
     EXPECT_EQ("1.5", SimpleDtoa(1.5));
     EXPECT_EQ("1.5", SimpleFtoa(1.5));
+
+    double value;
+    EXPECT_TRUE(safe_strtod("1.5", &value));
+    EXPECT_EQ(1.5, value);
   }
 
   // Return to original locale.
   setlocale(LC_NUMERIC, old_locale.c_str());
 }
 
+TEST(SafeStrto, Integers) {
+  int32_t value32;
+  ASSERT_TRUE(safe_strto32("  -42 ", &value32));
+  ASSERT_EQ(-42, value32);
+  ASSERT_TRUE(safe_strto32("+2147483647", &value32));
+  ASSERT_EQ(2147483647, value32);
+  ASSERT_TRUE(safe_strto32("-2147483648", &value32));
+  ASSERT_EQ(std::numeric_limits<int32_t>::min(), value32);
+  ASSERT_FALSE(safe_strto32("2147483648", &value32));
+  ASSERT_EQ(std::numeric_limits<int32_t>::max(), value32);
+  ASSERT_FALSE(safe_strto32("-2147483649", &value32));
+  ASSERT_EQ(std::numeric_limits<int32_t>::min(), value32);
+  ASSERT_FALSE(safe_strto32("-123x", &value32));
+  ASSERT_EQ(-123, value32);
+  ASSERT_FALSE(safe_strto32("", &value32));
+  ASSERT_FALSE(safe_strto32("-", &value32));
+  ASSERT_FALSE(safe_strto32("1 2", &value32));
+  ASSERT_FALSE(safe_strto32("\t1", &value32));
+
+  uint32_t value_u32;
+  ASSERT_TRUE(safe_strtou32("4294967295", &value_u32));
+  ASSERT_EQ(4294967295u, value_u32);
+  ASSERT_FALSE(safe_strtou32("4294967296", &value_u32));
+  ASSERT_EQ(4294967295u, value_u32);
+  ASSERT_FALSE(safe_strtou32("-0", &value_u32));
+
+  int64_t value64;
+  ASSERT_TRUE(safe_strto64("-9223372036854775808", &value64));
+  ASSERT_EQ(std::numeric_limits<int64_t>::min(), value64);
+  ASSERT_FALSE(safe_strto64("9223372036854775808", &value64));
+  ASSERT_EQ(std::numeric_limits<int64_t>::max(), value64);
+  ASSERT_TRUE(safe_strto64("0000000000000000000000000000001", &value64));
+  ASSERT_EQ(1, value64);
+
+  uint64_t value_u64;
+  ASSERT_TRUE(safe_strtou64("18446744073709551615", &value_u64));
+  ASSERT_EQ(std::numeric_limits<uint64_t>::max(), value_u64);
+  ASSERT_FALSE(safe_strtou64("18446744073709551616", &value_u64));
+  ASSERT_EQ(std::numeric_limits<uint64_t>::max(), value_u64);
+  ASSERT_FALSE(safe_strtou64("184467440737095516150", &value_u64));
+  ASSERT_EQ(std::numeric_limits<uint64_t>::max(), value_u64);
+
+  // Not NUL-terminated.
+  ASSERT_TRUE(safe_strtou64(StringPiece("123456789", 4), &value_u64));
+  ASSERT_EQ(1234u, value_u64);
+}
+
+TEST(SafeStrto, IntegersSameAsStrtoll) {
+  std::mt19937_64 rnd(1);
+  for (size_t i = 0; i < 100000; ++i) {
+    int64_t value = static_cast<int64_t>(rnd()) >> (rnd() % 64);
+    std::string text = std::to_string(value);
+
+    int64_t parsed;
+    ASSERT_TRUE(safe_strto64(text, &parsed));
+    ASSERT_EQ(strtoll(text.c_str(), nullptr, 10), parsed);
+
+    int32_t parsed32;
+    bool fits = value >= std::numeric_limits<int32_t>::min() &&
+                value <= std::numeric_limits<int32_t>::max();
+    ASSERT_EQ(fits, safe_strto32(text, &parsed32)) << text;
+    if (fits) {
+      ASSERT_EQ(value, parsed32);
+    }
+  }
+}
+
+TEST(SafeStrto, Doubles) {
+  double value;
+  ASSERT_TRUE(safe_strtod(" \t1.5e3\n", &value));
+  ASSERT_EQ(1500, value);
+  ASSERT_TRUE(safe_strtod(StringPiece("0.25000", 4), &value));
+  ASSERT_EQ(0.25, value);
+  ASSERT_TRUE(safe_strtod("1e400", &value));
+  ASSERT_TRUE(std::isinf(value));
+  ASSERT_TRUE(safe_strtod("0x10", &value));
+  ASSERT_EQ(16, value);
+  ASSERT_TRUE(safe_strtod("-inf", &value));
+  ASSERT_TRUE(std::isinf(value) && value < 0);
+  ASSERT_TRUE(safe_strtod("nan", &value));
+  ASSERT_TRUE(std::isnan(value));
+  ASSERT_FALSE(safe_strtod("", &value));
+  ASSERT_FALSE(safe_strtod(" ", &value));
+  ASSERT_FALSE(safe_strtod("1e", &value));
+  ASSERT_FALSE(safe_strtod("1.5x", &value));
+  ASSERT_EQ(1.5, value);
+
+  std::string digits = "0." + std::string(30, '9');
+  ASSERT_TRUE(safe_strtod(digits, &value));
+  ASSERT_EQ(strtod(digits.c_str(), nullptr), value);
+
+  float value_f;
+  ASSERT_TRUE(safe_strtof(" 0.1", &value_f));
+  ASSERT_EQ(0.1f, value_f);
+  ASSERT_FALSE(safe_strtof("0.1 ", &value_f));
+  ASSERT_FALSE(safe_strtof("1e39", &value_f));
+  ASSERT_TRUE(safe_strtof("0e-50", &value_f));
+  ASSERT_EQ(0, value_f);
+}
+
 #define EXPECT_EQ_ARRAY(len, x, y, msg)                                  \
   for (int j = 0; j < len; ++j) {                                        \
     EXPECT_EQ(x[j], y[j]) << "" #x << " != " #y << " byte " << j << ": " \
@@ -790,5 +897,68 @@ TEST(LevenshteinDistance, Distance) {
   ASSERT_EQ(1, StrDistanceCaseInsensitive("SomeString", "some string"));
 }
 
+static std::vector<std::string> SplitterPieces(const std::string& text,
+                                               const std::string& delimiters,
+                                               bool skip_empty) {
+  std::vector<StringPiece> pieces;
+  Splitter(delimiters, skip_empty).Split(text, &pieces);
+  std::vector<std::string> out;
+  for (StringPiece piece : pieces) {
+    out.emplace_back(piece.ToString());
+  }
+  return out;
+}
+
+TEST(Splitter, Simple) {
+  using Pieces = std::vector<std::string>;
+  ASSERT_EQ(Pieces({"a", "b"}), SplitterPieces("a b", " ", true));
+  ASSERT_EQ(Pieces({"a", "b"}), SplitterPieces("  a  b ", " ", true));
+  ASSERT_EQ(Pieces({"", "", "a", "", "b", ""}),
+            SplitterPieces("  a  b ", " ", false));
+  ASSERT_EQ(Pieces(), SplitterPieces("", " ", true));
+  ASSERT_EQ(Pieces({""}), SplitterPieces("", " ", false));
+  ASSERT_EQ(Pieces({"a", "b", "c"}), SplitterPieces("a->b, c", ", ->", true));
+  ASSERT_DEATH(Splitter(""), "No delimiters");
+}
+
+TEST(Splitter, SameAsSplit) {
+  std::mt19937 rnd(1);
+  std::uniform_int_distribution<int> char_dist(0, 9);
+  for (const std::string& delimiters :
+       {std::string(" "), std::string(",;"), std::string(" \t,\xff"),
+        std::string("abcde")}) {
+    for (size_t size : {0, 1, 15, 16, 17, 31, 32, 33, 100, 1000}) {
+      for (size_t i = 0; i < 10; ++i) {
+        // Mostly long fields, so that the vectorized search is exercised.
+        std::string text;
+        for (size_t j = 0; j < size; ++j) {
+          int value = char_dist(rnd);
+          text.push_back(value == 0 ? delimiters[j % delimiters.size()]
+                                    : 'f' + value);
+        }
+
+        for (bool skip_empty : {true, false}) {
+          ASSERT_EQ(Split(text, delimiters.c_str(), skip_empty),
+                    SplitterPieces(text, delimiters, skip_empty))
+              << text;
+        }
+      }
+    }
+  }
+}
+
+TEST(Splitter, ReusesVector) {
+  Splitter splitter(",");
+  std::vector<StringPiece> pieces;
+  splitter.Split("a,b,c,d", &pieces);
+  ASSERT_EQ(4ul, pieces.size());
+  const StringPiece* data = pieces.data();
+
+  splitter.Split("e,f", &pieces);
+  ASSERT_EQ(2ul, pieces.size());
+  ASSERT_EQ("f", pieces[1]);
+  ASSERT_EQ(data, pieces.data());
+}
+
 }  // namespace
 }  // namespace nc
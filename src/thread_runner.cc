@@ -0,0 +1,410 @@
+#include "thread_runner.h"
+
+#include <algorithm>
+
+namespace nc {
+namespace thread_runner_internal {
+
+// Initial capacity of a WorkStealingDeque. Should be a power of 2.
+static constexpr size_t kInitialDequeCapacity = 64;
+
+WorkStealingDeque::WorkStealingDeque() : top_(0), bottom_(0) {
+  arrays_.emplace_back(make_unique<Array>(kInitialDequeCapacity));
+  array_.store(arrays_.back().get(), std::memory_order_relaxed);
+}
+
+void WorkStealingDeque::Push(Task* task) {
+  int64_t bottom = bottom_.load(std::memory_order_relaxed);
+  int64_t top = top_.load(std::memory_order_acquire);
+  Array* array = array_.load(std::memory_order_relaxed);
+  if (bottom - top > static_cast<int64_t>(array->capacity) - 1) {
+    auto bigger = make_unique<Array>(array->capacity * 2);
+    for (int64_t i = top; i < bottom; ++i) {
+      bigger->Put(i, array->Get(i));
+    }
+
+    array = bigger.get();
+    arrays_.emplace_back(std::move(bigger));
+    array_.store(array, std::memory_order_release);
+  }
+
+  array->Put(bottom, task);
+  bottom_.store(bottom + 1, std::memory_order_release);
+}
+
+Task* WorkStealingDeque::Pop() {
+  int64_t bottom = bottom_.load(std::memory_order_relaxed) - 1;
+  Array* array = array_.load(std::memory_order_relaxed);
+  bottom_.store(bottom, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  int64_t top = top_.load(std::memory_order_relaxed);
+  if (top > bottom) {
+    // Empty.
+    bottom_.store(bottom + 1, std::memory_order_relaxed);
+    return nullptr;
+  }
+
+  Task* task = array->Get(bottom);
+  if (top == bottom) {
+    // Last task, may race with thieves.
+    if (!top_.compare_exchange_strong(top, top + 1,
+                                      std::memory_order_seq_cst,
+                                      std::memory_order_relaxed)) {
+      task = nullptr;
+    }
+    bottom_.store(bottom + 1, std::memory_order_relaxed);
+  }
+
+  return task;
+}
+
+Task* WorkStealingDeque::Steal() {
+  int64_t top = top_.load(std::memory_order_acquire);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  int64_t bottom = bottom_.load(std::memory_order_acquire);
+  if (top >= bottom) {
+    return nullptr;
+  }
+
+  Array* array = array_.load(std::memory_order_acquire);
+  Task* task = array->Get(top);
+  if (!top_.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst,
+                                    std::memory_order_relaxed)) {
+    return nullptr;
+  }
+
+  return task;
+}
+
+size_t WorkStealingDeque::size() const {
+  int64_t bottom = bottom_.load(std::memory_order_relaxed);
+  int64_t top = top_.load(std::memory_order_relaxed);
+  return bottom > top ? bottom - top : 0;
+}
+
+}  // namespace thread_runner_internal
+
+using thread_runner_internal::Task;
+
+// Number of times an idle worker looks for tasks before going to sleep.
+static constexpr size_t kIdleRoundsBeforeSleep = 64;
+
+// The pool and the index of the worker that the current thread runs, if any.
+static thread_local ThreadPool* current_pool = nullptr;
+static thread_local size_t current_worker = 0;
+
+// State of a per-thread random number generator used to pick victims to
+// steal from.
+static thread_local uint32_t steal_seed = 0x9e3779b9;
+
+static uint32_t NextStealSeed() {
+  steal_seed ^= steal_seed << 13;
+  steal_seed ^= steal_seed >> 17;
+  steal_seed ^= steal_seed << 5;
+  return steal_seed;
+}
+
+ThreadPool::ThreadPool(size_t threads)
+    : queued_(0), sleeping_(0), stop_(false) {
+  CHECK(threads > 0) << "Zero threads";
+  for (size_t i = 0; i < threads; ++i) {
+    workers_.emplace_back(make_unique<Worker>());
+  }
+
+  // Workers steal from each other, so all of them should exist before any
+  // starts running.
+  for (size_t i = 0; i < threads; ++i) {
+    workers_[i]->thread = std::thread([this, i] { WorkerLoop(i); });
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  stop_.store(true);
+  {
+    std::lock_guard<std::mutex> lock(sleep_mu_);
+    wake_up_.notify_all();
+  }
+
+  for (auto& worker : workers_) {
+    worker->thread.join();
+  }
+}
+
+ThreadPool* ThreadPool::Default() {
+  static ThreadPool* pool =
+      new ThreadPool(std::max(1u, std::thread::hardware_concurrency()));
+  return pool;
+}
+
+void ThreadPool::Schedule(std::function<void()> f) {
+  Task* task = new Task(std::move(f));
+
+  // Incremented before the task is visible, so that queued_ never goes below
+  // zero.
+  queued_.fetch_add(1, std::memory_order_relaxed);
+  if (current_pool == this) {
+    workers_[current_worker]->deque.Push(task);
+  } else {
+    std::lock_guard<std::mutex> lock(shared_queue_mu_);
+    shared_queue_.emplace_back(task);
+  }
+
+  // Pairs with the fence in WorkerLoop. Either the worker sees the new task
+  // or this thread sees that the worker is sleeping.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (sleeping_.load(std::memory_order_relaxed) > 0) {
+    std::lock_guard<std::mutex> lock(sleep_mu_);
+    wake_up_.notify_one();
+  }
+}
+
+Task* ThreadPool::FindTask() {
+  if (queued_.load(std::memory_order_relaxed) == 0) {
+    return nullptr;
+  }
+
+  Task* task = nullptr;
+  size_t self = workers_.size();
+  if (current_pool == this) {
+    self = current_worker;
+    task = workers_[self]->deque.Pop();
+  }
+
+  if (task == nullptr) {
+    std::lock_guard<std::mutex> lock(shared_queue_mu_);
+    if (!shared_queue_.empty()) {
+      task = shared_queue_.front();
+      shared_queue_.pop_front();
+    }
+  }
+
+  if (task == nullptr) {
+    size_t offset = NextStealSeed();
+    for (size_t i = 0; i < workers_.size() && task == nullptr; ++i) {
+      size_t victim = (offset + i) % workers_.size();
+      if (victim != self) {
+        task = workers_[victim]->deque.Steal();
+      }
+    }
+  }
+
+  if (task != nullptr) {
+    queued_.fetch_sub(1, std::memory_order_relaxed);
+  }
+  return task;
+}
+
+void ThreadPool::Run(Task* task) {
+  task->f();
+  delete task;
+}
+
+bool ThreadPool::RunPendingTask() {
+  Task* task = FindTask();
+  if (task == nullptr) {
+    return false;
+  }
+
+  Run(task);
+  return true;
+}
+
+bool ThreadPool::InWorker() const { return current_pool == this; }
+
+void ThreadPool::WorkerLoop(size_t index) {
+  current_pool = this;
+  current_worker = index;
+  steal_seed += index;
+
+  Worker* worker = workers_[index].get();
+  size_t idle_rounds = 0;
+  while (true) {
+    Task* task = FindTask();
+    if (task != nullptr) {
+      Run(task);
+      idle_rounds = 0;
+      continue;
+    }
+
+    if (stop_.load() && queued_.load() == 0) {
+      return;
+    }
+
+    worker->state.store(kIdle);
+    if (++idle_rounds < kIdleRoundsBeforeSleep) {
+      std::this_thread::yield();
+    } else {
+      idle_rounds = 0;
+      std::unique_lock<std::mutex> lock(sleep_mu_);
+      sleeping_.fetch_add(1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      wake_up_.wait(lock, [this, worker] {
+        return stop_.load() || queued_.load(std::memory_order_relaxed) > 0 ||
+               worker->state.load() != kIdle;
+      });
+      sleeping_.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    int idle = kIdle;
+    if (worker->state.compare_exchange_strong(idle, kBusy)) {
+      continue;
+    }
+
+    // Reserved by RunOnIdleWorkers, which is about to fill the mailbox. If
+    // this worker took the wake up meant for a scheduled task, passes it on.
+    if (queued_.load() > 0 && sleeping_.load() > 0) {
+      std::lock_guard<std::mutex> lock(sleep_mu_);
+      wake_up_.notify_one();
+    }
+
+    while ((task = worker->mailbox.exchange(nullptr)) == nullptr) {
+      std::this_thread::yield();
+    }
+
+    worker->state.store(kBusy);
+    Run(task);
+    idle_rounds = 0;
+  }
+}
+
+size_t ThreadPool::RunOnIdleWorkers(size_t max_workers,
+                                    const std::function<void()>& f,
+                                    TaskGroup* group) {
+  size_t reserved = 0;
+  for (size_t i = 0; i < workers_.size() && reserved < max_workers; ++i) {
+    Worker* worker = workers_[i].get();
+    int idle = kIdle;
+    if (worker->state.compare_exchange_strong(idle, kReserved)) {
+      worker->mailbox.store(new Task(group->Track(f)));
+      ++reserved;
+    }
+  }
+
+  if (reserved > 0) {
+    std::lock_guard<std::mutex> lock(sleep_mu_);
+    wake_up_.notify_all();
+  }
+
+  return reserved;
+}
+
+void ThreadPool::RunRange(size_t begin, size_t end, size_t grain,
+                          const std::function<void(size_t, size_t)>& f) {
+  if (begin >= end) {
+    return;
+  }
+
+  TaskGroup group(this);
+  RunRangeRecursive(begin, end, std::max(grain, static_cast<size_t>(1)), f,
+                    &group);
+  group.Wait();
+}
+
+void ThreadPool::RunRangeRecursive(
+    size_t begin, size_t end, size_t grain,
+    const std::function<void(size_t, size_t)>& f, TaskGroup* group) {
+  // Hands off the upper half until the range is small enough, then runs the
+  // rest here.
+  while (end - begin > grain) {
+    size_t middle = begin + (end - begin) / 2;
+    group->Run([this, middle, end, grain, &f, group] {
+      RunRangeRecursive(middle, end, grain, f, group);
+    });
+    end = middle;
+  }
+
+  f(begin, end);
+}
+
+void ThreadPool::RunIndices(size_t count, size_t parallelism,
+                            const std::function<void(size_t)>& f) {
+  CHECK(parallelism > 0);
+  std::atomic<size_t> next(0);
+  std::function<void()> loop = [&next, count, &f] {
+    while (true) {
+      size_t i = next.fetch_add(1, std::memory_order_relaxed);
+      if (i >= count) {
+        return;
+      }
+
+      f(i);
+    }
+  };
+
+  // Scheduled tasks may wait behind other tasks, so the loops only go to
+  // workers that are idle. The calling thread runs one of the loops.
+  size_t loops = std::min(count, parallelism);
+  if (loops == 0) {
+    return;
+  }
+
+  TaskGroup group(this);
+  size_t on_workers = RunOnIdleWorkers(loops - 1, loop, &group);
+  std::vector<std::thread> threads;
+  for (size_t i = on_workers + 1; i < loops; ++i) {
+    threads.emplace_back(loop);
+  }
+
+  loop();
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  group.Wait();
+}
+
+std::function<void()> TaskGroup::Track(std::function<void()> f) {
+  pending_.fetch_add(1, std::memory_order_relaxed);
+  return [this, f] {
+    f();
+    Done();
+  };
+}
+
+void TaskGroup::Run(std::function<void()> f) {
+  pool_->Schedule(Track(std::move(f)));
+}
+
+void TaskGroup::Done() {
+  size_t pending = pending_.load(std::memory_order_relaxed);
+  while (true) {
+    if (pending == 1) {
+      // Possibly the last task. The count is decremented under the lock, so
+      // that Wait cannot return (and the group cannot be destroyed) while
+      // this thread still uses the condition variable.
+      std::lock_guard<std::mutex> lock(mu_);
+      if (pending_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        all_done_.notify_all();
+      }
+      return;
+    }
+
+    if (pending_.compare_exchange_weak(pending, pending - 1,
+                                       std::memory_order_acq_rel,
+                                       std::memory_order_relaxed)) {
+      return;
+    }
+  }
+}
+
+void TaskGroup::Wait() {
+  if (pool_->InWorker()) {
+    // Blocking a worker could deadlock the pool if all workers wait, run
+    // other tasks instead.
+    while (pending_.load(std::memory_order_acquire) > 0) {
+      if (!pool_->RunPendingTask()) {
+        std::this_thread::yield();
+      }
+    }
+
+    // The last task may still be in Done.
+    std::lock_guard<std::mutex> lock(mu_);
+    return;
+  }
+
+  std::unique_lock<std::mutex> lock(mu_);
+  all_done_.wait(lock, [this] {
+    return pending_.load(std::memory_order_acquire) == 0;
+  });
+}
+
+}  // namespace nc
@@ -2,47 +2,295 @@
 #define NCODE_COMMON_THREAD_RUNNER_H
 
 #include <stddef.h>
+#include <algorithm>
 #include <atomic>
 #include <condition_variable>
+#include <deque>
 #include <functional>
+#include <iterator>
+#include <memory>
 #include <mutex>
 #include <thread>
 #include <vector>
 
 #include "common.h"
+#include "logging.h"
 
 namespace nc {
 
+class TaskGroup;
+template <typename Result>
+class TaskFuture;
+
+namespace thread_runner_internal {
+
+// A unit of work scheduled on a ThreadPool.
+struct Task {
+  explicit Task(std::function<void()> f) : f(std::move(f)) {}
+
+  std::function<void()> f;
+};
+
+// A Chase-Lev work-stealing deque ("Correct and Efficient Work-Stealing for
+// Weak Memory Models" by Le et al.). The owner thread pushes and pops tasks at
+// the bottom, other threads steal from the top. Grows when full; old arrays
+// are kept around until the deque is destroyed since thieves may still be
+// reading from them.
+class WorkStealingDeque {
+ public:
+  WorkStealingDeque();
+
+  // Adds a task at the bottom. Only called by the owner.
+  void Push(Task* task);
+
+  // Removes a task from the bottom. Only called by the owner. Returns null if
+  // the deque is empty.
+  Task* Pop();
+
+  // Removes a task from the top. Can be called by any thread. Returns null if
+  // the deque is empty or if another thread got the task first.
+  Task* Steal();
+
+  // Approximate number of tasks in the deque.
+  size_t size() const;
+
+ private:
+  struct Array {
+    explicit Array(size_t capacity)
+        : capacity(capacity), slots(new std::atomic<Task*>[capacity]) {}
+
+    Task* Get(int64_t i) const {
+      return slots[i & (capacity - 1)].load(std::memory_order_relaxed);
+    }
+
+    void Put(int64_t i, Task* task) {
+      slots[i & (capacity - 1)].store(task, std::memory_order_relaxed);
+    }
+
+    size_t capacity;
+    std::unique_ptr<std::atomic<Task*>[]> slots;
+  };
+
+  std::atomic<int64_t> top_;
+  std::atomic<int64_t> bottom_;
+  std::atomic<Array*> array_;
+
+  // All arrays allocated so far. Only modified by the owner.
+  std::vector<std::unique_ptr<Array>> arrays_;
+
+  DISALLOW_COPY_AND_ASSIGN(WorkStealingDeque);
+};
+
+}  // namespace thread_runner_internal
+
+// A pool of persistent worker threads that run tasks. Each worker has its own
+// work-stealing deque -- tasks scheduled from a worker go to its deque and
+// idle workers steal from other workers' deques. Tasks scheduled from threads
+// outside of the pool go to a shared queue. Tasks can schedule more tasks and
+// wait for them (see TaskGroup), a worker that waits runs other pending tasks
+// in the meantime, so nested parallelism does not deadlock.
+class ThreadPool {
+ public:
+  explicit ThreadPool(size_t threads);
+
+  // Waits for all scheduled tasks to complete and stops the workers.
+  ~ThreadPool();
+
+  // A process-wide pool with one thread per hardware thread. Never destroyed.
+  static ThreadPool* Default();
+
+  // Schedules a function to run on the pool.
+  void Schedule(std::function<void()> f);
+
+  // Runs a function on the pool and returns a future for its result.
+  template <typename F>
+  auto Submit(F f) -> TaskFuture<decltype(f())>;
+
+  // Calls f(from, to) on non-overlapping subranges that cover [begin, end)
+  // and returns once all calls have completed. The range is recursively split
+  // in halves until subranges are at most 'grain' long. Halves are scheduled
+  // as separate tasks, so idle workers steal large chunks of work.
+  void RunRange(size_t begin, size_t end, size_t grain,
+                const std::function<void(size_t, size_t)>& f);
+
+  // Calls f(i) for each i in [0, count) from min(count, parallelism) threads
+  // that all run at the same time, so calls may block on each other. Indices
+  // are handed out one at a time in order. The threads are the calling
+  // thread, workers that are idle and, if there are not enough of those, new
+  // threads that exit when done.
+  void RunIndices(size_t count, size_t parallelism,
+                  const std::function<void(size_t)>& f);
+
+  // Runs a single pending task, if there is one. Returns false if no task
+  // was found.
+  bool RunPendingTask();
+
+  // Returns true if called from one of this pool's workers.
+  bool InWorker() const;
+
+  size_t thread_count() const { return workers_.size(); }
+
+ private:
+  // A worker is idle while it has no task to run. RunIndices can reserve an
+  // idle worker, and then hands it a task through its mailbox.
+  enum WorkerState { kBusy, kIdle, kReserved };
+
+  struct Worker {
+    Worker() : state(kBusy), mailbox(nullptr) {}
+
+    thread_runner_internal::WorkStealingDeque deque;
+    std::thread thread;
+    std::atomic<int> state;
+    std::atomic<thread_runner_internal::Task*> mailbox;
+  };
+
+  void WorkerLoop(size_t index);
+
+  // Reserves up to max_workers idle workers and has each of them run f as
+  // part of a group. Returns the number of workers reserved.
+  size_t RunOnIdleWorkers(size_t max_workers, const std::function<void()>& f,
+                          TaskGroup* group);
+
+  // Finds a task to run -- first from the worker's own deque (if called from
+  // a worker), then from the shared queue and then by stealing.
+  thread_runner_internal::Task* FindTask();
+
+  // Runs and deletes a task.
+  void Run(thread_runner_internal::Task* task);
+
+  void RunRangeRecursive(size_t begin, size_t end, size_t grain,
+                         const std::function<void(size_t, size_t)>& f,
+                         TaskGroup* group);
+
+  std::vector<std::unique_ptr<Worker>> workers_;
+
+  // Tasks scheduled from outside of the pool.
+  std::deque<thread_runner_internal::Task*> shared_queue_;
+  std::mutex shared_queue_mu_;
+
+  // Number of tasks scheduled but not yet picked up by a thread.
+  std::atomic<size_t> queued_;
+
+  // Idle workers sleep on this condition variable.
+  std::atomic<size_t> sleeping_;
+  std::atomic<bool> stop_;
+  std::mutex sleep_mu_;
+  std::condition_variable wake_up_;
+
+  DISALLOW_COPY_AND_ASSIGN(ThreadPool);
+};
+
+// A set of tasks that run on a ThreadPool and can be waited for.
+class TaskGroup {
+ public:
+  explicit TaskGroup(ThreadPool* pool = ThreadPool::Default())
+      : pool_(pool), pending_(0) {}
+
+  ~TaskGroup() { Wait(); }
+
+  // Schedules a function to run as part of this group.
+  void Run(std::function<void()> f);
+
+  // Blocks until all functions added to the group have completed. If called
+  // from a worker of the pool, runs pending tasks while waiting.
+  void Wait();
+
+  ThreadPool* pool() const { return pool_; }
+
+ private:
+  // Returns a function that runs f and then marks it as complete. Wait will
+  // block until it has run.
+  std::function<void()> Track(std::function<void()> f);
+
+  // Called when a task of this group completes.
+  void Done();
+
+  ThreadPool* pool_;
+
+  // Number of tasks that have not completed yet.
+  std::atomic<size_t> pending_;
+
+  std::mutex mu_;
+  std::condition_variable all_done_;
+
+  friend class ThreadPool;
+
+  DISALLOW_COPY_AND_ASSIGN(TaskGroup);
+};
+
+// The result of a function submitted to a ThreadPool.
+template <typename Result>
+class TaskFuture {
+ public:
+  // Waits for the function to complete and returns its result.
+  Result& Get() {
+    state_->group.Wait();
+    return state_->result;
+  }
+
+ private:
+  struct State {
+    explicit State(ThreadPool* pool) : group(pool) {}
+
+    TaskGroup group;
+    Result result;
+  };
+
+  template <typename F>
+  TaskFuture(ThreadPool* pool, F f)
+      : state_(std::make_shared<State>(pool)) {
+    // The task keeps the state alive even if the future is destroyed.
+    std::shared_ptr<State> state = state_;
+    state_->group.Run([state, f] { state->result = f(); });
+  }
+
+  std::shared_ptr<State> state_;
+
+  friend class ThreadPool;
+};
+
+template <>
+class TaskFuture<void> {
+ public:
+  void Get() { state_->group.Wait(); }
+
+ private:
+  struct State {
+    explicit State(ThreadPool* pool) : group(pool) {}
+
+    TaskGroup group;
+  };
+
+  template <typename F>
+  TaskFuture(ThreadPool* pool, F f)
+      : state_(std::make_shared<State>(pool)) {
+    std::shared_ptr<State> state = state_;
+    state_->group.Run([state, f] { f(); });
+  }
+
+  std::shared_ptr<State> state_;
+
+  friend class ThreadPool;
+};
+
+template <typename F>
+auto ThreadPool::Submit(F f) -> TaskFuture<decltype(f())> {
+  return TaskFuture<decltype(f())>(this, f);
+}
+
 // Runs instances of a given function in parallel. At any given moment in time
-// up to 'batch_size' function will run in parallel. This function will block
-// and return when all functions have completed.
+// up to 'batch_size' function will run in parallel, and unless there are fewer
+// arguments exactly that many do, so functions may block on each other. Idle
+// workers of the default ThreadPool are used before new threads are started.
+// This function will block and return when all functions have completed.
 template <typename T>
 void RunInParallel(const std::vector<T>& arguments,
                    std::function<void(const T&)> f, size_t batch = 4) {
   CHECK(batch > 0) << "Zero batch size";
-
-  std::mutex mu;
-  std::vector<bool> done(arguments.size(), false);
-
-  std::vector<std::thread> threads;
-  for (size_t j = 0; j < batch; ++j) {
-    threads.emplace_back([&arguments, &f, &mu, &done] {
-      mu.lock();
-      for (size_t i = 0; i < arguments.size(); ++i) {
-        if (!done[i]) {
-          done[i] = true;
-          mu.unlock();
-          f(arguments[i]);
-          mu.lock();
-        }
-      }
-      mu.unlock();
-    });
-  }
-
-  for (size_t i = 0; i < batch; ++i) {
-    threads[i].join();
-  }
+  ThreadPool::Default()->RunIndices(arguments.size(), batch,
+                                    [&arguments, &f](size_t i) {
+                                      f(arguments[i]);
+                                    });
 }
 
 template <typename T, typename Result>
@@ -51,32 +299,257 @@ std::vector<std::unique_ptr<Result>> RunInParallelWithResult(
     std::function<std::unique_ptr<Result>(const T&)> f, size_t batch = 4) {
   CHECK(batch > 0) << "Zero batch size";
 
-  std::mutex mu;
-  std::vector<bool> done(arguments.size(), false);
   std::vector<std::unique_ptr<Result>> results(arguments.size());
+  ThreadPool::Default()->RunIndices(arguments.size(), batch,
+                                    [&arguments, &f, &results](size_t i) {
+                                      results[i] = f(arguments[i]);
+                                    });
+  return results;
+}
 
-  std::vector<std::thread> threads;
-  for (size_t j = 0; j < batch; ++j) {
-    threads.emplace_back([&arguments, &f, &mu, &done, &results] {
-      mu.lock();
-      for (size_t i = 0; i < arguments.size(); ++i) {
-        if (!done[i]) {
-          done[i] = true;
-          mu.unlock();
-          std::unique_ptr<Result> result = f(arguments[i]);
-          results[i] = std::move(result);
-          mu.lock();
-        }
-      }
-      mu.unlock();
+// Ranges at most this long are processed serially by the Parallel*
+// functions below.
+static constexpr size_t kDefaultParallelGrain = 1 << 12;
+static constexpr size_t kDefaultParallelSortGrain = 1 << 14;
+
+// Calls f(i) for each i in [begin, end). The range is split into chunks of at
+// most 'grain' indices that run in parallel. Ranges of up to 'grain' indices
+// run serially on the calling thread.
+template <typename F>
+void ParallelFor(size_t begin, size_t end, F f,
+                 size_t grain = kDefaultParallelGrain,
+                 ThreadPool* pool = ThreadPool::Default()) {
+  if (end <= begin + grain) {
+    for (size_t i = begin; i < end; ++i) {
+      f(i);
+    }
+    return;
+  }
+
+  pool->RunRange(begin, end, grain, [&f](size_t from, size_t to) {
+    for (size_t i = from; i < to; ++i) {
+      f(i);
+    }
+  });
+}
+
+// Returns combine(...combine(combine(identity, f(begin)), f(begin + 1))...,
+// f(end - 1)), computed in parallel. The range is split into chunks of
+// 'grain' indices, each chunk is reduced separately and the results of the
+// chunks are combined from left to right. The chunks only depend on the
+// range and the grain, so the result does not depend on the number of
+// threads or on scheduling, even if combine is not associative (e.g.
+// floating point addition). 'identity' should be an identity of combine.
+template <typename T, typename F, typename Combine>
+T ParallelReduce(size_t begin, size_t end, const T& identity, F f,
+                 Combine combine, size_t grain = kDefaultParallelGrain,
+                 ThreadPool* pool = ThreadPool::Default()) {
+  if (end <= begin) {
+    return identity;
+  }
+
+  grain = std::max(grain, static_cast<size_t>(1));
+  size_t num_chunks = (end - begin + grain - 1) / grain;
+  std::vector<T> partials(num_chunks, identity);
+  auto reduce_chunk = [begin, end, grain, &f, &combine, &partials](
+      size_t chunk) {
+    size_t from = begin + chunk * grain;
+    size_t to = std::min(end, from + grain);
+    T& partial = partials[chunk];
+    for (size_t i = from; i < to; ++i) {
+      partial = combine(partial, f(i));
+    }
+  };
+
+  if (num_chunks == 1) {
+    reduce_chunk(0);
+  } else {
+    pool->RunRange(0, num_chunks, 1,
+                   [&reduce_chunk](size_t from, size_t to) {
+                     for (size_t chunk = from; chunk < to; ++chunk) {
+                       reduce_chunk(chunk);
+                     }
+                   });
+  }
+
+  T result = identity;
+  for (const T& partial : partials) {
+    result = combine(result, partial);
+  }
+  return result;
+}
+
+namespace thread_runner_internal {
+
+// Merges the sorted ranges [first_one, last_one) and [first_two, last_two)
+// into out. Large merges are split in two independent merges by picking the
+// middle element of the larger range and finding where it falls in the other
+// range.
+template <typename InIt, typename OutIt, typename Compare>
+void ParallelMerge(InIt first_one, InIt last_one, InIt first_two,
+                   InIt last_two, OutIt out, Compare comp, size_t grain,
+                   ThreadPool* pool) {
+  size_t len_one = last_one - first_one;
+  size_t len_two = last_two - first_two;
+  if (len_one + len_two <= grain) {
+    std::merge(std::make_move_iterator(first_one),
+               std::make_move_iterator(last_one),
+               std::make_move_iterator(first_two),
+               std::make_move_iterator(last_two), out, comp);
+    return;
+  }
+
+  if (len_one < len_two) {
+    // Ties between the ranges go to the first one.
+    InIt mid_two = first_two + len_two / 2;
+    InIt mid_one = std::upper_bound(first_one, last_one, *mid_two, comp);
+    OutIt mid_out = out + (mid_one - first_one) + (mid_two - first_two);
+
+    TaskGroup group(pool);
+    group.Run([first_one, mid_one, first_two, mid_two, out, comp, grain,
+               pool] {
+      ParallelMerge(first_one, mid_one, first_two, mid_two, out, comp, grain,
+                    pool);
     });
+    ParallelMerge(mid_one, last_one, mid_two, last_two, mid_out, comp, grain,
+                  pool);
+    group.Wait();
+    return;
   }
 
-  for (size_t i = 0; i < batch; ++i) {
-    threads[i].join();
+  InIt mid_one = first_one + len_one / 2;
+  InIt mid_two = std::lower_bound(first_two, last_two, *mid_one, comp);
+  OutIt mid_out = out + (mid_one - first_one) + (mid_two - first_two);
+
+  TaskGroup group(pool);
+  group.Run([first_one, mid_one, first_two, mid_two, out, comp, grain, pool] {
+    ParallelMerge(first_one, mid_one, first_two, mid_two, out, comp, grain,
+                  pool);
+  });
+  ParallelMerge(mid_one, last_one, mid_two, last_two, mid_out, comp, grain,
+                pool);
+  group.Wait();
+}
+
+// Sorts [first, last) using a buffer of the same size. If to_buffer is true
+// the sorted values end up in the buffer, otherwise in [first, last). The two
+// halves are sorted into the opposite location and then merged, so values
+// only move between the range and the buffer once per level.
+template <typename It, typename BufferIt, typename Compare>
+void ParallelMergeSort(It first, It last, BufferIt buffer, bool to_buffer,
+                       Compare comp, size_t grain, ThreadPool* pool) {
+  size_t size = last - first;
+  if (size <= grain) {
+    std::sort(first, last, comp);
+    if (to_buffer) {
+      std::move(first, last, buffer);
+    }
+    return;
   }
 
-  return results;
+  It mid = first + size / 2;
+  BufferIt buffer_mid = buffer + size / 2;
+  BufferIt buffer_last = buffer + size;
+  TaskGroup group(pool);
+  group.Run([first, mid, buffer, to_buffer, comp, grain, pool] {
+    ParallelMergeSort(first, mid, buffer, !to_buffer, comp, grain, pool);
+  });
+  ParallelMergeSort(mid, last, buffer_mid, !to_buffer, comp, grain, pool);
+  group.Wait();
+
+  if (to_buffer) {
+    ParallelMerge(first, mid, mid, last, buffer, comp, grain, pool);
+  } else {
+    ParallelMerge(buffer, buffer_mid, buffer_mid, buffer_last, first, comp,
+                  grain, pool);
+  }
+}
+
+}  // namespace thread_runner_internal
+
+// Sorts [first, last) in parallel, using a merge sort with parallel merges
+// over chunks that are sorted with std::sort. Uses a temporary buffer of
+// last - first values, which should be default-constructible. Like std::sort
+// the sort is not stable. Ranges of up to 'grain' values are sorted serially.
+template <typename It, typename Compare>
+void ParallelSort(It first, It last, Compare comp,
+                  size_t grain = kDefaultParallelSortGrain,
+                  ThreadPool* pool = ThreadPool::Default()) {
+  size_t size = last - first;
+  grain = std::max(grain, static_cast<size_t>(1));
+  if (size <= grain) {
+    std::sort(first, last, comp);
+    return;
+  }
+
+  std::vector<typename std::iterator_traits<It>::value_type> buffer(size);
+  thread_runner_internal::ParallelMergeSort(first, last, buffer.begin(), false,
+                                            comp, grain, pool);
+}
+
+template <typename It>
+void ParallelSort(It first, It last) {
+  ParallelSort(first, last,
+               std::less<typename std::iterator_traits<It>::value_type>());
+}
+
+// Computes the inclusive prefix sums of [first, last) into out, i.e. out[i]
+// = op(...op(op(first[0], first[1]), first[2])..., first[i]). 'out' can be
+// the same as 'first'. The range is split into chunks of 'grain' values:
+// chunks are first reduced in parallel, the chunk totals are scanned serially
+// and then each chunk is scanned in parallel, starting from the total of all
+// chunks before it. As with ParallelReduce the chunks do not depend on the
+// number of threads, so the result is deterministic.
+template <typename InIt, typename OutIt,
+          typename Op =
+              std::plus<typename std::iterator_traits<InIt>::value_type>>
+void ParallelPrefixSum(InIt first, InIt last, OutIt out, Op op = Op(),
+                       size_t grain = kDefaultParallelGrain,
+                       ThreadPool* pool = ThreadPool::Default()) {
+  using T = typename std::iterator_traits<InIt>::value_type;
+  size_t size = last - first;
+  if (size == 0) {
+    return;
+  }
+
+  grain = std::max(grain, static_cast<size_t>(1));
+  auto scan_chunk = [first, out, &op](size_t from, size_t to, const T* init) {
+    T total = init ? op(*init, first[from]) : first[from];
+    out[from] = total;
+    for (size_t i = from + 1; i < to; ++i) {
+      total = op(total, first[i]);
+      out[i] = total;
+    }
+  };
+
+  if (size <= grain) {
+    scan_chunk(0, size, nullptr);
+    return;
+  }
+
+  size_t num_chunks = (size + grain - 1) / grain;
+  std::vector<T> totals(num_chunks);
+  ParallelFor(0, num_chunks, [first, size, grain, &op, &totals](size_t chunk) {
+    size_t from = chunk * grain;
+    size_t to = std::min(size, from + grain);
+    T total = first[from];
+    for (size_t i = from + 1; i < to; ++i) {
+      total = op(total, first[i]);
+    }
+    totals[chunk] = total;
+  }, 1, pool);
+
+  // totals[i] becomes the sum of all values before chunk i + 1.
+  for (size_t chunk = 1; chunk < num_chunks; ++chunk) {
+    totals[chunk] = op(totals[chunk - 1], totals[chunk]);
+  }
+
+  ParallelFor(0, num_chunks, [size, grain, &scan_chunk, &totals](
+      size_t chunk) {
+    size_t from = chunk * grain;
+    size_t to = std::min(size, from + grain);
+    scan_chunk(from, to, chunk == 0 ? nullptr : &totals[chunk - 1]);
+  }, 1, pool);
 }
 
 // Runs and maintains a number of threads that process incoming data. Each
@@ -89,6 +562,7 @@ class ThreadBatchProcessor {
         to_kill_(false),
         batch_arguments_(nullptr),
         batch_f_(nullptr),
+        next_index_(0),
         number_active_(0) {
     active_threads_.resize(thread_count_, false);
     for (size_t i = 0; i < threads; ++i) {
@@ -115,7 +589,7 @@ class ThreadBatchProcessor {
       batch_arguments_ = arguments;
       batch_f_ = &f;
 
-      batch_done_.resize(arguments->size(), false);
+      next_index_ = 0;
 
       // Activate all threads.
       std::fill(active_threads_.begin(), active_threads_.end(), true);
@@ -128,7 +602,6 @@ class ThreadBatchProcessor {
 
       batch_arguments_ = nullptr;
       batch_f_ = nullptr;
-      batch_done_.clear();
 
       // Deactivate all threads.
       std::fill(active_threads_.begin(), active_threads_.end(), false);
@@ -149,14 +622,17 @@ class ThreadBatchProcessor {
       std::vector<T>& arguments = *batch_arguments_;
       const std::function<void(T*, size_t, size_t)>& f = *batch_f_;
 
-      for (size_t i = 0; i < arguments.size(); ++i) {
-        if (!batch_done_[i]) {
-          batch_done_[i] = true;
-          lock.unlock();
-          f(&(arguments[i]), i, thread_index);
-          lock.lock();
+      // Items are handed out without holding the lock.
+      lock.unlock();
+      while (true) {
+        size_t i = next_index_.fetch_add(1, std::memory_order_relaxed);
+        if (i >= arguments.size()) {
+          break;
         }
+
+        f(&(arguments[i]), i, thread_index);
       }
+      lock.lock();
 
       active_threads_[thread_index] = false;
       --number_active_;
@@ -172,9 +648,6 @@ class ThreadBatchProcessor {
 
   std::atomic<bool> to_kill_;
 
-  // Done status of the current batch.
-  std::vector<bool> batch_done_;
-
   // The arguments for the current batch.Either null if no batch, or points to
   // the stack of RunInParallel.
   std::vector<T>* batch_arguments_;
@@ -182,6 +655,9 @@ class ThreadBatchProcessor {
   // Function for the current batch.
   std::function<void(T*, size_t, size_t)>* batch_f_;
 
+  // Index of the next item of the current batch to process.
+  std::atomic<size_t> next_index_;
+
   // The processors.
   std::vector<std::thread> threads_;
 
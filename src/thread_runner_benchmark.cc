@@ -0,0 +1,78 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <numeric>
+#include <random>
+#include <vector>
+
+#include "common.h"
+#include "logging.h"
+#include "thread_runner.h"
+
+static constexpr size_t kValueCount = 10000000;
+
+using namespace std::chrono;
+
+template <typename Callback>
+static void Bench(const std::string& name, size_t threads, Callback callback) {
+  auto start = high_resolution_clock::now();
+  double checksum = callback();
+  auto end = high_resolution_clock::now();
+
+  size_t duration_ms = duration_cast<milliseconds>(end - start).count();
+  LOG(INFO) << name << " (" << threads << " threads): " << duration_ms
+            << "ms, checksum " << checksum;
+}
+
+int main(int argc, char** argv) {
+  nc::Unused(argc);
+  nc::Unused(argv);
+
+  std::mt19937_64 gen(1);
+  std::uniform_int_distribution<uint64_t> dist;
+  std::vector<uint64_t> values(kValueCount);
+  for (uint64_t& value : values) {
+    value = dist(gen);
+  }
+
+  Bench("std::sort", 1, [&values] {
+    std::vector<uint64_t> to_sort = values;
+    std::sort(to_sort.begin(), to_sort.end());
+    return to_sort[kValueCount / 2];
+  });
+
+  for (size_t threads : {1, 2, 4, 8, 16, 32, 64}) {
+    nc::ThreadPool pool(threads);
+
+    Bench("ParallelFor", threads, [&values, &pool] {
+      std::vector<double> out(values.size());
+      nc::ParallelFor(0, values.size(), [&values, &out](size_t i) {
+        out[i] = std::sqrt(static_cast<double>(values[i]));
+      }, nc::kDefaultParallelGrain, &pool);
+      return out[kValueCount / 2];
+    });
+
+    Bench("ParallelReduce", threads, [&values, &pool] {
+      return nc::ParallelReduce(
+          0, values.size(), 0.0,
+          [&values](size_t i) { return std::log1p(values[i]); },
+          [](double lhs, double rhs) { return lhs + rhs; },
+          nc::kDefaultParallelGrain, &pool);
+    });
+
+    Bench("ParallelSort", threads, [&values, &pool] {
+      std::vector<uint64_t> to_sort = values;
+      nc::ParallelSort(to_sort.begin(), to_sort.end(), std::less<uint64_t>(),
+                       nc::kDefaultParallelSortGrain, &pool);
+      return to_sort[kValueCount / 2];
+    });
+
+    Bench("ParallelPrefixSum", threads, [&values, &pool] {
+      std::vector<uint64_t> out(values.size());
+      nc::ParallelPrefixSum(values.begin(), values.end(), out.begin(),
+                            std::plus<uint64_t>(), nc::kDefaultParallelGrain,
+                            &pool);
+      return out.back();
+    });
+  }
+}
@@ -1,4 +1,7 @@
 #include <mutex>
+#include <numeric>
+#include <random>
+#include <set>
 
 #include "common.h"
 #include "gtest/gtest.h"
@@ -61,5 +64,337 @@ INSTANTIATE_TEST_CASE_P(SimpleThreadRunner,
                         ThreadBatchProcessorTestWithBatchSize,
                         ::testing::Values(1, 5, 20, 50), );
 
+TEST(ThreadRunnerTest, WithResult) {
+  std::vector<int> args(100);
+  std::iota(args.begin(), args.end(), 0);
+
+  std::vector<std::unique_ptr<int>> results =
+      RunInParallelWithResult<int, int>(
+          args, [](int i) { return make_unique<int>(i * 2); }, 8);
+  ASSERT_EQ(args.size(), results.size());
+  for (size_t i = 0; i < args.size(); ++i) {
+    ASSERT_EQ(args[i] * 2, *results[i]);
+  }
+}
+
+TEST(ThreadRunnerTest, Nested) {
+  // Each outer call runs an inner RunInParallel on the same pool.
+  std::vector<int> args(16);
+  std::iota(args.begin(), args.end(), 0);
+
+  std::atomic<int> total(0);
+  RunInParallel<int>(args, [&args, &total](int i) {
+    RunInParallel<int>(args, [i, &total](int j) { total += i * j; }, 16);
+  }, 16);
+  ASSERT_EQ(120 * 120, total.load());
+}
+
+TEST(WorkStealingDeque, PopSteal) {
+  thread_runner_internal::WorkStealingDeque deque;
+  std::vector<std::unique_ptr<thread_runner_internal::Task>> tasks;
+  for (size_t i = 0; i < 1000; ++i) {
+    tasks.emplace_back(make_unique<thread_runner_internal::Task>(nullptr));
+    deque.Push(tasks.back().get());
+  }
+  ASSERT_EQ(1000ul, deque.size());
+
+  // The owner pops from the bottom, thieves steal from the top.
+  ASSERT_EQ(tasks.back().get(), deque.Pop());
+  ASSERT_EQ(tasks.front().get(), deque.Steal());
+  ASSERT_EQ(998ul, deque.size());
+}
+
+TEST(WorkStealingDeque, Concurrent) {
+  // Every task should be taken exactly once.
+  static constexpr size_t kTaskCount = 100000;
+  thread_runner_internal::WorkStealingDeque deque;
+  std::vector<std::unique_ptr<thread_runner_internal::Task>> tasks;
+  for (size_t i = 0; i < kTaskCount; ++i) {
+    tasks.emplace_back(make_unique<thread_runner_internal::Task>(nullptr));
+  }
+
+  std::vector<std::atomic<int>> taken(kTaskCount);
+  for (auto& count : taken) {
+    count = 0;
+  }
+  auto record = [&tasks, &taken](thread_runner_internal::Task* task) {
+    size_t index = std::lower_bound(tasks.begin(), tasks.end(), task,
+                                    [](
+                                        const std::unique_ptr<
+                                            thread_runner_internal::Task>& lhs,
+                                        thread_runner_internal::Task* rhs) {
+                                      return lhs.get() < rhs;
+                                    }) -
+                   tasks.begin();
+    ++taken[index];
+  };
+  std::sort(tasks.begin(), tasks.end());
+
+  std::atomic<bool> done(false);
+  std::vector<std::thread> thieves;
+  for (size_t i = 0; i < 3; ++i) {
+    thieves.emplace_back([&deque, &done, &record] {
+      while (!done) {
+        thread_runner_internal::Task* task = deque.Steal();
+        if (task != nullptr) {
+          record(task);
+        }
+      }
+    });
+  }
+
+  for (size_t i = 0; i < kTaskCount; ++i) {
+    deque.Push(tasks[i].get());
+    if (i % 3 == 0) {
+      thread_runner_internal::Task* task = deque.Pop();
+      if (task != nullptr) {
+        record(task);
+      }
+    }
+  }
+
+  while (deque.size() > 0) {
+    thread_runner_internal::Task* task = deque.Pop();
+    if (task != nullptr) {
+      record(task);
+    }
+  }
+  done = true;
+  for (auto& thread : thieves) {
+    thread.join();
+  }
+
+  for (size_t i = 0; i < kTaskCount; ++i) {
+    ASSERT_EQ(1, taken[i].load());
+  }
+}
+
+TEST(ThreadPool, Submit) {
+  ThreadPool pool(4);
+  TaskFuture<int> future = pool.Submit([] { return 42; });
+  ASSERT_EQ(42, future.Get());
+
+  std::atomic<bool> ran(false);
+  TaskFuture<void> void_future = pool.Submit([&ran] { ran = true; });
+  void_future.Get();
+  ASSERT_TRUE(ran);
+}
+
+// Naive recursive Fibonacci, exercises deeply nested task groups.
+static uint64_t Fibonacci(ThreadPool* pool, uint64_t n) {
+  if (n < 2) {
+    return n;
+  }
+
+  uint64_t a;
+  uint64_t b;
+  TaskGroup group(pool);
+  group.Run([pool, n, &a] { a = Fibonacci(pool, n - 1); });
+  b = Fibonacci(pool, n - 2);
+  group.Wait();
+  return a + b;
+}
+
+TEST(ThreadPool, NestedParallelism) {
+  ThreadPool pool(4);
+  TaskFuture<uint64_t> future =
+      pool.Submit([&pool] { return Fibonacci(&pool, 20); });
+  ASSERT_EQ(6765ul, future.Get());
+
+  // Also from outside the pool.
+  ASSERT_EQ(610ul, Fibonacci(&pool, 15));
+}
+
+TEST(ThreadPool, RunRange) {
+  ThreadPool pool(3);
+  for (size_t grain : {1ul, 7ul, 1000ul, 100000ul}) {
+    std::vector<std::atomic<int>> counts(10000);
+    for (auto& count : counts) {
+      count = 0;
+    }
+
+    pool.RunRange(5, counts.size(), grain,
+                  [grain, &counts](size_t from, size_t to) {
+                    ASSERT_LT(from, to);
+                    ASSERT_GE(grain, to - from);
+                    for (size_t i = from; i < to; ++i) {
+                      ++counts[i];
+                    }
+                  });
+
+    for (size_t i = 0; i < counts.size(); ++i) {
+      ASSERT_EQ(i < 5 ? 0 : 1, counts[i].load());
+    }
+  }
+
+  // Empty range.
+  pool.RunRange(10, 10, 1, [](size_t from, size_t to) {
+    Unused(from);
+    Unused(to);
+    FAIL();
+  });
+}
+
+TEST(ThreadPool, RunIndicesParallelism) {
+  ThreadPool pool(8);
+  std::atomic<size_t> running(0);
+  std::atomic<size_t> max_running(0);
+  pool.RunIndices(1000, 3, [&running, &max_running](size_t i) {
+    Unused(i);
+    size_t now = ++running;
+    size_t prev = max_running.load();
+    while (now > prev && !max_running.compare_exchange_weak(prev, now)) {
+    }
+    std::this_thread::yield();
+    --running;
+  });
+
+  ASSERT_GE(3ul, max_running.load());
+}
+
+TEST(ThreadPool, RunIndicesConcurrent) {
+  // Each call waits for all others to start, so the calls only complete if
+  // they all run at the same time, even though the pool has fewer workers.
+  ThreadPool pool(2);
+  for (size_t round = 0; round < 100; ++round) {
+    std::atomic<size_t> started(0);
+    pool.RunIndices(8, 8, [&started](size_t i) {
+      Unused(i);
+      ++started;
+      while (started.load() < 8) {
+        std::this_thread::yield();
+      }
+    });
+    ASSERT_EQ(8ul, started.load());
+  }
+}
+
+TEST(ThreadRunnerTest, BlockingCalls) {
+  // Same as above, through RunInParallel and from inside a worker.
+  std::vector<int> args(6);
+  std::atomic<size_t> started(0);
+  ThreadPool::Default()->Submit([&args, &started] {
+    RunInParallel<int>(args, [&started](int i) {
+      Unused(i);
+      ++started;
+      while (started.load() < 6) {
+        std::this_thread::yield();
+      }
+    }, 6);
+  }).Get();
+  ASSERT_EQ(6ul, started.load());
+}
+
+TEST(ThreadPool, ManyTasks) {
+  ThreadPool pool(4);
+  std::atomic<size_t> count(0);
+  {
+    TaskGroup group(&pool);
+    for (size_t i = 0; i < 100000; ++i) {
+      group.Run([&count] { ++count; });
+    }
+  }
+  ASSERT_EQ(100000ul, count.load());
+}
+
+TEST(ParallelFor, Coverage) {
+  ThreadPool pool(4);
+  for (size_t size : {0ul, 1ul, 100ul, 100000ul}) {
+    std::vector<int> counts(size, 0);
+    ParallelFor(0, size, [&counts](size_t i) { ++counts[i]; }, 64, &pool);
+    ASSERT_EQ(size, static_cast<size_t>(std::count(counts.begin(),
+                                                   counts.end(), 1)));
+  }
+}
+
+TEST(ParallelReduce, Deterministic) {
+  std::mt19937 rnd(1);
+  std::uniform_real_distribution<double> dist(-1e10, 1e10);
+  std::vector<double> values(100000);
+  for (double& value : values) {
+    value = dist(rnd);
+  }
+
+  // Floating point addition is not associative, the result should still not
+  // depend on the number of threads.
+  auto sum = [&values](ThreadPool* pool) {
+    return ParallelReduce(0, values.size(), 0.0,
+                          [&values](size_t i) { return values[i]; },
+                          [](double lhs, double rhs) { return lhs + rhs; },
+                          100, pool);
+  };
+
+  ThreadPool pool_one(1);
+  ThreadPool pool_many(7);
+  double sum_one = sum(&pool_one);
+  ASSERT_EQ(sum_one, sum(&pool_many));
+  ASSERT_EQ(sum_one, sum(&pool_many));
+  ASSERT_NEAR(std::accumulate(values.begin(), values.end(), 0.0), sum_one, 1);
+
+  ASSERT_EQ(5, ParallelReduce(0, 0, 5, [](size_t i) { return i; },
+                              [](int lhs, int rhs) { return lhs + rhs; }));
+}
+
+TEST(ParallelSort, Random) {
+  ThreadPool pool(4);
+  std::mt19937 rnd(1);
+  for (size_t size : {0ul, 1ul, 10ul, 1000ul, 100001ul}) {
+    // Few distinct values, so that there are many ties.
+    std::uniform_int_distribution<int> dist(0, 100);
+    std::vector<int> values(size);
+    for (int& value : values) {
+      value = dist(rnd);
+    }
+
+    std::vector<int> model = values;
+    std::sort(model.begin(), model.end(), std::greater<int>());
+    ParallelSort(values.begin(), values.end(), std::greater<int>(), 16,
+                 &pool);
+    ASSERT_EQ(model, values);
+  }
+}
+
+TEST(ParallelSort, Strings) {
+  std::vector<std::string> values;
+  for (size_t i = 0; i < 100000; ++i) {
+    values.emplace_back(std::to_string((i * 7919) % 100000));
+  }
+
+  std::vector<std::string> model = values;
+  std::sort(model.begin(), model.end());
+  ParallelSort(values.begin(), values.end());
+  ASSERT_EQ(model, values);
+}
+
+TEST(ParallelPrefixSum, Values) {
+  ThreadPool pool(4);
+  for (size_t size : {0ul, 1ul, 100ul, 10007ul}) {
+    std::vector<uint64_t> values(size);
+    std::iota(values.begin(), values.end(), 1);
+
+    std::vector<uint64_t> model(size);
+    std::partial_sum(values.begin(), values.end(), model.begin());
+
+    std::vector<uint64_t> out(size);
+    ParallelPrefixSum(values.begin(), values.end(), out.begin(),
+                      std::plus<uint64_t>(), 10, &pool);
+    ASSERT_EQ(model, out);
+
+    // In place.
+    ParallelPrefixSum(values.begin(), values.end(), values.begin(),
+                      std::plus<uint64_t>(), 10, &pool);
+    ASSERT_EQ(model, values);
+  }
+}
+
+TEST(ParallelPrefixSum, Max) {
+  std::vector<int> values = {3, 1, 4, 1, 5, 9, 2, 6, 5, 3};
+  std::vector<int> out(values.size());
+  ParallelPrefixSum(values.begin(), values.end(), out.begin(),
+                    [](int lhs, int rhs) { return std::max(lhs, rhs); }, 3);
+  std::vector<int> model = {3, 3, 4, 4, 5, 9, 9, 9, 9, 9};
+  ASSERT_EQ(model, out);
+}
+
 }  // namespace
 }  // namespace nc
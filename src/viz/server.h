@@ -91,8 +91,8 @@ struct OutgoingHeaderAndMessage {
 };
 
 // Queue for incoming messages. There will only be one incoming queue for the
-// server.
-using IncomingMessageQueue = PtrQueue<IncomingHeaderAndMessage, 1024>;
+// server. Each connection's thread produces to it, so it is multi-producer.
+using IncomingMessageQueue = MPMCPtrQueue<IncomingHeaderAndMessage, 1024>;
 
 class InputChannel {
  public: